@@ -914,7 +914,7 @@ ERST
         .name       = "stats",
         .args_type  = "target:s,names:s?,provider:s?",
         .params     = "target [names] [provider]",
-        .help       = "show statistics for the given target (vm or vcpu); optionally filter by"
+        .help       = "show statistics for the given target (vm, vcpu, cryptodev or cxl); optionally filter by"
                       "name (comma-separated list, or * for all) and provider",
         .cmd        = hmp_info_stats,
     },
@@ -5,6 +5,14 @@
  *
  * This work is licensed under the terms of the GNU GPL, version 2 or later.
  * See the COPYING file in the top-level directory.
+ *
+ * Each CDAT is kept as one contiguous, checksummed blob, with the offset of
+ * each of its entries, so that DOE Read Entry requests are served by copying
+ * straight out of it.  Blobs are shared by all the components whose CDATs
+ * are identical, and a CDAT file is only read and parsed once for all the
+ * components that use it, so that large topologies of identically
+ * configured devices do not build, parse and keep many copies of the same
+ * table.
  */
 
 #include "qemu/osdep.h"
@@ -13,191 +21,279 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 
-static void cdat_len_check(CDATSubHeader *hdr, Error **errp)
+struct CDATTable {
+    unsigned int refcount;
+    GBytes *blob;
+    /* Entry 0 is the header, entry i spans [offset[i], offset[i + 1]) */
+    uint32_t *entry_offset;
+    int entry_len;
+    /* Set if loaded from a file, to tell if it is still the same one */
+    char *filename;
+    struct stat st;
+};
+
+/* Tables by content */
+static GHashTable *cdat_tables;
+/* Tables by the file they were loaded from */
+static GHashTable *cdat_files;
+
+static void cdat_table_unref(CDATTable *table)
+{
+    if (!table || --table->refcount) {
+        return;
+    }
+
+    if (g_hash_table_lookup(cdat_tables, table->blob) == table) {
+        g_hash_table_remove(cdat_tables, table->blob);
+    }
+    if (table->filename &&
+        g_hash_table_lookup(cdat_files, table->filename) == table) {
+        g_hash_table_remove(cdat_files, table->filename);
+    }
+    g_bytes_unref(table->blob);
+    g_free(table->entry_offset);
+    g_free(table->filename);
+    g_free(table);
+}
+
+/* Return the table with the same content as @table, which is consumed */
+static CDATTable *cdat_table_intern(CDATTable *table)
 {
-    assert(hdr->length);
-    assert(hdr->reserved == 0);
+    CDATTable *found;
+
+    if (!cdat_tables) {
+        cdat_tables = g_hash_table_new(g_bytes_hash, g_bytes_equal);
+    }
+
+    found = g_hash_table_lookup(cdat_tables, table->blob);
+    if (found) {
+        found->refcount++;
+        cdat_table_unref(table);
+        return found;
+    }
+
+    g_hash_table_insert(cdat_tables, table->blob, table);
+    return table;
+}
+
+static bool cdat_len_check(CDATSubHeader *hdr, Error **errp)
+{
+    uint16_t len = hdr->length;
+    bool valid;
 
     switch (hdr->type) {
     case CDAT_TYPE_DSMAS:
-        assert(hdr->length == sizeof(CDATDsmas));
+        valid = len == sizeof(CDATDsmas);
         break;
     case CDAT_TYPE_DSLBIS:
-        assert(hdr->length == sizeof(CDATDslbis));
+        valid = len == sizeof(CDATDslbis);
         break;
     case CDAT_TYPE_DSMSCIS:
-        assert(hdr->length == sizeof(CDATDsmscis));
+        valid = len == sizeof(CDATDsmscis);
         break;
     case CDAT_TYPE_DSIS:
-        assert(hdr->length == sizeof(CDATDsis));
+        valid = len == sizeof(CDATDsis);
         break;
     case CDAT_TYPE_DSEMTS:
-        assert(hdr->length == sizeof(CDATDsemts));
+        valid = len == sizeof(CDATDsemts);
         break;
     case CDAT_TYPE_SSLBIS:
-        assert(hdr->length >= sizeof(CDATSslbisHeader));
-        assert((hdr->length - sizeof(CDATSslbisHeader)) %
-               sizeof(CDATSslbe) == 0);
+        valid = len >= sizeof(CDATSslbisHeader) &&
+                (len - sizeof(CDATSslbisHeader)) % sizeof(CDATSslbe) == 0;
         break;
     default:
         error_setg(errp, "Type %d is reserved", hdr->type);
+        return false;
+    }
+
+    if (!valid || hdr->reserved) {
+        error_setg(errp, "Malformed structure of type %d", hdr->type);
+        return false;
     }
+    return true;
 }
 
 static void ct3_build_cdat(CDATObject *cdat, Error **errp)
 {
-    g_autofree CDATTableHeader *cdat_header = NULL;
-    g_autofree CDATEntry *cdat_st = NULL;
+    CDATSubHeader **built_buf = NULL;
+    CDATTableHeader *cdat_header;
+    CDATTable *table;
+    uint32_t offset;
+    uint8_t *buf;
     uint8_t sum = 0;
-    int ent, i;
+    size_t len;
+    int num, ent, i;
 
     /* Use default table if fopen == NULL */
     assert(cdat->build_cdat_table);
 
-    cdat_header = g_malloc0(sizeof(*cdat_header));
-    if (!cdat_header) {
-        error_setg(errp, "Failed to allocate CDAT header");
-        return;
-    }
-
-    cdat->built_buf_len = cdat->build_cdat_table(&cdat->built_buf, cdat->private);
-
-    if (!cdat->built_buf_len) {
+    num = cdat->build_cdat_table(&built_buf, cdat->private);
+    if (!num) {
         /* Build later as not all data available yet */
         cdat->to_update = true;
         return;
     }
     cdat->to_update = false;
 
-    cdat_st = g_malloc0(sizeof(*cdat_st) * (cdat->built_buf_len + 1));
-    if (!cdat_st) {
-        error_setg(errp, "Failed to allocate CDAT entry array");
-        return;
+    len = sizeof(*cdat_header);
+    for (ent = 0; ent < num; ent++) {
+        len += built_buf[ent]->length;
     }
 
-    /* Entry 0 for CDAT header, starts with Entry 1 */
-    for (ent = 1; ent < cdat->built_buf_len + 1; ent++) {
-        CDATSubHeader *hdr = cdat->built_buf[ent - 1];
-        uint8_t *buf = (uint8_t *)cdat->built_buf[ent - 1];
-
-        cdat_st[ent].base = hdr;
-        cdat_st[ent].length = hdr->length;
+    table = g_new0(CDATTable, 1);
+    table->refcount = 1;
+    table->entry_len = 1 + num;
+    table->entry_offset = g_new(uint32_t, table->entry_len + 1);
 
-        cdat_header->length += hdr->length;
-        for (i = 0; i < hdr->length; i++) {
-            sum += buf[i];
-        }
+    /* Entry 0 for CDAT header, starts with Entry 1 */
+    buf = g_malloc0(len);
+    offset = sizeof(*cdat_header);
+    table->entry_offset[0] = 0;
+    for (ent = 0; ent < num; ent++) {
+        table->entry_offset[ent + 1] = offset;
+        memcpy(buf + offset, built_buf[ent], built_buf[ent]->length);
+        offset += built_buf[ent]->length;
     }
+    table->entry_offset[table->entry_len] = offset;
+    cdat->free_cdat_table(built_buf, num, cdat->private);
 
     /* CDAT header */
+    cdat_header = (CDATTableHeader *)buf;
     cdat_header->revision = CXL_CDAT_REV;
     /* For now, no runtime updates */
     cdat_header->sequence = 0;
-    cdat_header->length += sizeof(CDATTableHeader);
-    sum += cdat_header->revision + cdat_header->sequence +
-        cdat_header->length;
+    cdat_header->length = len;
+    for (i = 0; i < len; i++) {
+        sum += buf[i];
+    }
     /* Sum of all bytes including checksum must be 0 */
     cdat_header->checksum = ~sum + 1;
 
-    cdat_st[0].base = g_steal_pointer(&cdat_header);
-    cdat_st[0].length = sizeof(*cdat_header);
-    cdat->entry_len = 1 + cdat->built_buf_len;
-    cdat->entry = g_steal_pointer(&cdat_st);
+    table->blob = g_bytes_new_take(buf, len);
+    cdat->table = cdat_table_intern(table);
 }
 
-static void ct3_load_cdat(CDATObject *cdat, Error **errp)
+static CDATTable *ct3_parse_cdat(const char *filename, uint8_t *buf, size_t len,
+                                 Error **errp)
 {
-    g_autofree CDATEntry *cdat_st = NULL;
+    g_autofree uint32_t *offsets = NULL;
+    CDATTable *table;
+    CDATSubHeader *hdr;
     uint8_t sum = 0;
+    size_t i;
     int num_ent;
-    int i = 0, ent = 1, file_size = 0;
-    CDATSubHeader *hdr;
-    FILE *fp = NULL;
 
-    /* Read CDAT file and create its cache */
-    fp = fopen(cdat->filename, "r");
-    if (!fp) {
-        error_setg(errp, "CDAT: Unable to open file");
-        return;
-    }
-
-    fseek(fp, 0, SEEK_END);
-    file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    cdat->buf = g_malloc0(file_size);
-
-    if (fread(cdat->buf, file_size, 1, fp) == 0) {
-        error_setg(errp, "CDAT: File read failed");
-        return;
+    if (len < sizeof(CDATTableHeader)) {
+        error_setg(errp, "CDAT: File too short");
+        return NULL;
     }
 
-    fclose(fp);
+    /* Set CDAT header, Entry = 0 */
+    offsets = g_new(uint32_t, 2);
+    offsets[0] = 0;
+    num_ent = 1;
 
-    if (file_size < sizeof(CDATTableHeader)) {
-        error_setg(errp, "CDAT: File too short");
-        return;
-    }
+    /* Read CDAT structures */
     i = sizeof(CDATTableHeader);
-    num_ent = 1;
-    while (i < file_size) {
-        hdr = (CDATSubHeader *)(cdat->buf + i);
-        cdat_len_check(hdr, errp);
+    while (i < len) {
+        hdr = (CDATSubHeader *)(buf + i);
+        if (len - i < sizeof(*hdr) || hdr->length > len - i) {
+            error_setg(errp, "CDAT: File length mismatch");
+            return NULL;
+        }
+        if (!cdat_len_check(hdr, errp)) {
+            error_prepend(errp, "CDAT: ");
+            return NULL;
+        }
+        offsets[num_ent++] = i;
+        offsets = g_renew(uint32_t, offsets, num_ent + 1);
         i += hdr->length;
-        num_ent++;
-    }
-    if (i != file_size) {
-        error_setg(errp, "CDAT: File length mismatch");
-        return;
     }
+    offsets[num_ent] = i;
 
-    cdat_st = g_malloc0(sizeof(*cdat_st) * num_ent);
-    if (!cdat_st) {
-        error_setg(errp, "CDAT: Failed to allocate entry array");
-        return;
+    for (i = 0; i < len; i++) {
+        sum += buf[i];
+    }
+    if (sum != 0) {
+        warn_report("CDAT: Found checksum mismatch in %s", filename);
     }
 
-    /* Set CDAT header, Entry = 0 */
-    cdat_st[0].base = cdat->buf;
-    cdat_st[0].length = sizeof(CDATTableHeader);
-    i = 0;
+    table = g_new0(CDATTable, 1);
+    table->refcount = 1;
+    table->blob = g_bytes_new(buf, len);
+    table->entry_len = num_ent;
+    table->entry_offset = g_steal_pointer(&offsets);
+    return table;
+}
 
-    while (i < cdat_st[0].length) {
-        sum += cdat->buf[i++];
-    }
+static bool cdat_file_unchanged(CDATTable *table, struct stat *st)
+{
+    return table->st.st_dev == st->st_dev && table->st.st_ino == st->st_ino &&
+           table->st.st_size == st->st_size &&
+           table->st.st_mtime == st->st_mtime;
+}
 
-    /* Read CDAT structures */
-    while (i < file_size) {
-        hdr = (CDATSubHeader *)(cdat->buf + i);
-        cdat_len_check(hdr, errp);
+static bool ct3_load_cdat(CDATObject *cdat, Error **errp)
+{
+    g_autofree gchar *buf = NULL;
+    g_autoptr(GError) err = NULL;
+    CDATTable *table;
+    struct stat st;
+    gsize len;
+
+    if (!cdat_files) {
+        cdat_files = g_hash_table_new(g_str_hash, g_str_equal);
+    }
 
-        cdat_st[ent].base = hdr;
-        cdat_st[ent].length = hdr->length;
+    /* Read CDAT file and create its cache */
+    if (stat(cdat->filename, &st)) {
+        error_setg_errno(errp, errno, "CDAT: Unable to open file");
+        return false;
+    }
 
-        while (cdat->buf + i <
-               (uint8_t *)cdat_st[ent].base + cdat_st[ent].length) {
-            assert(i < file_size);
-            sum += cdat->buf[i++];
-        }
+    table = g_hash_table_lookup(cdat_files, cdat->filename);
+    if (table && cdat_file_unchanged(table, &st)) {
+        table->refcount++;
+        cdat->table = table;
+        return true;
+    }
 
-        ent++;
+    if (!g_file_get_contents(cdat->filename, &buf, &len, &err)) {
+        error_setg(errp, "CDAT: File read failed: %s", err->message);
+        return false;
     }
 
-    if (sum != 0) {
-        warn_report("CDAT: Found checksum mismatch in %s", cdat->filename);
+    table = ct3_parse_cdat(cdat->filename, (uint8_t *)buf, len, errp);
+    if (!table) {
+        return false;
+    }
+    table = cdat_table_intern(table);
+
+    /*
+     * Any table of an earlier version of the file stays with its users, but
+     * its entry is replaced, key included as that belongs to the table.
+     */
+    if (!table->filename) {
+        table->filename = g_strdup(cdat->filename);
+        table->st = st;
+        g_hash_table_replace(cdat_files, table->filename, table);
+    } else if (g_str_equal(table->filename, cdat->filename)) {
+        /* Touched but the same content */
+        table->st = st;
     }
-    cdat->entry_len = num_ent;
-    cdat->entry = g_steal_pointer(&cdat_st);
+    cdat->table = table;
+    return true;
 }
 
-void cxl_doe_cdat_init(CXLComponentState *cxl_cstate, Error **errp)
+bool cxl_doe_cdat_init(CXLComponentState *cxl_cstate, Error **errp)
 {
     CDATObject *cdat = &cxl_cstate->cdat;
 
     if (cdat->filename) {
-        ct3_load_cdat(cdat, errp);
-    } else {
-        ct3_build_cdat(cdat, errp);
+        return ct3_load_cdat(cdat, errp);
     }
+    ct3_build_cdat(cdat, errp);
+    return true;
 }
 
 void cxl_doe_cdat_update(CXLComponentState *cxl_cstate, Error **errp)
@@ -213,12 +309,60 @@ void cxl_doe_cdat_release(CXLComponentState *cxl_cstate)
 {
     CDATObject *cdat = &cxl_cstate->cdat;
 
-    free(cdat->entry);
-    if (cdat->built_buf) {
-        cdat->free_cdat_table(cdat->built_buf, cdat->built_buf_len,
-                              cdat->private);
+    cdat_table_unref(cdat->table);
+    cdat->table = NULL;
+}
+
+/*
+ * CXL r3.0 8.1.11.1 Read Entry, served from the table blob.  Requests that
+ * are too short or for an entry that does not exist are discarded.
+ */
+bool cxl_doe_cdat_read_entry(DOECap *doe_cap, CDATObject *cdat)
+{
+    CDATReq *req = pcie_doe_get_write_mbox_ptr(doe_cap);
+    CDATTable *table = cdat->table;
+    const uint8_t *base;
+    uint16_t ent;
+    uint32_t len;
+    CDATRsp rsp;
+
+    /* Not built yet, e.g. a switch without downstream ports */
+    if (!table) {
+        return false;
+    }
+
+    /* Discard if request length mismatched */
+    if (pcie_doe_get_obj_len(req) <
+        DIV_ROUND_UP(sizeof(CDATReq), sizeof(uint32_t))) {
+        return false;
     }
-    if (cdat->buf) {
-        free(cdat->buf);
+
+    ent = req->entry_handle;
+    if (ent >= table->entry_len) {
+        return false;
     }
+    base = (const uint8_t *)g_bytes_get_data(table->blob, NULL) +
+           table->entry_offset[ent];
+    len = table->entry_offset[ent + 1] - table->entry_offset[ent];
+
+    rsp = (CDATRsp) {
+        .header = {
+            .vendor_id = CXL_VENDOR_ID,
+            .data_obj_type = CXL_DOE_TABLE_ACCESS,
+            .reserved = 0x0,
+            .length = DIV_ROUND_UP((sizeof(rsp) + len), sizeof(uint32_t)),
+        },
+        .rsp_code = CXL_DOE_TAB_RSP,
+        .table_type = CXL_DOE_TAB_TYPE_CDAT,
+        .entry_handle = (ent < table->entry_len - 1) ?
+                        ent + 1 : CXL_DOE_TAB_ENT_MAX,
+    };
+
+    memcpy(doe_cap->read_mbox, &rsp, sizeof(rsp));
+    memcpy(doe_cap->read_mbox + DIV_ROUND_UP(sizeof(rsp), sizeof(uint32_t)),
+           base, len);
+
+    doe_cap->read_mbox_len += rsp.header.length;
+
+    return true;
 }
@@ -11,7 +11,9 @@
 #include "qemu/log.h"
 #include "qapi/error.h"
 #include "hw/pci/pci.h"
+#include "migration/vmstate.h"
 #include "hw/cxl/cxl.h"
+#include "hw/cxl/cxl_host.h"
 
 static uint64_t cxl_cache_mem_read_reg(void *opaque, hwaddr offset,
                                        unsigned size)
@@ -37,22 +39,31 @@ static void dumb_hdm_handler(CXLComponentState *cxl_cstate, hwaddr offset,
 {
     ComponentRegisters *cregs = &cxl_cstate->crb;
     uint32_t *cache_mem = cregs->cache_mem_registers;
+    int which_hdm = cxl_hdm_decoder_ctrl_index(offset);
     bool should_commit = false;
+    bool should_uncommit = false;
+    uint32_t *ctrl = NULL;
 
-    switch (offset) {
-    case A_CXL_HDM_DECODER0_CTRL:
+    if (which_hdm >= 0) {
+        ctrl = &cache_mem[R_CXL_HDM_DECODER0_CTRL +
+                          which_hdm * CXL_HDM_DECODER_STRIDE];
         should_commit = FIELD_EX32(value, CXL_HDM_DECODER0_CTRL, COMMIT);
-        break;
-    default:
-        break;
+        should_uncommit = !should_commit &&
+            FIELD_EX32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED);
     }
 
     memory_region_transaction_begin();
     stl_le_p((uint8_t *)cache_mem + offset, value);
     if (should_commit) {
-        ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, COMMIT, 0);
-        ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, ERR, 0);
-        ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, COMMITTED, 1);
+        *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMIT, 0);
+        *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, ERR, 0);
+        *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 1);
+    } else if (should_uncommit) {
+        *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 0);
+    }
+    if (should_commit || should_uncommit) {
+        cxl_hdm_decoders_changed();
+        cxl_fmws_update_mmio();
     }
     memory_region_transaction_commit();
 }
@@ -79,7 +90,7 @@ static void cxl_cache_mem_write_reg(void *opaque, hwaddr offset, uint64_t value,
     }
 
     if (offset >= A_CXL_HDM_DECODER_CAPABILITY &&
-        offset <= A_CXL_HDM_DECODER0_TARGET_LIST_HI) {
+        offset < CXL_HDM_REGISTERS_OFFSET + CXL_HDM_REGISTERS_SIZE) {
         dumb_hdm_handler(cxl_cstate, offset, value);
     } else {
         cregs->cache_mem_registers[offset / sizeof(*cregs->cache_mem_registers)] = value;
@@ -159,7 +170,8 @@ static void ras_init_common(uint32_t *reg_state, uint32_t *write_msk)
 static void hdm_init_common(uint32_t *reg_state, uint32_t *write_msk,
                             enum reg_type type)
 {
-    int decoder_count = 1;
+    int decoder_count = CXL_HDM_DECODER_COUNT;
+    int hdm_inc = CXL_HDM_DECODER_STRIDE;
     int i;
 
     ARRAY_FIELD_DP32(reg_state, CXL_HDM_DECODER_CAPABILITY, DECODER_COUNT,
@@ -172,20 +184,24 @@ static void hdm_init_common(uint32_t *reg_state, uint32_t *write_msk,
                      HDM_DECODER_ENABLE, 0);
     write_msk[R_CXL_HDM_DECODER_GLOBAL_CONTROL] = 0x3;
     for (i = 0; i < decoder_count; i++) {
-        write_msk[R_CXL_HDM_DECODER0_BASE_LO + i * 0x20] = 0xf0000000;
-        write_msk[R_CXL_HDM_DECODER0_BASE_HI + i * 0x20] = 0xffffffff;
-        write_msk[R_CXL_HDM_DECODER0_SIZE_LO + i * 0x20] = 0xf0000000;
-        write_msk[R_CXL_HDM_DECODER0_SIZE_HI + i * 0x20] = 0xffffffff;
-        write_msk[R_CXL_HDM_DECODER0_CTRL + i * 0x20] = 0x13ff;
+        write_msk[R_CXL_HDM_DECODER0_BASE_LO + i * hdm_inc] = 0xf0000000;
+        write_msk[R_CXL_HDM_DECODER0_BASE_HI + i * hdm_inc] = 0xffffffff;
+        write_msk[R_CXL_HDM_DECODER0_SIZE_LO + i * hdm_inc] = 0xf0000000;
+        write_msk[R_CXL_HDM_DECODER0_SIZE_HI + i * hdm_inc] = 0xffffffff;
+        write_msk[R_CXL_HDM_DECODER0_CTRL + i * hdm_inc] = 0x13ff;
         if (type == CXL2_DEVICE ||
             type == CXL2_TYPE3_DEVICE ||
             type == CXL2_LOGICAL_DEVICE) {
-            write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_LO + i * 0x20] = 0xf0000000;
+            write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_LO + i * hdm_inc] = 0xf0000000;
         } else {
-            write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_LO + i * 0x20] = 0xffffffff;
+            write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_LO + i * hdm_inc] = 0xffffffff;
         }
-        write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_HI + i * 0x20] = 0xffffffff;
+        write_msk[R_CXL_HDM_DECODER0_TARGET_LIST_HI + i * hdm_inc] = 0xffffffff;
     }
+
+    /* All decoders are now uncommitted, so drop any direct mappings */
+    cxl_hdm_decoders_changed();
+    cxl_fmws_update_mmio();
 }
 
 void cxl_component_register_init_common(uint32_t *reg_state, uint32_t *write_msk,
@@ -405,3 +421,30 @@ uint8_t cxl_interleave_granularity_enc(uint64_t gran, Error **errp)
         return 0;
     }
 }
+
+/* Decode may have changed under any fixed memory window */
+static int cxl_component_post_load(void *opaque, int version_id)
+{
+    cxl_hdm_decoders_changed();
+    cxl_fmws_update_mmio();
+
+    return 0;
+}
+
+/*
+ * Only the register values are migrated, the write masks and capability
+ * layout are recreated identically by realize on the destination.
+ */
+const VMStateDescription vmstate_cxl_component = {
+    .name = "cxl-component",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = cxl_component_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(crb.io_registers, CXLComponentState,
+                             CXL2_COMPONENT_IO_REGION_SIZE >> 2),
+        VMSTATE_UINT32_ARRAY(crb.cache_mem_registers, CXLComponentState,
+                             CXL2_COMPONENT_CM_REGION_SIZE >> 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include "qemu/log.h"
 #include "hw/cxl/cxl.h"
+#include "migration/vmstate.h"
 
 /*
  * Device registers have no restrictions per the spec, and so fall back to the
@@ -41,13 +42,23 @@ static uint64_t caps_reg_read(void *opaque, hwaddr offset, unsigned size)
 
 static uint64_t dev_reg_read(void *opaque, hwaddr offset, unsigned size)
 {
-    return 0;
+    CXLDeviceState *cxl_dstate = opaque;
+
+    /* Only the Event Status register, the rest is reserved */
+    if (offset >= sizeof(uint32_t)) {
+        return 0;
+    }
+
+    return extract64(cxl_event_status(cxl_dstate), offset * 8,
+                     MIN(size, sizeof(uint32_t) - offset) * 8);
 }
 
 static uint64_t mailbox_reg_read(void *opaque, hwaddr offset, unsigned size)
 {
     CXLDeviceState *cxl_dstate = opaque;
 
+    cxl_mailbox_bg_update(cxl_dstate);
+
     switch (size) {
     case 1:
         return cxl_dstate->mbox_reg_state[offset];
@@ -67,10 +78,10 @@ static void mailbox_mem_writel(uint32_t *reg_state, hwaddr offset,
 {
     switch (offset) {
     case A_CXL_DEV_MAILBOX_CTRL:
-        /* fallthrough */
+        break;
     case A_CXL_DEV_MAILBOX_CAP:
         /* RO register */
-        break;
+        return;
     default:
         qemu_log_mask(LOG_UNIMP,
                       "%s Unexpected 32-bit access to 0x%" PRIx64 " (WI)\n",
@@ -88,7 +99,6 @@ static void mailbox_mem_writeq(uint64_t *reg_state, hwaddr offset,
     case A_CXL_DEV_MAILBOX_CMD:
         break;
     case A_CXL_DEV_BG_CMD_STS:
-        /* BG not supported */
         /* fallthrough */
     case A_CXL_DEV_MAILBOX_STS:
         /* Read only register, will get updated by the state machine */
@@ -240,9 +250,16 @@ static void device_reg_init_common(CXLDeviceState *cxl_dstate) { }
 
 static void mailbox_reg_init_common(CXLDeviceState *cxl_dstate)
 {
-    /* 2048 payload size, with no interrupt or background support */
+    /*
+     * 2048 payload size, background completion interrupt on vector 0 and no
+     * interrupt for foreground commands
+     */
     ARRAY_FIELD_DP32(cxl_dstate->mbox_reg_state32, CXL_DEV_MAILBOX_CAP,
                      PAYLOAD_SIZE, CXL_MAILBOX_PAYLOAD_SHIFT);
+    ARRAY_FIELD_DP32(cxl_dstate->mbox_reg_state32, CXL_DEV_MAILBOX_CAP,
+                     BG_INT_CAP, 1);
+    ARRAY_FIELD_DP32(cxl_dstate->mbox_reg_state32, CXL_DEV_MAILBOX_CAP,
+                     MSI_N, 0);
     cxl_dstate->payload_size = CXL_MAILBOX_MAX_PAYLOAD_SIZE;
 }
 
@@ -269,3 +286,90 @@ void cxl_device_register_init_common(CXLDeviceState *cxl_dstate)
 
     cxl_initialize_mailbox(cxl_dstate);
 }
+
+static const VMStateDescription vmstate_cxl_event_log = {
+    .name = "cxl-device/event-log",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(next_handle, CXLEventLog),
+        VMSTATE_UINT16(head, CXLEventLog),
+        VMSTATE_UINT16(count, CXLEventLog),
+        VMSTATE_UINT16(overflow_err_count, CXLEventLog),
+        VMSTATE_UINT64(first_overflow_ts, CXLEventLog),
+        VMSTATE_UINT64(last_overflow_ts, CXLEventLog),
+        VMSTATE_BOOL(irq_pending, CXLEventLog),
+        VMSTATE_UINT8_ARRAY(raw, CXLEventLog,
+                            CXL_EVENT_LOG_SIZE * CXL_EVENT_RECORD_SIZE),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool cxl_device_events_needed(void *opaque)
+{
+    CXLDeviceState *cxl_dstate = opaque;
+    int i;
+
+    for (i = 0; i < CXL_EVENT_TYPE_MAX; i++) {
+        if (cxl_dstate->event_logs[i].count ||
+            cxl_dstate->event_logs[i].overflow_err_count ||
+            cxl_dstate->event_int_settings[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int cxl_device_events_post_load(void *opaque, int version_id)
+{
+    CXLDeviceState *cxl_dstate = opaque;
+    int i;
+
+    for (i = 0; i < CXL_EVENT_TYPE_MAX; i++) {
+        CXLEventLog *log = &cxl_dstate->event_logs[i];
+
+        if (log->head >= CXL_EVENT_LOG_SIZE ||
+            log->count > CXL_EVENT_LOG_SIZE) {
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_cxl_device_events = {
+    .name = "cxl-device/events",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = cxl_device_events_needed,
+    .post_load = cxl_device_events_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(event_logs, CXLDeviceState, CXL_EVENT_TYPE_MAX,
+                             1, vmstate_cxl_event_log, CXLEventLog),
+        VMSTATE_UINT8_ARRAY(event_int_settings, CXLDeviceState,
+                            CXL_EVENT_TYPE_MAX),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/*
+ * Background commands are finished before the VM stops, so the mailbox
+ * registers hold all of the mailbox state.  The capability registers are
+ * built by realize.
+ */
+const VMStateDescription vmstate_cxl_device = {
+    .name = "cxl-device",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8_ARRAY(mbox_reg_state, CXLDeviceState,
+                            CXL_MAILBOX_REGISTERS_LENGTH),
+        VMSTATE_BOOL(timestamp.set, CXLDeviceState),
+        VMSTATE_UINT64(timestamp.last_set, CXLDeviceState),
+        VMSTATE_UINT64(timestamp.host_set, CXLDeviceState),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_cxl_device_events,
+        NULL
+    }
+};
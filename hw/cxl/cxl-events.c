@@ -0,0 +1,132 @@
+/*
+ * CXL Event processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2. See the
+ * COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/cxl/cxl.h"
+#include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
+
+void cxl_event_init(CXLDeviceState *cxl_dstate)
+{
+    int i;
+
+    for (i = 0; i < CXL_EVENT_TYPE_MAX; i++) {
+        CXLEventLog *log = &cxl_dstate->event_logs[i];
+
+        memset(log, 0, sizeof(*log));
+        /* Handle 0 is reserved */
+        log->next_handle = 1;
+    }
+    memset(cxl_dstate->event_int_settings, 0,
+           sizeof(cxl_dstate->event_int_settings));
+}
+
+uint16_t cxl_event_log_free_space(CXLDeviceState *cxl_dstate,
+                                  CXLEventLogType log_type)
+{
+    return CXL_EVENT_LOG_SIZE - cxl_dstate->event_logs[log_type].count;
+}
+
+/* The @i'th oldest record of @log */
+CXLEventRecordRaw *cxl_event_log_record(CXLEventLog *log, uint16_t i)
+{
+    return &log->records[(log->head + i) % CXL_EVENT_LOG_SIZE];
+}
+
+/* Drop the @n oldest records, and the overflow once all are gone */
+void cxl_event_log_drop(CXLEventLog *log, uint16_t n)
+{
+    log->head = (log->head + n) % CXL_EVENT_LOG_SIZE;
+    log->count -= n;
+    if (!log->count) {
+        log->overflow_err_count = 0;
+        log->first_overflow_ts = 0;
+        log->last_overflow_ts = 0;
+    }
+}
+
+/*
+ * Append @record to the log, filling in its handle and timestamp.  If the
+ * log is full the record is dropped, the overflow accounted and false
+ * returned.  Call cxl_event_irq() once done adding records.
+ */
+bool cxl_event_insert(CXLDeviceState *cxl_dstate, CXLEventLogType log_type,
+                      const CXLEventRecordRaw *record)
+{
+    CXLEventLog *log = &cxl_dstate->event_logs[log_type];
+    uint64_t now = cxl_device_get_timestamp(cxl_dstate);
+    CXLEventRecordRaw *slot;
+
+    if (log->count == CXL_EVENT_LOG_SIZE) {
+        if (!log->overflow_err_count) {
+            log->first_overflow_ts = now;
+        }
+        if (log->overflow_err_count != UINT16_MAX) {
+            log->overflow_err_count++;
+        }
+        log->last_overflow_ts = now;
+        return false;
+    }
+
+    slot = cxl_event_log_record(log, log->count);
+    *slot = *record;
+    stw_le_p(&slot->hdr.handle, log->next_handle);
+    stq_le_p(&slot->hdr.timestamp, now);
+    if (!++log->next_handle) {
+        log->next_handle = 1;
+    }
+
+    if (!log->count++) {
+        log->irq_pending = true;
+    }
+    return true;
+}
+
+/*
+ * Signal records added to @log_type as its interrupt policy asks.  Software
+ * keeps reading the logs until the Event Status register shows them all
+ * empty, so only the first records added to an empty log need an
+ * interrupt.  A batch of records, or a storm of them, thus raises a single
+ * one.
+ */
+void cxl_event_irq(CXLDeviceState *cxl_dstate, CXLEventLogType log_type)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    PCIDevice *pdev = PCI_DEVICE(ct3d);
+    CXLEventLog *log = &cxl_dstate->event_logs[log_type];
+    uint8_t setting = cxl_dstate->event_int_settings[log_type];
+
+    if (!log->irq_pending) {
+        return;
+    }
+    log->irq_pending = false;
+
+    if ((setting & CXL_EVENT_INT_MODE_MASK) != CXL_EVENT_INT_MODE_MSI) {
+        return;
+    }
+
+    if (msix_enabled(pdev)) {
+        msix_notify(pdev, CXL_EVENT_INT_VECTOR);
+    } else if (msi_enabled(pdev)) {
+        msi_notify(pdev, CXL_EVENT_INT_VECTOR);
+    }
+}
+
+/* 8.2.8.3.1 Event Status Register */
+uint32_t cxl_event_status(CXLDeviceState *cxl_dstate)
+{
+    uint32_t status = 0;
+    int i;
+
+    for (i = 0; i < CXL_EVENT_TYPE_MAX; i++) {
+        if (cxl_dstate->event_logs[i].count) {
+            status |= BIT(i);
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,203 @@
+/*
+ * CXL HDM decoder lookup
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2. See the
+ * COPYING file in the top-level directory.
+ *
+ * The decoders of a component are kept in its registers, but walking those
+ * on every access grows linearly with the number of decoders.  Instead keep
+ * a table of the committed decoders sorted by base address and binary search
+ * it.  Tables are rebuilt lazily on the first lookup after any decoder in the
+ * system has been committed, uncommitted or reset.
+ */
+
+#include "qemu/osdep.h"
+#include "hw/cxl/cxl_component.h"
+
+/* Start above the generation of zero initialized tables */
+static uint64_t cxl_hdm_gen = 1;
+
+void cxl_hdm_decoders_changed(void)
+{
+    cxl_hdm_gen++;
+}
+
+static uint64_t cxl_hdm_reg64(const uint32_t *cache_mem, int lo, int hi)
+{
+    return ((uint64_t)cache_mem[hi] << 32) | cache_mem[lo];
+}
+
+/* 8.2.5.12.7 - Interleave Ways encoding */
+static unsigned int cxl_hdm_ways(uint8_t iw)
+{
+    switch (iw) {
+    case 8:
+        return 3;
+    case 9:
+        return 6;
+    case 10:
+        return 12;
+    default:
+        return 1 << iw;
+    }
+}
+
+static int cxl_hdm_decoder_cmp(const void *a, const void *b)
+{
+    const CXLHDMDecoder *da = a, *db = b;
+
+    if (da->base < db->base) {
+        return -1;
+    }
+    return da->base > db->base;
+}
+
+/*
+ * Decoders are committed in order, so stop at the first uncommitted one.
+ * For endpoints, each decoder's DPA range follows that of the previous
+ * decoder after skipping the DPA skip of the decoder itself (8.2.5.12.13).
+ */
+void cxl_hdm_table_build(CXLHDMDecoderTable *table, const uint32_t *cache_mem)
+{
+    uint32_t cap = cache_mem[R_CXL_HDM_DECODER_CAPABILITY];
+    int count = cxl_decoder_count_dec(FIELD_EX32(cap,
+                                                 CXL_HDM_DECODER_CAPABILITY,
+                                                 DECODER_COUNT));
+    uint64_t dpa_base = 0;
+    int i;
+
+    table->count = 0;
+    for (i = 0; i < count && i < HDM_DECODE_MAX; i++) {
+        const uint32_t *regs = cache_mem + i * CXL_HDM_DECODER_STRIDE;
+        uint32_t ctrl = regs[R_CXL_HDM_DECODER0_CTRL];
+        CXLHDMDecoder *decoder;
+        uint32_t lo, hi;
+
+        if (!FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED)) {
+            break;
+        }
+
+        decoder = &table->decoders[table->count++];
+        decoder->index = i;
+        decoder->base = cxl_hdm_reg64(regs, R_CXL_HDM_DECODER0_BASE_LO,
+                                      R_CXL_HDM_DECODER0_BASE_HI);
+        decoder->size = cxl_hdm_reg64(regs, R_CXL_HDM_DECODER0_SIZE_LO,
+                                      R_CXL_HDM_DECODER0_SIZE_HI);
+        decoder->iw = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IW);
+        decoder->ig = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IG);
+
+        /* Port decoders have a target list where endpoints have DPA skip */
+        lo = regs[R_CXL_HDM_DECODER0_TARGET_LIST_LO];
+        hi = regs[R_CXL_HDM_DECODER0_TARGET_LIST_HI];
+        stl_le_p(&decoder->targets[0], lo);
+        stl_le_p(&decoder->targets[4], hi);
+
+        dpa_base += cxl_hdm_reg64(regs, R_CXL_HDM_DECODER0_DPA_SKIP_LO,
+                                  R_CXL_HDM_DECODER0_DPA_SKIP_HI);
+        decoder->dpa_base = dpa_base;
+        dpa_base += decoder->size / cxl_hdm_ways(decoder->iw);
+    }
+
+    qsort(table->decoders, table->count, sizeof(table->decoders[0]),
+          cxl_hdm_decoder_cmp);
+}
+
+/*
+ * Find the decoder covering @hpa.  If @run is non NULL it is clamped to the
+ * bytes from @hpa to the end of that decoder or, if there is none, up to the
+ * next decoder so the caller can skip the undecoded gap.
+ */
+const CXLHDMDecoder *cxl_hdm_table_find(const CXLHDMDecoderTable *table,
+                                        uint64_t hpa, uint64_t *run)
+{
+    int lo = 0, hi = table->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const CXLHDMDecoder *decoder = &table->decoders[mid];
+
+        if (hpa < decoder->base) {
+            hi = mid;
+        } else if (hpa - decoder->base >= decoder->size) {
+            lo = mid + 1;
+        } else {
+            if (run) {
+                *run = MIN(*run, decoder->size - (hpa - decoder->base));
+            }
+            return decoder;
+        }
+    }
+
+    if (run && lo < table->count) {
+        *run = MIN(*run, table->decoders[lo].base - hpa);
+    }
+    return NULL;
+}
+
+const CXLHDMDecoderTable *cxl_hdm_get_table(CXLComponentState *cxl_cstate)
+{
+    CXLHDMDecoderTable *table = &cxl_cstate->hdm_table;
+
+    if (table->gen != cxl_hdm_gen) {
+        cxl_hdm_table_build(table, cxl_cstate->crb.cache_mem_registers);
+        table->gen = cxl_hdm_gen;
+    }
+
+    return table;
+}
+
+const CXLHDMDecoder *cxl_hdm_find_decoder(CXLComponentState *cxl_cstate,
+                                          uint64_t hpa, uint64_t *run)
+{
+    return cxl_hdm_table_find(cxl_hdm_get_table(cxl_cstate), hpa, run);
+}
+
+/* Endpoints only, there are few decoders so just look at all of them */
+const CXLHDMDecoder *cxl_hdm_find_decoder_by_dpa(CXLComponentState *cxl_cstate,
+                                                 uint64_t dpa)
+{
+    const CXLHDMDecoderTable *table = cxl_hdm_get_table(cxl_cstate);
+    int i;
+
+    for (i = 0; i < table->count; i++) {
+        const CXLHDMDecoder *decoder = &table->decoders[i];
+        uint64_t dpa_size = decoder->size / cxl_hdm_ways(decoder->iw);
+
+        if (dpa >= decoder->dpa_base && dpa - decoder->dpa_base < dpa_size) {
+            return decoder;
+        }
+    }
+
+    return NULL;
+}
+
+unsigned int cxl_hdm_decoder_ways(const CXLHDMDecoder *decoder)
+{
+    return cxl_hdm_ways(decoder->iw);
+}
+
+/* Index into targets[] of the target @hpa is routed to */
+unsigned int cxl_hdm_decoder_way(const CXLHDMDecoder *decoder, uint64_t hpa)
+{
+    uint64_t target_idx = (hpa / cxl_decode_ig(decoder->ig)) %
+                          cxl_hdm_ways(decoder->iw);
+
+    return target_idx % ARRAY_SIZE(decoder->targets);
+}
+
+uint64_t cxl_hdm_decoder_dpa(const CXLHDMDecoder *decoder, uint64_t hpa)
+{
+    uint64_t hpa_offset = hpa - decoder->base;
+    int ig = decoder->ig, iw = decoder->iw;
+
+    if (iw >= 8) {
+        /* 3, 6 and 12 way, each target takes every ways'th granule */
+        uint64_t gran = cxl_decode_ig(ig);
+
+        return decoder->dpa_base + hpa_offset % gran +
+            hpa_offset / (gran * cxl_hdm_ways(iw)) * gran;
+    }
+
+    return decoder->dpa_base + ((MAKE_64BIT_MASK(0, 8 + ig) & hpa_offset) |
+        ((MAKE_64BIT_MASK(8 + ig + iw, 64 - 8 - ig - iw) & hpa_offset) >> iw));
+}
@@ -5,6 +5,7 @@
  */
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-cxl.h"
 #include "hw/cxl/cxl.h"
 #include "hw/cxl/cxl_host.h"
 
@@ -13,3 +14,16 @@ void cxl_machine_init(Object *obj, CXLState *state) {};
 void cxl_hook_up_pxb_registers(PCIBus *bus, CXLState *state, Error **errp) {};
 
 const MemoryRegionOps cfmws_ops;
+
+void qmp_cxl_set_hot_page_tracking(bool enable, Error **errp)
+{
+    error_setg(errp, "CXL support is not compiled in");
+}
+
+CXLHotPageList *qmp_query_cxl_hot_pages(bool has_count, uint32_t count,
+                                        bool has_reset, bool reset,
+                                        Error **errp)
+{
+    error_setg(errp, "CXL support is not compiled in");
+    return NULL;
+}
@@ -80,68 +80,138 @@ void cxl_fmws_link_targets(CXLState *cxl_state, Error **errp)
             int i;
 
             for (i = 0; i < fw->num_targets; i++) {
+                PXBDev *pxb = NULL;
                 Object *o;
                 bool ambig;
 
-                o = object_resolve_path_type(fw->targets[i],
-                                             TYPE_PXB_CXL_DEVICE,
-                                             &ambig);
-                if (!o) {
-                    error_setg(errp, "Could not resolve CXLFM target %s",
-                               fw->targets[i]);
-                    return;
+                if (cxl_state->host_bridges) {
+                    pxb = g_hash_table_lookup(cxl_state->host_bridges,
+                                              fw->targets[i]);
+                }
+                if (!pxb) {
+                    /* Not a host bridge id, but could still be a path */
+                    o = object_resolve_path_type(fw->targets[i],
+                                                 TYPE_PXB_CXL_DEVICE,
+                                                 &ambig);
+                    if (!o) {
+                        error_setg(errp, "Could not resolve CXLFM target %s",
+                                   fw->targets[i]);
+                        return;
+                    }
+                    pxb = PXB_CXL_DEV(o);
                 }
-                fw->target_hbs[i] = PXB_CXL_DEV(o);
+                fw->target_hbs[i] = pxb;
             }
         }
     }
 }
 
-/* TODO: support, multiple hdm decoders */
-static bool cxl_hdm_find_target(uint32_t *cache_mem, hwaddr addr,
-                                uint8_t *target)
+/*
+ * Decode tree of a fixed memory window, built from the committed decoders of
+ * all the components below its host bridges whenever decode has changed, so
+ * that routing an address does not have to search buses for ports.  There
+ * is a node per component with HDM decoders, host bridges and any number of
+ * levels of switch upstream ports, and a leaf per Type 3 device.  Nodes are
+ * shared where decoders route to the same port.
+ */
+struct CXLDecodeNode {
+    /* Device below a port, checked to catch hot unplug */
+    PCIBus *bus;
+    PCIDevice *dev;
+    /* Routing component, NULL for leaves and passthrough host bridges */
+    CXLComponentState *cstate;
+    CXLDecodeNode *passthrough;
+    /* Node of each target of each decoder, by decoder index */
+    CXLDecodeNode *targets[CXL_HDM_DECODER_COUNT][8];
+};
+
+typedef struct CXLDecodeTreeBuild {
+    CXLFixedWindow *fw;
+    /* Nodes by the port above them */
+    GHashTable *ports;
+} CXLDecodeTreeBuild;
+
+static CXLDecodeNode *cxl_decode_node_new(CXLDecodeTreeBuild *build)
 {
-    uint32_t ctrl;
-    uint32_t ig_enc;
-    uint32_t iw_enc;
-    uint32_t target_idx;
+    CXLDecodeNode *node = g_new0(CXLDecodeNode, 1);
 
-    ctrl = cache_mem[R_CXL_HDM_DECODER0_CTRL];
-    if (!FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED)) {
-        return false;
-    }
+    g_ptr_array_add(build->fw->decode_nodes, node);
+    return node;
+}
 
-    ig_enc = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IG);
-    iw_enc = FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, IW);
-    target_idx = (addr / cxl_decode_ig(ig_enc)) % (1 << iw_enc);
+static CXLDecodeNode *cxl_decode_tree_component(CXLDecodeTreeBuild *build,
+                                                CXLComponentState *cstate,
+                                                PCIBus *bus);
 
-    if (target_idx < 4) {
-        *target = extract32(cache_mem[R_CXL_HDM_DECODER0_TARGET_LIST_LO],
-                            target_idx * 8, 8);
-    } else {
-        *target = extract32(cache_mem[R_CXL_HDM_DECODER0_TARGET_LIST_HI],
-                            (target_idx - 4) * 8, 8);
+/* Node for what is below root or downstream port @port, if anything */
+static CXLDecodeNode *cxl_decode_tree_port(CXLDecodeTreeBuild *build,
+                                           PCIDevice *port)
+{
+    PCIBus *bus = pci_bridge_get_sec_bus(PCI_BRIDGE(port));
+    PCIDevice *d = bus->devices[0];
+    CXLComponentState *cstate;
+    CXLDecodeNode *node;
+
+    if (g_hash_table_lookup_extended(build->ports, port, NULL,
+                                     (gpointer *)&node)) {
+        return node;
     }
 
-    return true;
+    node = NULL;
+    if (d && object_dynamic_cast(OBJECT(d), TYPE_CXL_TYPE3)) {
+        node = cxl_decode_node_new(build);
+    } else if (d && object_dynamic_cast(OBJECT(d), TYPE_CXL_USP)) {
+        cstate = cxl_usp_to_cstate(CXL_USP(d));
+        if (cstate) {
+            node = cxl_decode_tree_component(build, cstate,
+                                             &PCI_BRIDGE(d)->sec_bus);
+        }
+    }
+    if (node) {
+        node->bus = bus;
+        node->dev = d;
+    }
+
+    g_hash_table_insert(build->ports, port, node);
+    return node;
 }
 
-static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
+/* Node for a component routing through its HDM decoders to ports on @bus */
+static CXLDecodeNode *cxl_decode_tree_component(CXLDecodeTreeBuild *build,
+                                                CXLComponentState *cstate,
+                                                PCIBus *bus)
 {
-    CXLComponentState *hb_cstate, *usp_cstate;
-    PCIHostState *hb;
-    CXLUpstreamPort *usp;
-    int rb_index;
-    uint32_t *cache_mem;
-    uint8_t target;
-    bool target_found;
-    PCIDevice *rp, *d;
+    const CXLHDMDecoderTable *table = cxl_hdm_get_table(cstate);
+    CXLDecodeNode *node = cxl_decode_node_new(build);
+    int i, j;
+
+    node->cstate = cstate;
+    for (i = 0; i < table->count; i++) {
+        const CXLHDMDecoder *decoder = &table->decoders[i];
+        int ways = MIN(cxl_hdm_decoder_ways(decoder),
+                       ARRAY_SIZE(decoder->targets));
+
+        for (j = 0; j < ways; j++) {
+            PCIDevice *port = pcie_find_port_by_pn(bus, decoder->targets[j]);
+
+            if (port) {
+                node->targets[decoder->index][j] =
+                    cxl_decode_tree_port(build, port);
+            }
+        }
+    }
 
-    /* Address is relative to memory region. Convert to HPA */
-    addr += fw->base;
+    return node;
+}
+
+static CXLDecodeNode *cxl_decode_tree_hb(CXLDecodeTreeBuild *build,
+                                         PXBDev *pxb)
+{
+    PCIHostState *hb = PCI_HOST_BRIDGE(pxb->cxl.cxl_host_bridge);
+    CXLComponentState *hb_cstate;
+    CXLDecodeNode *node;
+    PCIDevice *rp;
 
-    rb_index = (addr / cxl_decode_ig(fw->enc_int_gran)) % fw->num_targets;
-    hb = PCI_HOST_BRIDGE(fw->target_hbs[rb_index]->cxl.cxl_host_bridge);
     if (!hb || !hb->bus || !pci_bus_is_cxl(hb->bus)) {
         return NULL;
     }
@@ -151,79 +221,297 @@ static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr)
         if (!rp) {
             return NULL;
         }
-    } else {
-        hb_cstate = cxl_get_hb_cstate(hb);
-        if (!hb_cstate) {
-            return NULL;
-        }
+        node = cxl_decode_node_new(build);
+        node->passthrough = cxl_decode_tree_port(build, rp);
+        return node;
+    }
 
-        cache_mem = hb_cstate->crb.cache_mem_registers;
+    hb_cstate = cxl_get_hb_cstate(hb);
+    if (!hb_cstate) {
+        return NULL;
+    }
+    return cxl_decode_tree_component(build, hb_cstate, hb->bus);
+}
 
-        target_found = cxl_hdm_find_target(cache_mem, addr, &target);
-        if (!target_found) {
-            return NULL;
+static void cxl_cfmws_build_decode_tree(CXLFixedWindow *fw)
+{
+    CXLDecodeTreeBuild build = {
+        .fw = fw,
+        .ports = g_hash_table_new(NULL, NULL),
+    };
+    int i;
+
+    if (fw->decode_nodes) {
+        g_ptr_array_free(fw->decode_nodes, true);
+    }
+    fw->decode_nodes = g_ptr_array_new_with_free_func(g_free);
+
+    for (i = 0; i < fw->num_targets; i++) {
+        fw->decode_roots[i] = cxl_decode_tree_hb(&build, fw->target_hbs[i]);
+    }
+    fw->decode_gen = fw->route_gen;
+
+    g_hash_table_destroy(build.ports);
+}
+
+/*
+ * Walk the decode tree.  The cost grows with the depth of the topology, but
+ * the MMIO path only gets here on a route cache miss.  Returns false if the
+ * tree is stale because a device has gone away.
+ */
+static bool cxl_cfmws_decode(CXLFixedWindow *fw, hwaddr addr, uint64_t *run,
+                             PCIDevice **d)
+{
+    int rb_index = (addr / cxl_decode_ig(fw->enc_int_gran)) % fw->num_targets;
+    CXLDecodeNode *node = fw->decode_roots[rb_index];
+    const CXLHDMDecoder *decoder;
+
+    *d = NULL;
+    while (node) {
+        if (node->bus && node->bus->devices[0] != node->dev) {
+            return false;
         }
 
-        rp = pcie_find_port_by_pn(hb->bus, target);
-        if (!rp) {
-            return NULL;
+        if (node->passthrough) {
+            node = node->passthrough;
+        } else if (node->cstate) {
+            decoder = cxl_hdm_find_decoder(node->cstate, addr, run);
+            if (!decoder) {
+                return true;
+            }
+            if (run && decoder->iw) {
+                /* Stay within the granule, so routed to the same target */
+                uint64_t gran = cxl_decode_ig(decoder->ig);
+
+                *run = MIN(*run, gran - addr % gran);
+            }
+            node = node->targets[decoder->index]
+                                [cxl_hdm_decoder_way(decoder, addr)];
+        } else {
+            *d = node->dev;
+            return true;
         }
     }
 
-    d = pci_bridge_get_sec_bus(PCI_BRIDGE(rp))->devices[0];
-    if (!d) {
-        return NULL;
+    return true;
+}
+
+static PCIDevice *cxl_cfmws_find_device(CXLFixedWindow *fw, hwaddr addr,
+                                        uint64_t *run)
+{
+    uint64_t gran = cxl_decode_ig(fw->enc_int_gran);
+    PCIDevice *d;
+
+    /* Address is relative to memory region. Convert to HPA */
+    addr += fw->base;
+
+    if (run && fw->num_targets > 1) {
+        *run = MIN(*run, gran - addr % gran);
     }
 
-    if (object_dynamic_cast(OBJECT(d), TYPE_CXL_TYPE3)) {
-        return d;
+    if (!fw->decode_nodes || fw->decode_gen != fw->route_gen) {
+        cxl_cfmws_build_decode_tree(fw);
+    }
+    if (!cxl_cfmws_decode(fw, addr, run, &d)) {
+        cxl_cfmws_build_decode_tree(fw);
+        cxl_cfmws_decode(fw, addr, run, &d);
     }
 
-    /*
-     * Could also be a switch.  Note only one level of switching currently
-     * supported.
-     */
-    if (!object_dynamic_cast(OBJECT(d), TYPE_CXL_USP)) {
-        return NULL;
+    return d;
+}
+
+/*
+ * Upper bound on the decode steps taken when looking for direct mappings in
+ * a window.  Fine grained interleave gives many small runs that cannot be
+ * mapped anyway, so stop looking once this is exceeded and leave the rest
+ * of the window to the MMIO path.
+ */
+#define CXL_CFMWS_DIRECT_MAX_STEPS 4096
+
+static void cxl_cfmws_unmap_direct(CXLFixedWindow *fw)
+{
+    int i;
+
+    if (!fw->direct_mrs) {
+        return;
     }
-    usp = CXL_USP(d);
 
-    usp_cstate = cxl_usp_to_cstate(usp);
-    if (!usp_cstate) {
-        return NULL;
+    for (i = 0; i < fw->direct_mrs->len; i++) {
+        MemoryRegion *mr = g_ptr_array_index(fw->direct_mrs, i);
+
+        cxl_hot_pages_unmap(fw, mr);
+        memory_region_del_subregion(&fw->mr, mr);
+        object_unparent(OBJECT(mr));
+        g_free(mr);
     }
+    g_ptr_array_free(fw->direct_mrs, true);
+    fw->direct_mrs = NULL;
+}
 
-    cache_mem = usp_cstate->crb.cache_mem_registers;
+/*
+ * Walk the window and overlay each run of host physical addresses that is
+ * decoded by committed decoders all the way to a Type 3 device, and is
+ * contiguous in that device's DPA space, with an alias of the device memory.
+ * Anything that cannot be mapped that way keeps using cfmws_ops.
+ */
+static void cxl_cfmws_map_direct(CXLFixedWindow *fw)
+{
+    uint64_t page_size = qemu_real_host_page_size();
+    Object *owner = memory_region_owner(&fw->mr);
+    hwaddr offset = 0;
+    int steps = 0;
 
-    target_found = cxl_hdm_find_target(cache_mem, addr, &target);
-    if (!target_found) {
-        return NULL;
+    cxl_cfmws_unmap_direct(fw);
+
+    /* Host bridge interleave finer than a page cannot be mapped */
+    if (fw->num_targets > 1 &&
+        cxl_decode_ig(fw->enc_int_gran) < page_size) {
+        return;
     }
 
-    d = pcie_find_port_by_pn(&PCI_BRIDGE(d)->sec_bus, target);
-    if (!d) {
-        return NULL;
+    while (offset < fw->size && steps++ < CXL_CFMWS_DIRECT_MAX_STEPS) {
+        uint64_t run = fw->size - offset;
+        uint64_t mr_offset = 0;
+        MemoryRegion *target_mr = NULL, *mr;
+        PCIDevice *d;
+        char *name;
+
+        d = cxl_cfmws_find_device(fw, offset, &run);
+        if (d) {
+            target_mr = cxl_type3_hpa_to_mr(d, fw->base + offset, &mr_offset,
+                                            &run);
+        }
+        if (!target_mr ||
+            !QEMU_IS_ALIGNED(offset | run | mr_offset, page_size)) {
+            offset += run;
+            continue;
+        }
+
+        if (!fw->direct_mrs) {
+            fw->direct_mrs = g_ptr_array_new();
+        }
+        mr = g_new0(MemoryRegion, 1);
+        name = g_strdup_printf("cxl-fixed-memory-direct-%" PRIx64,
+                               fw->base + offset);
+        memory_region_init_alias(mr, owner, name, target_mr, mr_offset, run);
+        g_free(name);
+        memory_region_add_subregion_overlap(&fw->mr, offset, mr, 1);
+        g_ptr_array_add(fw->direct_mrs, mr);
+        cxl_hot_pages_map(fw, mr);
+
+        offset += run;
     }
+}
+
+/*
+ * Called whenever an HDM decoder anywhere in the CXL topology is committed,
+ * uncommitted or reset, so that the direct mappings of all fixed memory
+ * windows reflect the current decode.
+ */
+void cxl_fmws_update_mmio(void)
+{
+    GList *it;
+
+    memory_region_transaction_begin();
+    for (it = cxl_fmws_get_all(); it; it = it->next) {
+        CXLFixedWindow *fw = it->data;
+
+        /* Any cached route may have changed */
+        fw->route_gen++;
 
-    d = pci_bridge_get_sec_bus(PCI_BRIDGE(d))->devices[0];
-    if (!d) {
+        /* Targets are only resolved once the machine is done */
+        if (!fw->target_hbs[0] || !memory_region_is_mapped(&fw->mr)) {
+            continue;
+        }
+        cxl_cfmws_map_direct(fw);
+    }
+    memory_region_transaction_commit();
+}
+
+/* The fixed memory windows of the machine, if it has CXL enabled */
+GList *cxl_fmws_get_all(void)
+{
+    MachineState *ms = (MachineState *)object_dynamic_cast(qdev_get_machine(),
+                                                           TYPE_MACHINE);
+    MachineClass *mc;
+    CXLState *state;
+
+    if (!ms) {
+        return NULL;
+    }
+    mc = MACHINE_GET_CLASS(ms);
+    if (!mc->get_cxl_state) {
         return NULL;
     }
+    state = mc->get_cxl_state(ms);
+
+    return state->is_enabled ? state->fixed_windows : NULL;
+}
+
+/*
+ * Look up the route for an access of @size bytes at @addr, relative to the
+ * window, in the route cache.  On a miss do the full topology walk and, if
+ * the result resolves to a contiguous range of a committed Type 3 decoder,
+ * remember it.
+ *
+ * An entry records [start, start + run) for the whole run of contiguous DPA
+ * on one device that the walk found from the 256 byte block of the access,
+ * which may span many interleave granules.  It is only filed under the
+ * granule of the access that missed, so the index is just where to look:
+ * a hit still needs the access to be within the recorded range.  Accesses
+ * to other granules of the same run look in other slots, and at worst miss
+ * and walk again, filling their slot with a copy of the same range.  Every
+ * copy stays valid until decode changes, which bumps route_gen.
+ */
+static CXLFixedWindowRoute *cxl_cfmws_find_route(CXLFixedWindow *fw,
+                                                 hwaddr addr, unsigned size)
+{
+    uint64_t gran = cxl_decode_ig(fw->enc_int_gran);
+    CXLFixedWindowRoute *route;
+    uint64_t run, dpa;
+    hwaddr start;
+    PCIDevice *d;
+
+    route = &fw->route_cache[(addr / gran) % CXL_FMW_ROUTE_CACHE_SIZE];
+    if (route->d && route->gen == fw->route_gen &&
+        addr >= route->start && addr + size <= route->end) {
+        return route;
+    }
 
-    if (!object_dynamic_cast(OBJECT(d), TYPE_CXL_TYPE3)) {
+    /* Smallest interleave granule, so the whole block has a single target */
+    start = QEMU_ALIGN_DOWN(addr, 256);
+    run = fw->size - start;
+    d = cxl_cfmws_find_device(fw, start, &run);
+    if (!d || !cxl_type3_hpa_to_dpa(d, fw->base + start, &dpa, &run) ||
+        addr + size > start + run) {
         return NULL;
     }
 
-    return d;
+    route->start = start;
+    route->end = start + run;
+    route->dpa = dpa;
+    route->d = d;
+    route->gen = fw->route_gen;
+
+    return route;
 }
 
 static MemTxResult cxl_read_cfmws(void *opaque, hwaddr addr, uint64_t *data,
                                   unsigned size, MemTxAttrs attrs)
 {
     CXLFixedWindow *fw = opaque;
+    CXLFixedWindowRoute *route;
     PCIDevice *d;
 
-    d = cxl_cfmws_find_device(fw, addr);
+    cxl_hot_pages_access(fw, addr, false);
+
+    route = cxl_cfmws_find_route(fw, addr, size);
+    if (route) {
+        return cxl_type3_read_dpa(route->d, route->dpa + addr - route->start,
+                                  data, size, attrs);
+    }
+
+    d = cxl_cfmws_find_device(fw, addr, NULL);
     if (d == NULL) {
         *data = 0;
         /* Reads to invalid address return poison */
@@ -238,9 +526,18 @@ static MemTxResult cxl_write_cfmws(void *opaque, hwaddr addr,
                                    MemTxAttrs attrs)
 {
     CXLFixedWindow *fw = opaque;
+    CXLFixedWindowRoute *route;
     PCIDevice *d;
 
-    d = cxl_cfmws_find_device(fw, addr);
+    cxl_hot_pages_access(fw, addr, true);
+
+    route = cxl_cfmws_find_route(fw, addr, size);
+    if (route) {
+        return cxl_type3_write_dpa(route->d, route->dpa + addr - route->start,
+                                   data, size, attrs);
+    }
+
+    d = cxl_cfmws_find_device(fw, addr, NULL);
     if (d == NULL) {
         /* Writes to invalid address are silent */
         return MEMTX_OK;
@@ -329,6 +626,10 @@ void cxl_machine_init(Object *obj, CXLState *state)
 
 void cxl_hook_up_pxb_registers(PCIBus *bus, CXLState *state, Error **errp)
 {
+    if (!state->host_bridges) {
+        state->host_bridges = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+
     /* Walk the pci busses looking for pxb busses to hook up */
     if (bus) {
         QLIST_FOREACH(bus, &bus->child, sibling) {
@@ -336,11 +637,17 @@ void cxl_hook_up_pxb_registers(PCIBus *bus, CXLState *state, Error **errp)
                 continue;
             }
             if (pci_bus_is_cxl(bus)) {
+                PXBDev *pxb = PXB_CXL_DEV(pci_bridge_get_device(bus));
+                const char *id = DEVICE(pxb)->id;
+
                 if (!state->is_enabled) {
                     error_setg(errp, "CXL host bridges present, but cxl=off");
                     return;
                 }
                 pxb_cxl_hook_up_registers(state, bus, errp);
+                if (id) {
+                    g_hash_table_insert(state->host_bridges, (gpointer)id, pxb);
+                }
             }
         }
     }
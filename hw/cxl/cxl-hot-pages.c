@@ -0,0 +1,251 @@
+/*
+ * CXL fixed memory window hot page tracking
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2. See the
+ * COPYING file in the top-level directory.
+ *
+ * Counts accesses to each page of the CXL fixed memory windows so that a
+ * management agent can tell which guest pages use CXL memory the most, e.g.
+ * to move them to or from local memory.  Accesses that go through MMIO
+ * emulation are counted one by one.  Memory that is mapped straight into the
+ * guest is not visible to QEMU, so for that the dirty log of the mapping is
+ * sampled instead whenever the counts are queried or the mapping goes away.
+ * Such pages are thus only seen when written.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-cxl.h"
+#include "exec/memory.h"
+#include "hw/cxl/cxl.h"
+#include "hw/cxl/cxl_host.h"
+
+#define CXL_HOT_PAGE_DEFAULT_COUNT 32
+/* Pages whose counts are allocated together, on their first access */
+#define CXL_HOT_PAGE_CHUNK 512
+
+typedef struct CXLHotPageCounts {
+    uint32_t reads;
+    uint32_t writes;
+    uint32_t dirty;
+} CXLHotPageCounts;
+
+/*
+ * Windows can be much larger than the memory behind them, so only the
+ * counts of the chunks of pages that have been accessed are allocated.
+ */
+struct CXLHotPages {
+    uint64_t nr_chunks;
+    CXLHotPageCounts **chunks;
+};
+
+static bool cxl_hot_pages_enabled;
+
+static void cxl_hot_pages_inc(uint32_t *count)
+{
+    if (*count != UINT32_MAX) {
+        (*count)++;
+    }
+}
+
+static CXLHotPageCounts *cxl_hot_pages_get(CXLHotPages *hp, uint64_t page)
+{
+    CXLHotPageCounts **chunk = &hp->chunks[page / CXL_HOT_PAGE_CHUNK];
+
+    if (!*chunk) {
+        *chunk = g_new0(CXLHotPageCounts, CXL_HOT_PAGE_CHUNK);
+    }
+    return &(*chunk)[page % CXL_HOT_PAGE_CHUNK];
+}
+
+static void cxl_hot_pages_clear(CXLHotPages *hp)
+{
+    uint64_t i;
+
+    for (i = 0; i < hp->nr_chunks; i++) {
+        g_free(hp->chunks[i]);
+        hp->chunks[i] = NULL;
+    }
+}
+
+void cxl_hot_pages_access(CXLFixedWindow *fw, hwaddr addr, bool is_write)
+{
+    CXLHotPageCounts *counts;
+
+    if (!fw->hot_pages) {
+        return;
+    }
+
+    counts = cxl_hot_pages_get(fw->hot_pages, addr / CXL_HOT_PAGE_SIZE);
+    cxl_hot_pages_inc(is_write ? &counts->writes : &counts->reads);
+}
+
+/* Account pages of the direct mapping @mr that have been written to */
+static void cxl_hot_pages_sample(CXLFixedWindow *fw, MemoryRegion *mr)
+{
+    MemoryRegion *target = mr->alias;
+    hwaddr size = memory_region_size(mr);
+    hwaddr window_offset = mr->addr;
+    DirtyBitmapSnapshot *snap;
+    hwaddr offset;
+
+    snap = memory_region_snapshot_and_clear_dirty(target, mr->alias_offset,
+                                                  size, DIRTY_MEMORY_VGA);
+    for (offset = 0; offset < size; offset += CXL_HOT_PAGE_SIZE) {
+        if (memory_region_snapshot_get_dirty(target, snap,
+                                             mr->alias_offset + offset,
+                                             CXL_HOT_PAGE_SIZE)) {
+            uint64_t page = (window_offset + offset) / CXL_HOT_PAGE_SIZE;
+
+            cxl_hot_pages_inc(&cxl_hot_pages_get(fw->hot_pages,
+                                                 page)->dirty);
+        }
+    }
+    g_free(snap);
+}
+
+/*
+ * Direct mappings of a window are logged for as long as it is tracked, so
+ * these are called as they come and go as well as when tracking is toggled.
+ */
+void cxl_hot_pages_map(CXLFixedWindow *fw, MemoryRegion *mr)
+{
+    if (fw->hot_pages) {
+        memory_region_set_log(mr->alias, true, DIRTY_MEMORY_VGA);
+    }
+}
+
+void cxl_hot_pages_unmap(CXLFixedWindow *fw, MemoryRegion *mr)
+{
+    if (fw->hot_pages) {
+        cxl_hot_pages_sample(fw, mr);
+        memory_region_set_log(mr->alias, false, DIRTY_MEMORY_VGA);
+    }
+}
+
+static void cxl_hot_pages_start(CXLFixedWindow *fw)
+{
+    int i;
+
+    fw->hot_pages = g_new0(CXLHotPages, 1);
+    fw->hot_pages->nr_chunks = DIV_ROUND_UP(fw->size, CXL_HOT_PAGE_SIZE *
+                                                      CXL_HOT_PAGE_CHUNK);
+    fw->hot_pages->chunks = g_new0(CXLHotPageCounts *,
+                                   fw->hot_pages->nr_chunks);
+
+    for (i = 0; fw->direct_mrs && i < fw->direct_mrs->len; i++) {
+        cxl_hot_pages_map(fw, g_ptr_array_index(fw->direct_mrs, i));
+    }
+}
+
+static void cxl_hot_pages_stop(CXLFixedWindow *fw)
+{
+    int i;
+
+    for (i = 0; fw->direct_mrs && i < fw->direct_mrs->len; i++) {
+        cxl_hot_pages_unmap(fw, g_ptr_array_index(fw->direct_mrs, i));
+    }
+
+    cxl_hot_pages_clear(fw->hot_pages);
+    g_free(fw->hot_pages->chunks);
+    g_free(fw->hot_pages);
+    fw->hot_pages = NULL;
+}
+
+void qmp_cxl_set_hot_page_tracking(bool enable, Error **errp)
+{
+    GList *it, *windows = cxl_fmws_get_all();
+
+    if (!windows) {
+        error_setg(errp, "No CXL fixed memory windows");
+        return;
+    }
+
+    if (enable == cxl_hot_pages_enabled) {
+        return;
+    }
+
+    memory_region_transaction_begin();
+    for (it = windows; it; it = it->next) {
+        if (enable) {
+            cxl_hot_pages_start(it->data);
+        } else {
+            cxl_hot_pages_stop(it->data);
+        }
+    }
+    memory_region_transaction_commit();
+
+    cxl_hot_pages_enabled = enable;
+}
+
+static uint64_t cxl_hot_page_score(const CXLHotPage *page)
+{
+    return page->reads + page->writes + page->dirty_samples;
+}
+
+static gint cxl_hot_page_cmp(gconstpointer a, gconstpointer b)
+{
+    uint64_t sa = cxl_hot_page_score(a), sb = cxl_hot_page_score(b);
+
+    if (sa != sb) {
+        return sa > sb ? -1 : 1;
+    }
+    return ((const CXLHotPage *)a)->address <
+           ((const CXLHotPage *)b)->address ? -1 : 1;
+}
+
+CXLHotPageList *qmp_query_cxl_hot_pages(bool has_count, uint32_t count,
+                                        bool has_reset, bool reset,
+                                        Error **errp)
+{
+    GList *it, *windows = cxl_fmws_get_all();
+    g_autoptr(GArray) found = g_array_new(false, false, sizeof(CXLHotPage));
+    CXLHotPageList *head = NULL, **tail = &head;
+    uint64_t i, j;
+
+    if (!cxl_hot_pages_enabled) {
+        error_setg(errp, "CXL hot page tracking is not enabled");
+        return NULL;
+    }
+    if (!has_count) {
+        count = CXL_HOT_PAGE_DEFAULT_COUNT;
+    }
+
+    for (it = windows; it; it = it->next) {
+        CXLFixedWindow *fw = it->data;
+        CXLHotPages *hp = fw->hot_pages;
+
+        for (i = 0; fw->direct_mrs && i < fw->direct_mrs->len; i++) {
+            cxl_hot_pages_sample(fw, g_ptr_array_index(fw->direct_mrs, i));
+        }
+
+        for (i = 0; i < hp->nr_chunks; i++) {
+            for (j = 0; hp->chunks[i] && j < CXL_HOT_PAGE_CHUNK; j++) {
+                CXLHotPageCounts *counts = &hp->chunks[i][j];
+                CXLHotPage page = {
+                    .address = fw->base + (i * CXL_HOT_PAGE_CHUNK + j) *
+                                          CXL_HOT_PAGE_SIZE,
+                    .reads = counts->reads,
+                    .writes = counts->writes,
+                    .dirty_samples = counts->dirty,
+                };
+
+                if (cxl_hot_page_score(&page)) {
+                    g_array_append_val(found, page);
+                }
+            }
+        }
+
+        if (has_reset && reset) {
+            cxl_hot_pages_clear(hp);
+        }
+    }
+
+    g_array_sort(found, cxl_hot_page_cmp);
+    for (i = 0; i < found->len && i < count; i++) {
+        QAPI_LIST_APPEND(tail, g_memdup2(&g_array_index(found, CXLHotPage, i),
+                                         sizeof(CXLHotPage)));
+    }
+
+    return head;
+}
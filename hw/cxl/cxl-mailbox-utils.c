@@ -9,13 +9,24 @@
 
 #include "qemu/osdep.h"
 #include "hw/cxl/cxl.h"
+#include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
 #include "hw/pci/pci.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
 #include "qemu/log.h"
 #include "qemu/units.h"
 #include "qemu/uuid.h"
+#include "sysemu/hostmem.h"
 
-#define CXL_CAPACITY_MULTIPLIER   (256 * MiB)
+/* Background commands on the media split it in chunks for a few threads */
+#define CXL_MEDIA_CHUNK_SIZE      (64 * MiB)
+#define CXL_MEDIA_MAX_THREADS     16
+#define CXL_MEDIA_ZERO_PAGE_SIZE  (4 * KiB)
 
 /*
  * How to add a new command, example. The command set FOO, with cmd BAR.
@@ -40,6 +51,17 @@
  *
  *  XXX: The handler need not worry about endianess. The payload is read out of
  *  a register interface that already deals with it.
+ *
+ *  Background commands:
+ *    A command that takes a long time sets cxl_dstate->bg.func and returns
+ *    CXL_MBOX_BG_STARTED instead of doing the work itself, and is marked with
+ *    BACKGROUND_OPERATION in cxl_cmd_set[][]. bg.func then runs on a worker
+ *    thread without the BQL. It must not touch the mailbox registers, but
+ *    may report progress with cxl_mailbox_bg_progress(), and returns the
+ *    ret_code that completes the command.  Work that can be split may set
+ *    bg.nr_workers too, to run bg.func on as many threads of the pool at
+ *    once.  The command completes once all have returned, with the first
+ *    error any returned.
  */
 
 enum {
@@ -62,6 +84,21 @@ enum {
         #define GET_PARTITION_INFO     0x0
         #define GET_LSA       0x2
         #define SET_LSA       0x3
+    MEDIA_AND_POISON = 0x43,
+        #define GET_POISON_LIST        0x0
+        #define INJECT_POISON          0x1
+        #define CLEAR_POISON           0x2
+        #define GET_SCAN_MEDIA_CAPABILITIES 0x3
+        #define SCAN_MEDIA             0x4
+        #define GET_SCAN_MEDIA_RESULTS 0x5
+    SANITIZE    = 0x44,
+        #define OVERWRITE     0x0
+        #define SECURE_ERASE  0x1
+    DCD_CONFIG  = 0x48,
+        #define GET_DC_CONFIG          0x0
+        #define GET_DYN_CAP_EXT_LIST   0x1
+        #define ADD_DYN_CAP_RSP        0x2
+        #define RELEASE_DYN_CAP        0x3
 };
 
 /* 8.2.8.4.5.1 Command Return Codes */
@@ -103,26 +140,188 @@ struct cxl_cmd {
     uint8_t *payload;
 };
 
-#define DEFINE_MAILBOX_HANDLER_ZEROED(name, size)                         \
-    uint16_t __zero##name = size;                                         \
-    static ret_code cmd_##name(struct cxl_cmd *cmd,                       \
-                               CXLDeviceState *cxl_dstate, uint16_t *len) \
-    {                                                                     \
-        *len = __zero##name;                                              \
-        memset(cmd->payload, 0, *len);                                    \
-        return CXL_MBOX_SUCCESS;                                          \
+/*
+ * CXL 3.0 8.2.9.2.2 Get Event Records
+ *
+ * Returns as many records as fit in the payload, oldest first.  They stay
+ * in the log until cleared.
+ */
+static ret_code cmd_events_get_records(struct cxl_cmd *cmd,
+                                       CXLDeviceState *cxl_dstate,
+                                       uint16_t *len)
+{
+    struct get_event_records_out_pl {
+        uint8_t flags;
+        uint8_t rsvd1;
+        uint16_t overflow_err_count;
+        uint64_t first_overflow_timestamp;
+        uint64_t last_overflow_timestamp;
+        uint16_t record_count;
+        uint8_t rsvd2[0xa];
+        CXLEventRecordRaw records[];
+    } QEMU_PACKED;
+
+    struct get_event_records_out_pl *out = (void *)cmd->payload;
+    uint8_t log_type = cmd->payload[0];
+    int max = (cxl_dstate->payload_size - sizeof(*out)) /
+              CXL_EVENT_RECORD_SIZE;
+    CXLEventLog *log;
+    int count;
+
+    QEMU_BUILD_BUG_ON(sizeof(struct get_event_records_out_pl) != 0x20);
+    QEMU_BUILD_BUG_ON(CXL_EVENT_RECORD_SIZE != 0x80);
+
+    if (log_type >= CXL_EVENT_TYPE_MAX) {
+        return CXL_MBOX_INVALID_INPUT;
     }
-#define DEFINE_MAILBOX_HANDLER_NOP(name)                                  \
-    static ret_code cmd_##name(struct cxl_cmd *cmd,                       \
-                               CXLDeviceState *cxl_dstate, uint16_t *len) \
-    {                                                                     \
-        return CXL_MBOX_SUCCESS;                                          \
+    log = &cxl_dstate->event_logs[log_type];
+
+    memset(out, 0, sizeof(*out));
+    count = MIN(log->count, max);
+    if (count < log->count) {
+        out->flags |= BIT(1); /* More Event Records */
     }
+    if (log->overflow_err_count) {
+        out->flags |= BIT(0); /* Overflow */
+        stw_le_p(&out->overflow_err_count, log->overflow_err_count);
+        stq_le_p(&out->first_overflow_timestamp, log->first_overflow_ts);
+        stq_le_p(&out->last_overflow_timestamp, log->last_overflow_ts);
+    }
+    for (int i = 0; i < count; i++) {
+        out->records[i] = *cxl_event_log_record(log, i);
+    }
+    stw_le_p(&out->record_count, count);
+
+    *len = sizeof(*out) + count * CXL_EVENT_RECORD_SIZE;
+    return CXL_MBOX_SUCCESS;
+}
+
+/*
+ * CXL 3.0 8.2.9.2.3 Clear Event Records
+ *
+ * Handles must be those of the oldest records, in the order Get Event
+ * Records returned them.  Nothing is cleared if any of them is not.
+ */
+static ret_code cmd_events_clear_records(struct cxl_cmd *cmd,
+                                         CXLDeviceState *cxl_dstate,
+                                         uint16_t *len)
+{
+    struct clear_event_records_pl {
+        uint8_t event_log;
+        uint8_t clear_flags;
+        uint8_t nr_recs;
+        uint8_t rsvd[3];
+        uint16_t handle[];
+    } QEMU_PACKED;
 
-DEFINE_MAILBOX_HANDLER_ZEROED(events_get_records, 0x20);
-DEFINE_MAILBOX_HANDLER_NOP(events_clear_records);
-DEFINE_MAILBOX_HANDLER_ZEROED(events_get_interrupt_policy, 4);
-DEFINE_MAILBOX_HANDLER_NOP(events_set_interrupt_policy);
+    struct clear_event_records_pl *in = (void *)cmd->payload;
+    uint16_t plen = *len;
+    CXLEventLog *log;
+    int i;
+
+    *len = 0;
+    if (plen < sizeof(*in) || in->event_log >= CXL_EVENT_TYPE_MAX ||
+        plen < sizeof(*in) + in->nr_recs * sizeof(in->handle[0])) {
+        return CXL_MBOX_INVALID_PAYLOAD_LENGTH;
+    }
+    log = &cxl_dstate->event_logs[in->event_log];
+
+    /* Clear All Events */
+    if (in->clear_flags & BIT(0)) {
+        cxl_event_log_drop(log, log->count);
+        return CXL_MBOX_SUCCESS;
+    }
+
+    if (in->nr_recs > log->count) {
+        return CXL_MBOX_INVALID_HANDLE;
+    }
+    for (i = 0; i < in->nr_recs; i++) {
+        CXLEventRecordRaw *record = cxl_event_log_record(log, i);
+
+        if (lduw_le_p(&in->handle[i]) != lduw_le_p(&record->hdr.handle)) {
+            return CXL_MBOX_INVALID_HANDLE;
+        }
+    }
+    cxl_event_log_drop(log, in->nr_recs);
+
+    return CXL_MBOX_SUCCESS;
+}
+
+/* CXL 3.0 8.2.9.2.4 Get Event Interrupt Policy, Table 8-52 */
+struct event_interrupt_policy_pl {
+    uint8_t info_settings;
+    uint8_t warn_settings;
+    uint8_t failure_settings;
+    uint8_t fatal_settings;
+    uint8_t dyn_cap_settings;
+} QEMU_PACKED;
+
+/* MSI interrupts report the vector they are signalled with */
+static uint8_t cxl_event_int_setting(uint8_t setting)
+{
+    if (setting == CXL_EVENT_INT_MODE_MSI) {
+        setting |= CXL_EVENT_INT_VECTOR << CXL_EVENT_INT_MSGNUM_SHIFT;
+    }
+    return setting;
+}
+
+static ret_code cmd_events_get_interrupt_policy(struct cxl_cmd *cmd,
+                                                CXLDeviceState *cxl_dstate,
+                                                uint16_t *len)
+{
+    struct event_interrupt_policy_pl *out = (void *)cmd->payload;
+    uint8_t *settings = cxl_dstate->event_int_settings;
+
+    QEMU_BUILD_BUG_ON(sizeof(*out) != 0x5);
+
+    out->info_settings = cxl_event_int_setting(settings[CXL_EVENT_TYPE_INFO]);
+    out->warn_settings = cxl_event_int_setting(settings[CXL_EVENT_TYPE_WARN]);
+    out->failure_settings =
+        cxl_event_int_setting(settings[CXL_EVENT_TYPE_FAIL]);
+    out->fatal_settings =
+        cxl_event_int_setting(settings[CXL_EVENT_TYPE_FATAL]);
+    out->dyn_cap_settings =
+        cxl_event_int_setting(settings[CXL_EVENT_TYPE_DYNAMIC_CAP]);
+
+    *len = sizeof(*out);
+    return CXL_MBOX_SUCCESS;
+}
+
+/*
+ * CXL 3.0 8.2.9.2.5 Set Event Interrupt Policy
+ *
+ * The Dynamic Capacity setting is only there in the longer form of the
+ * payload.  Firmware interrupts are accepted but never raised, as there is
+ * no firmware to take them.
+ */
+static ret_code cmd_events_set_interrupt_policy(struct cxl_cmd *cmd,
+                                                CXLDeviceState *cxl_dstate,
+                                                uint16_t *len)
+{
+    struct event_interrupt_policy_pl *in = (void *)cmd->payload;
+    uint8_t *settings = cxl_dstate->event_int_settings;
+    uint16_t plen = *len;
+
+    *len = 0;
+    if (plen != sizeof(*in) - 1 && plen != sizeof(*in)) {
+        return CXL_MBOX_INVALID_PAYLOAD_LENGTH;
+    }
+
+    settings[CXL_EVENT_TYPE_INFO] =
+        in->info_settings & CXL_EVENT_INT_MODE_MASK;
+    settings[CXL_EVENT_TYPE_WARN] =
+        in->warn_settings & CXL_EVENT_INT_MODE_MASK;
+    settings[CXL_EVENT_TYPE_FAIL] =
+        in->failure_settings & CXL_EVENT_INT_MODE_MASK;
+    settings[CXL_EVENT_TYPE_FATAL] =
+        in->fatal_settings & CXL_EVENT_INT_MODE_MASK;
+    if (plen == sizeof(*in)) {
+        settings[CXL_EVENT_TYPE_DYNAMIC_CAP] =
+            in->dyn_cap_settings & CXL_EVENT_INT_MODE_MASK;
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
 
 /* 8.2.9.2.1 */
 static ret_code cmd_firmware_update_get_info(struct cxl_cmd *cmd,
@@ -139,9 +338,12 @@ static ret_code cmd_firmware_update_get_info(struct cxl_cmd *cmd,
         char fw_rev3[0x10];
         char fw_rev4[0x10];
     } QEMU_PACKED *fw_info;
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
     QEMU_BUILD_BUG_ON(sizeof(*fw_info) != 0x50);
 
-    if (cxl_dstate->pmem_size < CXL_CAPACITY_MULTIPLIER) {
+    if ((cxl_dstate->vmem_size < CXL_CAPACITY_MULTIPLIER) &&
+        (cxl_dstate->pmem_size < CXL_CAPACITY_MULTIPLIER) &&
+        !ct3d->dc.num_regions) {
         return CXL_MBOX_INTERNAL_ERROR;
     }
 
@@ -157,23 +359,28 @@ static ret_code cmd_firmware_update_get_info(struct cxl_cmd *cmd,
     return CXL_MBOX_SUCCESS;
 }
 
-/* 8.2.9.3.1 */
-static ret_code cmd_timestamp_get(struct cxl_cmd *cmd,
-                                  CXLDeviceState *cxl_dstate,
-                                  uint16_t *len)
+uint64_t cxl_device_get_timestamp(CXLDeviceState *cxl_dstate)
 {
     uint64_t time, delta;
-    uint64_t final_time = 0;
 
-    if (cxl_dstate->timestamp.set) {
-        /* First find the delta from the last time the host set the time. */
-        time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
-        delta = time - cxl_dstate->timestamp.last_set;
-        final_time = cxl_dstate->timestamp.host_set + delta;
+    if (!cxl_dstate->timestamp.set) {
+        return 0;
     }
 
+    /* First find the delta from the last time the host set the time. */
+    time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    delta = time - cxl_dstate->timestamp.last_set;
+
     /* Then adjust the actual time */
-    stq_le_p(cmd->payload, final_time);
+    return cxl_dstate->timestamp.host_set + delta;
+}
+
+/* 8.2.9.3.1 */
+static ret_code cmd_timestamp_get(struct cxl_cmd *cmd,
+                                  CXLDeviceState *cxl_dstate,
+                                  uint16_t *len)
+{
+    stq_le_p(cmd->payload, cxl_device_get_timestamp(cxl_dstate));
     *len = 8;
 
     return CXL_MBOX_SUCCESS;
@@ -283,26 +490,39 @@ static ret_code cmd_identify_memory_device(struct cxl_cmd *cmd,
         uint16_t inject_poison_limit;
         uint8_t poison_caps;
         uint8_t qos_telemetry_caps;
+        uint16_t dc_event_log_size;
     } QEMU_PACKED *id;
-    QEMU_BUILD_BUG_ON(sizeof(*id) != 0x43);
+    QEMU_BUILD_BUG_ON(sizeof(*id) != 0x45);
 
     CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
     CXLType3Class *cvc = CXL_TYPE3_GET_CLASS(ct3d);
-    uint64_t size = cxl_dstate->pmem_size;
 
-    if (!QEMU_IS_ALIGNED(size, CXL_CAPACITY_MULTIPLIER)) {
+    if ((!QEMU_IS_ALIGNED(cxl_dstate->vmem_size, CXL_CAPACITY_MULTIPLIER)) ||
+        (!QEMU_IS_ALIGNED(cxl_dstate->pmem_size, CXL_CAPACITY_MULTIPLIER))) {
         return CXL_MBOX_INTERNAL_ERROR;
     }
 
     id = (void *)cmd->payload;
     memset(id, 0, sizeof(*id));
 
-    /* PMEM only */
     snprintf(id->fw_revision, 0x10, "BWFW VERSION %02d", 0);
 
-    id->total_capacity = size / CXL_CAPACITY_MULTIPLIER;
-    id->persistent_capacity = size / CXL_CAPACITY_MULTIPLIER;
+    id->total_capacity = cxl_dstate->mem_size / CXL_CAPACITY_MULTIPLIER;
+    id->persistent_capacity = cxl_dstate->pmem_size / CXL_CAPACITY_MULTIPLIER;
+    id->volatile_capacity = cxl_dstate->vmem_size / CXL_CAPACITY_MULTIPLIER;
     id->lsa_size = cvc->get_lsa_size(ct3d);
+    id->poison_list_max_mer[0] = extract32(CXL_POISON_LIST_LIMIT, 0, 8);
+    id->poison_list_max_mer[1] = extract32(CXL_POISON_LIST_LIMIT, 8, 8);
+    id->poison_list_max_mer[2] = extract32(CXL_POISON_LIST_LIMIT, 16, 8);
+    /* Only limited by the poison list */
+    id->inject_poison_limit = 0;
+    stw_le_p(&id->info_event_log_size, CXL_EVENT_LOG_SIZE);
+    stw_le_p(&id->warning_event_log_size, CXL_EVENT_LOG_SIZE);
+    stw_le_p(&id->failure_event_log_size, CXL_EVENT_LOG_SIZE);
+    stw_le_p(&id->fatal_event_log_size, CXL_EVENT_LOG_SIZE);
+    if (ct3d->dc.num_regions) {
+        stw_le_p(&id->dc_event_log_size, CXL_EVENT_LOG_SIZE);
+    }
 
     *len = sizeof(*id);
     return CXL_MBOX_SUCCESS;
@@ -319,16 +539,16 @@ static ret_code cmd_ccls_get_partition_info(struct cxl_cmd *cmd,
         uint64_t next_pmem;
     } QEMU_PACKED *part_info = (void *)cmd->payload;
     QEMU_BUILD_BUG_ON(sizeof(*part_info) != 0x20);
-    uint64_t size = cxl_dstate->pmem_size;
 
-    if (!QEMU_IS_ALIGNED(size, CXL_CAPACITY_MULTIPLIER)) {
+    if ((!QEMU_IS_ALIGNED(cxl_dstate->vmem_size, CXL_CAPACITY_MULTIPLIER)) ||
+        (!QEMU_IS_ALIGNED(cxl_dstate->pmem_size, CXL_CAPACITY_MULTIPLIER))) {
         return CXL_MBOX_INTERNAL_ERROR;
     }
 
-    /* PMEM only */
-    part_info->active_vmem = 0;
+    /* Partitions are fixed by the memory backends, so nothing is pending */
+    part_info->active_vmem = cxl_dstate->vmem_size / CXL_CAPACITY_MULTIPLIER;
     part_info->next_vmem = 0;
-    part_info->active_pmem = size / CXL_CAPACITY_MULTIPLIER;
+    part_info->active_pmem = cxl_dstate->pmem_size / CXL_CAPACITY_MULTIPLIER;
     part_info->next_pmem = 0;
 
     *len = sizeof(*part_info);
@@ -351,11 +571,13 @@ static ret_code cmd_ccls_get_lsa(struct cxl_cmd *cmd,
     offset = get_lsa->offset;
     length = get_lsa->length;
 
-    if (offset + length > cvc->get_lsa_size(ct3d)) {
+    if ((uint64_t)offset + length > cvc->get_lsa_size(ct3d) ||
+        length > cxl_dstate->payload_size) {
         *len = 0;
         return CXL_MBOX_INVALID_INPUT;
     }
 
+    /* Labels are copied straight from the backend into the payload */
     *len = cvc->get_lsa(ct3d, get_lsa, length, offset);
     return CXL_MBOX_SUCCESS;
 }
@@ -380,7 +602,9 @@ static ret_code cmd_ccls_set_lsa(struct cxl_cmd *cmd,
         return CXL_MBOX_SUCCESS;
     }
 
-    if (set_lsa_payload->offset + plen > cvc->get_lsa_size(ct3d) + hdr_len) {
+    if (plen < hdr_len ||
+        (uint64_t)set_lsa_payload->offset + plen >
+        cvc->get_lsa_size(ct3d) + hdr_len) {
         return CXL_MBOX_INVALID_INPUT;
     }
     plen -= hdr_len;
@@ -389,10 +613,735 @@ static ret_code cmd_ccls_set_lsa(struct cxl_cmd *cmd,
     return CXL_MBOX_SUCCESS;
 }
 
+/*
+ * CXL 3.0 8.2.9.8.4.1 Get Poison List
+ *
+ * Records that do not fit in the payload are returned by the next commands
+ * for the same range, which continue where the previous one left off.
+ */
+static ret_code cmd_media_get_poison_list(struct cxl_cmd *cmd,
+                                          CXLDeviceState *cxl_dstate,
+                                          uint16_t *len)
+{
+    struct get_poison_list_pl {
+        uint64_t pa;
+        uint64_t length;
+    } QEMU_PACKED;
+
+    struct get_poison_list_out_pl {
+        uint8_t flags;
+        uint8_t rsvd1;
+        uint64_t overflow_timestamp;
+        uint16_t count;
+        uint8_t rsvd2[0x14];
+        struct {
+            uint64_t addr;
+            uint32_t length;
+            uint32_t resv;
+        } QEMU_PACKED records[];
+    } QEMU_PACKED;
+
+    struct get_poison_list_pl *in = (void *)cmd->payload;
+    struct get_poison_list_out_pl *out = (void *)cmd->payload;
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    int max = (cxl_dstate->payload_size - sizeof(*out)) /
+              sizeof(out->records[0]);
+    uint64_t start = ldq_le_p(&in->pa), length = ldq_le_p(&in->length);
+    uint64_t last, next;
+    IntervalTreeNode *node;
+    int count = 0;
+
+    QEMU_BUILD_BUG_ON(sizeof(struct get_poison_list_out_pl) != 0x20);
+
+    /* Length is in units of 64 bytes */
+    if (!QEMU_IS_ALIGNED(start, CXL_POISON_GRANULE) || !length ||
+        length > (UINT64_MAX - start) / CXL_POISON_GRANULE) {
+        return CXL_MBOX_INVALID_INPUT;
+    }
+    last = start + length * CXL_POISON_GRANULE - 1;
+
+    next = start;
+    if (ct3d->poison_list_resume.start == start &&
+        ct3d->poison_list_resume.last == last) {
+        next = ct3d->poison_list_resume.next;
+    }
+
+    memset(out, 0, sizeof(*out));
+    while (count < max && next <= last &&
+           (node = interval_tree_iter_first(&ct3d->poison_tree, next, last))) {
+        uint64_t rec_start = MAX(node->start, next);
+        uint64_t rec_len = MIN((MIN(node->last, last) - rec_start + 1) /
+                               CXL_POISON_GRANULE, UINT32_MAX);
+
+        stq_le_p(&out->records[count].addr,
+                 rec_start | container_of(node, CXLPoison, node)->type);
+        stl_le_p(&out->records[count].length, rec_len);
+        out->records[count].resv = 0;
+        count++;
+
+        next = rec_start + rec_len * CXL_POISON_GRANULE;
+        if (!next) {
+            break;
+        }
+    }
+
+    memset(&ct3d->poison_list_resume, 0, sizeof(ct3d->poison_list_resume));
+    if (next && next <= last &&
+        interval_tree_iter_first(&ct3d->poison_tree, next, last)) {
+        out->flags |= BIT(0);
+        ct3d->poison_list_resume.start = start;
+        ct3d->poison_list_resume.last = last;
+        ct3d->poison_list_resume.next = next;
+    }
+    if (ct3d->poison_overflowed) {
+        out->flags |= BIT(1);
+        stq_le_p(&out->overflow_timestamp, ct3d->poison_overflow_ts);
+    }
+    stw_le_p(&out->count, count);
+
+    *len = sizeof(*out) + count * sizeof(out->records[0]);
+    return CXL_MBOX_SUCCESS;
+}
+
+static bool cxl_poison_dpa_valid(CXLDeviceState *cxl_dstate, uint64_t dpa)
+{
+    return QEMU_IS_ALIGNED(dpa, CXL_POISON_GRANULE) &&
+           dpa < cxl_dstate->mem_size;
+}
+
+/* CXL 3.0 8.2.9.8.4.2 Inject Poison */
+static ret_code cmd_media_inject_poison(struct cxl_cmd *cmd,
+                                        CXLDeviceState *cxl_dstate,
+                                        uint16_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    uint64_t dpa = ldq_le_p(cmd->payload);
+
+    *len = 0;
+    if (!cxl_poison_dpa_valid(cxl_dstate, dpa)) {
+        return CXL_MBOX_INVALID_PA;
+    }
+
+    if (!cxl_type3_poison_add(ct3d, dpa, CXL_POISON_GRANULE,
+                              CXL_POISON_TYPE_INJECTED)) {
+        return CXL_MBOX_INJECT_POISON_LIMIT;
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
+
+/* CXL 3.0 8.2.9.8.4.3 Clear Poison, the data replaces the poisoned data */
+static ret_code cmd_media_clear_poison(struct cxl_cmd *cmd,
+                                       CXLDeviceState *cxl_dstate,
+                                       uint16_t *len)
+{
+    struct clear_poison_pl {
+        uint64_t dpa;
+        uint8_t data[CXL_POISON_GRANULE];
+    } QEMU_PACKED;
+
+    struct clear_poison_pl *in = (void *)cmd->payload;
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    uint64_t dpa = ldq_le_p(&in->dpa);
+
+    *len = 0;
+    if (!cxl_poison_dpa_valid(cxl_dstate, dpa)) {
+        return CXL_MBOX_INVALID_PA;
+    }
+
+    cxl_type3_poison_clear(ct3d, dpa, CXL_POISON_GRANULE, in->data);
+    return CXL_MBOX_SUCCESS;
+}
+
+/* Range of the scan media commands, in units of 64 bytes */
+static bool cxl_scan_media_range(CXLDeviceState *cxl_dstate,
+                                 const uint8_t *payload, uint64_t *start,
+                                 uint64_t *last)
+{
+    uint64_t length = ldq_le_p(payload + 8);
+
+    *start = ldq_le_p(payload);
+    if (!QEMU_IS_ALIGNED(*start, CXL_POISON_GRANULE) || !length ||
+        *start >= cxl_dstate->mem_size ||
+        length > (cxl_dstate->mem_size - *start) / CXL_POISON_GRANULE) {
+        return false;
+    }
+    *last = *start + length * CXL_POISON_GRANULE - 1;
+    return true;
+}
+
+/* CXL 3.0 8.2.9.8.4.4 Get Scan Media Capabilities */
+static ret_code cmd_media_get_scan_media_caps(struct cxl_cmd *cmd,
+                                              CXLDeviceState *cxl_dstate,
+                                              uint16_t *len)
+{
+    uint64_t start, last;
+
+    if (!cxl_scan_media_range(cxl_dstate, cmd->payload, &start, &last)) {
+        *len = 0;
+        return CXL_MBOX_INVALID_PA;
+    }
+
+    /* Estimated time in ms, the results come from the poison list */
+    stl_le_p(cmd->payload, 1);
+    *len = 4;
+    return CXL_MBOX_SUCCESS;
+}
+
+/* Runs on the background worker, the results are ready already */
+static int cxl_media_scan_work(CXLDeviceState *cxl_dstate)
+{
+    return CXL_MBOX_SUCCESS;
+}
+
+/*
+ * CXL 3.0 8.2.9.8.4.5 Scan Media
+ *
+ * Media errors are the poisoned ranges, so those in the range scanned are
+ * the results.  They are taken here, as the poison list may only be read
+ * with the BQL held, and the background command only completes the scan.
+ */
+static ret_code cmd_media_scan_media(struct cxl_cmd *cmd,
+                                     CXLDeviceState *cxl_dstate,
+                                     uint16_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    uint64_t start, last, next;
+    IntervalTreeNode *node;
+    GArray *results;
+
+    *len = 0;
+    if (!cxl_scan_media_range(cxl_dstate, cmd->payload, &start, &last)) {
+        return CXL_MBOX_INVALID_PA;
+    }
+
+    results = g_array_new(false, false, sizeof(CXLPoisonRecord));
+    for (next = start;
+         next <= last &&
+         (node = interval_tree_iter_first(&ct3d->poison_tree, next, last));
+         next = node->last + 1) {
+        CXLPoisonRecord rec = {
+            .start = MAX(node->start, start),
+            .last = MIN(node->last, last),
+            .type = container_of(node, CXLPoison, node)->type,
+        };
+
+        g_array_append_val(results, rec);
+        if (node->last >= last) {
+            break;
+        }
+    }
+
+    g_free(ct3d->scan_media.records);
+    ct3d->scan_media.count = results->len;
+    ct3d->scan_media.next = 0;
+    ct3d->scan_media.records =
+        (CXLPoisonRecord *)g_array_free(results, false);
+
+    cxl_dstate->bg.func = cxl_media_scan_work;
+    return CXL_MBOX_BG_STARTED;
+}
+
+/*
+ * CXL 3.0 8.2.9.8.4.6 Get Scan Media Results
+ *
+ * Records that do not fit are returned by the next commands.
+ */
+static ret_code cmd_media_get_scan_media_results(struct cxl_cmd *cmd,
+                                                 CXLDeviceState *cxl_dstate,
+                                                 uint16_t *len)
+{
+    struct get_scan_media_results_out_pl {
+        uint64_t restart_pa;
+        uint64_t restart_length;
+        uint8_t flags;
+        uint8_t rsvd1;
+        uint16_t count;
+        uint8_t rsvd2[0xc];
+        struct {
+            uint64_t addr;
+            uint32_t length;
+            uint32_t resv;
+        } QEMU_PACKED records[];
+    } QEMU_PACKED;
+
+    struct get_scan_media_results_out_pl *out = (void *)cmd->payload;
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    int max = (cxl_dstate->payload_size - sizeof(*out)) /
+              sizeof(out->records[0]);
+    int count = 0;
+
+    QEMU_BUILD_BUG_ON(sizeof(struct get_scan_media_results_out_pl) != 0x20);
+
+    if (cxl_dstate->bg.running &&
+        cxl_dstate->bg.opcode == (MEDIA_AND_POISON << 8 | SCAN_MEDIA)) {
+        *len = 0;
+        return CXL_MBOX_BUSY;
+    }
+
+    memset(out, 0, sizeof(*out));
+    while (count < max && ct3d->scan_media.next < ct3d->scan_media.count) {
+        CXLPoisonRecord *rec =
+            &ct3d->scan_media.records[ct3d->scan_media.next++];
+
+        stq_le_p(&out->records[count].addr, rec->start | rec->type);
+        stl_le_p(&out->records[count].length,
+                 MIN((rec->last - rec->start + 1) / CXL_POISON_GRANULE,
+                     UINT32_MAX));
+        out->records[count].resv = 0;
+        count++;
+    }
+    if (ct3d->scan_media.next < ct3d->scan_media.count) {
+        out->flags |= BIT(0);
+    }
+    stw_le_p(&out->count, count);
+
+    *len = sizeof(*out) + count * sizeof(out->records[0]);
+    return CXL_MBOX_SUCCESS;
+}
+
+/* Worker side: percentage of the background command done so far */
+static void cxl_mailbox_bg_progress(CXLDeviceState *cxl_dstate,
+                                    uint64_t done, uint64_t total)
+{
+    qatomic_set(&cxl_dstate->bg.complete_pct,
+                total ? done * 100 / total : 100);
+}
+
+/*
+ * Work of a background command on the memory of the device, split in chunks
+ * that its workers take in turn, like memory preallocation does.  Returns
+ * false once all have been taken, otherwise the memory region of the next
+ * chunk, and its offset and length within it.
+ */
+static bool cxl_media_next_chunk(CXLDeviceState *cxl_dstate,
+                                 MemoryRegion **mr, uint64_t *offset,
+                                 uint64_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    HostMemoryBackend *hostmems[] = { ct3d->hostvmem, ct3d->hostpmem };
+    uint64_t chunk = qatomic_fetch_inc(&cxl_dstate->bg.next);
+    uint64_t size, chunks;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(hostmems); i++) {
+        if (!hostmems[i]) {
+            continue;
+        }
+        *mr = host_memory_backend_get_memory(hostmems[i]);
+        size = memory_region_size(*mr);
+        chunks = DIV_ROUND_UP(size, CXL_MEDIA_CHUNK_SIZE);
+        if (chunk < chunks) {
+            *offset = chunk * CXL_MEDIA_CHUNK_SIZE;
+            *len = MIN(size - *offset, CXL_MEDIA_CHUNK_SIZE);
+            return true;
+        }
+        chunk -= chunks;
+    }
+
+    return false;
+}
+
+/* Workers for a background command on all the memory of the device */
+static int cxl_media_workers(CXLDeviceState *cxl_dstate)
+{
+    uint64_t chunks =
+        DIV_ROUND_UP(cxl_dstate->vmem_size, CXL_MEDIA_CHUNK_SIZE) +
+        DIV_ROUND_UP(cxl_dstate->pmem_size, CXL_MEDIA_CHUNK_SIZE);
+
+    return MAX(MIN(MIN(g_get_num_processors(), CXL_MEDIA_MAX_THREADS),
+                   chunks), 1);
+}
+
+/*
+ * Zero a chunk, skipping the pages that already are.  Those are not
+ * written, so memory that was never touched is not allocated, and is not
+ * sent again by a migration in progress.
+ */
+static void cxl_media_zero_chunk(MemoryRegion *mr, uint64_t offset,
+                                 uint64_t len)
+{
+    uint8_t *host = memory_region_get_ram_ptr(mr);
+    uint64_t end = offset + len, dirty = end, page;
+
+    for (page = offset; page < end; page += CXL_MEDIA_ZERO_PAGE_SIZE) {
+        uint64_t page_len = MIN(end - page, CXL_MEDIA_ZERO_PAGE_SIZE);
+
+        if (buffer_is_zero(host + page, page_len)) {
+            if (dirty < page) {
+                /* Written behind the back of dirty tracking */
+                memory_region_set_dirty(mr, dirty, page - dirty);
+                dirty = end;
+            }
+            continue;
+        }
+        memset(host + page, 0, page_len);
+        dirty = MIN(dirty, page);
+    }
+    if (dirty < end) {
+        memory_region_set_dirty(mr, dirty, end - dirty);
+    }
+}
+
+/* Runs on each of the background workers */
+static int cxl_media_zero_work(CXLDeviceState *cxl_dstate)
+{
+    uint64_t offset, len;
+    MemoryRegion *mr;
+
+    while (cxl_media_next_chunk(cxl_dstate, &mr, &offset, &len)) {
+        cxl_media_zero_chunk(mr, offset, len);
+        cxl_mailbox_bg_progress(cxl_dstate,
+                                qatomic_add_fetch(&cxl_dstate->bg.done, len),
+                                cxl_dstate->mem_size);
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
+
+/*
+ * Zero all user data in the background.  Dropping the dynamic capacity
+ * backing zeroes it without populating it, which is quick enough to do
+ * right away.
+ */
+static void cxl_media_zero_start(CXLDeviceState *cxl_dstate)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+
+    if (ct3d->host_dc) {
+        MemoryRegion *mr = host_memory_backend_get_memory(ct3d->host_dc);
+
+        ram_block_discard_range(mr->ram_block, 0, memory_region_size(mr));
+        memory_region_set_dirty(mr, 0, memory_region_size(mr));
+    }
+
+    cxl_dstate->bg.func = cxl_media_zero_work;
+    cxl_dstate->bg.nr_workers = cxl_media_workers(cxl_dstate);
+}
+
+/*
+ * CXL 3.0 8.2.9.8.5.1 Sanitize
+ *
+ * Overwrites all user data with zeroes. That takes a while for large
+ * backends, so it is done as a background operation.
+ */
+static ret_code cmd_sanitize_overwrite(struct cxl_cmd *cmd,
+                                       CXLDeviceState *cxl_dstate,
+                                       uint16_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+
+    /* The media is overwritten, so none of it remains poisoned */
+    cxl_type3_poison_clear(ct3d, 0, cxl_dstate->mem_size, NULL);
+    ct3d->poison_overflowed = false;
+
+    *len = 0;
+    cxl_media_zero_start(cxl_dstate);
+    return CXL_MBOX_BG_STARTED;
+}
+
+/*
+ * CXL 3.0 8.2.9.8.5.2 Secure Erase
+ *
+ * Real devices drop their media encryption keys, which is emulated by
+ * zeroing all user data like Sanitize.  Media errors remain.
+ */
+static ret_code cmd_sanitize_secure_erase(struct cxl_cmd *cmd,
+                                          CXLDeviceState *cxl_dstate,
+                                          uint16_t *len)
+{
+    *len = 0;
+    cxl_media_zero_start(cxl_dstate);
+    return CXL_MBOX_BG_STARTED;
+}
+
+/*
+ * CXL 3.1 8.2.9.9.9.1 Get Dynamic Capacity Configuration
+ *
+ * The counts of extents and tags trail the region configurations.
+ */
+static ret_code cmd_dcd_get_dyn_cap_config(struct cxl_cmd *cmd,
+                                           CXLDeviceState *cxl_dstate,
+                                           uint16_t *len)
+{
+    struct get_dyn_cap_config_in_pl {
+        uint8_t region_cnt;
+        uint8_t start_region_id;
+    } QEMU_PACKED;
+
+    struct get_dyn_cap_config_out_pl {
+        uint8_t num_regions;
+        uint8_t regions_returned;
+        uint8_t rsvd1[6];
+        struct {
+            uint64_t base;
+            uint64_t decode_len;
+            uint64_t region_len;
+            uint64_t block_size;
+            uint32_t dsmadhandle;
+            uint8_t flags;
+            uint8_t rsvd2[3];
+        } QEMU_PACKED records[];
+    } QEMU_PACKED;
+
+    struct get_dyn_cap_config_out_tail {
+        uint32_t num_extents_supported;
+        uint32_t num_extents_available;
+        uint32_t num_tags_supported;
+        uint32_t num_tags_available;
+    } QEMU_PACKED;
+
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    struct get_dyn_cap_config_in_pl *in = (void *)cmd->payload;
+    struct get_dyn_cap_config_out_pl *out = (void *)cmd->payload;
+    struct get_dyn_cap_config_out_tail *tail;
+    uint8_t start_region_id = in->start_region_id;
+    uint8_t count, i;
+    uint32_t used;
+
+    QEMU_BUILD_BUG_ON(sizeof(out->records[0]) != 0x28);
+
+    if (!ct3d->dc.num_regions) {
+        return CXL_MBOX_UNSUPPORTED;
+    }
+    if (start_region_id >= ct3d->dc.num_regions) {
+        return CXL_MBOX_INVALID_INPUT;
+    }
+    count = MIN(in->region_cnt, ct3d->dc.num_regions - start_region_id);
+
+    memset(out, 0, sizeof(*out));
+    out->num_regions = ct3d->dc.num_regions;
+    out->regions_returned = count;
+    for (i = 0; i < count; i++) {
+        CXLDCRegion *region = &ct3d->dc.regions[start_region_id + i];
+
+        stq_le_p(&out->records[i].base, region->base);
+        stq_le_p(&out->records[i].decode_len,
+                 region->decode_len / CXL_CAPACITY_MULTIPLIER);
+        stq_le_p(&out->records[i].region_len, region->len);
+        stq_le_p(&out->records[i].block_size, region->block_size);
+        stl_le_p(&out->records[i].dsmadhandle, region->dsmadhandle);
+        out->records[i].flags = region->flags;
+        memset(out->records[i].rsvd2, 0, sizeof(out->records[i].rsvd2));
+    }
+
+    used = ct3d->dc.extent_count + ct3d->dc.pending_count;
+    tail = (void *)&out->records[count];
+    stl_le_p(&tail->num_extents_supported, CXL_NUM_EXTENTS_SUPPORTED);
+    stl_le_p(&tail->num_extents_available,
+             used < CXL_NUM_EXTENTS_SUPPORTED ?
+             CXL_NUM_EXTENTS_SUPPORTED - used : 0);
+    /* Tags are not supported */
+    stl_le_p(&tail->num_tags_supported, 0);
+    stl_le_p(&tail->num_tags_available, 0);
+
+    *len = sizeof(*out) + count * sizeof(out->records[0]) + sizeof(*tail);
+    return CXL_MBOX_SUCCESS;
+}
+
+/* CXL 3.1 8.2.9.9.9.2 Get Dynamic Capacity Extent List */
+static ret_code cmd_dcd_get_dyn_cap_ext_list(struct cxl_cmd *cmd,
+                                             CXLDeviceState *cxl_dstate,
+                                             uint16_t *len)
+{
+    struct get_dyn_cap_ext_list_in_pl {
+        uint32_t extent_cnt;
+        uint32_t start_extent_id;
+    } QEMU_PACKED;
+
+    struct get_dyn_cap_ext_list_out_pl {
+        uint32_t count;
+        uint32_t total_extents;
+        uint32_t generation_num;
+        uint8_t rsvd[4];
+        CXLDCExtentRaw records[];
+    } QEMU_PACKED;
+
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    struct get_dyn_cap_ext_list_in_pl *in = (void *)cmd->payload;
+    struct get_dyn_cap_ext_list_out_pl *out = (void *)cmd->payload;
+    uint32_t start_extent_id = ldl_le_p(&in->start_extent_id);
+    uint32_t max = (cxl_dstate->payload_size - sizeof(*out)) /
+                   sizeof(out->records[0]);
+    uint32_t count = MIN(ldl_le_p(&in->extent_cnt), max);
+    CXLDCExtent *ent;
+    uint32_t i = 0, n = 0;
+
+    QEMU_BUILD_BUG_ON(sizeof(CXLDCExtentRaw) != 0x28);
+
+    if (!ct3d->dc.num_regions) {
+        return CXL_MBOX_UNSUPPORTED;
+    }
+    if (start_extent_id > ct3d->dc.extent_count) {
+        return CXL_MBOX_INVALID_INPUT;
+    }
+
+    QTAILQ_FOREACH(ent, &ct3d->dc.extents, node) {
+        if (n == count) {
+            break;
+        }
+        if (i++ < start_extent_id) {
+            continue;
+        }
+        memset(&out->records[n], 0, sizeof(out->records[n]));
+        stq_le_p(&out->records[n].start_dpa, ent->start_dpa);
+        stq_le_p(&out->records[n].len, ent->len);
+        n++;
+    }
+
+    stl_le_p(&out->count, n);
+    stl_le_p(&out->total_extents, ct3d->dc.extent_count);
+    stl_le_p(&out->generation_num, ct3d->dc.ext_list_gen);
+    memset(out->rsvd, 0, sizeof(out->rsvd));
+
+    *len = sizeof(*out) + n * sizeof(out->records[0]);
+    return CXL_MBOX_SUCCESS;
+}
+
+/* CXL 3.1 8.2.9.9.9.3 Updated Extent List of Add and Release commands */
+struct updated_dc_extent_list_pl {
+    uint32_t num_entries_updated;
+    uint8_t flags;
+    uint8_t rsvd[3];
+    struct {
+        uint64_t start_dpa;
+        uint64_t len;
+        uint8_t rsvd[8];
+    } QEMU_PACKED updated_entries[];
+} QEMU_PACKED;
+
+/* More extents follow in another command, 8.2.9.9.9.3 */
+#define CXL_DC_RSP_FLAG_MORE BIT(0)
+
+/*
+ * Check the extents listed by the host are whole blocks of one region and
+ * don't overlap each other.  @pending asks for extents offered by Add
+ * Capacity events, otherwise they must be accepted ones.
+ */
+static ret_code cxl_dcd_check_extent_list(CXLType3Dev *ct3d,
+                                          struct updated_dc_extent_list_pl *in,
+                                          uint16_t plen, bool pending)
+{
+    uint32_t n = ldl_le_p(&in->num_entries_updated);
+    g_autofree unsigned long *seen = NULL;
+    uint64_t nbits = ct3d->dc.total_capacity / CXL_DC_BLOCK_SIZE;
+    uint64_t dc_base = ct3d->dc.regions[0].base;
+    uint32_t i;
+
+    if (plen < sizeof(*in) ||
+        (plen - sizeof(*in)) / sizeof(in->updated_entries[0]) < n) {
+        return CXL_MBOX_INVALID_PAYLOAD_LENGTH;
+    }
+
+    seen = bitmap_new(nbits);
+    for (i = 0; i < n; i++) {
+        uint64_t dpa = ldq_le_p(&in->updated_entries[i].start_dpa);
+        uint64_t len = ldq_le_p(&in->updated_entries[i].len);
+        CXLDCRegion *region = cxl_type3_dc_find_region(ct3d, dpa, len);
+        uint64_t first, nr;
+
+        if (!region) {
+            return CXL_MBOX_INVALID_PA;
+        }
+        if (!QEMU_IS_ALIGNED(dpa | len, region->block_size)) {
+            return CXL_MBOX_INVALID_INPUT;
+        }
+
+        first = (dpa - dc_base) / CXL_DC_BLOCK_SIZE;
+        nr = len / CXL_DC_BLOCK_SIZE;
+        if (pending) {
+            /* Offered, and not accepted by an earlier response */
+            if (!cxl_type3_dc_pending(ct3d, dpa, len) ||
+                find_next_bit(ct3d->dc.blk_bitmap, first + nr, first) <
+                first + nr) {
+                return CXL_MBOX_INVALID_PA;
+            }
+        } else if (!cxl_type3_dc_backed(ct3d, dpa, len)) {
+            return CXL_MBOX_INVALID_PA;
+        }
+        if (find_next_bit(seen, first + nr, first) < first + nr) {
+            return CXL_MBOX_INVALID_INPUT;
+        }
+        bitmap_set(seen, first, nr);
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
+
+/*
+ * CXL 3.1 8.2.9.9.9.3 Add Dynamic Capacity Response
+ *
+ * The host accepts some or none of the capacity offered so far, the rest
+ * of the offer lapses unless the host says more responses follow.
+ */
+static ret_code cmd_dcd_add_dyn_cap_rsp(struct cxl_cmd *cmd,
+                                        CXLDeviceState *cxl_dstate,
+                                        uint16_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    struct updated_dc_extent_list_pl *in = (void *)cmd->payload;
+    uint16_t plen = *len;
+    uint32_t i, n;
+    ret_code ret;
+
+    *len = 0;
+    if (!ct3d->dc.num_regions) {
+        return CXL_MBOX_UNSUPPORTED;
+    }
+
+    ret = cxl_dcd_check_extent_list(ct3d, in, plen, true);
+    if (ret != CXL_MBOX_SUCCESS) {
+        return ret;
+    }
+
+    n = ldl_le_p(&in->num_entries_updated);
+    for (i = 0; i < n; i++) {
+        cxl_type3_dc_accept(ct3d, ldq_le_p(&in->updated_entries[i].start_dpa),
+                            ldq_le_p(&in->updated_entries[i].len));
+    }
+    if (!(in->flags & CXL_DC_RSP_FLAG_MORE)) {
+        cxl_type3_dc_clear_pending(ct3d);
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
+
+/* CXL 3.1 8.2.9.9.9.4 Release Dynamic Capacity */
+static ret_code cmd_dcd_release_dyn_cap(struct cxl_cmd *cmd,
+                                        CXLDeviceState *cxl_dstate,
+                                        uint16_t *len)
+{
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    struct updated_dc_extent_list_pl *in = (void *)cmd->payload;
+    uint16_t plen = *len;
+    uint32_t i, n;
+    ret_code ret;
+
+    *len = 0;
+    if (!ct3d->dc.num_regions) {
+        return CXL_MBOX_UNSUPPORTED;
+    }
+
+    ret = cxl_dcd_check_extent_list(ct3d, in, plen, false);
+    if (ret != CXL_MBOX_SUCCESS) {
+        return ret;
+    }
+
+    n = ldl_le_p(&in->num_entries_updated);
+    for (i = 0; i < n; i++) {
+        cxl_type3_dc_release(ct3d, ldq_le_p(&in->updated_entries[i].start_dpa),
+                             ldq_le_p(&in->updated_entries[i].len));
+    }
+
+    return CXL_MBOX_SUCCESS;
+}
+
 #define IMMEDIATE_CONFIG_CHANGE (1 << 1)
 #define IMMEDIATE_DATA_CHANGE (1 << 2)
 #define IMMEDIATE_POLICY_CHANGE (1 << 3)
 #define IMMEDIATE_LOG_CHANGE (1 << 4)
+#define SECURITY_STATE_CHANGE (1 << 5)
+#define BACKGROUND_OPERATION (1 << 6)
 
 static struct cxl_cmd cxl_cmd_set[256][256] = {
     [EVENTS][GET_RECORDS] = { "EVENTS_GET_RECORDS",
@@ -402,7 +1351,7 @@ static struct cxl_cmd cxl_cmd_set[256][256] = {
     [EVENTS][GET_INTERRUPT_POLICY] = { "EVENTS_GET_INTERRUPT_POLICY",
         cmd_events_get_interrupt_policy, 0, 0 },
     [EVENTS][SET_INTERRUPT_POLICY] = { "EVENTS_SET_INTERRUPT_POLICY",
-        cmd_events_set_interrupt_policy, 4, IMMEDIATE_CONFIG_CHANGE },
+        cmd_events_set_interrupt_policy, ~0, IMMEDIATE_CONFIG_CHANGE },
     [FIRMWARE_UPDATE][GET_INFO] = { "FIRMWARE_UPDATE_GET_INFO",
         cmd_firmware_update_get_info, 0, 0 },
     [TIMESTAMP][GET] = { "TIMESTAMP_GET", cmd_timestamp_get, 0, 0 },
@@ -416,8 +1365,127 @@ static struct cxl_cmd cxl_cmd_set[256][256] = {
     [CCLS][GET_LSA] = { "CCLS_GET_LSA", cmd_ccls_get_lsa, 8, 0 },
     [CCLS][SET_LSA] = { "CCLS_SET_LSA", cmd_ccls_set_lsa,
         ~0, IMMEDIATE_CONFIG_CHANGE | IMMEDIATE_DATA_CHANGE },
+    [MEDIA_AND_POISON][GET_POISON_LIST] = { "MEDIA_AND_POISON_GET_POISON_LIST",
+        cmd_media_get_poison_list, 16, 0 },
+    [MEDIA_AND_POISON][INJECT_POISON] = { "MEDIA_AND_POISON_INJECT_POISON",
+        cmd_media_inject_poison, 8, IMMEDIATE_DATA_CHANGE },
+    [MEDIA_AND_POISON][CLEAR_POISON] = { "MEDIA_AND_POISON_CLEAR_POISON",
+        cmd_media_clear_poison, 72, IMMEDIATE_DATA_CHANGE },
+    [MEDIA_AND_POISON][GET_SCAN_MEDIA_CAPABILITIES] = {
+        "MEDIA_AND_POISON_GET_SCAN_MEDIA_CAPABILITIES",
+        cmd_media_get_scan_media_caps, 16, 0 },
+    [MEDIA_AND_POISON][SCAN_MEDIA] = { "MEDIA_AND_POISON_SCAN_MEDIA",
+        cmd_media_scan_media, 17, BACKGROUND_OPERATION },
+    [MEDIA_AND_POISON][GET_SCAN_MEDIA_RESULTS] = {
+        "MEDIA_AND_POISON_GET_SCAN_MEDIA_RESULTS",
+        cmd_media_get_scan_media_results, 0, 0 },
+    [SANITIZE][OVERWRITE] = { "SANITIZE_OVERWRITE", cmd_sanitize_overwrite,
+        0, IMMEDIATE_DATA_CHANGE | SECURITY_STATE_CHANGE |
+        BACKGROUND_OPERATION },
+    [SANITIZE][SECURE_ERASE] = { "SANITIZE_SECURE_ERASE",
+        cmd_sanitize_secure_erase, 0,
+        IMMEDIATE_DATA_CHANGE | SECURITY_STATE_CHANGE |
+        BACKGROUND_OPERATION },
+    [DCD_CONFIG][GET_DC_CONFIG] = { "DCD_GET_DC_CONFIG",
+        cmd_dcd_get_dyn_cap_config, 2, 0 },
+    [DCD_CONFIG][GET_DYN_CAP_EXT_LIST] = {
+        "DCD_GET_DYNAMIC_CAPACITY_EXTENT_LIST", cmd_dcd_get_dyn_cap_ext_list,
+        8, 0 },
+    [DCD_CONFIG][ADD_DYN_CAP_RSP] = { "DCD_ADD_DYNAMIC_CAPACITY_RESPONSE",
+        cmd_dcd_add_dyn_cap_rsp, ~0,
+        IMMEDIATE_DATA_CHANGE | IMMEDIATE_CONFIG_CHANGE },
+    [DCD_CONFIG][RELEASE_DYN_CAP] = { "DCD_RELEASE_DYNAMIC_CAPACITY",
+        cmd_dcd_release_dyn_cap, ~0,
+        IMMEDIATE_DATA_CHANGE | IMMEDIATE_CONFIG_CHANGE },
 };
 
+void cxl_mailbox_bg_update(CXLDeviceState *cxl_dstate)
+{
+    if (cxl_dstate->bg.running) {
+        ARRAY_FIELD_DP64(cxl_dstate->mbox_reg_state64, CXL_DEV_BG_CMD_STS,
+                         PERCENTAGE_COMP,
+                         qatomic_read(&cxl_dstate->bg.complete_pct));
+    }
+}
+
+static int cxl_mailbox_bg_work(void *opaque)
+{
+    CXLDeviceState *cxl_dstate = opaque;
+
+    return cxl_dstate->bg.func(cxl_dstate);
+}
+
+/* Main loop side, 8.2.8.4.7 and 8.2.8.4.3 */
+static void cxl_mailbox_bg_complete(void *opaque, int ret)
+{
+    CXLDeviceState *cxl_dstate = opaque;
+    CXLType3Dev *ct3d = container_of(cxl_dstate, CXLType3Dev, cxl_dstate);
+    PCIDevice *pdev = PCI_DEVICE(ct3d);
+    uint64_t bg_status_reg = cxl_dstate->mbox_reg_state64[R_CXL_DEV_BG_CMD_STS];
+    int msi_n;
+
+    /* The first error of any worker, once they are all done */
+    if (ret != CXL_MBOX_SUCCESS && cxl_dstate->bg.ret == CXL_MBOX_SUCCESS) {
+        cxl_dstate->bg.ret = ret;
+    }
+    if (--cxl_dstate->bg.pending) {
+        return;
+    }
+    ret = cxl_dstate->bg.ret;
+
+    bg_status_reg = FIELD_DP64(bg_status_reg, CXL_DEV_BG_CMD_STS,
+                               PERCENTAGE_COMP, 100);
+    bg_status_reg = FIELD_DP64(bg_status_reg, CXL_DEV_BG_CMD_STS, RET_CODE,
+                               ret);
+    cxl_dstate->mbox_reg_state64[R_CXL_DEV_BG_CMD_STS] = bg_status_reg;
+    ARRAY_FIELD_DP64(cxl_dstate->mbox_reg_state64, CXL_DEV_MAILBOX_STS,
+                     BG_OP, 0);
+    cxl_dstate->bg.func = NULL;
+    cxl_dstate->bg.nr_workers = 0;
+    cxl_dstate->bg.running = false;
+
+    if (!ARRAY_FIELD_EX32(cxl_dstate->mbox_reg_state32, CXL_DEV_MAILBOX_CTRL,
+                          BG_INT_EN)) {
+        return;
+    }
+
+    msi_n = ARRAY_FIELD_EX32(cxl_dstate->mbox_reg_state32, CXL_DEV_MAILBOX_CAP,
+                             MSI_N);
+    if (msix_enabled(pdev)) {
+        msix_notify(pdev, msi_n);
+    } else if (msi_enabled(pdev)) {
+        msi_notify(pdev, msi_n);
+    }
+}
+
+static void cxl_mailbox_bg_start(CXLDeviceState *cxl_dstate, uint16_t opcode)
+{
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_aio_context());
+    uint64_t bg_status_reg;
+    int i;
+
+    bg_status_reg = FIELD_DP64(0, CXL_DEV_BG_CMD_STS, OP, opcode);
+    cxl_dstate->mbox_reg_state64[R_CXL_DEV_BG_CMD_STS] = bg_status_reg;
+
+    cxl_dstate->bg.opcode = opcode;
+    cxl_dstate->bg.complete_pct = 0;
+    cxl_dstate->bg.running = true;
+    cxl_dstate->bg.pending = MAX(cxl_dstate->bg.nr_workers, 1);
+    cxl_dstate->bg.ret = CXL_MBOX_SUCCESS;
+    cxl_dstate->bg.next = 0;
+    cxl_dstate->bg.done = 0;
+    for (i = 0; i < cxl_dstate->bg.pending; i++) {
+        thread_pool_submit_aio(pool, cxl_mailbox_bg_work, cxl_dstate,
+                               cxl_mailbox_bg_complete, cxl_dstate);
+    }
+}
+
+/* The completion runs in the main loop, so the device must wait for it */
+void cxl_mailbox_bg_wait(CXLDeviceState *cxl_dstate)
+{
+    AIO_WAIT_WHILE(NULL, cxl_dstate->bg.running);
+}
+
 void cxl_process_mailbox(CXLDeviceState *cxl_dstate)
 {
     uint16_t ret = CXL_MBOX_SUCCESS;
@@ -432,11 +1500,20 @@ void cxl_process_mailbox(CXLDeviceState *cxl_dstate)
     cxl_cmd = &cxl_cmd_set[set][cmd];
     h = cxl_cmd->handler;
     if (h) {
-        if (len == cxl_cmd->in || cxl_cmd->in == ~0) {
+        if ((cxl_cmd->effect & BACKGROUND_OPERATION) &&
+            cxl_dstate->bg.running) {
+            /* 8.2.8.4.7 - one background command at a time */
+            len = 0;
+            ret = CXL_MBOX_BUSY;
+        } else if (len == cxl_cmd->in || cxl_cmd->in == ~0) {
             cxl_cmd->payload = cxl_dstate->mbox_reg_state +
                 A_CXL_DEV_CMD_PAYLOAD;
             ret = (*h)(cxl_cmd, cxl_dstate, &len);
             assert(len <= cxl_dstate->payload_size);
+            if (ret == CXL_MBOX_BG_STARTED) {
+                assert(cxl_cmd->effect & BACKGROUND_OPERATION);
+                cxl_mailbox_bg_start(cxl_dstate, set << 8 | cmd);
+            }
         } else {
             ret = CXL_MBOX_INVALID_PAYLOAD_LENGTH;
         }
@@ -448,6 +1525,8 @@ void cxl_process_mailbox(CXLDeviceState *cxl_dstate)
 
     /* Set the return code */
     status_reg = FIELD_DP64(0, CXL_DEV_MAILBOX_STS, ERRNO, ret);
+    status_reg = FIELD_DP64(status_reg, CXL_DEV_MAILBOX_STS, BG_OP,
+                            cxl_dstate->bg.running);
 
     /* Set the return length */
     command_reg = FIELD_DP64(command_reg, CXL_DEV_MAILBOX_CMD, COMMAND_SET, 0);
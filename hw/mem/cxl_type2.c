@@ -0,0 +1,480 @@
+/*
+ * CXL Type 2 (accelerator) device
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * A Type 3 device whose volatile memory is the device coherent HDM of an
+ * accelerator, with a compute engine that copies, fills and checksums
+ * ranges of that memory.  The engine registers are in BAR 5:
+ *
+ *   0x00 CAP       RO  version and the operations supported
+ *   0x08 SRC       RW  DPA of the source, for copy and CRC
+ *   0x10 DST       RW  DPA of the destination, for copy and fill
+ *   0x18 LEN       RW  length in bytes
+ *   0x20 PATTERN   RW  64-bit little endian fill pattern
+ *   0x28 CMD       RW  operation, and whether to interrupt on completion
+ *   0x30 DOORBELL  WO  write 1 to start the operation
+ *   0x38 STS       RW  busy, and done and error, which are write 1 to clear
+ *   0x40 RESULT    RO  CRC32C of the source, for CRC
+ *   0x48 COMPLETED RO  count of operations completed without error
+ *   0x50 LAST_NS   RO  time the last operation took, in nanoseconds
+ *
+ * All accesses are 64 bits.  One operation runs at a time, on the iothread
+ * if one is given and on the thread pool otherwise, and signals completion
+ * on MSI-X vector 0.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "hw/cxl/cxl.h"
+#include "hw/pci/msi.h"
+#include "hw/pci/msix.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+#include "sysemu/hostmem.h"
+#include "sysemu/iothread.h"
+#include "sysemu/runstate.h"
+#include "trace.h"
+
+#define CXL_TYPE2_ENGINE_BAR_IDX 5
+#define CXL_TYPE2_ENGINE_REGS_SIZE 0x1000
+#define CXL_TYPE2_ENGINE_VERSION 1
+/* Memory is marked dirty for migration as each chunk is done */
+#define CXL_TYPE2_ENGINE_CHUNK_SIZE (1 * MiB)
+#define CXL_TYPE2_ENGINE_FILL_SIZE 4096
+
+REG64(CXL_T2_ENGINE_CAP, 0x00)
+    FIELD(CXL_T2_ENGINE_CAP, VERSION, 0, 8)
+    FIELD(CXL_T2_ENGINE_CAP, OPS, 8, 8)
+REG64(CXL_T2_ENGINE_SRC, 0x08)
+REG64(CXL_T2_ENGINE_DST, 0x10)
+REG64(CXL_T2_ENGINE_LEN, 0x18)
+REG64(CXL_T2_ENGINE_PATTERN, 0x20)
+REG64(CXL_T2_ENGINE_CMD, 0x28)
+    FIELD(CXL_T2_ENGINE_CMD, OP, 0, 8)
+    FIELD(CXL_T2_ENGINE_CMD, INT_EN, 8, 1)
+REG64(CXL_T2_ENGINE_DOORBELL, 0x30)
+REG64(CXL_T2_ENGINE_STS, 0x38)
+    FIELD(CXL_T2_ENGINE_STS, BUSY, 0, 1)
+    FIELD(CXL_T2_ENGINE_STS, DONE, 1, 1)
+    FIELD(CXL_T2_ENGINE_STS, ERR, 2, 1)
+REG64(CXL_T2_ENGINE_RESULT, 0x40)
+REG64(CXL_T2_ENGINE_COMPLETED, 0x48)
+REG64(CXL_T2_ENGINE_LAST_NS, 0x50)
+
+enum {
+    CXL_T2_ENGINE_OP_COPY = 1,
+    CXL_T2_ENGINE_OP_FILL = 2,
+    CXL_T2_ENGINE_OP_CRC = 3,
+};
+
+static bool ct2_engine_range_ok(CXLType2Dev *ct2d, uint64_t dpa, uint64_t len)
+{
+    uint64_t size = memory_region_size(
+        host_memory_backend_get_memory(ct2d->parent_obj.hostvmem));
+
+    return len <= size && dpa <= size - len;
+}
+
+/* Check the job latched by the doorbell before the engine gets it */
+static bool ct2_engine_job_ok(CXLType2Dev *ct2d)
+{
+    CXLType3Dev *ct3d = &ct2d->parent_obj;
+    CXLType2Engine *e = &ct2d->engine;
+    uint64_t len = e->job.len;
+
+    switch (e->job.op) {
+    case CXL_T2_ENGINE_OP_COPY:
+        /* The engine copies forward, so the ranges must not overlap */
+        return ct2_engine_range_ok(ct2d, e->job.src, len) &&
+               ct2_engine_range_ok(ct2d, e->job.dst, len) &&
+               (e->job.src + len <= e->job.dst ||
+                e->job.dst + len <= e->job.src) &&
+               !cxl_type3_poisoned(ct3d, e->job.src, len);
+    case CXL_T2_ENGINE_OP_FILL:
+        return ct2_engine_range_ok(ct2d, e->job.dst, len);
+    case CXL_T2_ENGINE_OP_CRC:
+        return ct2_engine_range_ok(ct2d, e->job.src, len) &&
+               !cxl_type3_poisoned(ct3d, e->job.src, len);
+    default:
+        return false;
+    }
+}
+
+/* Runs on the iothread or the thread pool, without the BQL */
+static int ct2_engine_run(void *opaque)
+{
+    CXLType2Dev *ct2d = opaque;
+    CXLType2Engine *e = &ct2d->engine;
+    MemoryRegion *mr =
+        host_memory_backend_get_memory(ct2d->parent_obj.hostvmem);
+    uint8_t *host = memory_region_get_ram_ptr(mr);
+    uint8_t fill[CXL_TYPE2_ENGINE_FILL_SIZE];
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint32_t crc = 0xffffffff;
+    uint64_t offset, i;
+
+    if (e->job.op == CXL_T2_ENGINE_OP_FILL) {
+        for (i = 0; i < sizeof(fill); i += sizeof(e->job.pattern)) {
+            stq_le_p(fill + i, e->job.pattern);
+        }
+    }
+
+    for (offset = 0; offset < e->job.len;
+         offset += CXL_TYPE2_ENGINE_CHUNK_SIZE) {
+        uint64_t chunk = MIN(e->job.len - offset, CXL_TYPE2_ENGINE_CHUNK_SIZE);
+        uint8_t *src = host + e->job.src + offset;
+        uint8_t *dst = host + e->job.dst + offset;
+
+        switch (e->job.op) {
+        case CXL_T2_ENGINE_OP_COPY:
+            memcpy(dst, src, chunk);
+            break;
+        case CXL_T2_ENGINE_OP_FILL:
+            /* Chunks are a multiple of the pattern, so it stays in phase */
+            for (i = 0; i < chunk; i += sizeof(fill)) {
+                memcpy(dst + i, fill, MIN(chunk - i, sizeof(fill)));
+            }
+            break;
+        case CXL_T2_ENGINE_OP_CRC:
+            crc = crc32c(crc, src, chunk);
+            continue;
+        }
+        /* Written behind the back of dirty tracking, e.g. for migration */
+        memory_region_set_dirty(mr, e->job.dst + offset, chunk);
+    }
+
+    e->job.result = e->job.op == CXL_T2_ENGINE_OP_CRC ? crc ^ 0xffffffff : 0;
+    e->job.ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+    return 0;
+}
+
+/* Main loop side */
+static void ct2_engine_complete(void *opaque, int ret)
+{
+    CXLType2Dev *ct2d = opaque;
+    CXLType2Engine *e = &ct2d->engine;
+    PCIDevice *pdev = PCI_DEVICE(ct2d);
+
+    e->busy = false;
+    e->result = e->job.result;
+    e->last_ns = e->job.ns;
+    e->status = FIELD_DP64(e->status, CXL_T2_ENGINE_STS, BUSY, 0);
+    e->status = FIELD_DP64(e->status, CXL_T2_ENGINE_STS, DONE, 1);
+    if (e->job.err) {
+        e->status = FIELD_DP64(e->status, CXL_T2_ENGINE_STS, ERR, 1);
+    } else {
+        e->completed++;
+    }
+    trace_cxl_type2_engine_done(e->job.op, e->job.len, e->job.ns,
+                                e->job.err);
+
+    if (!FIELD_EX64(e->cmd, CXL_T2_ENGINE_CMD, INT_EN)) {
+        return;
+    }
+    if (msix_enabled(pdev)) {
+        msix_notify(pdev, 0);
+    } else if (msi_enabled(pdev)) {
+        msi_notify(pdev, 0);
+    }
+}
+
+static void ct2_engine_complete_bh(void *opaque)
+{
+    ct2_engine_complete(opaque, 0);
+}
+
+static void ct2_engine_iothread_bh(void *opaque)
+{
+    ct2_engine_run(opaque);
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), ct2_engine_complete_bh,
+                            opaque);
+}
+
+static void ct2_engine_start(CXLType2Dev *ct2d)
+{
+    CXLType2Engine *e = &ct2d->engine;
+
+    if (e->busy) {
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "cxl-type2: doorbell rung while the engine is busy\n");
+        return;
+    }
+
+    e->job.op = FIELD_EX64(e->cmd, CXL_T2_ENGINE_CMD, OP);
+    e->job.src = e->src;
+    e->job.dst = e->dst;
+    e->job.len = e->len;
+    e->job.pattern = e->pattern;
+    e->job.result = 0;
+    e->job.ns = 0;
+    e->job.err = !ct2_engine_job_ok(ct2d);
+
+    e->busy = true;
+    e->status = FIELD_DP64(0, CXL_T2_ENGINE_STS, BUSY, 1);
+    trace_cxl_type2_engine_start(e->job.op, e->job.src, e->job.dst,
+                                 e->job.len);
+
+    if (e->job.err) {
+        ct2_engine_complete(ct2d, 0);
+    } else if (ct2d->iothread) {
+        aio_bh_schedule_oneshot(iothread_get_aio_context(ct2d->iothread),
+                                ct2_engine_iothread_bh, ct2d);
+    } else {
+        thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                               ct2_engine_run, ct2d, ct2_engine_complete,
+                               ct2d);
+    }
+}
+
+/* The completion runs in the main loop, so the device must wait for it */
+static void ct2_engine_wait(CXLType2Dev *ct2d)
+{
+    AIO_WAIT_WHILE(NULL, ct2d->engine.busy);
+}
+
+static uint64_t ct2_engine_read(void *opaque, hwaddr offset, unsigned size)
+{
+    CXLType2Dev *ct2d = opaque;
+    CXLType2Engine *e = &ct2d->engine;
+    uint64_t cap;
+
+    switch (offset) {
+    case A_CXL_T2_ENGINE_CAP:
+        cap = FIELD_DP64(0, CXL_T2_ENGINE_CAP, VERSION,
+                         CXL_TYPE2_ENGINE_VERSION);
+        return FIELD_DP64(cap, CXL_T2_ENGINE_CAP, OPS,
+                          BIT(CXL_T2_ENGINE_OP_COPY) |
+                          BIT(CXL_T2_ENGINE_OP_FILL) |
+                          BIT(CXL_T2_ENGINE_OP_CRC));
+    case A_CXL_T2_ENGINE_SRC:
+        return e->src;
+    case A_CXL_T2_ENGINE_DST:
+        return e->dst;
+    case A_CXL_T2_ENGINE_LEN:
+        return e->len;
+    case A_CXL_T2_ENGINE_PATTERN:
+        return e->pattern;
+    case A_CXL_T2_ENGINE_CMD:
+        return e->cmd;
+    case A_CXL_T2_ENGINE_STS:
+        return e->status;
+    case A_CXL_T2_ENGINE_RESULT:
+        return e->result;
+    case A_CXL_T2_ENGINE_COMPLETED:
+        return e->completed;
+    case A_CXL_T2_ENGINE_LAST_NS:
+        return e->last_ns;
+    default:
+        return 0;
+    }
+}
+
+static void ct2_engine_write(void *opaque, hwaddr offset, uint64_t value,
+                             unsigned size)
+{
+    CXLType2Dev *ct2d = opaque;
+    CXLType2Engine *e = &ct2d->engine;
+
+    switch (offset) {
+    case A_CXL_T2_ENGINE_SRC:
+        e->src = value;
+        break;
+    case A_CXL_T2_ENGINE_DST:
+        e->dst = value;
+        break;
+    case A_CXL_T2_ENGINE_LEN:
+        e->len = value;
+        break;
+    case A_CXL_T2_ENGINE_PATTERN:
+        e->pattern = value;
+        break;
+    case A_CXL_T2_ENGINE_CMD:
+        e->cmd = value & (R_CXL_T2_ENGINE_CMD_OP_MASK |
+                          R_CXL_T2_ENGINE_CMD_INT_EN_MASK);
+        break;
+    case A_CXL_T2_ENGINE_DOORBELL:
+        if (value & 1) {
+            ct2_engine_start(ct2d);
+        }
+        break;
+    case A_CXL_T2_ENGINE_STS:
+        e->status &= ~(value & (R_CXL_T2_ENGINE_STS_DONE_MASK |
+                                R_CXL_T2_ENGINE_STS_ERR_MASK));
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR,
+                      "cxl-type2: write to read only engine register 0x%"
+                      HWADDR_PRIx "\n", offset);
+        break;
+    }
+}
+
+static const MemoryRegionOps ct2_engine_ops = {
+    .read = ct2_engine_read,
+    .write = ct2_engine_write,
+    .endianness = DEVICE_LITTLE_ENDIAN,
+    .valid = {
+        .min_access_size = 8,
+        .max_access_size = 8,
+    },
+};
+
+/* The engine must not write memory once it may have been migrated */
+static void ct2_vm_state_change(void *opaque, bool running, RunState state)
+{
+    if (!running) {
+        ct2_engine_wait(opaque);
+    }
+}
+
+/*
+ * Advertise CXL.cache in the DVSECs of the Type 3 device, as the device
+ * may cache host memory (CXL r3.0 8.1.3 and 8.2.1.3).
+ */
+static void ct2_set_cache_capable(CXLType2Dev *ct2d)
+{
+    PCIDevice *pdev = PCI_DEVICE(ct2d);
+    CXLComponentState *cxl_cstate = &ct2d->parent_obj.cxl_cstate;
+    uint8_t *dvsec;
+
+    dvsec = pdev->config +
+            range_lob(&cxl_cstate->dvsecs[PCIE_CXL_DEVICE_DVSEC]);
+    pci_set_word(dvsec + offsetof(CXLDVSECDevice, cap),
+                 pci_get_word(dvsec + offsetof(CXLDVSECDevice, cap)) | 0x1);
+
+    dvsec = pdev->config +
+            range_lob(&cxl_cstate->dvsecs[PCIE_FLEXBUS_PORT_DVSEC]);
+    pci_set_word(dvsec + offsetof(CXLDVSECPortFlexBus, cap),
+                 pci_get_word(dvsec + offsetof(CXLDVSECPortFlexBus, cap)) |
+                 0x1);
+    pci_set_word(dvsec + offsetof(CXLDVSECPortFlexBus, status),
+                 pci_get_word(dvsec + offsetof(CXLDVSECPortFlexBus, status)) |
+                 0x1);
+}
+
+static void ct2_realize(PCIDevice *pci_dev, Error **errp)
+{
+    CXLType2Dev *ct2d = CXL_TYPE2(pci_dev);
+    CXLType2Class *ct2c = CXL_TYPE2_GET_CLASS(ct2d);
+    CXLType3Dev *ct3d = &ct2d->parent_obj;
+    ERRP_GUARD();
+
+    /* The engine works on the HDM, which is volatile */
+    if (!ct3d->hostvmem) {
+        error_setg(errp, "volatile-memdev must be set");
+        return;
+    }
+    if (ct3d->hostmem || ct3d->hostpmem || ct3d->lsa || ct3d->host_dc ||
+        ct3d->dc.num_regions) {
+        error_setg(errp, "Type 2 devices only have volatile memory");
+        return;
+    }
+
+    ct2c->parent_realize(pci_dev, errp);
+    if (*errp) {
+        return;
+    }
+
+    pci_config_set_prog_interface(pci_dev->config, 0);
+    ct2_set_cache_capable(ct2d);
+
+    memory_region_init_io(&ct2d->engine_mr, OBJECT(ct2d), &ct2_engine_ops,
+                          ct2d, "cxl-type2-engine",
+                          CXL_TYPE2_ENGINE_REGS_SIZE);
+    pci_register_bar(pci_dev, CXL_TYPE2_ENGINE_BAR_IDX,
+                     PCI_BASE_ADDRESS_SPACE_MEMORY, &ct2d->engine_mr);
+
+    ct2d->vm_change_entry =
+        qemu_add_vm_change_state_handler(ct2_vm_state_change, ct2d);
+}
+
+static void ct2_exit(PCIDevice *pci_dev)
+{
+    CXLType2Dev *ct2d = CXL_TYPE2(pci_dev);
+    CXLType2Class *ct2c = CXL_TYPE2_GET_CLASS(ct2d);
+
+    ct2_engine_wait(ct2d);
+    qemu_del_vm_change_state_handler(ct2d->vm_change_entry);
+    ct2c->parent_exit(pci_dev);
+}
+
+static void ct2d_reset(DeviceState *dev)
+{
+    CXLType2Dev *ct2d = CXL_TYPE2(dev);
+    CXLType2Class *ct2c = CXL_TYPE2_GET_CLASS(ct2d);
+
+    ct2_engine_wait(ct2d);
+    memset(&ct2d->engine, 0, sizeof(ct2d->engine));
+    ct2c->parent_reset(dev);
+}
+
+static const VMStateDescription vmstate_ct2d = {
+    .name = "cxl-type2",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(parent_obj, CXLType2Dev, 0, vmstate_ct3d, CXLType3Dev),
+        VMSTATE_UINT64(engine.src, CXLType2Dev),
+        VMSTATE_UINT64(engine.dst, CXLType2Dev),
+        VMSTATE_UINT64(engine.len, CXLType2Dev),
+        VMSTATE_UINT64(engine.pattern, CXLType2Dev),
+        VMSTATE_UINT64(engine.cmd, CXLType2Dev),
+        VMSTATE_UINT64(engine.status, CXLType2Dev),
+        VMSTATE_UINT64(engine.result, CXLType2Dev),
+        VMSTATE_UINT64(engine.completed, CXLType2Dev),
+        VMSTATE_UINT64(engine.last_ns, CXLType2Dev),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property ct2_props[] = {
+    DEFINE_PROP_LINK("iothread", CXLType2Dev, iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void ct2_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(oc);
+    PCIDeviceClass *pc = PCI_DEVICE_CLASS(oc);
+    CXLType2Class *ct2c = CXL_TYPE2_CLASS(oc);
+
+    ct2c->parent_realize = pc->realize;
+    ct2c->parent_exit = pc->exit;
+    pc->realize = ct2_realize;
+    pc->exit = ct2_exit;
+    pc->class_id = PCI_CLASS_ACCELERATOR_PROCESSING;
+    pc->vendor_id = PCI_VENDOR_ID_REDHAT;
+    pc->device_id = PCI_DEVICE_ID_REDHAT_CXL_TYPE2;
+
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    dc->desc = "CXL Accelerator Device (Type 2)";
+    dc->vmsd = &vmstate_ct2d;
+    device_class_set_parent_reset(dc, ct2d_reset, &ct2c->parent_reset);
+    device_class_set_props(dc, ct2_props);
+}
+
+static const TypeInfo ct2d_info = {
+    .name = TYPE_CXL_TYPE2,
+    .parent = TYPE_CXL_TYPE3,
+    .class_size = sizeof(struct CXLType2Class),
+    .class_init = ct2_class_init,
+    .instance_size = sizeof(CXLType2Dev),
+};
+
+static void ct2d_registers(void)
+{
+    type_register_static(&ct2d_info);
+}
+
+type_init(ct2d_registers);
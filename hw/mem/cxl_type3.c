@@ -1,23 +1,30 @@
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bitmap.h"
 #include "qemu/error-report.h"
 #include "qapi/qapi-commands-cxl.h"
+#include "hw/core/cpu.h"
 #include "hw/mem/memory-device.h"
 #include "hw/mem/pc-dimm.h"
 #include "hw/pci/pci.h"
 #include "hw/qdev-properties.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
+#include "qemu/processor.h"
 #include "qemu/pmem.h"
 #include "qemu/range.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "sysemu/hostmem.h"
 #include "sysemu/numa.h"
+#include "sysemu/runstate.h"
+#include "sysemu/stats.h"
 #include "hw/cxl/cxl.h"
+#include "hw/cxl/cxl_host.h"
 #include "hw/pci/msix.h"
-
-#define DWORD_BYTE 4
+#include "migration/vmstate.h"
 
 /* Default CDAT entries for a memory region */
 enum {
@@ -30,9 +37,21 @@ enum {
     CT3_CDAT_NUM_ENTRIES
 };
 
-static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
-                                         int dsmad_handle, MemoryRegion *mr)
+/* DSLBIS bandwidth is entry_base_unit * entry MB/s, with 16 bit entries */
+static uint64_t ct3_cdat_bandwidth_unit(uint64_t bandwidth)
+{
+    return bandwidth > UINT16_MAX ? 1000 : 1;
+}
+
+static int ct3_build_cdat_entries_for_mr(CXLType3Dev *ct3d,
+                                         CDATSubHeader **cdat_table,
+                                         int dsmad_handle, uint64_t size,
+                                         uint8_t flags, uint64_t dpa_base)
 {
+    bool is_pmem = flags & CDAT_DSMAS_FLAG_NV;
+    uint64_t read_bw = ct3d->read_timing.bandwidth;
+    uint64_t write_bw = ct3d->write_timing.bandwidth;
+
     g_autofree CDATDsmas *dsmas = NULL;
     g_autofree CDATDslbis *dslbis0 = NULL;
     g_autofree CDATDslbis *dslbis1 = NULL;
@@ -50,12 +69,12 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
             .length = sizeof(*dsmas),
         },
         .DSMADhandle = dsmad_handle,
-        .flags = CDAT_DSMAS_FLAG_NV,
-        .DPA_base = 0,
-        .DPA_length = int128_get64(mr->size),
+        .flags = flags,
+        .DPA_base = dpa_base,
+        .DPA_length = size,
     };
 
-    /* For now, no memory side cache, plausiblish numbers */
+    /* For now, no memory side cache, numbers from the timing properties */
     dslbis0 = g_malloc(sizeof(*dslbis0));
     if (!dslbis0) {
         return -ENOMEM;
@@ -68,8 +87,8 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .handle = dsmad_handle,
         .flags = HMAT_LB_MEM_MEMORY,
         .data_type = HMAT_LB_DATA_READ_LATENCY,
-        .entry_base_unit = 10000, /* 10ns base */
-        .entry[0] = 15, /* 150ns */
+        .entry_base_unit = 1000, /* 1ns base */
+        .entry[0] = ct3d->read_timing.latency,
     };
 
     dslbis1 = g_malloc(sizeof(*dslbis1));
@@ -84,8 +103,8 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .handle = dsmad_handle,
         .flags = HMAT_LB_MEM_MEMORY,
         .data_type = HMAT_LB_DATA_WRITE_LATENCY,
-        .entry_base_unit = 10000,
-        .entry[0] = 25, /* 250ns */
+        .entry_base_unit = 1000,
+        .entry[0] = ct3d->write_timing.latency,
     };
 
     dslbis2 = g_malloc(sizeof(*dslbis2));
@@ -100,8 +119,8 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .handle = dsmad_handle,
         .flags = HMAT_LB_MEM_MEMORY,
         .data_type = HMAT_LB_DATA_READ_BANDWIDTH,
-        .entry_base_unit = 1000, /* GB/s */
-        .entry[0] = 16,
+        .entry_base_unit = ct3_cdat_bandwidth_unit(read_bw),
+        .entry[0] = read_bw / ct3_cdat_bandwidth_unit(read_bw),
     };
 
     dslbis3 = g_malloc(sizeof(*dslbis3));
@@ -116,8 +135,8 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
         .handle = dsmad_handle,
         .flags = HMAT_LB_MEM_MEMORY,
         .data_type = HMAT_LB_DATA_WRITE_BANDWIDTH,
-        .entry_base_unit = 1000, /* GB/s */
-        .entry[0] = 16,
+        .entry_base_unit = ct3_cdat_bandwidth_unit(write_bw),
+        .entry[0] = write_bw / ct3_cdat_bandwidth_unit(write_bw),
     };
 
     dsemts = g_malloc(sizeof(*dsemts));
@@ -130,10 +149,13 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
             .length = sizeof(*dsemts),
         },
         .DSMAS_handle = dsmad_handle,
-        /* Reserved - the non volatile from DSMAS matters */
-        .EFI_memory_type_attr = 2,
+        /*
+         * NV: Reserved - the non volatile from DSMAS matters
+         * V: EFI_MEMORY_SP
+         */
+        .EFI_memory_type_attr = is_pmem ? 2 : 1,
         .DPA_offset = 0,
-        .DPA_length = int128_get64(mr->size),
+        .DPA_length = size,
     };
 
     /* Header always at start of structure */
@@ -150,33 +172,87 @@ static int ct3_build_cdat_entries_for_mr(CDATSubHeader **cdat_table,
 static int ct3_build_cdat_table(CDATSubHeader ***cdat_table, void *priv)
 {
     g_autofree CDATSubHeader **table = NULL;
-    MemoryRegion *nonvolatile_mr;
     CXLType3Dev *ct3d = priv;
+    MemoryRegion *volatile_mr = NULL, *nonvolatile_mr = NULL;
     int dsmad_handle = 0;
-    int rc;
+    int cur_ent = 0;
+    int len = 0;
+    int rc, i;
 
-    if (!ct3d->hostmem) {
+    if (!ct3d->hostpmem && !ct3d->hostvmem && !ct3d->dc.num_regions) {
         return 0;
     }
 
-    nonvolatile_mr = host_memory_backend_get_memory(ct3d->hostmem);
-    if (!nonvolatile_mr) {
-        return -EINVAL;
+    if (ct3d->hostvmem) {
+        volatile_mr = host_memory_backend_get_memory(ct3d->hostvmem);
+        if (!volatile_mr) {
+            return -EINVAL;
+        }
+        len += CT3_CDAT_NUM_ENTRIES;
+    }
+
+    if (ct3d->hostpmem) {
+        nonvolatile_mr = host_memory_backend_get_memory(ct3d->hostpmem);
+        if (!nonvolatile_mr) {
+            return -EINVAL;
+        }
+        len += CT3_CDAT_NUM_ENTRIES;
     }
 
-    table = g_malloc0(CT3_CDAT_NUM_ENTRIES * sizeof(*table));
+    len += ct3d->dc.num_regions * CT3_CDAT_NUM_ENTRIES;
+
+    table = g_malloc0(len * sizeof(*table));
     if (!table) {
         return -ENOMEM;
     }
 
-    rc = ct3_build_cdat_entries_for_mr(table, dsmad_handle++, nonvolatile_mr);
-    if (rc < 0) {
-        return rc;
+    /* Now fill them in */
+    if (volatile_mr) {
+        rc = ct3_build_cdat_entries_for_mr(ct3d, table, dsmad_handle++,
+                                           memory_region_size(volatile_mr),
+                                           0, 0);
+        if (rc < 0) {
+            return rc;
+        }
+        cur_ent = CT3_CDAT_NUM_ENTRIES;
+    }
+
+    if (nonvolatile_mr) {
+        uint64_t base = volatile_mr ? memory_region_size(volatile_mr) : 0;
+
+        rc = ct3_build_cdat_entries_for_mr(ct3d, &(table[cur_ent]),
+                                           dsmad_handle++,
+                                           memory_region_size(nonvolatile_mr),
+                                           CDAT_DSMAS_FLAG_NV, base);
+        if (rc < 0) {
+            goto error_cleanup;
+        }
+        cur_ent += CT3_CDAT_NUM_ENTRIES;
+    }
+
+    for (i = 0; i < ct3d->dc.num_regions; i++) {
+        CXLDCRegion *region = &ct3d->dc.regions[i];
+
+        region->dsmadhandle = dsmad_handle++;
+        rc = ct3_build_cdat_entries_for_mr(ct3d, &(table[cur_ent]),
+                                           region->dsmadhandle, region->len,
+                                           CDAT_DSMAS_FLAG_DYNAMIC_CAP,
+                                           region->base);
+        if (rc < 0) {
+            goto error_cleanup;
+        }
+        cur_ent += CT3_CDAT_NUM_ENTRIES;
     }
+    assert(len == cur_ent);
 
     *cdat_table = g_steal_pointer(&table);
 
-    return CT3_CDAT_NUM_ENTRIES;
+    return len;
+error_cleanup:
+    for (i = 0; i < cur_ent; i++) {
+        g_free(table[i]);
+    }
+    return rc;
 }
 
 static void ct3_free_cdat_table(CDATSubHeader **cdat_table, int num, void *priv)
@@ -191,45 +267,8 @@ static void ct3_free_cdat_table(CDATSubHeader **cdat_table, int num, void *priv)
 
 static bool cxl_doe_cdat_rsp(DOECap *doe_cap)
 {
-    CDATObject *cdat = &CXL_TYPE3(doe_cap->pdev)->cxl_cstate.cdat;
-    uint16_t ent;
-    void *base;
-    uint32_t len;
-    CDATReq *req = pcie_doe_get_write_mbox_ptr(doe_cap);
-    CDATRsp rsp;
-
-    assert(cdat->entry_len);
-
-    /* Discard if request length mismatched */
-    if (pcie_doe_get_obj_len(req) <
-        DIV_ROUND_UP(sizeof(CDATReq), DWORD_BYTE)) {
-        return false;
-    }
-
-    ent = req->entry_handle;
-    base = cdat->entry[ent].base;
-    len = cdat->entry[ent].length;
-
-    rsp = (CDATRsp) {
-        .header = {
-            .vendor_id = CXL_VENDOR_ID,
-            .data_obj_type = CXL_DOE_TABLE_ACCESS,
-            .reserved = 0x0,
-            .length = DIV_ROUND_UP((sizeof(rsp) + len), DWORD_BYTE),
-        },
-        .rsp_code = CXL_DOE_TAB_RSP,
-        .table_type = CXL_DOE_TAB_TYPE_CDAT,
-        .entry_handle = (ent < cdat->entry_len - 1) ?
-                        ent + 1 : CXL_DOE_TAB_ENT_MAX,
-    };
-
-    memcpy(doe_cap->read_mbox, &rsp, sizeof(rsp));
-    memcpy(doe_cap->read_mbox + DIV_ROUND_UP(sizeof(rsp), DWORD_BYTE),
-           base, len);
-
-    doe_cap->read_mbox_len += rsp.header.length;
-
-    return true;
+    return cxl_doe_cdat_read_entry(doe_cap,
+                                   &CXL_TYPE3(doe_cap->pdev)->cxl_cstate.cdat);
 }
 
 static uint32_t ct3d_config_read(PCIDevice *pci_dev, uint32_t addr, int size)
@@ -264,16 +303,44 @@ static void build_dvsecs(CXLType3Dev *ct3d)
 {
     CXLComponentState *cxl_cstate = &ct3d->cxl_cstate;
     uint8_t *dvsec;
+    uint32_t range1_size_hi, range1_size_lo,
+             range1_base_hi = 0, range1_base_lo = 0,
+             range2_size_hi = 0, range2_size_lo = 0,
+             range2_base_hi = 0, range2_base_lo = 0;
+    uint16_t hdm_count = 1;
+
+    /*
+     * Volatile memory is mapped as (0x0)
+     * Persistent memory is mapped at (volatile->size)
+     */
+    if (ct3d->hostvmem) {
+        range1_size_hi = ct3d->hostvmem->size >> 32;
+        range1_size_lo = (2 << 5) | (2 << 2) | 0x3 |
+                         (ct3d->hostvmem->size & 0xF0000000);
+        if (ct3d->hostpmem) {
+            range2_size_hi = ct3d->hostpmem->size >> 32;
+            range2_size_lo = (2 << 5) | (2 << 2) | 0x3 |
+                             (ct3d->hostpmem->size & 0xF0000000);
+            hdm_count = 2;
+        }
+    } else {
+        range1_size_hi = ct3d->hostpmem->size >> 32;
+        range1_size_lo = (2 << 5) | (2 << 2) | 0x3 |
+                         (ct3d->hostpmem->size & 0xF0000000);
+    }
 
     dvsec = (uint8_t *)&(CXLDVSECDevice){
-        .cap = 0x1e,
+        .cap = 0xe | (hdm_count << 4),
         .ctrl = 0x2,
         .status2 = 0x2,
-        .range1_size_hi = ct3d->hostmem->size >> 32,
-        .range1_size_lo = (2 << 5) | (2 << 2) | 0x3 |
-        (ct3d->hostmem->size & 0xF0000000),
-        .range1_base_hi = 0,
-        .range1_base_lo = 0,
+        .range1_size_hi = range1_size_hi,
+        .range1_size_lo = range1_size_lo,
+        .range1_base_hi = range1_base_hi,
+        .range1_base_lo = range1_base_lo,
+        .range2_size_hi = range2_size_hi,
+        .range2_size_lo = range2_size_lo,
+        .range2_base_hi = range2_base_hi,
+        .range2_base_lo = range2_base_lo,
     };
     cxl_component_create_dvsec(cxl_cstate, CXL2_TYPE3_DEVICE,
                                PCIE_CXL_DEVICE_DVSEC_LENGTH,
@@ -314,14 +381,34 @@ static void hdm_decoder_commit(CXLType3Dev *ct3d, int which)
 {
     ComponentRegisters *cregs = &ct3d->cxl_cstate.crb;
     uint32_t *cache_mem = cregs->cache_mem_registers;
+    uint32_t *ctrl;
 
-    assert(which == 0);
+    ctrl = &cache_mem[R_CXL_HDM_DECODER0_CTRL +
+                      which * CXL_HDM_DECODER_STRIDE];
 
     /* TODO: Sanity checks that the decoder is possible */
-    ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, COMMIT, 0);
-    ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, ERR, 0);
+    *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMIT, 0);
+    *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, ERR, 0);
+
+    *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 1);
+
+    cxl_hdm_decoders_changed();
+    cxl_fmws_update_mmio();
+}
+
+static void hdm_decoder_uncommit(CXLType3Dev *ct3d, int which)
+{
+    ComponentRegisters *cregs = &ct3d->cxl_cstate.crb;
+    uint32_t *cache_mem = cregs->cache_mem_registers;
+    uint32_t *ctrl;
+
+    ctrl = &cache_mem[R_CXL_HDM_DECODER0_CTRL +
+                      which * CXL_HDM_DECODER_STRIDE];
 
-    ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER0_CTRL, COMMITTED, 1);
+    *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 0);
+
+    cxl_hdm_decoders_changed();
+    cxl_fmws_update_mmio();
 }
 
 static int ct3d_qmp_uncor_err_to_cxl(CxlUncorErrorType qmp_err)
@@ -392,16 +479,23 @@ static void ct3d_reg_write(void *opaque, hwaddr offset, uint64_t value,
     CXLType3Dev *ct3d = container_of(cxl_cstate, CXLType3Dev, cxl_cstate);
     uint32_t *cache_mem = cregs->cache_mem_registers;
     bool should_commit = false;
-    int which_hdm = -1;
+    bool should_uncommit = false;
+    int which_hdm;
 
     assert(size == 4);
     g_assert(offset < CXL2_COMPONENT_CM_REGION_SIZE);
 
-    switch (offset) {
-    case A_CXL_HDM_DECODER0_CTRL:
+    which_hdm = cxl_hdm_decoder_ctrl_index(offset);
+    if (which_hdm >= 0) {
+        uint32_t ctrl = cache_mem[R_CXL_HDM_DECODER0_CTRL +
+                                  which_hdm * CXL_HDM_DECODER_STRIDE];
+
         should_commit = FIELD_EX32(value, CXL_HDM_DECODER0_CTRL, COMMIT);
-        which_hdm = 0;
-        break;
+        should_uncommit = !should_commit &&
+            FIELD_EX32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED);
+    }
+
+    switch (offset) {
     case A_CXL_RAS_UNC_ERR_STATUS:
     {
         uint32_t capctrl = ldl_le_p(cache_mem + R_CXL_RAS_ERR_CAP_CTRL);
@@ -486,47 +580,322 @@ static void ct3d_reg_write(void *opaque, hwaddr offset, uint64_t value,
     stl_le_p((uint8_t *)cache_mem + offset, value);
     if (should_commit) {
         hdm_decoder_commit(ct3d, which_hdm);
+    } else if (should_uncommit) {
+        hdm_decoder_uncommit(ct3d, which_hdm);
     }
 }
 
-static bool cxl_setup_memory(CXLType3Dev *ct3d, Error **errp)
+/*
+ * Dynamic capacity regions split the backend evenly and follow the static
+ * capacity.  None of it is accepted yet, so none of the backend needs to
+ * be populated.  Like for virtio-mem, this relies on discarding RAM.
+ */
+static bool cxl_setup_dc_memory(CXLType3Dev *ct3d, Error **errp)
 {
+    CXLDeviceState *cxl_dstate = &ct3d->cxl_dstate;
     DeviceState *ds = DEVICE(ct3d);
-    MemoryRegion *mr;
-    char *name;
+    uint64_t base, region_len;
+    MemoryRegion *dc_mr;
+    char *dc_name;
+    int i, ret;
+
+    if (!ct3d->host_dc) {
+        if (ct3d->dc.num_regions) {
+            error_setg(errp, "num-dc-regions requires volatile-dc-memdev");
+            return false;
+        }
+        return true;
+    }
+
+    if (ct3d->dc.num_regions < 1 ||
+        ct3d->dc.num_regions > DCD_MAX_NUM_REGION) {
+        error_setg(errp, "num-dc-regions must be between 1 and %d",
+                   DCD_MAX_NUM_REGION);
+        return false;
+    }
+
+    dc_mr = host_memory_backend_get_memory(ct3d->host_dc);
+    if (!dc_mr) {
+        error_setg(errp, "dynamic capacity memdev must have backing device");
+        return false;
+    }
+    if (ct3d->host_dc->prealloc) {
+        error_setg(errp, "dynamic capacity memdev must not be preallocated");
+        return false;
+    }
 
-    if (!ct3d->hostmem) {
-        error_setg(errp, "memdev property must be set");
+    region_len = memory_region_size(dc_mr) / ct3d->dc.num_regions;
+    if (!region_len ||
+        !QEMU_IS_ALIGNED(region_len, CXL_CAPACITY_MULTIPLIER)) {
+        error_setg(errp, "dynamic capacity regions must be multiples of "
+                   "256 MiB");
         return false;
     }
 
-    mr = host_memory_backend_get_memory(ct3d->hostmem);
-    if (!mr) {
-        error_setg(errp, "memdev property must be set");
+    if (ram_block_discard_require(true)) {
+        error_setg(errp, "dynamic capacity requires discarding RAM, which "
+                   "is disabled");
+        return false;
+    }
+    ret = ram_block_discard_range(dc_mr->ram_block, 0,
+                                  memory_region_size(dc_mr));
+    if (ret) {
+        error_setg_errno(errp, -ret, "Unexpected error discarding RAM");
+        ram_block_discard_require(false);
         return false;
     }
-    memory_region_set_nonvolatile(mr, true);
-    memory_region_set_enabled(mr, true);
-    host_memory_backend_set_mapped(ct3d->hostmem, true);
 
+    base = QEMU_ALIGN_UP(cxl_dstate->mem_size, CXL_CAPACITY_MULTIPLIER);
+    for (i = 0; i < ct3d->dc.num_regions; i++) {
+        CXLDCRegion *region = &ct3d->dc.regions[i];
+
+        region->base = base;
+        region->decode_len = region_len;
+        region->len = region_len;
+        region->block_size = CXL_DC_BLOCK_SIZE;
+        base += region_len;
+    }
+    ct3d->dc.total_capacity = region_len * ct3d->dc.num_regions;
+    ct3d->dc.blk_bitmap = bitmap_new(ct3d->dc.total_capacity /
+                                     CXL_DC_BLOCK_SIZE);
+
+    memory_region_set_nonvolatile(dc_mr, false);
+    memory_region_set_enabled(dc_mr, true);
+    host_memory_backend_set_mapped(ct3d->host_dc, true);
     if (ds->id) {
-        name = g_strdup_printf("cxl-type3-dpa-space:%s", ds->id);
+        dc_name = g_strdup_printf("cxl-type3-dpa-dc-space:%s", ds->id);
     } else {
-        name = g_strdup("cxl-type3-dpa-space");
+        dc_name = g_strdup("cxl-type3-dpa-dc-space");
     }
-    address_space_init(&ct3d->hostmem_as, mr, name);
-    g_free(name);
+    address_space_init(&ct3d->host_dc_as, dc_mr, dc_name);
+    g_free(dc_name);
 
-    ct3d->cxl_dstate.pmem_size = ct3d->hostmem->size;
+    return true;
+}
 
-    if (!ct3d->lsa) {
-        error_setg(errp, "lsa property must be set");
+static void cxl_destroy_dc_memory(CXLType3Dev *ct3d)
+{
+    CXLDCExtent *ent, *next;
+
+    if (!ct3d->dc.num_regions) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(ent, &ct3d->dc.extents, node, next) {
+        QTAILQ_REMOVE(&ct3d->dc.extents, ent, node);
+        g_free(ent);
+    }
+    cxl_type3_dc_clear_pending(ct3d);
+    g_free(ct3d->dc.blk_bitmap);
+    address_space_destroy(&ct3d->host_dc_as);
+    ram_block_discard_require(false);
+}
+
+static bool ct3_backend_is_shared(HostMemoryBackend *hostmem)
+{
+    return !hostmem ||
+        qemu_ram_is_shared(host_memory_backend_get_memory(hostmem)->ram_block);
+}
+
+/*
+ * Devices of several QEMU instances can be the heads of one multi-headed
+ * device, sharing its memory.  That needs the backends to be mapped shared
+ * by all of them, e.g. files on a tmpfs with share=on.  Each head has its
+ * own decoders, poison and labels.  Dynamic capacity is not supported, as
+ * releasing capacity from one head discards it for all.
+ */
+static bool ct3_check_shared(CXLType3Dev *ct3d, Error **errp)
+{
+    if (ct3d->host_dc) {
+        error_setg(errp, "dynamic capacity cannot be shared");
+        return false;
+    }
+    if (!ct3_backend_is_shared(ct3d->hostvmem) ||
+        !ct3_backend_is_shared(ct3d->hostpmem)) {
+        error_setg(errp, "shared memory backends must have share=on");
+        return false;
+    }
+
+    return true;
+}
+
+static bool cxl_setup_memory(CXLType3Dev *ct3d, Error **errp)
+{
+    DeviceState *ds = DEVICE(ct3d);
+
+    if (!ct3d->hostmem && !ct3d->hostvmem && !ct3d->hostpmem &&
+        !ct3d->host_dc) {
+        error_setg(errp, "at least one memdev property must be set");
+        return false;
+    } else if (ct3d->hostmem && ct3d->hostpmem) {
+        error_setg(errp, "[memdev] cannot be used with new "
+                         "[persistent-memdev] property");
+        return false;
+    } else if (ct3d->hostmem) {
+        /* Use of hostmem property implies pmem */
+        ct3d->hostpmem = ct3d->hostmem;
+        ct3d->hostmem = NULL;
+    }
+
+    if (ct3d->hostpmem && !ct3d->lsa) {
+        error_setg(errp, "lsa property must be set for persistent devices");
         return false;
     }
 
+    if (ct3d->hostvmem) {
+        MemoryRegion *vmr;
+        char *v_name;
+
+        vmr = host_memory_backend_get_memory(ct3d->hostvmem);
+        if (!vmr) {
+            error_setg(errp, "volatile memdev must have backing device");
+            return false;
+        }
+        memory_region_set_nonvolatile(vmr, false);
+        memory_region_set_enabled(vmr, true);
+        host_memory_backend_set_mapped(ct3d->hostvmem, true);
+        if (ds->id) {
+            v_name = g_strdup_printf("cxl-type3-dpa-vmem-space:%s", ds->id);
+        } else {
+            v_name = g_strdup("cxl-type3-dpa-vmem-space");
+        }
+        address_space_init(&ct3d->hostvmem_as, vmr, v_name);
+        ct3d->cxl_dstate.vmem_size = memory_region_size(vmr);
+        ct3d->cxl_dstate.mem_size += memory_region_size(vmr);
+        g_free(v_name);
+    }
+
+    if (ct3d->hostpmem) {
+        MemoryRegion *pmr;
+        char *p_name;
+
+        pmr = host_memory_backend_get_memory(ct3d->hostpmem);
+        if (!pmr) {
+            error_setg(errp, "persistent memdev must have backing device");
+            goto err_destroy_vmem_as;
+        }
+        memory_region_set_nonvolatile(pmr, true);
+        memory_region_set_enabled(pmr, true);
+        host_memory_backend_set_mapped(ct3d->hostpmem, true);
+        if (ds->id) {
+            p_name = g_strdup_printf("cxl-type3-dpa-pmem-space:%s", ds->id);
+        } else {
+            p_name = g_strdup("cxl-type3-dpa-pmem-space");
+        }
+        address_space_init(&ct3d->hostpmem_as, pmr, p_name);
+        ct3d->cxl_dstate.pmem_size = memory_region_size(pmr);
+        ct3d->cxl_dstate.mem_size += memory_region_size(pmr);
+        g_free(p_name);
+    }
+
+    if (ct3d->shared && !ct3_check_shared(ct3d, errp)) {
+        goto err_destroy_pmem_as;
+    }
+
+    if (!cxl_setup_dc_memory(ct3d, errp)) {
+        goto err_destroy_pmem_as;
+    }
+
+    return true;
+
+err_destroy_pmem_as:
+    if (ct3d->hostpmem) {
+        address_space_destroy(&ct3d->hostpmem_as);
+    }
+err_destroy_vmem_as:
+    if (ct3d->hostvmem) {
+        address_space_destroy(&ct3d->hostvmem_as);
+    }
+    return false;
+}
+
+/*
+ * Label writes are written back to the LSA backend a while after the first
+ * one, so that the many Set LSA commands of a namespace update share one
+ * flush.  Only the modified labels (CXL 2.0 9.13.2) are written back.
+ */
+#define CXL_LSA_FLUSH_DELAY_MS 100
+#define CXL_LSA_DIRTY_GRANULE 256
+
+static void ct3_lsa_flush(CXLType3Dev *ct3d)
+{
+    MemoryRegion *mr = host_memory_backend_get_memory(ct3d->lsa);
+    uint64_t lsa_size = memory_region_size(mr);
+    unsigned long nbits = DIV_ROUND_UP(lsa_size, CXL_LSA_DIRTY_GRANULE);
+    unsigned long start, end;
+
+    for (start = find_first_bit(ct3d->lsa_dirty, nbits); start < nbits;
+         start = find_next_bit(ct3d->lsa_dirty, nbits, end)) {
+        uint64_t offset = (uint64_t)start * CXL_LSA_DIRTY_GRANULE;
+
+        end = find_next_zero_bit(ct3d->lsa_dirty, nbits, start);
+        bitmap_clear(ct3d->lsa_dirty, start, end - start);
+        memory_region_msync(mr, offset,
+                            MIN((uint64_t)end * CXL_LSA_DIRTY_GRANULE,
+                                lsa_size) - offset);
+    }
+}
+
+static void ct3_lsa_flush_timer_cb(void *opaque)
+{
+    ct3_lsa_flush(opaque);
+}
+
+/* Values must be representable in the CDAT */
+static bool ct3_timing_check(CXLTiming *timing, const char *dir, Error **errp)
+{
+    if (timing->latency > UINT16_MAX) {
+        error_setg(errp, "%s-latency must be at most %u ns", dir, UINT16_MAX);
+        return false;
+    }
+    if (!timing->bandwidth || timing->bandwidth > UINT16_MAX * 1000ULL) {
+        error_setg(errp, "%s-bandwidth must be between 1 and %llu MB/s", dir,
+                   UINT16_MAX * 1000ULL);
+        return false;
+    }
     return true;
 }
 
+/*
+ * A background command writes to the memory backends behind the back of
+ * dirty tracking and migration, so make sure none is in flight while the
+ * VM is stopped.
+ */
+static void ct3_vm_state_change(void *opaque, bool running, RunState state)
+{
+    CXLType3Dev *ct3d = opaque;
+
+    if (!running) {
+        cxl_mailbox_bg_wait(&ct3d->cxl_dstate);
+    }
+}
+
+/*
+ * Shared memory is not migrated, the other heads keep using it.  The
+ * destination must map the same memory.
+ */
+static void ct3_register_ram(CXLType3Dev *ct3d, HostMemoryBackend *hostmem,
+                             bool shared)
+{
+    MemoryRegion *mr;
+
+    if (hostmem) {
+        mr = host_memory_backend_get_memory(hostmem);
+        vmstate_register_ram(mr, DEVICE(ct3d));
+        if (shared) {
+            qemu_ram_unset_migratable(mr->ram_block);
+        }
+    }
+}
+
+static void ct3_unregister_ram(CXLType3Dev *ct3d, HostMemoryBackend *hostmem)
+{
+    if (hostmem) {
+        vmstate_unregister_ram(host_memory_backend_get_memory(hostmem),
+                               DEVICE(ct3d));
+    }
+}
+
 static DOEProtocol doe_cdat_prot[] = {
     { CXL_VENDOR_ID, CXL_DOE_TABLE_ACCESS, cxl_doe_cdat_rsp },
     { }
@@ -539,10 +908,18 @@ static void ct3_realize(PCIDevice *pci_dev, Error **errp)
     ComponentRegisters *regs = &cxl_cstate->crb;
     MemoryRegion *mr = &regs->component_registers;
     uint8_t *pci_conf = pci_dev->config;
-    unsigned short msix_num = 1;
+    unsigned short msix_num = 2;
     int i, rc;
 
     QTAILQ_INIT(&ct3d->error_list);
+    QTAILQ_INIT(&ct3d->dc.extents);
+    QTAILQ_INIT(&ct3d->dc.pending);
+    cxl_event_init(&ct3d->cxl_dstate);
+
+    if (!ct3_timing_check(&ct3d->read_timing, "read", errp) ||
+        !ct3_timing_check(&ct3d->write_timing, "write", errp)) {
+        return;
+    }
 
     if (!cxl_setup_memory(ct3d, errp)) {
         return;
@@ -592,7 +969,9 @@ static void ct3_realize(PCIDevice *pci_dev, Error **errp)
     cxl_cstate->cdat.build_cdat_table = ct3_build_cdat_table;
     cxl_cstate->cdat.free_cdat_table = ct3_free_cdat_table;
     cxl_cstate->cdat.private = ct3d;
-    cxl_doe_cdat_init(cxl_cstate, errp);
+    if (!cxl_doe_cdat_init(cxl_cstate, errp)) {
+        goto err_release_cdat;
+    }
 
     pcie_cap_deverr_init(pci_dev);
     /* Leave a bit of room for expansion */
@@ -601,13 +980,36 @@ static void ct3_realize(PCIDevice *pci_dev, Error **errp)
         goto err_release_cdat;
     }
 
+    if (ct3d->lsa) {
+        MemoryRegion *lsa_mr = host_memory_backend_get_memory(ct3d->lsa);
+
+        ct3d->lsa_dirty = bitmap_new(DIV_ROUND_UP(memory_region_size(lsa_mr),
+                                                  CXL_LSA_DIRTY_GRANULE));
+        ct3d->lsa_flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                             ct3_lsa_flush_timer_cb, ct3d);
+    }
+
+    /* Memory is migrated by the RAM pre-copy, the rest by vmstate_ct3d */
+    ct3_register_ram(ct3d, ct3d->hostvmem, ct3d->shared);
+    ct3_register_ram(ct3d, ct3d->hostpmem, ct3d->shared);
+    ct3_register_ram(ct3d, ct3d->lsa, false);
+    ct3_register_ram(ct3d, ct3d->host_dc, false);
+    ct3d->vm_change_entry =
+        qemu_add_vm_change_state_handler(ct3_vm_state_change, ct3d);
+
     return;
 
 err_release_cdat:
     cxl_doe_cdat_release(cxl_cstate);
     g_free(regs->special_ops);
 err_address_space_free:
-    address_space_destroy(&ct3d->hostmem_as);
+    cxl_destroy_dc_memory(ct3d);
+    if (ct3d->hostpmem) {
+        address_space_destroy(&ct3d->hostpmem_as);
+    }
+    if (ct3d->hostvmem) {
+        address_space_destroy(&ct3d->hostvmem_as);
+    }
     return;
 }
 
@@ -616,133 +1018,1037 @@ static void ct3_exit(PCIDevice *pci_dev)
     CXLType3Dev *ct3d = CXL_TYPE3(pci_dev);
     CXLComponentState *cxl_cstate = &ct3d->cxl_cstate;
     ComponentRegisters *regs = &cxl_cstate->crb;
+    uint32_t *cache_mem = regs->cache_mem_registers;
+    int i;
 
+    /* A background command may still be using the memory backends */
+    qemu_del_vm_change_state_handler(ct3d->vm_change_entry);
+    cxl_mailbox_bg_wait(&ct3d->cxl_dstate);
+    ct3_unregister_ram(ct3d, ct3d->host_dc);
+    ct3_unregister_ram(ct3d, ct3d->lsa);
+    ct3_unregister_ram(ct3d, ct3d->hostpmem);
+    ct3_unregister_ram(ct3d, ct3d->hostvmem);
+
+    /* Drop any window mappings and cached routes to this device */
+    for (i = 0; i < CXL_HDM_DECODER_COUNT; i++) {
+        uint32_t *ctrl = &cache_mem[R_CXL_HDM_DECODER0_CTRL +
+                                    i * CXL_HDM_DECODER_STRIDE];
+
+        *ctrl = FIELD_DP32(*ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 0);
+    }
+    cxl_hdm_decoders_changed();
+    cxl_fmws_update_mmio();
+    cxl_type3_poison_clear(ct3d, 0, ct3d->cxl_dstate.mem_size, NULL);
+    g_free(ct3d->scan_media.records);
+    ct3d->scan_media.records = NULL;
+    if (ct3d->lsa_dirty) {
+        timer_free(ct3d->lsa_flush_timer);
+        ct3_lsa_flush(ct3d);
+        g_free(ct3d->lsa_dirty);
+    }
     pcie_aer_exit(pci_dev);
     cxl_doe_cdat_release(cxl_cstate);
     g_free(regs->special_ops);
-    address_space_destroy(&ct3d->hostmem_as);
+    cxl_destroy_dc_memory(ct3d);
+    if (ct3d->hostpmem) {
+        address_space_destroy(&ct3d->hostpmem_as);
+    }
+    if (ct3d->hostvmem) {
+        address_space_destroy(&ct3d->hostvmem_as);
+    }
 }
 
-/* TODO: Support multiple HDM decoders and DPA skip */
 static bool cxl_type3_dpa(CXLType3Dev *ct3d, hwaddr host_addr, uint64_t *dpa)
 {
-    uint32_t *cache_mem = ct3d->cxl_cstate.crb.cache_mem_registers;
-    uint64_t decoder_base, decoder_size, hpa_offset;
-    uint32_t hdm0_ctrl;
-    int ig, iw;
-
-    decoder_base = (((uint64_t)cache_mem[R_CXL_HDM_DECODER0_BASE_HI] << 32) |
-                    cache_mem[R_CXL_HDM_DECODER0_BASE_LO]);
-    if ((uint64_t)host_addr < decoder_base) {
-        return false;
-    }
-
-    hpa_offset = (uint64_t)host_addr - decoder_base;
+    const CXLHDMDecoder *decoder;
 
-    decoder_size = ((uint64_t)cache_mem[R_CXL_HDM_DECODER0_SIZE_HI] << 32) |
-        cache_mem[R_CXL_HDM_DECODER0_SIZE_LO];
-    if (hpa_offset >= decoder_size) {
+    decoder = cxl_hdm_find_decoder(&ct3d->cxl_cstate, host_addr, NULL);
+    if (!decoder) {
         return false;
     }
 
-    hdm0_ctrl = cache_mem[R_CXL_HDM_DECODER0_CTRL];
-    iw = FIELD_EX32(hdm0_ctrl, CXL_HDM_DECODER0_CTRL, IW);
-    ig = FIELD_EX32(hdm0_ctrl, CXL_HDM_DECODER0_CTRL, IG);
-
-    *dpa = (MAKE_64BIT_MASK(0, 8 + ig) & hpa_offset) |
-        ((MAKE_64BIT_MASK(8 + ig + iw, 64 - 8 - ig - iw) & hpa_offset) >> iw);
+    *dpa = cxl_hdm_decoder_dpa(decoder, host_addr);
 
     return true;
 }
 
-MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
-                           unsigned size, MemTxAttrs attrs)
+/*
+ * Volatile capacity is at DPA 0, persistent capacity follows it and dynamic
+ * capacity follows that.  Return the address space backing @dpa and convert
+ * @dpa to an offset within it, or return NULL if @dpa is beyond the capacity
+ * of the device.
+ */
+static AddressSpace *cxl_type3_dpa_to_as(CXLType3Dev *ct3d, uint64_t *dpa,
+                                         MemoryRegion **mr)
 {
-    CXLType3Dev *ct3d = CXL_TYPE3(d);
-    uint64_t dpa_offset;
-    MemoryRegion *mr;
+    CXLDeviceState *cxl_dstate = &ct3d->cxl_dstate;
+    uint64_t dpa_in = *dpa;
 
-    /* TODO support volatile region */
-    mr = host_memory_backend_get_memory(ct3d->hostmem);
-    if (!mr) {
-        return MEMTX_ERROR;
+    if (*dpa < cxl_dstate->vmem_size) {
+        if (mr) {
+            *mr = host_memory_backend_get_memory(ct3d->hostvmem);
+        }
+        return &ct3d->hostvmem_as;
     }
 
-    if (!cxl_type3_dpa(ct3d, host_addr, &dpa_offset)) {
-        return MEMTX_ERROR;
+    *dpa -= cxl_dstate->vmem_size;
+    if (*dpa < cxl_dstate->pmem_size) {
+        if (mr) {
+            *mr = host_memory_backend_get_memory(ct3d->hostpmem);
+        }
+        return &ct3d->hostpmem_as;
     }
 
-    if (dpa_offset > int128_get64(mr->size)) {
-        return MEMTX_ERROR;
+    if (ct3d->dc.num_regions && dpa_in >= ct3d->dc.regions[0].base &&
+        dpa_in - ct3d->dc.regions[0].base < ct3d->dc.total_capacity) {
+        *dpa = dpa_in - ct3d->dc.regions[0].base;
+        if (mr) {
+            *mr = host_memory_backend_get_memory(ct3d->host_dc);
+        }
+        return &ct3d->host_dc_as;
     }
 
-    return address_space_read(&ct3d->hostmem_as, dpa_offset, attrs, data, size);
+    return NULL;
 }
 
-MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
-                            unsigned size, MemTxAttrs attrs)
+/*
+ * Poison is kept in an interval tree, so that checking an access costs
+ * nothing while there is none and O(log n) however much there is.  Host
+ * pages that hold any poison are not mapped straight into the guest, see
+ * cxl_type3_hpa_to_mr(), so that every access to them is checked.
+ */
+bool cxl_type3_poisoned(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len)
 {
-    CXLType3Dev *ct3d = CXL_TYPE3(d);
-    uint64_t dpa_offset;
-    MemoryRegion *mr;
+    return !interval_tree_is_empty(&ct3d->poison_tree) &&
+           interval_tree_iter_first(&ct3d->poison_tree, dpa, dpa + len - 1);
+}
 
-    mr = host_memory_backend_get_memory(ct3d->hostmem);
-    if (!mr) {
-        return MEMTX_OK;
-    }
+/* Beyond this many pages don't bother checking, just remap */
+#define CXL_POISON_COVERED_MAX_PAGES 64
 
-    if (!cxl_type3_dpa(ct3d, host_addr, &dpa_offset)) {
-        return MEMTX_OK;
+/*
+ * Whether every host page overlapping [start, last] holds some poison, in
+ * which case poisoning or clearing part of the range leaves the mappings of
+ * the fixed memory windows as they are.
+ */
+static bool ct3_poison_pages_covered(CXLType3Dev *ct3d, uint64_t start,
+                                     uint64_t last)
+{
+    uint64_t page_size = qemu_real_host_page_size();
+    uint64_t page;
+
+    start = QEMU_ALIGN_DOWN(start, page_size);
+    if ((last - start) / page_size >= CXL_POISON_COVERED_MAX_PAGES) {
+        return false;
     }
 
-    if (dpa_offset > int128_get64(mr->size)) {
-        return MEMTX_OK;
+    for (page = start; page <= last; page += page_size) {
+        if (!cxl_type3_poisoned(ct3d, page, page_size)) {
+            return false;
+        }
     }
-    return address_space_write(&ct3d->hostmem_as, dpa_offset, attrs,
-                               &data, size);
+
+    return true;
 }
 
-static void ct3d_reset(DeviceState *dev)
+static void ct3_poison_insert(CXLType3Dev *ct3d, uint64_t start,
+                              uint64_t last, uint8_t type)
 {
-    CXLType3Dev *ct3d = CXL_TYPE3(dev);
-    uint32_t *reg_state = ct3d->cxl_cstate.crb.cache_mem_registers;
-    uint32_t *write_msk = ct3d->cxl_cstate.crb.cache_mem_regs_write_mask;
+    CXLPoison *p = g_new0(CXLPoison, 1);
 
-    cxl_component_register_init_common(reg_state, write_msk, CXL2_TYPE3_DEVICE);
-    cxl_device_register_init_common(&ct3d->cxl_dstate);
+    p->node.start = start;
+    p->node.last = last;
+    p->type = type;
+    interval_tree_insert(&p->node, &ct3d->poison_tree);
+    ct3d->poison_count++;
 }
 
-static Property ct3_props[] = {
-    DEFINE_PROP_LINK("memdev", CXLType3Dev, hostmem, TYPE_MEMORY_BACKEND,
-                     HostMemoryBackend *),
-    DEFINE_PROP_LINK("lsa", CXLType3Dev, lsa, TYPE_MEMORY_BACKEND,
-                     HostMemoryBackend *),
-    DEFINE_PROP_UINT64("sn", CXLType3Dev, sn, UI64_NULL),
-    DEFINE_PROP_STRING("cdat", CXLType3Dev, cxl_cstate.cdat.filename),
-    DEFINE_PROP_END_OF_LIST(),
-};
+static void ct3_poison_remove(CXLType3Dev *ct3d, IntervalTreeNode *node)
+{
+    interval_tree_remove(node, &ct3d->poison_tree);
+    ct3d->poison_count--;
+    g_free(container_of(node, CXLPoison, node));
+}
 
-static uint64_t get_lsa_size(CXLType3Dev *ct3d)
+/* Unpoison [start, last], keeping any poison around it */
+static bool ct3_poison_punch(CXLType3Dev *ct3d, uint64_t start, uint64_t last)
 {
-    MemoryRegion *mr;
+    IntervalTreeNode *node;
+    bool found = false;
 
-    mr = host_memory_backend_get_memory(ct3d->lsa);
-    return memory_region_size(mr);
+    while ((node = interval_tree_iter_first(&ct3d->poison_tree, start,
+                                            last))) {
+        uint64_t node_start = node->start, node_last = node->last;
+        uint8_t type = container_of(node, CXLPoison, node)->type;
+
+        ct3_poison_remove(ct3d, node);
+        if (node_start < start) {
+            ct3_poison_insert(ct3d, node_start, start - 1, type);
+        }
+        if (node_last > last) {
+            ct3_poison_insert(ct3d, last + 1, node_last, type);
+        }
+        found = true;
+    }
+
+    return found;
 }
 
-static void validate_lsa_access(MemoryRegion *mr, uint64_t size,
-                                uint64_t offset)
+/* Note that poison was lost, to be reported by Get Poison List */
+static void ct3_poison_set_overflow(CXLType3Dev *ct3d)
 {
-    assert(offset + size <= memory_region_size(mr));
-    assert(offset + size > offset);
+    if (!ct3d->poison_overflowed) {
+        ct3d->poison_overflowed = true;
+        ct3d->poison_overflow_ts = cxl_device_get_timestamp(&ct3d->cxl_dstate);
+    }
 }
 
-static uint64_t get_lsa(CXLType3Dev *ct3d, void *buf, uint64_t size,
-                    uint64_t offset)
-{
+/*
+ * How many records poisoning [start, last] with @type adds to the list, see
+ * cxl_type3_poison_add().  The records it overlaps go, but the ends of those
+ * it overlaps partly stay unless they have its type, and it is merged with
+ * adjacent records of its type.
+ */
+static int ct3_poison_add_delta(CXLType3Dev *ct3d, uint64_t start,
+                                uint64_t last, uint8_t type)
+{
+    IntervalTreeNode *node, *first = NULL, *end = NULL;
+    int delta = 1;
+
+    /* Records do not overlap, so they come in order */
+    for (node = interval_tree_iter_first(&ct3d->poison_tree, start, last);
+         node; node = interval_tree_iter_next(node, start, last)) {
+        first = first ?: node;
+        end = node;
+        delta--;
+    }
+
+    if (first && first->start < start) {
+        delta += container_of(first, CXLPoison, node)->type != type;
+    } else if (start &&
+               (node = interval_tree_iter_first(&ct3d->poison_tree, start - 1,
+                                                start - 1)) &&
+               container_of(node, CXLPoison, node)->type == type) {
+        delta--;
+    }
+
+    if (end && end->last > last) {
+        delta += container_of(end, CXLPoison, node)->type != type;
+    } else if (last != UINT64_MAX &&
+               (node = interval_tree_iter_first(&ct3d->poison_tree, last + 1,
+                                                last + 1)) &&
+               container_of(node, CXLPoison, node)->type == type) {
+        delta--;
+    }
+
+    return delta;
+}
+
+/*
+ * Poison [dpa, dpa + len), replacing any poison of another type there and
+ * merging with adjacent poison of the same type.  Returns false if the
+ * poison list would not hold the result.
+ */
+bool cxl_type3_poison_add(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len,
+                          uint8_t type)
+{
+    uint64_t start = dpa, last = dpa + len - 1;
+    bool covered = ct3_poison_pages_covered(ct3d, start, last);
+    IntervalTreeNode *node;
+
+    if ((int64_t)ct3d->poison_count +
+        ct3_poison_add_delta(ct3d, start, last, type) >
+        CXL_POISON_LIST_LIMIT) {
+        return false;
+    }
+
+    ct3_poison_punch(ct3d, start, last);
+
+    node = start ? interval_tree_iter_first(&ct3d->poison_tree, start - 1,
+                                            start - 1) : NULL;
+    if (node && container_of(node, CXLPoison, node)->type == type) {
+        start = node->start;
+        ct3_poison_remove(ct3d, node);
+    }
+    node = last != UINT64_MAX ?
+        interval_tree_iter_first(&ct3d->poison_tree, last + 1, last + 1) :
+        NULL;
+    if (node && container_of(node, CXLPoison, node)->type == type) {
+        last = node->last;
+        ct3_poison_remove(ct3d, node);
+    }
+    ct3_poison_insert(ct3d, start, last, type);
+
+    if (!covered) {
+        cxl_fmws_update_mmio();
+    }
+    return true;
+}
+
+/*
+ * Unpoison [dpa, dpa + len), first overwriting it with @data if given.
+ * Clearing the middle of a record splits it in two; if the list is full,
+ * the end of the record is lost instead, as an overflow.
+ */
+void cxl_type3_poison_clear(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len,
+                            const void *data)
+{
+    uint64_t last = dpa + len - 1;
+    IntervalTreeNode *node;
+
+    if (data) {
+        uint64_t as_offset = dpa;
+        AddressSpace *as = cxl_type3_dpa_to_as(ct3d, &as_offset, NULL);
+
+        if (as) {
+            address_space_write(as, as_offset, MEMTXATTRS_UNSPECIFIED, data,
+                                len);
+        }
+    }
+
+    node = interval_tree_iter_first(&ct3d->poison_tree, dpa, last);
+    if (node && node->start < dpa && node->last > last &&
+        ct3d->poison_count >= CXL_POISON_LIST_LIMIT) {
+        ct3_poison_set_overflow(ct3d);
+        last = node->last;
+    }
+
+    if (ct3_poison_punch(ct3d, dpa, last) &&
+        !ct3_poison_pages_covered(ct3d, dpa, last)) {
+        cxl_fmws_update_mmio();
+    }
+}
+
+/*
+ * Clamp *@run from @dpa to end before the first host page holding poison.
+ * If the page of @dpa holds poison, clamp it to the end of the page holding
+ * the end of that poison instead and return false.
+ */
+static bool ct3_poison_clamp_run(CXLType3Dev *ct3d, uint64_t dpa,
+                                 uint64_t *run)
+{
+    uint64_t page_size = qemu_real_host_page_size();
+    IntervalTreeNode *node;
+    uint64_t start;
+
+    if (interval_tree_is_empty(&ct3d->poison_tree)) {
+        return true;
+    }
+
+    node = interval_tree_iter_first(&ct3d->poison_tree,
+                                    QEMU_ALIGN_DOWN(dpa, page_size),
+                                    dpa + (run ? *run : 1) - 1);
+    if (!node) {
+        return true;
+    }
+
+    start = QEMU_ALIGN_DOWN(node->start, page_size);
+    if (start <= dpa) {
+        if (run) {
+            *run = MIN(*run, QEMU_ALIGN_UP(node->last + 1, page_size) - dpa);
+        }
+        return false;
+    }
+
+    *run = start - dpa;
+    return true;
+}
+
+/*
+ * Dynamic capacity is tracked in blocks, and the regions are contiguous, so
+ * one bitmap covers all of them.
+ */
+static bool ct3_dc_blocks(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len,
+                          uint64_t *first, uint64_t *nr)
+{
+    uint64_t dc_base = ct3d->dc.regions[0].base;
+
+    if (!ct3d->dc.num_regions || dpa < dc_base || !len ||
+        dpa - dc_base >= ct3d->dc.total_capacity ||
+        len > ct3d->dc.total_capacity - (dpa - dc_base)) {
+        return false;
+    }
+
+    *first = (dpa - dc_base) / CXL_DC_BLOCK_SIZE;
+    *nr = DIV_ROUND_UP(dpa - dc_base + len, CXL_DC_BLOCK_SIZE) - *first;
+    return true;
+}
+
+CXLDCRegion *cxl_type3_dc_find_region(CXLType3Dev *ct3d, uint64_t dpa,
+                                      uint64_t len)
+{
+    int i;
+
+    for (i = 0; i < ct3d->dc.num_regions; i++) {
+        CXLDCRegion *region = &ct3d->dc.regions[i];
+
+        if (len && dpa >= region->base && dpa - region->base < region->len &&
+            len <= region->len - (dpa - region->base)) {
+            return region;
+        }
+    }
+
+    return NULL;
+}
+
+/* Whether all of [dpa, dpa + len) is dynamic capacity the host accepted */
+bool cxl_type3_dc_backed(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len)
+{
+    uint64_t first, nr;
+
+    if (!ct3_dc_blocks(ct3d, dpa, len, &first, &nr)) {
+        return false;
+    }
+
+    return find_next_zero_bit(ct3d->dc.blk_bitmap, first + nr, first) ==
+           first + nr;
+}
+
+/* Whether [dpa, dpa + len) lies within one extent offered to the host */
+bool cxl_type3_dc_pending(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len)
+{
+    CXLDCExtent *ent;
+
+    QTAILQ_FOREACH(ent, &ct3d->dc.pending, node) {
+        if (dpa >= ent->start_dpa && dpa - ent->start_dpa < ent->len &&
+            len <= ent->len - (dpa - ent->start_dpa)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ct3_dc_overlaps(CXLDCExtentList *list, uint64_t dpa, uint64_t len)
+{
+    CXLDCExtent *ent;
+
+    QTAILQ_FOREACH(ent, list, node) {
+        if (ranges_overlap(ent->start_dpa, ent->len, dpa, len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static CXLDCExtent *ct3_dc_extent_new(uint64_t dpa, uint64_t len)
+{
+    CXLDCExtent *ent = g_new0(CXLDCExtent, 1);
+
+    ent->start_dpa = dpa;
+    ent->len = len;
+    return ent;
+}
+
+void cxl_type3_dc_clear_pending(CXLType3Dev *ct3d)
+{
+    CXLDCExtent *ent, *next;
+
+    QTAILQ_FOREACH_SAFE(ent, &ct3d->dc.pending, node, next) {
+        QTAILQ_REMOVE(&ct3d->dc.pending, ent, node);
+        g_free(ent);
+    }
+    ct3d->dc.pending_count = 0;
+}
+
+/* Back [dpa, dpa + len) of a pending extent, which the host accepted */
+void cxl_type3_dc_accept(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len)
+{
+    uint64_t first, nr;
+
+    if (!ct3_dc_blocks(ct3d, dpa, len, &first, &nr)) {
+        return;
+    }
+
+    QTAILQ_INSERT_TAIL(&ct3d->dc.extents, ct3_dc_extent_new(dpa, len), node);
+    ct3d->dc.extent_count++;
+    ct3d->dc.ext_list_gen++;
+    bitmap_set(ct3d->dc.blk_bitmap, first, nr);
+
+    /* Map the new capacity straight into the guest */
+    cxl_fmws_update_mmio();
+}
+
+/*
+ * Release accepted capacity [dpa, dpa + len), splitting any extent it only
+ * covers part of.  The backing memory is given back to the host, so reads
+ * of the capacity return zeroes if it is accepted again.
+ */
+void cxl_type3_dc_release(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len)
+{
+    MemoryRegion *dc_mr = host_memory_backend_get_memory(ct3d->host_dc);
+    uint64_t last = dpa + len - 1;
+    CXLDCExtent *ent, *next;
+    uint64_t first, nr;
+
+    if (!ct3_dc_blocks(ct3d, dpa, len, &first, &nr)) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(ent, &ct3d->dc.extents, node, next) {
+        uint64_t ent_last = ent->start_dpa + ent->len - 1;
+
+        if (!ranges_overlap(ent->start_dpa, ent->len, dpa, len)) {
+            continue;
+        }
+
+        if (ent->start_dpa < dpa) {
+            QTAILQ_INSERT_BEFORE(ent, ct3_dc_extent_new(ent->start_dpa,
+                                                        dpa - ent->start_dpa),
+                                 node);
+            ct3d->dc.extent_count++;
+        }
+        if (ent_last > last) {
+            QTAILQ_INSERT_BEFORE(ent, ct3_dc_extent_new(last + 1,
+                                                        ent_last - last),
+                                 node);
+            ct3d->dc.extent_count++;
+        }
+        QTAILQ_REMOVE(&ct3d->dc.extents, ent, node);
+        ct3d->dc.extent_count--;
+        g_free(ent);
+    }
+    ct3d->dc.ext_list_gen++;
+    bitmap_clear(ct3d->dc.blk_bitmap, first, nr);
+
+    /* Unmap it before the memory goes */
+    cxl_fmws_update_mmio();
+    ram_block_discard_range(dc_mr->ram_block,
+                            dpa - ct3d->dc.regions[0].base, len);
+    memory_region_set_dirty(dc_mr, dpa - ct3d->dc.regions[0].base, len);
+}
+
+/*
+ * Clamp *@run from @dpa to the end of the accepted capacity at @dpa.  If
+ * @dpa is dynamic capacity that is not accepted, clamp it to the next
+ * accepted block instead and return false.
+ */
+static bool ct3_dc_clamp_run(CXLType3Dev *ct3d, uint64_t dpa, uint64_t *run)
+{
+    uint64_t nbits = ct3d->dc.total_capacity / CXL_DC_BLOCK_SIZE;
+    uint64_t first, nr, next;
+
+    if (!ct3_dc_blocks(ct3d, dpa, 1, &first, &nr)) {
+        return true;
+    }
+
+    if (test_bit(first, ct3d->dc.blk_bitmap)) {
+        next = find_next_zero_bit(ct3d->dc.blk_bitmap, nbits, first);
+    } else {
+        next = find_next_bit(ct3d->dc.blk_bitmap, nbits, first);
+    }
+    *run = MIN(*run, ct3d->dc.regions[0].base + next * CXL_DC_BLOCK_SIZE -
+                     dpa);
+
+    return test_bit(first, ct3d->dc.blk_bitmap);
+}
+
+/*
+ * Translate @host_addr to a DPA backed by one of the memory backends.  If
+ * @run is non NULL it is clamped to the number of bytes that follow
+ * contiguously in DPA space within the same backend or, on failure, to the
+ * bytes that remain undecoded by this device if that is known.
+ */
+bool cxl_type3_hpa_to_dpa(PCIDevice *d, hwaddr host_addr, uint64_t *dpa,
+                          uint64_t *run)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    CXLDeviceState *cxl_dstate = &ct3d->cxl_dstate;
+    const CXLHDMDecoder *decoder;
+    uint64_t end;
+
+    decoder = cxl_hdm_find_decoder(&ct3d->cxl_cstate, host_addr, run);
+    if (!decoder) {
+        return false;
+    }
+
+    *dpa = cxl_hdm_decoder_dpa(decoder, host_addr);
+    if (*dpa < cxl_dstate->vmem_size) {
+        end = cxl_dstate->vmem_size;
+    } else if (*dpa < cxl_dstate->mem_size) {
+        end = cxl_dstate->mem_size;
+    } else if (ct3d->dc.num_regions && *dpa >= ct3d->dc.regions[0].base &&
+               *dpa - ct3d->dc.regions[0].base < ct3d->dc.total_capacity) {
+        end = ct3d->dc.regions[0].base + ct3d->dc.total_capacity;
+    } else {
+        return false;
+    }
+
+    if (run) {
+        if (decoder->iw) {
+            /* Next granule belongs to another device */
+            uint64_t gran = cxl_decode_ig(decoder->ig);
+
+            *run = MIN(*run, gran - (host_addr - decoder->base) % gran);
+        }
+        *run = MIN(*run, end - *dpa);
+    }
+
+    return true;
+}
+
+/*
+ * Resolve @host_addr for mapping straight onto the backend.  On success the
+ * backing region is returned, @mr_offset is the offset within it and @run is
+ * clamped as for cxl_type3_hpa_to_dpa() and to exclude host pages that
+ * hold poison and dynamic capacity that is not accepted.  Accesses to such
+ * a mapping cannot be timed or checked for poison, so there is none with
+ * the timing model enabled.
+ */
+MemoryRegion *cxl_type3_hpa_to_mr(PCIDevice *d, hwaddr host_addr,
+                                  uint64_t *mr_offset, uint64_t *run)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    MemoryRegion *mr = NULL;
+
+    if (ct3d->timing_model) {
+        return NULL;
+    }
+
+    if (!cxl_type3_hpa_to_dpa(d, host_addr, mr_offset, run) ||
+        !ct3_poison_clamp_run(ct3d, *mr_offset, run) ||
+        !ct3_dc_clamp_run(ct3d, *mr_offset, run) ||
+        !cxl_type3_dpa_to_as(ct3d, mr_offset, &mr)) {
+        return NULL;
+    }
+
+    return mr;
+}
+
+/*
+ * Up to this much link time may be saved up while the link is idle, so that
+ * short bursts go at full speed.
+ */
+#define CXL_TIMING_BURST_NS 1000
+/* Sleep rather than spin for delays longer than this */
+#define CXL_TIMING_SPIN_NS (50 * SCALE_US)
+
+/*
+ * Take the link for an access of @size bytes as described for CXLTiming,
+ * and return when the access completes.  Accesses are serialized by the
+ * BQL, so are the updates of @timing.
+ */
+static int64_t ct3_timing_deadline(CXLTiming *timing, unsigned size)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t xfer;
+
+    /* 1 MB/s moves a byte per us */
+    xfer = timing->link_carry + size * 1000000ULL / timing->bandwidth;
+    timing->link_carry = xfer % 1000;
+    timing->link_free = MAX(timing->link_free, now - CXL_TIMING_BURST_NS) +
+                        xfer / 1000;
+    return MAX(timing->link_free, now) + timing->latency;
+}
+
+/*
+ * Hold the access up until @deadline.  A vCPU waits without the BQL, so
+ * that only the vCPU that made the access is delayed, and not the other
+ * vCPUs and the main loop.  Nothing of the device is touched after that,
+ * the access itself is done by then.
+ */
+static void ct3_timing_wait(int64_t deadline)
+{
+    bool unlock = current_cpu && qemu_mutex_iothread_locked();
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (now >= deadline) {
+        return;
+    }
+
+    if (unlock) {
+        qemu_mutex_unlock_iothread();
+    }
+    while (now < deadline) {
+        if (deadline - now > CXL_TIMING_SPIN_NS) {
+            g_usleep((deadline - now - CXL_TIMING_SPIN_NS) / SCALE_US);
+        } else {
+            cpu_relax();
+        }
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+    if (unlock) {
+        qemu_mutex_lock_iothread();
+    }
+}
+
+static void ct3_stats_account_one(CXLType3Stats *stats, unsigned size,
+                                  bool is_write, bool ok)
+{
+    if (!ok) {
+        stats->errors++;
+    } else if (is_write) {
+        stats->writes++;
+        stats->write_bytes += size;
+    } else {
+        stats->reads++;
+        stats->read_bytes += size;
+    }
+}
+
+/*
+ * Emulated accesses are all made with the BQL held, even those from other
+ * threads, so plain counters will do.  Accesses are accounted to the decoder
+ * that maps their DPA, if any, so those no decoder maps only count for the
+ * device as a whole.
+ */
+static void ct3_stats_account(CXLType3Dev *ct3d, uint64_t dpa, unsigned size,
+                              bool is_write, bool ok)
+{
+    const CXLHDMDecoder *decoder;
+
+    ct3_stats_account_one(&ct3d->stats, size, is_write, ok);
+
+    decoder = cxl_hdm_find_decoder_by_dpa(&ct3d->cxl_cstate, dpa);
+    if (decoder) {
+        ct3_stats_account_one(&ct3d->decoder_stats[decoder->index], size,
+                              is_write, ok);
+    }
+}
+
+/*
+ * Accesses by DPA for callers that already routed and translated the host
+ * address, e.g. through the route cache of a fixed memory window.
+ */
+MemTxResult cxl_type3_read_dpa(PCIDevice *d, uint64_t dpa, uint64_t *data,
+                               unsigned size, MemTxAttrs attrs)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    uint64_t as_offset = dpa;
+    int64_t deadline = 0;
+    AddressSpace *as;
+    MemTxResult res;
+
+    as = cxl_type3_dpa_to_as(ct3d, &as_offset, NULL);
+    if (!as || cxl_type3_poisoned(ct3d, dpa, size) ||
+        (as == &ct3d->host_dc_as && !cxl_type3_dc_backed(ct3d, dpa, size))) {
+        ct3_stats_account(ct3d, dpa, size, false, false);
+        return MEMTX_ERROR;
+    }
+
+    if (ct3d->timing_model) {
+        deadline = ct3_timing_deadline(&ct3d->read_timing, size);
+    }
+
+    res = address_space_read(as, as_offset, attrs, data, size);
+    ct3_stats_account(ct3d, dpa, size, false, res == MEMTX_OK);
+    ct3_timing_wait(deadline);
+    return res;
+}
+
+MemTxResult cxl_type3_write_dpa(PCIDevice *d, uint64_t dpa, uint64_t data,
+                                unsigned size, MemTxAttrs attrs)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    uint64_t as_offset = dpa;
+    int64_t deadline = 0;
+    AddressSpace *as;
+    MemTxResult res;
+
+    as = cxl_type3_dpa_to_as(ct3d, &as_offset, NULL);
+    if (!as ||
+        (as == &ct3d->host_dc_as && !cxl_type3_dc_backed(ct3d, dpa, size))) {
+        ct3_stats_account(ct3d, dpa, size, true, false);
+        return MEMTX_OK;
+    }
+
+    if (ct3d->timing_model) {
+        deadline = ct3_timing_deadline(&ct3d->write_timing, size);
+    }
+
+    res = address_space_write(as, as_offset, attrs, &data, size);
+    ct3_stats_account(ct3d, dpa, size, true, res == MEMTX_OK);
+    ct3_timing_wait(deadline);
+    return res;
+}
+
+MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
+                           unsigned size, MemTxAttrs attrs)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    uint64_t dpa_offset;
+
+    /* No decoder maps @host_addr to account it to */
+    if (!cxl_type3_dpa(ct3d, host_addr, &dpa_offset)) {
+        ct3_stats_account_one(&ct3d->stats, size, false, false);
+        return MEMTX_ERROR;
+    }
+
+    return cxl_type3_read_dpa(d, dpa_offset, data, size, attrs);
+}
+
+MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
+                            unsigned size, MemTxAttrs attrs)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(d);
+    uint64_t dpa_offset;
+
+    if (!cxl_type3_dpa(ct3d, host_addr, &dpa_offset)) {
+        ct3_stats_account_one(&ct3d->stats, size, true, false);
+        return MEMTX_OK;
+    }
+
+    return cxl_type3_write_dpa(d, dpa_offset, data, size, attrs);
+}
+
+static void ct3d_reset(DeviceState *dev)
+{
+    CXLType3Dev *ct3d = CXL_TYPE3(dev);
+    uint32_t *reg_state = ct3d->cxl_cstate.crb.cache_mem_registers;
+    uint32_t *write_msk = ct3d->cxl_cstate.crb.cache_mem_regs_write_mask;
+
+    cxl_component_register_init_common(reg_state, write_msk, CXL2_TYPE3_DEVICE);
+    cxl_device_register_init_common(&ct3d->cxl_dstate);
+}
+
+/* Labels reach the LSA backend of the source before it is handed over */
+static int ct3d_pre_save(void *opaque)
+{
+    CXLType3Dev *ct3d = opaque;
+
+    if (ct3d->lsa_dirty) {
+        timer_del(ct3d->lsa_flush_timer);
+        ct3_lsa_flush(ct3d);
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_cxl_error = {
+    .name = "cxl-type3/error",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(type, CXLError),
+        VMSTATE_UINT32_ARRAY(header, CXLError, 32),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool ct3d_poison_needed(void *opaque)
+{
+    CXLType3Dev *ct3d = opaque;
+
+    return ct3d->poison_count || ct3d->poison_overflowed;
+}
+
+static int ct3d_poison_pre_save(void *opaque)
+{
+    CXLType3Dev *ct3d = opaque;
+    IntervalTreeNode *node;
+    int32_t i = 0;
+
+    ct3d->poison_mig = g_new(CXLPoisonRecord, ct3d->poison_count);
+    for (node = interval_tree_iter_first(&ct3d->poison_tree, 0, UINT64_MAX);
+         node; node = interval_tree_iter_next(node, 0, UINT64_MAX)) {
+        CXLPoisonRecord *rec = &ct3d->poison_mig[i++];
+
+        rec->start = node->start;
+        rec->last = node->last;
+        rec->type = container_of(node, CXLPoison, node)->type;
+    }
+    ct3d->poison_mig_count = i;
+
+    return 0;
+}
+
+static int ct3d_poison_post_save(void *opaque)
+{
+    CXLType3Dev *ct3d = opaque;
+
+    g_free(ct3d->poison_mig);
+    ct3d->poison_mig = NULL;
+
+    return 0;
+}
+
+static int ct3d_poison_post_load(void *opaque, int version_id)
+{
+    CXLType3Dev *ct3d = opaque;
+    int32_t i;
+
+    for (i = 0; i < ct3d->poison_mig_count; i++) {
+        CXLPoisonRecord *rec = &ct3d->poison_mig[i];
+
+        ct3_poison_insert(ct3d, rec->start, rec->last, rec->type);
+    }
+    g_free(ct3d->poison_mig);
+    ct3d->poison_mig = NULL;
+
+    /* Punch the poisoned pages out of the direct mappings */
+    cxl_fmws_update_mmio();
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_cxl_poison_record = {
+    .name = "cxl-type3/poison-record",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(start, CXLPoisonRecord),
+        VMSTATE_UINT64(last, CXLPoisonRecord),
+        VMSTATE_UINT8(type, CXLPoisonRecord),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ct3d_poison = {
+    .name = "cxl-type3/poison",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ct3d_poison_needed,
+    .pre_save = ct3d_poison_pre_save,
+    .post_save = ct3d_poison_post_save,
+    .post_load = ct3d_poison_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(poison_mig_count, CXLType3Dev),
+        VMSTATE_STRUCT_VARRAY_ALLOC(poison_mig, CXLType3Dev, poison_mig_count,
+                                    0, vmstate_cxl_poison_record,
+                                    CXLPoisonRecord),
+        VMSTATE_BOOL(poison_overflowed, CXLType3Dev),
+        VMSTATE_UINT64(poison_overflow_ts, CXLType3Dev),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool ct3d_dc_needed(void *opaque)
+{
+    CXLType3Dev *ct3d = opaque;
+
+    return ct3d->dc.num_regions;
+}
+
+/* The block bitmap and mappings follow from the accepted extents */
+static int ct3d_dc_post_load(void *opaque, int version_id)
+{
+    CXLType3Dev *ct3d = opaque;
+    uint64_t nbits = ct3d->dc.total_capacity / CXL_DC_BLOCK_SIZE;
+    CXLDCExtent *ent;
+    uint64_t first, nr;
+
+    bitmap_zero(ct3d->dc.blk_bitmap, nbits);
+    QTAILQ_FOREACH(ent, &ct3d->dc.extents, node) {
+        if (!ct3_dc_blocks(ct3d, ent->start_dpa, ent->len, &first, &nr)) {
+            return -EINVAL;
+        }
+        bitmap_set(ct3d->dc.blk_bitmap, first, nr);
+    }
+    cxl_fmws_update_mmio();
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_cxl_dc_extent = {
+    .name = "cxl-type3/dc-extent",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT64(start_dpa, CXLDCExtent),
+        VMSTATE_UINT64(len, CXLDCExtent),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ct3d_dc = {
+    .name = "cxl-type3/dc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ct3d_dc_needed,
+    .post_load = ct3d_dc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_QTAILQ_V(dc.extents, CXLType3Dev, 1, vmstate_cxl_dc_extent,
+                         CXLDCExtent, node),
+        VMSTATE_UINT32(dc.extent_count, CXLType3Dev),
+        VMSTATE_UINT32(dc.ext_list_gen, CXLType3Dev),
+        VMSTATE_QTAILQ_V(dc.pending, CXLType3Dev, 1, vmstate_cxl_dc_extent,
+                         CXLDCExtent, node),
+        VMSTATE_UINT32(dc.pending_count, CXLType3Dev),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+const VMStateDescription vmstate_ct3d = {
+    .name = "cxl-type3",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .pre_save = ct3d_pre_save,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj, CXLType3Dev),
+        VMSTATE_STRUCT(parent_obj.exp.aer_log, CXLType3Dev, 0,
+                       vmstate_pcie_aer_log, PCIEAERLog),
+        VMSTATE_MSIX(parent_obj, CXLType3Dev),
+        VMSTATE_STRUCT(cxl_cstate, CXLType3Dev, 0, vmstate_cxl_component,
+                       CXLComponentState),
+        VMSTATE_STRUCT(cxl_dstate, CXLType3Dev, 0, vmstate_cxl_device,
+                       CXLDeviceState),
+        VMSTATE_QTAILQ_V(error_list, CXLType3Dev, 1, vmstate_cxl_error,
+                         CXLError, node),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_ct3d_poison,
+        &vmstate_ct3d_dc,
+        NULL
+    }
+};
+
+static Property ct3_props[] = {
+    DEFINE_PROP_LINK("memdev", CXLType3Dev, hostmem, TYPE_MEMORY_BACKEND,
+                     HostMemoryBackend *), /* for backward compatibility */
+    DEFINE_PROP_LINK("persistent-memdev", CXLType3Dev, hostpmem,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_LINK("volatile-memdev", CXLType3Dev, hostvmem,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_LINK("lsa", CXLType3Dev, lsa, TYPE_MEMORY_BACKEND,
+                     HostMemoryBackend *),
+    DEFINE_PROP_LINK("volatile-dc-memdev", CXLType3Dev, host_dc,
+                     TYPE_MEMORY_BACKEND, HostMemoryBackend *),
+    DEFINE_PROP_UINT8("num-dc-regions", CXLType3Dev, dc.num_regions, 0),
+    DEFINE_PROP_UINT64("sn", CXLType3Dev, sn, UI64_NULL),
+    DEFINE_PROP_BOOL("shared", CXLType3Dev, shared, false),
+    DEFINE_PROP_BOOL("timing-model", CXLType3Dev, timing_model, false),
+    DEFINE_PROP_UINT64("read-latency", CXLType3Dev, read_timing.latency, 150),
+    DEFINE_PROP_UINT64("write-latency", CXLType3Dev, write_timing.latency,
+                       250),
+    DEFINE_PROP_UINT64("read-bandwidth", CXLType3Dev, read_timing.bandwidth,
+                       16000),
+    DEFINE_PROP_UINT64("write-bandwidth", CXLType3Dev, write_timing.bandwidth,
+                       16000),
+    DEFINE_PROP_STRING("cdat", CXLType3Dev, cxl_cstate.cdat.filename),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static uint64_t get_lsa_size(CXLType3Dev *ct3d)
+{
+    MemoryRegion *mr;
+
+    if (!ct3d->lsa) {
+        return 0;
+    }
+
+    mr = host_memory_backend_get_memory(ct3d->lsa);
+    return memory_region_size(mr);
+}
+
+static void validate_lsa_access(MemoryRegion *mr, uint64_t size,
+                                uint64_t offset)
+{
+    assert(offset + size <= memory_region_size(mr));
+    assert(offset + size > offset);
+}
+
+static uint64_t get_lsa(CXLType3Dev *ct3d, void *buf, uint64_t size,
+                    uint64_t offset)
+{
     MemoryRegion *mr;
     void *lsa;
 
+    if (!ct3d->lsa) {
+        return 0;
+    }
+
     mr = host_memory_backend_get_memory(ct3d->lsa);
     validate_lsa_access(mr, size, offset);
 
@@ -758,6 +2064,10 @@ static void set_lsa(CXLType3Dev *ct3d, const void *buf, uint64_t size,
     MemoryRegion *mr;
     void *lsa;
 
+    if (!ct3d->lsa) {
+        return;
+    }
+
     mr = host_memory_backend_get_memory(ct3d->lsa);
     validate_lsa_access(mr, size, offset);
 
@@ -765,10 +2075,17 @@ static void set_lsa(CXLType3Dev *ct3d, const void *buf, uint64_t size,
     memcpy(lsa, buf, size);
     memory_region_set_dirty(mr, offset, size);
 
-    /*
-     * Just like the PMEM, if the guest is not allowed to exit gracefully, label
-     * updates will get lost.
-     */
+    if (!size) {
+        return;
+    }
+    bitmap_set(ct3d->lsa_dirty, offset / CXL_LSA_DIRTY_GRANULE,
+               DIV_ROUND_UP(offset + size, CXL_LSA_DIRTY_GRANULE) -
+               offset / CXL_LSA_DIRTY_GRANULE);
+    if (!timer_pending(ct3d->lsa_flush_timer)) {
+        timer_mod(ct3d->lsa_flush_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  CXL_LSA_FLUSH_DELAY_MS);
+    }
 }
 
 /* For uncorrectable errors include support for multiple header recording */
@@ -912,6 +2229,409 @@ void qmp_cxl_inject_correctable_error(const char *path, CxlCorErrorType type,
     pcie_aer_inject_error(PCI_DEVICE(obj), &err);
 }
 
+/*
+ * Poison found by the device itself, so when the poison list is full it is
+ * dropped and the list marked as overflowed.
+ */
+void qmp_cxl_inject_poison(const char *path, uint64_t start, uint64_t length,
+                           Error **errp)
+{
+    Object *obj = object_resolve_path(path, NULL);
+    CXLType3Dev *ct3d;
+
+    if (!obj) {
+        error_setg(errp, "Unable to resolve path");
+        return;
+    }
+    if (!object_dynamic_cast(obj, TYPE_CXL_TYPE3)) {
+        error_setg(errp, "Path does not point to a CXL type 3 device");
+        return;
+    }
+    if (!length || !QEMU_IS_ALIGNED(start | length, CXL_POISON_GRANULE)) {
+        error_setg(errp, "Poison must be a non-empty range aligned to %d "
+                   "bytes", CXL_POISON_GRANULE);
+        return;
+    }
+
+    ct3d = CXL_TYPE3(obj);
+    if (start >= ct3d->cxl_dstate.mem_size ||
+        length > ct3d->cxl_dstate.mem_size - start) {
+        error_setg(errp, "Poison must be within the device capacity");
+        return;
+    }
+
+    if (!cxl_type3_poison_add(ct3d, start, length,
+                              CXL_POISON_TYPE_INTERNAL)) {
+        ct3_poison_set_overflow(ct3d);
+    }
+}
+
+static const CXLEventLogType ct3_qmp_event_logs[CXL_EVENT_LOG__MAX] = {
+    [CXL_EVENT_LOG_INFORMATIONAL] = CXL_EVENT_TYPE_INFO,
+    [CXL_EVENT_LOG_WARNING] = CXL_EVENT_TYPE_WARN,
+    [CXL_EVENT_LOG_FAILURE] = CXL_EVENT_TYPE_FAIL,
+    [CXL_EVENT_LOG_FATAL] = CXL_EVENT_TYPE_FATAL,
+};
+
+/*
+ * All the records are added before the host is told about them, so that a
+ * batch raises a single interrupt however many records it holds.
+ */
+void qmp_cxl_inject_general_media_events(const char *path, CxlEventLog log,
+                                         CXLGeneralMediaEventList *records,
+                                         Error **errp)
+{
+    /* CXL 3.0 Table 8-43 */
+    static const QemuUUID gen_media_uuid = {
+        .data = UUID(0xfbcd0a77, 0xc260, 0x417f, 0x85, 0xa9,
+                     0x08, 0x8b, 0x16, 0x21, 0xeb, 0xa6),
+    };
+    Object *obj = object_resolve_path(path, NULL);
+    CXLEventLogType log_type = ct3_qmp_event_logs[log];
+    CXLGeneralMediaEventList *list;
+    CXLType3Dev *ct3d;
+
+    if (!obj) {
+        error_setg(errp, "Unable to resolve path");
+        return;
+    }
+    if (!object_dynamic_cast(obj, TYPE_CXL_TYPE3)) {
+        error_setg(errp, "Path does not point to a CXL type 3 device");
+        return;
+    }
+    ct3d = CXL_TYPE3(obj);
+
+    for (list = records; list; list = list->next) {
+        CXLGeneralMediaEvent *rec = list->value;
+        CXLEventGenMedia gem = {
+            .descriptor = rec->descriptor,
+            .type = rec->type,
+            .transaction_type = rec->transaction_type,
+        };
+        uint16_t valid = 0;
+
+        QEMU_BUILD_BUG_ON(sizeof(gem) != CXL_EVENT_RECORD_SIZE);
+
+        gem.hdr.id = gen_media_uuid;
+        gem.hdr.length = sizeof(gem);
+        /* Event Record Severity matches the log */
+        gem.hdr.flags[0] = log_type;
+        stq_le_p(&gem.phys_addr, rec->dpa);
+        if (rec->has_channel) {
+            gem.channel = rec->channel;
+            valid |= CXL_GMER_VALID_CHANNEL;
+        }
+        if (rec->has_rank) {
+            gem.rank = rec->rank;
+            valid |= CXL_GMER_VALID_RANK;
+        }
+        stw_le_p(&gem.validity_flags, valid);
+
+        cxl_event_insert(&ct3d->cxl_dstate, log_type,
+                         (CXLEventRecordRaw *)&gem);
+    }
+    cxl_event_irq(&ct3d->cxl_dstate, log_type);
+}
+
+/*
+ * Announce [dpa, dpa + len) to the host with a Dynamic Capacity event
+ * record.  The last record of an operation has the More flag clear.
+ */
+static void ct3_dc_event(CXLType3Dev *ct3d, uint8_t type, uint8_t region_id,
+                         uint64_t dpa, uint64_t len, bool more)
+{
+    /* CXL 3.0 Table 8-47 */
+    static const QemuUUID dc_event_uuid = {
+        .data = UUID(0xca95afa7, 0xf183, 0x4018, 0x8c, 0x2f,
+                     0x95, 0x26, 0x8e, 0x10, 0x1a, 0x2a),
+    };
+    CXLEventDynamicCapacity dc_event = {
+        .type = type,
+        .updated_region_id = region_id,
+        .flags = more ? CXL_DC_EVENT_FLAG_MORE : 0,
+    };
+
+    QEMU_BUILD_BUG_ON(sizeof(dc_event) != CXL_EVENT_RECORD_SIZE);
+
+    dc_event.hdr.id = dc_event_uuid;
+    dc_event.hdr.length = sizeof(dc_event);
+    stq_le_p(&dc_event.extent.start_dpa, dpa);
+    stq_le_p(&dc_event.extent.len, len);
+
+    cxl_event_insert(&ct3d->cxl_dstate, CXL_EVENT_TYPE_DYNAMIC_CAP,
+                     (CXLEventRecordRaw *)&dc_event);
+}
+
+/*
+ * Common checks of the QMP dynamic capacity commands.  Returns the region
+ * and the number of extents, which each have been checked to be in the
+ * region and aligned to its blocks.
+ */
+static CXLDCRegion *ct3_dc_qmp_check(const char *path, uint8_t region_id,
+                                     CXLDCExtentRecordList *extents,
+                                     CXLType3Dev **ct3d, uint32_t *count,
+                                     Error **errp)
+{
+    Object *obj = object_resolve_path(path, NULL);
+    CXLDCExtentRecordList *list;
+    CXLDCRegion *region;
+
+    if (!obj) {
+        error_setg(errp, "Unable to resolve path");
+        return NULL;
+    }
+    if (!object_dynamic_cast(obj, TYPE_CXL_TYPE3)) {
+        error_setg(errp, "Path does not point to a CXL type 3 device");
+        return NULL;
+    }
+
+    *ct3d = CXL_TYPE3(obj);
+    if (region_id >= (*ct3d)->dc.num_regions) {
+        error_setg(errp, "Region %u is not a dynamic capacity region",
+                   region_id);
+        return NULL;
+    }
+    region = &(*ct3d)->dc.regions[region_id];
+
+    *count = 0;
+    for (list = extents; list; list = list->next) {
+        uint64_t offset = list->value->offset, len = list->value->len;
+
+        if (!len || !QEMU_IS_ALIGNED(offset | len, region->block_size)) {
+            error_setg(errp, "Extents must be non-empty and aligned to %"
+                       PRIu64 " bytes", region->block_size);
+            return NULL;
+        }
+        if (offset >= region->len || len > region->len - offset) {
+            error_setg(errp, "Extents must be within the region");
+            return NULL;
+        }
+        (*count)++;
+    }
+
+    if (!*count) {
+        error_setg(errp, "No extents given");
+        return NULL;
+    }
+    if (*count > cxl_event_log_free_space(&(*ct3d)->cxl_dstate,
+                                          CXL_EVENT_TYPE_DYNAMIC_CAP)) {
+        error_setg(errp, "Not enough room in the dynamic capacity event log");
+        return NULL;
+    }
+
+    return region;
+}
+
+void qmp_cxl_add_dynamic_capacity(const char *path, uint8_t region_id,
+                                  CXLDCExtentRecordList *extents,
+                                  Error **errp)
+{
+    CXLDCExtentRecordList *list, *other;
+    CXLDCRegion *region;
+    CXLType3Dev *ct3d;
+    uint32_t count;
+
+    region = ct3_dc_qmp_check(path, region_id, extents, &ct3d, &count, errp);
+    if (!region) {
+        return;
+    }
+
+    if (ct3d->dc.extent_count + ct3d->dc.pending_count + count >
+        CXL_NUM_EXTENTS_SUPPORTED) {
+        error_setg(errp, "Too many extents, at most %d are supported",
+                   CXL_NUM_EXTENTS_SUPPORTED);
+        return;
+    }
+
+    for (list = extents; list; list = list->next) {
+        uint64_t dpa = region->base + list->value->offset;
+        uint64_t len = list->value->len;
+
+        if (ct3_dc_overlaps(&ct3d->dc.extents, dpa, len) ||
+            ct3_dc_overlaps(&ct3d->dc.pending, dpa, len)) {
+            error_setg(errp, "Extent at offset 0x%" PRIx64 " overlaps "
+                       "capacity already offered", list->value->offset);
+            return;
+        }
+        for (other = extents; other != list; other = other->next) {
+            if (ranges_overlap(other->value->offset, other->value->len,
+                               list->value->offset, len)) {
+                error_setg(errp, "Extents overlap each other");
+                return;
+            }
+        }
+    }
+
+    for (list = extents; list; list = list->next) {
+        uint64_t dpa = region->base + list->value->offset;
+        uint64_t len = list->value->len;
+
+        QTAILQ_INSERT_TAIL(&ct3d->dc.pending, ct3_dc_extent_new(dpa, len),
+                           node);
+        ct3d->dc.pending_count++;
+        ct3_dc_event(ct3d, CXL_DC_EVENT_ADD_CAPACITY, region_id, dpa, len,
+                     list->next);
+    }
+    cxl_event_irq(&ct3d->cxl_dstate, CXL_EVENT_TYPE_DYNAMIC_CAP);
+}
+
+void qmp_cxl_release_dynamic_capacity(const char *path, uint8_t region_id,
+                                      CXLDCExtentRecordList *extents,
+                                      Error **errp)
+{
+    CXLDCExtentRecordList *list;
+    CXLDCRegion *region;
+    CXLType3Dev *ct3d;
+    uint32_t count;
+
+    region = ct3_dc_qmp_check(path, region_id, extents, &ct3d, &count, errp);
+    if (!region) {
+        return;
+    }
+
+    for (list = extents; list; list = list->next) {
+        if (!cxl_type3_dc_backed(ct3d, region->base + list->value->offset,
+                                 list->value->len)) {
+            error_setg(errp, "Extent at offset 0x%" PRIx64 " is not "
+                       "accepted capacity", list->value->offset);
+            return;
+        }
+    }
+
+    for (list = extents; list; list = list->next) {
+        ct3_dc_event(ct3d, CXL_DC_EVENT_RELEASE_CAPACITY, region_id,
+                     region->base + list->value->offset, list->value->len,
+                     list->next);
+    }
+    cxl_event_irq(&ct3d->cxl_dstate, CXL_EVENT_TYPE_DYNAMIC_CAP);
+}
+
+static const struct {
+    const char *name;
+    size_t offset;
+    bool bytes;
+} ct3_stats_fields[] = {
+    { "reads", offsetof(CXLType3Stats, reads) },
+    { "writes", offsetof(CXLType3Stats, writes) },
+    { "read-bytes", offsetof(CXLType3Stats, read_bytes), true },
+    { "write-bytes", offsetof(CXLType3Stats, write_bytes), true },
+    { "errors", offsetof(CXLType3Stats, errors) },
+};
+
+/*
+ * Calls @fn for the name of each statistic, in the order they are reported,
+ * and the counter in @ct3d if given.  Per decoder statistics are prefixed
+ * with "decoder<n>-".
+ */
+static void ct3_stats_foreach(CXLType3Dev *ct3d,
+                              void (*fn)(const char *name, bool bytes,
+                                         uint64_t *val, void *opaque),
+                              void *opaque)
+{
+    int i, j;
+
+    for (i = 0; i < ARRAY_SIZE(ct3_stats_fields); i++) {
+        fn(ct3_stats_fields[i].name, ct3_stats_fields[i].bytes,
+           ct3d ? (void *)&ct3d->stats + ct3_stats_fields[i].offset : NULL,
+           opaque);
+    }
+
+    for (i = 0; i < CXL_HDM_DECODER_COUNT; i++) {
+        for (j = 0; j < ARRAY_SIZE(ct3_stats_fields); j++) {
+            g_autofree char *name =
+                g_strdup_printf("decoder%d-%s", i, ct3_stats_fields[j].name);
+
+            fn(name, ct3_stats_fields[j].bytes,
+               ct3d ? (void *)&ct3d->decoder_stats[i] +
+                      ct3_stats_fields[j].offset : NULL,
+               opaque);
+        }
+    }
+}
+
+typedef struct CT3StatsArgs {
+    StatsResultList **result;
+    strList *names;
+    StatsList *stats_list;
+} CT3StatsArgs;
+
+static void ct3_stats_add(const char *name, bool bytes, uint64_t *val,
+                          void *opaque)
+{
+    CT3StatsArgs *args = opaque;
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, args->names)) {
+        return;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = *val;
+    QAPI_LIST_PREPEND(args->stats_list, stats);
+}
+
+static int ct3_stats_query(Object *obj, void *opaque)
+{
+    CT3StatsArgs *args = opaque;
+    StatsResult *entry;
+
+    if (!object_dynamic_cast(obj, TYPE_CXL_TYPE3)) {
+        return 0;
+    }
+
+    args->stats_list = NULL;
+    ct3_stats_foreach(CXL_TYPE3(obj), ct3_stats_add, args);
+
+    entry = g_new0(StatsResult, 1);
+    entry->provider = STATS_PROVIDER_CXL;
+    entry->qom_path = object_get_canonical_path(obj);
+    entry->stats = args->stats_list;
+    QAPI_LIST_PREPEND(*args->result, entry);
+
+    return 0;
+}
+
+static void ct3_stats_cb(StatsResultList **result, StatsTarget target,
+                         strList *names, strList *targets, Error **errp)
+{
+    CT3StatsArgs args = {
+        .result = result,
+        .names = names,
+    };
+
+    if (target != STATS_TARGET_CXL) {
+        return;
+    }
+
+    object_child_foreach_recursive(object_get_root(), ct3_stats_query, &args);
+}
+
+static void ct3_schemas_add(const char *name, bool bytes, uint64_t *val,
+                            void *opaque)
+{
+    StatsSchemaValueList **list = opaque;
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = STATS_TYPE_CUMULATIVE;
+    if (bytes) {
+        value->has_unit = true;
+        value->unit = STATS_UNIT_BYTES;
+    }
+    QAPI_LIST_PREPEND(*list, value);
+}
+
+static void ct3_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+
+    ct3_stats_foreach(NULL, ct3_schemas_add, &stats_list);
+    add_stats_schema(result, STATS_PROVIDER_CXL, STATS_TARGET_CXL, stats_list);
+}
+
 static void ct3_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -931,6 +2651,7 @@ static void ct3_class_init(ObjectClass *oc, void *data)
     set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
     dc->desc = "CXL PMEM Device (Type 3)";
     dc->reset = ct3d_reset;
+    dc->vmsd = &vmstate_ct3d;
     device_class_set_props(dc, ct3_props);
 
     cvc->get_lsa_size = get_lsa_size;
@@ -954,6 +2675,7 @@ static const TypeInfo ct3d_info = {
 static void ct3d_registers(void)
 {
     type_register_static(&ct3d_info);
+    add_stats_callbacks(STATS_PROVIDER_CXL, ct3_stats_cb, ct3_schemas_cb);
 }
 
 type_init(ct3d_registers);
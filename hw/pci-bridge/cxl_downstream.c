@@ -13,6 +13,7 @@
 #include "hw/pci/msi.h"
 #include "hw/pci/pcie.h"
 #include "hw/pci/pcie_port.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 
 typedef struct CXLDownstreamPort {
@@ -212,6 +213,23 @@ static void cxl_dsp_exitfn(PCIDevice *d)
     pci_bridge_exitfn(d);
 }
 
+static const VMStateDescription vmstate_cxl_dsp = {
+    .name = "cxl-downstream-port",
+    .priority = MIG_PRI_PCI_BUS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = pcie_cap_slot_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj.parent_obj.parent_obj.parent_obj,
+                           CXLDownstreamPort),
+        VMSTATE_STRUCT(parent_obj.parent_obj.parent_obj.parent_obj.exp.aer_log,
+                       CXLDownstreamPort, 0, vmstate_pcie_aer_log, PCIEAERLog),
+        VMSTATE_STRUCT(cxl_cstate, CXLDownstreamPort, 0, vmstate_cxl_component,
+                       CXLComponentState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void cxl_dsp_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -226,6 +244,7 @@ static void cxl_dsp_class_init(ObjectClass *oc, void *data)
     set_bit(DEVICE_CATEGORY_BRIDGE, dc->categories);
     dc->desc = "CXL Switch Downstream Port";
     dc->reset = cxl_dsp_reset;
+    dc->vmsd = &vmstate_cxl_dsp;
 }
 
 static const TypeInfo cxl_dsp_info = {
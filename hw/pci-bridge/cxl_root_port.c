@@ -25,6 +25,7 @@
 #include "hw/pci/msi.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "hw/cxl/cxl.h"
 
@@ -258,6 +259,23 @@ static void cxl_rp_write_config(PCIDevice *d, uint32_t address, uint32_t val,
     cxl_rp_dvsec_write_config(d, address, val, len);
 }
 
+static const VMStateDescription vmstate_cxl_rp = {
+    .name = "cxl-root-port",
+    .priority = MIG_PRI_PCI_BUS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = pcie_cap_slot_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj.parent_obj.parent_obj.parent_obj,
+                           CXLRootPort),
+        VMSTATE_STRUCT(parent_obj.parent_obj.parent_obj.parent_obj.exp.aer_log,
+                       CXLRootPort, 0, vmstate_pcie_aer_log, PCIEAERLog),
+        VMSTATE_STRUCT(cxl_cstate, CXLRootPort, 0, vmstate_cxl_component,
+                       CXLComponentState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void cxl_root_port_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc        = DEVICE_CLASS(oc);
@@ -268,6 +286,7 @@ static void cxl_root_port_class_init(ObjectClass *oc, void *data)
     k->vendor_id = PCI_VENDOR_ID_INTEL;
     k->device_id = CXL_ROOT_PORT_DID;
     dc->desc     = "CXL Root Port";
+    dc->vmsd     = &vmstate_cxl_rp;
     k->revision  = 0;
     device_class_set_props(dc, gen_rp_props);
     k->config_write = cxl_rp_write_config;
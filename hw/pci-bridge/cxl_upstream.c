@@ -14,6 +14,7 @@
 #include "hw/pci/msi.h"
 #include "hw/pci/pcie.h"
 #include "hw/pci/pcie_port.h"
+#include "migration/vmstate.h"
 
 #define CXL_UPSTREAM_PORT_MSI_NR_VECTOR 2
 
@@ -138,46 +139,10 @@ static void build_dvsecs(CXLComponentState *cxl)
 
 static bool cxl_doe_cdat_rsp(DOECap *doe_cap)
 {
-    CDATObject *cdat = &CXL_USP(doe_cap->pdev)->cxl_cstate.cdat;
-    uint16_t ent;
-    void *base;
-    uint32_t len;
-    CDATReq *req = pcie_doe_get_write_mbox_ptr(doe_cap);
-    CDATRsp rsp;
-
-    cxl_doe_cdat_update(&CXL_USP(doe_cap->pdev)->cxl_cstate, &error_fatal);
-    assert(cdat->entry_len);
-
-    /* Discard if request length mismatched */
-    if (pcie_doe_get_obj_len(req) <
-        DIV_ROUND_UP(sizeof(CDATReq), sizeof(uint32_t))) {
-        return false;
-    }
-
-    ent = req->entry_handle;
-    base = cdat->entry[ent].base;
-    len = cdat->entry[ent].length;
-
-    rsp = (CDATRsp) {
-        .header = {
-            .vendor_id = CXL_VENDOR_ID,
-            .data_obj_type = CXL_DOE_TABLE_ACCESS,
-            .reserved = 0x0,
-            .length = DIV_ROUND_UP((sizeof(rsp) + len), sizeof(uint32_t)),
-        },
-        .rsp_code = CXL_DOE_TAB_RSP,
-        .table_type = CXL_DOE_TAB_TYPE_CDAT,
-        .entry_handle = (ent < cdat->entry_len - 1) ?
-                        ent + 1 : CXL_DOE_TAB_ENT_MAX,
-    };
-
-    memcpy(doe_cap->read_mbox, &rsp, sizeof(rsp));
-        memcpy(doe_cap->read_mbox + DIV_ROUND_UP(sizeof(rsp), sizeof(uint32_t)),
-           base, len);
+    CXLComponentState *cxl_cstate = &CXL_USP(doe_cap->pdev)->cxl_cstate;
 
-    doe_cap->read_mbox_len += rsp.header.length;
-
-    return true;
+    cxl_doe_cdat_update(cxl_cstate, &error_fatal);
+    return cxl_doe_cdat_read_entry(doe_cap, &cxl_cstate->cdat);
 }
 
 static DOEProtocol doe_cdat_prot[] = {
@@ -345,10 +310,14 @@ static void cxl_usp_realize(PCIDevice *d, Error **errp)
     cxl_cstate->cdat.build_cdat_table = build_cdat_table;
     cxl_cstate->cdat.free_cdat_table = free_default_cdat_table;
     cxl_cstate->cdat.private = d;
-    cxl_doe_cdat_init(cxl_cstate, errp);
+    if (!cxl_doe_cdat_init(cxl_cstate, errp)) {
+        goto err_aer;
+    }
 
     return;
 
+err_aer:
+    pcie_aer_exit(d);
 err_cap:
     pcie_cap_exit(d);
 err_msi:
@@ -370,6 +339,21 @@ static Property cxl_upstream_props[] = {
     DEFINE_PROP_END_OF_LIST()
 };
 
+static const VMStateDescription vmstate_cxl_usp = {
+    .name = "cxl-upstream-port",
+    .priority = MIG_PRI_PCI_BUS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_obj.parent_obj.parent_obj, CXLUpstreamPort),
+        VMSTATE_STRUCT(parent_obj.parent_obj.parent_obj.exp.aer_log,
+                       CXLUpstreamPort, 0, vmstate_pcie_aer_log, PCIEAERLog),
+        VMSTATE_STRUCT(cxl_cstate, CXLUpstreamPort, 0, vmstate_cxl_component,
+                       CXLComponentState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void cxl_upstream_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
@@ -385,6 +369,7 @@ static void cxl_upstream_class_init(ObjectClass *oc, void *data)
     set_bit(DEVICE_CATEGORY_BRIDGE, dc->categories);
     dc->desc = "CXL Switch Upstream Port";
     dc->reset = cxl_usp_reset;
+    dc->vmsd = &vmstate_cxl_usp;
     device_class_set_props(dc, cxl_upstream_props);
 }
 
@@ -20,6 +20,7 @@
 #include "hw/pci/pci_bridge.h"
 #include "hw/pci-bridge/pci_expander_bridge.h"
 #include "hw/cxl/cxl.h"
+#include "migration/vmstate.h"
 #include "qemu/range.h"
 #include "qemu/error-report.h"
 #include "qemu/module.h"
@@ -219,7 +220,8 @@ void pxb_cxl_hook_up_registers(CXLState *cxl_state, PCIBus *bus, Error **errp)
     hwaddr offset;
 
     offset = memory_region_size(mr) * cxl_state->next_mr_idx;
-    if (offset > memory_region_size(&cxl_state->host_mr)) {
+    if (offset + memory_region_size(mr) >
+        memory_region_size(&cxl_state->host_mr)) {
         error_setg(errp, "Insufficient space for pxb cxl host register space");
         return;
     }
@@ -228,6 +230,17 @@ void pxb_cxl_hook_up_registers(CXLState *cxl_state, PCIBus *bus, Error **errp)
     cxl_state->next_mr_idx++;
 }
 
+static const VMStateDescription vmstate_pxb_cxl_host = {
+    .name = "pxb-cxl-host",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT(cxl_cstate, CXLHost, 0, vmstate_cxl_component,
+                       CXLComponentState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void pxb_cxl_host_class_init(ObjectClass *class, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(class);
@@ -236,6 +249,7 @@ static void pxb_cxl_host_class_init(ObjectClass *class, void *data)
     hc->root_bus_path = pxb_host_root_bus_path;
     dc->fw_name = "cxl";
     dc->realize = pxb_cxl_realize;
+    dc->vmsd = &vmstate_pxb_cxl_host;
     /* Reason: Internal part of the pxb/pxb-pcie device, not usable by itself */
     dc->user_creatable = false;
 }
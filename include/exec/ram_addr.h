@@ -446,6 +446,60 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 }
 
 
+/* Is the range of @rb aligned to whole words of the dirty bitmaps? */
+static inline bool cpu_physical_memory_sync_dirty_aligned(RAMBlock *rb,
+                                                          ram_addr_t start,
+                                                          ram_addr_t length)
+{
+    ram_addr_t mask = (BITS_PER_LONG << TARGET_PAGE_BITS) - 1;
+
+    return !((start + rb->offset) & mask) && !(length & mask);
+}
+
+/*
+ * Move the migration dirty bits of a word aligned range of @rb to its
+ * bitmap, and return how many of them were not set there yet.  Calls on
+ * disjoint ranges of the same block may run concurrently, under the RCU
+ * critical section of their caller; the clear bitmap is left to the caller.
+ */
+static inline
+uint64_t cpu_physical_memory_sync_dirty_words(RAMBlock *rb,
+                                              ram_addr_t start,
+                                              ram_addr_t length)
+{
+    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
+    uint64_t num_dirty = 0;
+    unsigned long *dest = rb->bmap;
+    unsigned long k;
+    unsigned long nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
+    unsigned long * const *src;
+    unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
+                                    DIRTY_MEMORY_BLOCK_SIZE);
+    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
+
+    src = qatomic_rcu_read(
+            &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
+
+    for (k = page; k < page + nr; k++) {
+        if (src[idx][offset]) {
+            unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
+            unsigned long new_dirty;
+            new_dirty = ~dest[k];
+            dest[k] |= bits;
+            new_dirty &= bits;
+            num_dirty += ctpopl(new_dirty);
+        }
+
+        if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+            offset = 0;
+            idx++;
+        }
+    }
+
+    return num_dirty;
+}
+
 /* Called with RCU critical section */
 static inline
 uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
@@ -453,40 +507,12 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                                                ram_addr_t length)
 {
     ram_addr_t addr;
-    unsigned long word = BIT_WORD((start + rb->offset) >> TARGET_PAGE_BITS);
     uint64_t num_dirty = 0;
     unsigned long *dest = rb->bmap;
 
     /* start address and length is aligned at the start of a word? */
-    if (((word * BITS_PER_LONG) << TARGET_PAGE_BITS) ==
-         (start + rb->offset) &&
-        !(length & ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1))) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long * const *src;
-        unsigned long idx = (word * BITS_PER_LONG) / DIRTY_MEMORY_BLOCK_SIZE;
-        unsigned long offset = BIT_WORD((word * BITS_PER_LONG) %
-                                        DIRTY_MEMORY_BLOCK_SIZE);
-        unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-        src = qatomic_rcu_read(
-                &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
-
-        for (k = page; k < page + nr; k++) {
-            if (src[idx][offset]) {
-                unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
-                unsigned long new_dirty;
-                new_dirty = ~dest[k];
-                dest[k] |= bits;
-                new_dirty &= bits;
-                num_dirty += ctpopl(new_dirty);
-            }
-
-            if (++offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
-                offset = 0;
-                idx++;
-            }
-        }
+    if (cpu_physical_memory_sync_dirty_aligned(rb, start, length)) {
+        num_dirty = cpu_physical_memory_sync_dirty_words(rb, start, length);
 
         if (rb->clear_bmap) {
             /*
@@ -172,6 +172,9 @@ typedef struct {
  * @get_default_cpu_node_id:
  *    returns default board specific node_id value for CPU slot specified by
  *    index @idx in @ms->possible_cpus[]
+ * @get_cxl_state:
+ *    If defined, returns the CXL state of the machine, whether CXL is
+ *    enabled or not.
  * @has_hotpluggable_cpus:
  *    If true, board supports CPUs creation with -device/device_add.
  * @default_cpu_type:
@@ -284,6 +287,7 @@ struct MachineClass {
                                                          unsigned cpu_index);
     const CPUArchIdList *(*possible_cpu_arch_ids)(MachineState *machine);
     int64_t (*get_default_cpu_node_id)(const MachineState *ms, int idx);
+    CXLState *(*get_cxl_state)(MachineState *ms);
     ram_addr_t (*fixup_ram_size)(ram_addr_t size);
 };
 
@@ -25,6 +25,23 @@
 
 typedef struct PXBDev PXBDev;
 
+/*
+ * Decoded route of [start, end) in a fixed memory window to a contiguous DPA
+ * range of a Type 3 device.  Only valid while gen matches the window's.
+ */
+typedef struct CXLFixedWindowRoute {
+    hwaddr start;
+    hwaddr end;
+    uint64_t dpa;
+    PCIDevice *d;
+    uint64_t gen;
+} CXLFixedWindowRoute;
+
+#define CXL_FMW_ROUTE_CACHE_SIZE 256
+
+typedef struct CXLDecodeNode CXLDecodeNode;
+typedef struct CXLHotPages CXLHotPages;
+
 typedef struct CXLFixedWindow {
     uint64_t size;
     char **targets;
@@ -35,15 +52,28 @@ typedef struct CXLFixedWindow {
     /* Todo: XOR based interleaving */
     MemoryRegion mr;
     hwaddr base;
+    /* RAM aliases overlaying mr for fully committed decode, see cxl-host.c */
+    GPtrArray *direct_mrs;
+    /* Routes for the MMIO path, indexed by interleave granule */
+    CXLFixedWindowRoute route_cache[CXL_FMW_ROUTE_CACHE_SIZE];
+    uint64_t route_gen;
+    /* Decode tree for each target host bridge, valid while gen matches */
+    GPtrArray *decode_nodes;
+    CXLDecodeNode *decode_roots[8];
+    uint64_t decode_gen;
+    /* Per page access counts while hot page tracking is enabled */
+    CXLHotPages *hot_pages;
 } CXLFixedWindow;
 
-typedef struct CXLState {
+struct CXLState {
     bool is_enabled;
     MemoryRegion host_mr;
     unsigned int next_mr_idx;
     GList *fixed_windows;
     CXLFixedMemoryWindowOptionsList *cfmw_list;
-} CXLState;
+    /* CXL host bridges by id, to link the fixed windows to their targets */
+    GHashTable *host_bridges;
+};
 
 struct CXLHost {
     PCIHostState parent_obj;
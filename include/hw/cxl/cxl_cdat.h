@@ -146,22 +146,16 @@ typedef struct CDATSslbis {
     CDATSslbe sslbe[];
 } QEMU_PACKED CDATSslbis;
 
-typedef struct CDATEntry {
-    void *base;
-    uint32_t length;
-} CDATEntry;
+/* A built or loaded CDAT, shared by the components with the same one */
+typedef struct CDATTable CDATTable;
 
 typedef struct CDATObject {
-    CDATEntry *entry;
-    int entry_len;
+    CDATTable *table;
 
     int (*build_cdat_table)(CDATSubHeader ***cdat_table, void *priv);
     void (*free_cdat_table)(CDATSubHeader **cdat_table, int num, void *priv);
     bool to_update;
     void *private;
     char *filename;
-    uint8_t *buf;
-    struct CDATSubHeader **built_buf;
-    int built_buf_len;
 } CDATObject;
 #endif /* CXL_CDAT_H */
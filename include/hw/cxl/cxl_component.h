@@ -135,6 +135,10 @@ REG32(CXL_RAS_ERR_HEADER0, CXL_RAS_REGISTERS_OFFSET + 0x18)
   REG32(CXL_HDM_DECODER##n##_TARGET_LIST_LO,                                   \
         CXL_HDM_REGISTERS_OFFSET + (0x20 * n) + 0x24)                          \
   REG32(CXL_HDM_DECODER##n##_TARGET_LIST_HI,                                   \
+        CXL_HDM_REGISTERS_OFFSET + (0x20 * n) + 0x28)                          \
+  REG32(CXL_HDM_DECODER##n##_DPA_SKIP_LO,                                      \
+        CXL_HDM_REGISTERS_OFFSET + (0x20 * n) + 0x24)                          \
+  REG32(CXL_HDM_DECODER##n##_DPA_SKIP_HI,                                      \
         CXL_HDM_REGISTERS_OFFSET + (0x20 * n) + 0x28)
 
 REG32(CXL_HDM_DECODER_CAPABILITY, CXL_HDM_REGISTERS_OFFSET)
@@ -148,6 +152,28 @@ REG32(CXL_HDM_DECODER_GLOBAL_CONTROL, CXL_HDM_REGISTERS_OFFSET + 4)
     FIELD(CXL_HDM_DECODER_GLOBAL_CONTROL, HDM_DECODER_ENABLE, 1, 1)
 
 HDM_DECODER_INIT(0);
+HDM_DECODER_INIT(1);
+
+/*
+ * Decoder n has the same register layout as decoder 0, offset by n times
+ * this many 32 bit registers.
+ */
+#define CXL_HDM_DECODER_STRIDE \
+    (R_CXL_HDM_DECODER1_BASE_LO - R_CXL_HDM_DECODER0_BASE_LO)
+#define CXL_HDM_DECODER_COUNT 8
+
+/* Index of the decoder whose control register is at @offset, or -1 */
+static inline int cxl_hdm_decoder_ctrl_index(hwaddr offset)
+{
+    hwaddr stride = CXL_HDM_DECODER_STRIDE * sizeof(uint32_t);
+
+    if (offset < A_CXL_HDM_DECODER0_CTRL ||
+        (offset - A_CXL_HDM_DECODER0_CTRL) % stride ||
+        (offset - A_CXL_HDM_DECODER0_CTRL) / stride >= HDM_DECODE_MAX) {
+        return -1;
+    }
+    return (offset - A_CXL_HDM_DECODER0_CTRL) / stride;
+}
 
 /* 8.2.5.13 - CXL Extended Security Capability Structure (Root complex only) */
 #define EXTSEC_ENTRY_MAX        256
@@ -197,6 +223,30 @@ typedef struct component_registers {
     MemoryRegionOps *special_ops;
 } ComponentRegisters;
 
+/*
+ * A committed HDM decoder.  Port decoders route to targets[], endpoint
+ * decoders translate to device physical addresses starting at dpa_base.
+ */
+typedef struct CXLHDMDecoder {
+    uint64_t base;
+    uint64_t size;
+    uint64_t dpa_base;
+    uint8_t index;
+    uint8_t iw;
+    uint8_t ig;
+    uint8_t targets[8];
+} CXLHDMDecoder;
+
+/*
+ * Committed decoders of a component sorted by base, rebuilt from the
+ * registers whenever decode has changed since gen.
+ */
+typedef struct CXLHDMDecoderTable {
+    uint64_t gen;
+    int count;
+    CXLHDMDecoder decoders[HDM_DECODE_MAX];
+} CXLHDMDecoderTable;
+
 /*
  * A CXL component represents all entities in a CXL hierarchy. This includes,
  * host bridges, root ports, upstream/downstream switch ports, and devices
@@ -212,6 +262,7 @@ typedef struct cxl_component {
     };
 
     CDATObject cdat;
+    CXLHDMDecoderTable hdm_table;
 } CXLComponentState;
 
 void cxl_component_register_block_init(Object *obj,
@@ -238,6 +289,19 @@ static inline int cxl_decoder_count_enc(int count)
     return 0;
 }
 
+static inline int cxl_decoder_count_dec(int enc_cnt)
+{
+    switch (enc_cnt) {
+    case 0: return 1;
+    case 1: return 2;
+    case 2: return 4;
+    case 3: return 6;
+    case 4: return 8;
+    case 5: return 10;
+    }
+    return 0;
+}
+
 uint8_t cxl_interleave_ways_enc(int iw, Error **errp);
 uint8_t cxl_interleave_granularity_enc(uint64_t gran, Error **errp);
 
@@ -246,11 +310,27 @@ static inline hwaddr cxl_decode_ig(int ig)
     return 1ULL << (ig + 8);
 }
 
+void cxl_hdm_decoders_changed(void);
+void cxl_hdm_table_build(CXLHDMDecoderTable *table, const uint32_t *cache_mem);
+const CXLHDMDecoder *cxl_hdm_table_find(const CXLHDMDecoderTable *table,
+                                        uint64_t hpa, uint64_t *run);
+const CXLHDMDecoderTable *cxl_hdm_get_table(CXLComponentState *cxl_cstate);
+const CXLHDMDecoder *cxl_hdm_find_decoder(CXLComponentState *cxl_cstate,
+                                          uint64_t hpa, uint64_t *run);
+const CXLHDMDecoder *cxl_hdm_find_decoder_by_dpa(CXLComponentState *cxl_cstate,
+                                                 uint64_t dpa);
+unsigned int cxl_hdm_decoder_ways(const CXLHDMDecoder *decoder);
+unsigned int cxl_hdm_decoder_way(const CXLHDMDecoder *decoder, uint64_t hpa);
+uint64_t cxl_hdm_decoder_dpa(const CXLHDMDecoder *decoder, uint64_t hpa);
+
 CXLComponentState *cxl_get_hb_cstate(PCIHostState *hb);
 bool cxl_get_hb_passthrough(PCIHostState *hb);
 
-void cxl_doe_cdat_init(CXLComponentState *cxl_cstate, Error **errp);
+bool cxl_doe_cdat_init(CXLComponentState *cxl_cstate, Error **errp);
 void cxl_doe_cdat_release(CXLComponentState *cxl_cstate);
 void cxl_doe_cdat_update(CXLComponentState *cxl_cstate, Error **errp);
+bool cxl_doe_cdat_read_entry(DOECap *doe_cap, CDATObject *cdat);
+
+extern const VMStateDescription vmstate_cxl_component;
 
 #endif
@@ -11,8 +11,12 @@
 #define CXL_DEVICE_H
 
 #include "hw/cxl/cxl_component.h"
+#include "hw/cxl/cxl_events.h"
 #include "hw/pci/pci_device.h"
 #include "hw/register.h"
+#include "sysemu/iothread.h"
+#include "qemu/interval-tree.h"
+#include "qemu/units.h"
 
 /*
  * The following is how a CXL device's Memory Device registers are laid out.
@@ -82,6 +86,41 @@
     (CXL_DEVICE_CAP_REG_SIZE + CXL_DEVICE_STATUS_REGISTERS_LENGTH +     \
      CXL_MAILBOX_REGISTERS_LENGTH + CXL_MEMORY_DEVICE_REGISTERS_LENGTH)
 
+/* Capacities are reported in multiples of this, 8.2.9.5.1.1 */
+#define CXL_CAPACITY_MULTIPLIER (256 * MiB)
+
+/* Records each event log can hold */
+#define CXL_EVENT_LOG_SIZE 256
+
+/*
+ * Ring of event records, the oldest at head.  Records that arrive while the
+ * log is full are dropped and accounted as an overflow (8.2.9.2.2), which
+ * is reported until the log has been emptied.
+ */
+typedef struct CXLEventLog {
+    uint16_t next_handle;
+    uint16_t head;
+    uint16_t count;
+    uint16_t overflow_err_count;
+    uint64_t first_overflow_ts;
+    uint64_t last_overflow_ts;
+    /* Records were added to an empty log, see cxl_event_irq() */
+    bool irq_pending;
+    union {
+        CXLEventRecordRaw records[CXL_EVENT_LOG_SIZE];
+        uint8_t raw[CXL_EVENT_LOG_SIZE * CXL_EVENT_RECORD_SIZE];
+    };
+} CXLEventLog;
+
+/* 8.2.9.2.4 Event Interrupt Policy settings */
+#define CXL_EVENT_INT_MODE_MASK 0x3
+#define CXL_EVENT_INT_MODE_NONE 0x0
+#define CXL_EVENT_INT_MODE_MSI 0x1
+#define CXL_EVENT_INT_MODE_FW 0x2
+#define CXL_EVENT_INT_MSGNUM_SHIFT 4
+/* MSI/MSI-X vector of event interrupts, the mailbox has vector 0 */
+#define CXL_EVENT_INT_VECTOR 1
+
 typedef struct cxl_device_state {
     MemoryRegion device_registers;
 
@@ -113,14 +152,39 @@ typedef struct cxl_device_state {
         size_t cel_size;
     };
 
+    /*
+     * Background command (8.2.8.4.7), run on nr_workers worker threads.
+     * Only one can be in progress at a time and the workers only update
+     * complete_pct and the work they share, next and done.
+     */
+    struct {
+        uint16_t opcode;
+        uint16_t complete_pct;
+        bool running;
+        int nr_workers;
+        /* Workers yet to complete, and the first error they returned */
+        int pending;
+        int ret;
+        size_t next;
+        size_t done;
+        int (*func)(struct cxl_device_state *cxl_dstate);
+    } bg;
+
     struct {
         bool set;
         uint64_t last_set;
         uint64_t host_set;
     } timestamp;
 
+    /* 8.2.9.2 Events, a log has a bit in the Event Status while not empty */
+    CXLEventLog event_logs[CXL_EVENT_TYPE_MAX];
+    uint8_t event_int_settings[CXL_EVENT_TYPE_MAX];
+
     /* memory region for persistent memory, HDM */
+    /* Volatile capacity is at DPA 0, followed by persistent capacity */
+    uint64_t vmem_size;
     uint64_t pmem_size;
+    uint64_t mem_size;
 } CXLDeviceState;
 
 /* Initialize the register block for a device */
@@ -129,6 +193,8 @@ void cxl_device_register_block_init(Object *obj, CXLDeviceState *dev);
 /* Set up default values for the register block */
 void cxl_device_register_init_common(CXLDeviceState *dev);
 
+extern const VMStateDescription vmstate_cxl_device;
+
 /*
  * CXL 2.0 - 8.2.8.1 including errata F4
  * Documented as a 128 bit register, but 64 bit accesses and the second
@@ -172,6 +238,19 @@ CXL_DEVICE_CAPABILITY_HEADER_REGISTER(MEMORY_DEVICE,
 
 void cxl_initialize_mailbox(CXLDeviceState *cxl_dstate);
 void cxl_process_mailbox(CXLDeviceState *cxl_dstate);
+void cxl_mailbox_bg_update(CXLDeviceState *cxl_dstate);
+void cxl_mailbox_bg_wait(CXLDeviceState *cxl_dstate);
+uint64_t cxl_device_get_timestamp(CXLDeviceState *cxl_dstate);
+
+void cxl_event_init(CXLDeviceState *cxl_dstate);
+uint16_t cxl_event_log_free_space(CXLDeviceState *cxl_dstate,
+                                  CXLEventLogType log_type);
+bool cxl_event_insert(CXLDeviceState *cxl_dstate, CXLEventLogType log_type,
+                      const CXLEventRecordRaw *record);
+void cxl_event_irq(CXLDeviceState *cxl_dstate, CXLEventLogType log_type);
+CXLEventRecordRaw *cxl_event_log_record(CXLEventLog *log, uint16_t i);
+void cxl_event_log_drop(CXLEventLog *log, uint16_t n);
+uint32_t cxl_event_status(CXLDeviceState *cxl_dstate);
 
 #define cxl_device_cap_init(dstate, reg, cap_id)                           \
     do {                                                                   \
@@ -240,25 +319,156 @@ typedef struct CXLError {
 
 typedef QTAILQ_HEAD(, CXLError) CXLErrorList;
 
+/*
+ * 8.2.9.8.4.1 Media error records.  Poison is tracked in units of 64 bytes
+ * of device physical address space, and each record covers a range of them
+ * in the poison tree of the device.
+ */
+#define CXL_POISON_GRANULE 64
+#define CXL_POISON_LIST_LIMIT 65536
+
+#define CXL_POISON_TYPE_EXTERNAL 0x1
+#define CXL_POISON_TYPE_INTERNAL 0x2
+#define CXL_POISON_TYPE_INJECTED 0x3
+
+typedef struct CXLPoison {
+    IntervalTreeNode node; /* DPA range [start, last] */
+    uint8_t type;
+} CXLPoison;
+
+/* Flattened poison tree, only used while migrating */
+typedef struct CXLPoisonRecord {
+    uint64_t start;
+    uint64_t last;
+    uint8_t type;
+} CXLPoisonRecord;
+
+/*
+ * CXL 3.0 8.2.9.8.9 Dynamic Capacity.  Regions follow the static capacity in
+ * DPA space and split the dynamic capacity backend between them.  Capacity
+ * is added and released in extents, multiples of the block size.
+ */
+#define DCD_MAX_NUM_REGION 8
+#define CXL_DC_BLOCK_SIZE (2 * MiB)
+#define CXL_NUM_EXTENTS_SUPPORTED 512
+
+typedef struct CXLDCRegion {
+    uint64_t base; /* DPA */
+    uint64_t decode_len;
+    uint64_t len;
+    uint64_t block_size;
+    uint32_t dsmadhandle;
+    uint8_t flags;
+} CXLDCRegion;
+
+typedef struct CXLDCExtent {
+    uint64_t start_dpa;
+    uint64_t len;
+    QTAILQ_ENTRY(CXLDCExtent) node;
+} CXLDCExtent;
+
+typedef QTAILQ_HEAD(, CXLDCExtent) CXLDCExtentList;
+
+/*
+ * Timing of one direction of accesses to a Type 3 device.  The latency and
+ * bandwidth are what the CDAT advertises.  With the timing model enabled
+ * every access is also delayed by the latency, after waiting for the link
+ * which is busy until link_free, so the bandwidth is a token bucket.
+ */
+typedef struct CXLTiming {
+    uint64_t latency; /* ns */
+    uint64_t bandwidth; /* MB/s */
+    int64_t link_free; /* QEMU_CLOCK_REALTIME */
+    uint64_t link_carry; /* ps not yet accounted in link_free */
+} CXLTiming;
+
+/*
+ * Accesses to a Type 3 device through emulation, i.e. not those to memory
+ * mapped straight into the guest.  Reported by query-stats.
+ */
+typedef struct CXLType3Stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t errors;
+} CXLType3Stats;
+
 struct CXLType3Dev {
     /* Private */
     PCIDevice parent_obj;
 
     /* Properties */
-    HostMemoryBackend *hostmem;
+    HostMemoryBackend *hostmem; /* deprecated */
+    HostMemoryBackend *hostvmem;
+    HostMemoryBackend *hostpmem;
     HostMemoryBackend *lsa;
+    HostMemoryBackend *host_dc;
     uint64_t sn;
+    /* Memory shared with other QEMU instances, as a multi-headed device */
+    bool shared;
+    bool timing_model;
+    CXLTiming read_timing;
+    CXLTiming write_timing;
 
     /* State */
-    AddressSpace hostmem_as;
+    AddressSpace hostvmem_as;
+    AddressSpace hostpmem_as;
+    AddressSpace host_dc_as;
     CXLComponentState cxl_cstate;
     CXLDeviceState cxl_dstate;
 
+    /* LSA granules written since the last flush to the backend */
+    unsigned long *lsa_dirty;
+    QEMUTimer *lsa_flush_timer;
+
+    /* Background commands are completed whenever the VM stops */
+    VMChangeStateEntry *vm_change_entry;
+
     /* DOE */
     DOECap doe_cdat;
 
+    /* Access statistics, in total and by the decoder they went through */
+    CXLType3Stats stats;
+    CXLType3Stats decoder_stats[CXL_HDM_DECODER_COUNT];
+
     /* Error injection */
     CXLErrorList error_list;
+
+    /* Poisoned media, see cxl_type3_poison_add() */
+    IntervalTreeRoot poison_tree;
+    uint32_t poison_count;
+    bool poison_overflowed;
+    uint64_t poison_overflow_ts;
+    /* Where an incomplete Get Poison List left off */
+    struct {
+        uint64_t start;
+        uint64_t last;
+        uint64_t next;
+    } poison_list_resume;
+    CXLPoisonRecord *poison_mig;
+    int32_t poison_mig_count;
+    /* Media errors found by the last Scan Media, not handed out yet */
+    struct {
+        CXLPoisonRecord *records;
+        uint32_t count;
+        uint32_t next;
+    } scan_media;
+
+    /* Dynamic capacity, only backed where the host accepted an extent */
+    struct {
+        uint8_t num_regions; /* Property */
+        CXLDCRegion regions[DCD_MAX_NUM_REGION];
+        uint64_t total_capacity;
+        CXLDCExtentList extents;
+        uint32_t extent_count;
+        uint32_t ext_list_gen;
+        /* Offered by Add Capacity events, waiting for the host's response */
+        CXLDCExtentList pending;
+        uint32_t pending_count;
+        /* Blocks of the accepted extents */
+        unsigned long *blk_bitmap;
+    } dc;
 };
 
 #define TYPE_CXL_TYPE3 "cxl-type3"
@@ -277,9 +487,88 @@ struct CXLType3Class {
                     uint64_t offset);
 };
 
+extern const VMStateDescription vmstate_ct3d;
+
+/*
+ * A Type 2 device is a Type 3 device with its volatile memory as device
+ * coherent HDM, and a compute engine to offload work on it to.
+ */
+typedef struct CXLType2Engine {
+    /* Registers */
+    uint64_t src;
+    uint64_t dst;
+    uint64_t len;
+    uint64_t pattern;
+    uint64_t cmd;
+    uint64_t status;
+    uint64_t result;
+    uint64_t completed;
+    uint64_t last_ns;
+
+    /* Job run by the engine thread, copied from the registers at doorbell */
+    struct {
+        uint8_t op;
+        uint64_t src;
+        uint64_t dst;
+        uint64_t len;
+        uint64_t pattern;
+        uint64_t result;
+        uint64_t ns;
+        bool err;
+    } job;
+    bool busy;
+} CXLType2Engine;
+
+struct CXLType2Dev {
+    /* Private */
+    CXLType3Dev parent_obj;
+
+    /* Properties */
+    IOThread *iothread;
+
+    /* State */
+    MemoryRegion engine_mr;
+    CXLType2Engine engine;
+    VMChangeStateEntry *vm_change_entry;
+};
+
+#define TYPE_CXL_TYPE2 "cxl-type2"
+OBJECT_DECLARE_TYPE(CXLType2Dev, CXLType2Class, CXL_TYPE2)
+
+struct CXLType2Class {
+    /* Private */
+    CXLType3Class parent_class;
+
+    void (*parent_realize)(PCIDevice *dev, Error **errp);
+    PCIUnregisterFunc *parent_exit;
+    DeviceReset parent_reset;
+};
+
 MemTxResult cxl_type3_read(PCIDevice *d, hwaddr host_addr, uint64_t *data,
                            unsigned size, MemTxAttrs attrs);
 MemTxResult cxl_type3_write(PCIDevice *d, hwaddr host_addr, uint64_t data,
                             unsigned size, MemTxAttrs attrs);
+MemTxResult cxl_type3_read_dpa(PCIDevice *d, uint64_t dpa, uint64_t *data,
+                               unsigned size, MemTxAttrs attrs);
+MemTxResult cxl_type3_write_dpa(PCIDevice *d, uint64_t dpa, uint64_t data,
+                                unsigned size, MemTxAttrs attrs);
+bool cxl_type3_hpa_to_dpa(PCIDevice *d, hwaddr host_addr, uint64_t *dpa,
+                          uint64_t *run);
+MemoryRegion *cxl_type3_hpa_to_mr(PCIDevice *d, hwaddr host_addr,
+                                  uint64_t *mr_offset, uint64_t *run);
+
+bool cxl_type3_poison_add(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len,
+                          uint8_t type);
+void cxl_type3_poison_clear(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len,
+                            const void *data);
+bool cxl_type3_poisoned(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len);
+
+CXLDCRegion *cxl_type3_dc_find_region(CXLType3Dev *ct3d, uint64_t dpa,
+                                      uint64_t len);
+bool cxl_type3_dc_backed(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len);
+bool cxl_type3_dc_pending(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len);
+void cxl_type3_dc_accept(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len);
+void cxl_type3_dc_release(CXLType3Dev *ct3d, uint64_t dpa, uint64_t len);
+void cxl_type3_dc_clear_pending(CXLType3Dev *ct3d);
 
 #endif
@@ -0,0 +1,96 @@
+/*
+ * QEMU CXL Events
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2. See the
+ * COPYING file in the top-level directory.
+ */
+
+#ifndef CXL_EVENTS_H
+#define CXL_EVENTS_H
+
+#include "qemu/uuid.h"
+
+/*
+ * CXL 3.0 - 8.2.9.2.2 Get Event Records, Event Log values.  The bits of the
+ * Event Status register (8.2.8.3.1) are in the same order.
+ */
+typedef enum CXLEventLogType {
+    CXL_EVENT_TYPE_INFO = 0,
+    CXL_EVENT_TYPE_WARN = 1,
+    CXL_EVENT_TYPE_FAIL = 2,
+    CXL_EVENT_TYPE_FATAL = 3,
+    CXL_EVENT_TYPE_DYNAMIC_CAP = 4,
+    CXL_EVENT_TYPE_MAX
+} CXLEventLogType;
+
+/* CXL 3.0 - 8.2.9.2.1 Table 8-42 Common Event Record Format */
+#define CXL_EVENT_REC_HDR_RES_LEN 0xf
+typedef struct CXLEventRecordHdr {
+    QemuUUID id;
+    uint8_t length;
+    uint8_t flags[3];
+    uint16_t handle;
+    uint16_t related_handle;
+    uint64_t timestamp;
+    uint8_t maint_op_class;
+    uint8_t reserved[CXL_EVENT_REC_HDR_RES_LEN];
+} QEMU_PACKED CXLEventRecordHdr;
+
+#define CXL_EVENT_RECORD_DATA_LENGTH 0x50
+typedef struct CXLEventRecordRaw {
+    CXLEventRecordHdr hdr;
+    uint8_t data[CXL_EVENT_RECORD_DATA_LENGTH];
+} QEMU_PACKED CXLEventRecordRaw;
+#define CXL_EVENT_RECORD_SIZE (sizeof(CXLEventRecordRaw))
+
+/* CXL 3.0 - 8.2.9.2.1.1 Table 8-43 General Media Event Record */
+#define CXL_GMER_VALID_CHANNEL BIT(0)
+#define CXL_GMER_VALID_RANK BIT(1)
+#define CXL_GMER_VALID_DEVICE BIT(2)
+#define CXL_GMER_VALID_COMPONENT BIT(3)
+
+typedef struct CXLEventGenMedia {
+    CXLEventRecordHdr hdr;
+    uint64_t phys_addr;
+    uint8_t descriptor;
+    uint8_t type;
+    uint8_t transaction_type;
+    uint16_t validity_flags;
+    uint8_t channel;
+    uint8_t rank;
+    uint8_t device[3];
+    uint8_t component_id[0x10];
+    uint8_t reserved[0x2e];
+} QEMU_PACKED CXLEventGenMedia;
+
+/* CXL 3.0 - 8.2.9.8.9.2 Table 8-164 Dynamic Capacity Extent */
+typedef struct CXLDCExtentRaw {
+    uint64_t start_dpa;
+    uint64_t len;
+    uint8_t tag[0x10];
+    uint16_t shared_seq;
+    uint8_t rsvd[0x6];
+} QEMU_PACKED CXLDCExtentRaw;
+
+/* CXL 3.0 - 8.2.9.2.1.5 Table 8-47 Dynamic Capacity Event Record */
+#define CXL_DC_EVENT_ADD_CAPACITY 0x0
+#define CXL_DC_EVENT_RELEASE_CAPACITY 0x1
+#define CXL_DC_EVENT_FORCED_RELEASE 0x2
+#define CXL_DC_EVENT_REGION_CONFIG_UPDATED 0x3
+
+/* Flags byte of the event, more records of the same operation follow */
+#define CXL_DC_EVENT_FLAG_MORE BIT(0)
+
+typedef struct CXLEventDynamicCapacity {
+    CXLEventRecordHdr hdr;
+    uint8_t type;
+    uint8_t validity_flags;
+    uint16_t host_id;
+    uint8_t updated_region_id;
+    uint8_t flags;
+    uint8_t reserved2[2];
+    CXLDCExtentRaw extent;
+    uint8_t reserved[0x20];
+} QEMU_PACKED CXLEventDynamicCapacity;
+
+#endif /* CXL_EVENTS_H */
@@ -16,6 +16,14 @@
 void cxl_machine_init(Object *obj, CXLState *state);
 void cxl_fmws_link_targets(CXLState *stat, Error **errp);
 void cxl_hook_up_pxb_registers(PCIBus *bus, CXLState *state, Error **errp);
+void cxl_fmws_update_mmio(void);
+GList *cxl_fmws_get_all(void);
+
+#define CXL_HOT_PAGE_SIZE 4096
+
+void cxl_hot_pages_access(CXLFixedWindow *fw, hwaddr addr, bool is_write);
+void cxl_hot_pages_map(CXLFixedWindow *fw, MemoryRegion *mr);
+void cxl_hot_pages_unmap(CXLFixedWindow *fw, MemoryRegion *mr);
 
 extern const MemoryRegionOps cfmws_ops;
 
@@ -153,6 +153,9 @@
 #define PCI_CLASS_SP_MANAGEMENT          0x1120
 #define PCI_CLASS_SP_OTHER               0x1180
 
+#define PCI_BASE_CLASS_ACCELERATOR       0x12
+#define PCI_CLASS_ACCELERATOR_PROCESSING 0x1200
+
 #define PCI_CLASS_OTHERS                 0xff
 
 /* Vendors and devices.  Sort key: vendor first, device next. */
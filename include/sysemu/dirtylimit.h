@@ -34,4 +34,20 @@ void dirtylimit_set_vcpu(int cpu_index,
 void dirtylimit_set_all(uint64_t quota,
                         bool enable);
 void dirtylimit_vcpu_execute(CPUState *cpu);
+
+/*
+ * Migration with the dirty-limit capability owns the limits, from
+ * dirtylimit_migration_start(), which starts measuring the dirty page rate
+ * of each vCPU, to dirtylimit_migration_stop(), which lifts all the limits
+ * and must be called with the iothread lock held.  Limits the user had set
+ * before are never exceeded meanwhile, and are restored by the latter.
+ *
+ * dirtylimit_migration_throttle() limits the vCPUs that dirty memory the
+ * fastest to the same rate, no lower than @min_quota, so that all the vCPUs
+ * together dirty at most @quota.  Rates are in MB/s.  vCPUs once limited
+ * stay limited, to a lower or higher rate as @quota changes.
+ */
+void dirtylimit_migration_start(void);
+void dirtylimit_migration_stop(void);
+void dirtylimit_migration_throttle(uint64_t quota, uint64_t min_quota);
 #endif
@@ -0,0 +1,268 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each channel keeps one lz4 stream for the whole migration, so that the
+ * pages of a packet are compressed with the previous packet as dictionary.
+ * lz4 needs the previous block to stay where it was, both when compressing
+ * and when decompressing, so the pages of a packet are gathered into one
+ * half of a buffer and the halves alternate from packet to packet.  Both
+ * sides see the same packets in the same order, and the copy also keeps
+ * the guest from changing the pages under the compressor.
+ */
+struct lz4_data {
+    /* stream for compression */
+    LZ4_stream_t *stream;
+    /* stream for decompression */
+    LZ4_streamDecode_t *stream_decode;
+    /* uncompressed pages of the last two packets */
+    uint8_t *buf[2];
+    /* half of buf used by the next packet */
+    int next;
+    /* compressed buffer */
+    char *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+static struct lz4_data *lz4_data_new(void)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->zbuff_len = LZ4_compressBound(MULTIFD_PACKET_SIZE);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    z->buf[0] = g_try_malloc(MULTIFD_PACKET_SIZE);
+    z->buf[1] = g_try_malloc(MULTIFD_PACKET_SIZE);
+    return z;
+}
+
+static void lz4_data_free(struct lz4_data *z)
+{
+    g_free(z->zbuff);
+    g_free(z->buf[0]);
+    g_free(z->buf[1]);
+    g_free(z);
+}
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = lz4_data_new();
+
+    z->stream = LZ4_createStream();
+    if (!z->stream) {
+        lz4_data_free(z);
+        error_setg(errp, "multifd %u: lz4 createStream failed", p->id);
+        return -1;
+    }
+    if (!z->zbuff || !z->buf[0] || !z->buf[1]) {
+        LZ4_freeStream(z->stream);
+        lz4_data_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+
+    LZ4_freeStream(z->stream);
+    lz4_data_free(z);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a compressed buffer with all the pages that we are going to
+ * send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    uint8_t *buf = z->buf[z->next];
+    uint32_t i;
+    int ret;
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(buf + i * p->page_size, p->pages->block->host + p->normal[i],
+               p->page_size);
+    }
+
+    ret = LZ4_compress_fast_continue(z->stream, (const char *)buf, z->zbuff,
+                                     p->normal_num * p->page_size,
+                                     z->zbuff_len, 1);
+    if (ret <= 0) {
+        error_setg(errp, "multifd %u: lz4 compression failed", p->id);
+        return -1;
+    }
+    z->next ^= 1;
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = ret;
+    p->iovs_num++;
+    p->next_packet_size = ret;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the compressed channel and buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lz4_data *z = lz4_data_new();
+
+    z->stream_decode = LZ4_createStreamDecode();
+    if (!z->stream_decode) {
+        lz4_data_free(z);
+        error_setg(errp, "multifd %u: lz4 createStreamDecode failed", p->id);
+        return -1;
+    }
+    if (!z->zbuff || !z->buf[0] || !z->buf[1]) {
+        LZ4_freeStreamDecode(z->stream_decode);
+        lz4_data_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lz4_data *z = p->data;
+
+    LZ4_freeStreamDecode(z->stream_decode);
+    lz4_data_free(z);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the compressed buffer, and uncompress it into the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t expected_size = p->normal_num * p->page_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lz4_data *z = p->data;
+    uint8_t *buf = z->buf[z->next];
+    int ret;
+    int i;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u size expected "
+                   "at most %u", p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret = LZ4_decompress_safe_continue(z->stream_decode, z->zbuff,
+                                       (char *)buf, in_size,
+                                       MULTIFD_PACKET_SIZE);
+    if (ret < 0) {
+        error_setg(errp, "multifd %u: lz4 decompression failed", p->id);
+        return -1;
+    }
+    if (ret != expected_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, ret, expected_size);
+        return -1;
+    }
+    z->next ^= 1;
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(p->host + p->normal[i], buf + i * p->page_size, p->page_size);
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
@@ -11,6 +11,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/cutils.h"
 #include "qemu/rcu.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
@@ -24,6 +25,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "postcopy-ram.h"
 #include "threadinfo.h"
 
 #include "qemu/yank.h"
@@ -264,6 +266,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->normal_pages = cpu_to_be32(p->normal_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -275,6 +278,11 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->normal_num + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -321,10 +329,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum zero pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -338,6 +354,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->host = block->host;
+    p->block = block;
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -349,6 +366,17 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         }
         p->normal[i] = offset;
     }
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (block->used_length - p->page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
 
     return 0;
 }
@@ -428,6 +456,9 @@ static int multifd_send_pages(QEMUFile *f)
     assert(!p->pages->block);
 
     p->packet_num = multifd_send_state->packet_num++;
+    if (migration_in_postcopy()) {
+        p->flags |= MULTIFD_FLAG_POSTCOPY;
+    }
     multifd_send_state->pages = p->pages;
     p->pages = pages;
     transferred = ((uint64_t) pages->num) * p->page_size + p->packet_len;
@@ -471,6 +502,18 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return 1;
 }
 
+/*
+ * Send the pages queued so far rather than wait for the packet to fill up,
+ * e.g. when the destination waits for one of them.
+ */
+int multifd_flush_pages(QEMUFile *f)
+{
+    if (!multifd_send_state->pages->num) {
+        return 0;
+    }
+    return multifd_send_pages(f) < 0 ? -1 : 0;
+}
+
 static void multifd_send_terminate_threads(Error *err)
 {
     int i;
@@ -550,6 +593,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -654,6 +699,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_zero_copy_send = migrate_use_zero_copy_send();
+    bool use_zero_page = migrate_multifd_zero_page();
 
     thread = MigrationThreadAdd(p->name, qemu_get_thread_id());
 
@@ -679,6 +725,7 @@ static void *multifd_send_thread(void *opaque)
             uint64_t packet_num = p->packet_num;
             uint32_t flags;
             p->normal_num = 0;
+            p->zero_num = 0;
 
             if (use_zero_copy_send) {
                 p->iovs_num = 0;
@@ -686,9 +733,22 @@ static void *multifd_send_thread(void *opaque)
                 p->iovs_num = 1;
             }
 
+            /*
+             * Zero pages are found here, rather than by the migration
+             * thread, so that checking them scales with the channels.
+             */
             for (int i = 0; i < p->pages->num; i++) {
-                p->normal[p->normal_num] = p->pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = p->pages->offset[i];
+
+                if (use_zero_page &&
+                    buffer_is_zero(p->pages->block->host + offset,
+                                   p->page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
             if (p->normal_num) {
@@ -703,12 +763,18 @@ static void *multifd_send_thread(void *opaque)
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
             p->pages->num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            if (use_zero_page) {
+                stat64_add(&ram_atomic_counters.normal, p->normal_num);
+                stat64_add(&ram_atomic_counters.duplicate, p->zero_num);
+            }
+
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
 
             if (use_zero_copy_send) {
                 /* Send header first, without zerocopy */
@@ -768,7 +834,8 @@ out:
 
     rcu_unregister_thread();
     MigrationThreadDel(thread);
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -942,6 +1009,7 @@ int multifd_save_setup(Error **errp)
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
         p->page_size = qemu_target_page_size();
         p->page_count = page_count;
 
@@ -976,6 +1044,8 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* set once pages can be placed for postcopy, or on exit */
+    QemuEvent postcopy_listen;
     /* multifd ops */
     MultiFDMethods *ops;
 } *multifd_recv_state;
@@ -1012,6 +1082,7 @@ static void multifd_recv_terminate_threads(Error *err)
         }
         qemu_mutex_unlock(&p->mutex);
     }
+    qemu_event_set(&multifd_recv_state->postcopy_listen);
 }
 
 void multifd_load_shutdown(void)
@@ -1059,9 +1130,14 @@ void multifd_load_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
+        g_free(p->postcopy_buf);
+        p->postcopy_buf = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    qemu_event_destroy(&multifd_recv_state->postcopy_listen);
     g_free(multifd_recv_state->params);
     multifd_recv_state->params = NULL;
     g_free(multifd_recv_state);
@@ -1095,6 +1171,80 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Called once guest RAM is registered for postcopy, from then on pages
+ * sent during postcopy can be placed.
+ */
+void multifd_recv_postcopy_listen(void)
+{
+    if (multifd_recv_state) {
+        qemu_event_set(&multifd_recv_state->postcopy_listen);
+    }
+}
+
+/*
+ * Pages sent during postcopy must be placed atomically, as the guest may
+ * already be running and touching them, so they are read into a buffer
+ * and copied into place with userfaultfd, each one a whole host page.
+ * They can arrive before the main channel tells that the destination
+ * is ready for them, in which case they wait.
+ */
+static int multifd_recv_postcopy_pages(MultiFDRecvParams *p, Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    int ret;
+
+    qemu_event_wait(&multifd_recv_state->postcopy_listen);
+    if (p->quit) {
+        return -1;
+    }
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x "
+                   "for postcopy", p->id, flags, MULTIFD_FLAG_NOCOMP);
+        return -1;
+    }
+    if (qemu_ram_pagesize(p->block) != p->page_size) {
+        error_setg(errp, "multifd %u: postcopy pages received for ramblock "
+                   "%s with host page size %zu", p->id, p->block->idstr,
+                   qemu_ram_pagesize(p->block));
+        return -1;
+    }
+
+    if (!p->postcopy_buf) {
+        p->postcopy_buf = g_malloc(p->page_count * p->page_size);
+    }
+    for (int i = 0; i < p->normal_num; i++) {
+        p->iov[i].iov_base = p->postcopy_buf + i * p->page_size;
+        p->iov[i].iov_len = p->page_size;
+    }
+    ret = qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (int i = 0; i < p->normal_num; i++) {
+        if (postcopy_place_page(mis, p->host + p->normal[i],
+                                p->postcopy_buf + i * p->page_size,
+                                p->block)) {
+            error_setg(errp, "multifd %u: failed to place page at offset "
+                       RAM_ADDR_FMT " of ramblock %s", p->id, p->normal[i],
+                       p->block->idstr);
+            return -1;
+        }
+    }
+    for (int i = 0; i < p->zero_num; i++) {
+        if (postcopy_place_page_zero(mis, p->host + p->zero[i], p->block)) {
+            error_setg(errp, "multifd %u: failed to place zero page at offset "
+                       RAM_ADDR_FMT " of ramblock %s", p->id, p->zero[i],
+                       p->block->idstr);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1127,17 +1277,30 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
-        if (p->normal_num) {
-            ret = multifd_recv_state->ops->recv_pages(p, &local_err);
+        if ((flags & MULTIFD_FLAG_POSTCOPY) &&
+            (p->normal_num || p->zero_num)) {
+            ret = multifd_recv_postcopy_pages(p, &local_err);
             if (ret != 0) {
                 break;
             }
+        } else {
+            if (p->normal_num) {
+                ret = multifd_recv_state->ops->recv_pages(p, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
+
+            for (int i = 0; i < p->zero_num; i++) {
+                ram_handle_compressed(p->host + p->zero[i], 0, p->page_size);
+            }
         }
 
         if (flags & MULTIFD_FLAG_SYNC) {
@@ -1155,7 +1318,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1179,6 +1343,7 @@ int multifd_load_setup(Error **errp)
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     qatomic_set(&multifd_recv_state->count, 0);
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_event_init(&multifd_recv_state->postcopy_listen, false);
     multifd_recv_state->ops = multifd_ops[migrate_multifd_compression()];
 
     for (i = 0; i < thread_count; i++) {
@@ -1194,6 +1359,7 @@ int multifd_load_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
         p->page_count = page_count;
         p->page_size = qemu_target_page_size();
     }
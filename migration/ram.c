@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
@@ -53,6 +54,7 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
@@ -129,6 +131,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Whether the page was requested by the destination during postcopy */
+    bool          postcopy_requested;
     /* Whether we're sending a host page */
     bool          host_page_sending;
     /* The start/end of current host page.  Invalid if host_page_sending==false */
@@ -415,6 +419,11 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /*
+     * An urgent request found its page sent already, so the migration
+     * thread should flush the multifd pages, see ram_multifd_flush().
+     */
+    bool multifd_flush_requested;
 };
 typedef struct RAMState RAMState;
 
@@ -547,6 +556,7 @@ static void pss_init(PageSearchStatus *pss, RAMBlock *rb, ram_addr_t page)
     pss->block = rb;
     pss->page = page;
     pss->complete_round = false;
+    pss->postcopy_requested = false;
 }
 
 /*
@@ -750,6 +760,23 @@ static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
     }
 }
 
+/*
+ * Throttle the vCPUs that dirty memory the fastest, so that the guest dirties
+ * memory no faster than the threshold rate of the transfer rate, and
+ * leave the other vCPUs alone.
+ */
+static void migration_dirty_limit_guest(RAMState *rs,
+                                        uint64_t bytes_dirty_threshold)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t period = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                     rs->time_last_bitmap_sync;
+    uint64_t quota = bytes_dirty_threshold * 1000 / MAX(period, 1) / MiB;
+
+    trace_migration_dirty_limit_guest(quota);
+    dirtylimit_migration_throttle(quota, s->parameters.vcpu_dirty_limit);
+}
+
 void mig_throttle_counter_reset(void)
 {
     RAMState *rs = ram_state;
@@ -1107,6 +1134,123 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Blocks of at least two chunks, aligned to words of the dirty bitmaps, are
+ * synced a chunk at a time by up to RAM_SYNC_MAX_THREADS threads.  Chunks
+ * are whole words of the bitmaps, so that no two threads write the same
+ * word of a block bitmap.
+ */
+#define RAM_SYNC_CHUNK_PAGES (1UL << 20)
+#define RAM_SYNC_MAX_THREADS 16
+
+typedef struct RAMSyncBlock {
+    RAMBlock *block;
+    unsigned long pages;
+    /* Next chunk to take, size_t to be atomic on all hosts */
+    size_t next;
+} RAMSyncBlock;
+
+typedef struct RAMSyncThread {
+    QemuThread thread;
+    RAMSyncBlock *blocks;
+    int nr_blocks;
+    uint64_t num_dirty;
+} RAMSyncThread;
+
+/*
+ * Runs on the migration thread and on the helper threads, inside the RCU
+ * critical section of the migration thread that waits for them all.
+ */
+static void *ram_sync_dirty_thread(void *opaque)
+{
+    RAMSyncThread *t = opaque;
+    int i;
+
+    for (i = 0; i < t->nr_blocks; i++) {
+        RAMSyncBlock *sb = &t->blocks[i];
+        size_t chunks = DIV_ROUND_UP(sb->pages, RAM_SYNC_CHUNK_PAGES);
+        size_t chunk;
+
+        while ((chunk = qatomic_fetch_inc(&sb->next)) < chunks) {
+            ram_addr_t start = (ram_addr_t)chunk * RAM_SYNC_CHUNK_PAGES;
+            ram_addr_t len = MIN(sb->pages - start, RAM_SYNC_CHUNK_PAGES);
+
+            t->num_dirty += cpu_physical_memory_sync_dirty_words(
+                sb->block, start << TARGET_PAGE_BITS, len << TARGET_PAGE_BITS);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Sync the dirty bitmaps of all the blocks.  Small or unaligned blocks are
+ * synced one after the other, the big ones are split in chunks shared with
+ * helper threads.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void ram_sync_dirty_bitmaps(RAMState *rs)
+{
+    RAMSyncThread threads[RAM_SYNC_MAX_THREADS] = {};
+    g_autofree RAMSyncBlock *blocks = NULL;
+    int i, nr_blocks = 0, num_threads;
+    uint64_t chunks = 0, new_dirty_pages;
+    int64_t start_time;
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->used_length >> TARGET_PAGE_BITS;
+
+        if (!block->clear_bmap || pages < 2 * RAM_SYNC_CHUNK_PAGES ||
+            !cpu_physical_memory_sync_dirty_aligned(block, 0,
+                                                    block->used_length)) {
+            ramblock_sync_dirty_bitmap(rs, block);
+            continue;
+        }
+        blocks = g_renew(RAMSyncBlock, blocks, nr_blocks + 1);
+        blocks[nr_blocks++] = (RAMSyncBlock) {
+            .block = block,
+            .pages = pages,
+        };
+        chunks += DIV_ROUND_UP(pages, RAM_SYNC_CHUNK_PAGES);
+    }
+
+    if (!nr_blocks) {
+        return;
+    }
+
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    num_threads = MIN(g_get_num_processors(), RAM_SYNC_MAX_THREADS);
+    num_threads = MIN(num_threads, chunks);
+    for (i = 0; i < num_threads; i++) {
+        threads[i].blocks = blocks;
+        threads[i].nr_blocks = nr_blocks;
+    }
+    for (i = 1; i < num_threads; i++) {
+        qemu_thread_create(&threads[i].thread, "ram-sync",
+                           ram_sync_dirty_thread, &threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    ram_sync_dirty_thread(&threads[0]);
+    new_dirty_pages = threads[0].num_dirty;
+    for (i = 1; i < num_threads; i++) {
+        qemu_thread_join(&threads[i].thread);
+        new_dirty_pages += threads[i].num_dirty;
+    }
+
+    /* Postponed clear of the dirty log, as in the single threaded sync */
+    for (i = 0; i < nr_blocks; i++) {
+        clear_bmap_set(blocks[i].block, 0, blocks[i].pages);
+    }
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+    trace_ram_sync_dirty_bitmaps(nr_blocks, chunks, num_threads,
+                                 qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                                 start_time);
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1213,12 +1357,19 @@ static void migration_trigger_throttle(RAMState *rs)
             mig_throttle_guest_down(bytes_dirty_period,
                                     bytes_dirty_threshold);
         }
+    } else if (migrate_dirty_limit() && !blk_mig_bulk_active()) {
+        /* Same detection as auto-converge, but only slow down some vCPUs */
+        dirtylimit_migration_start();
+        if ((bytes_dirty_period > bytes_dirty_threshold) &&
+            (++rs->dirty_rate_high_cnt >= 2)) {
+            rs->dirty_rate_high_cnt = 0;
+            migration_dirty_limit_guest(rs, bytes_dirty_threshold);
+        }
     }
 }
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
     int64_t end_time;
 
     ram_counters.dirty_sync_count++;
@@ -1232,9 +1383,7 @@ static void migration_bitmap_sync(RAMState *rs)
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        ram_sync_dirty_bitmaps(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
@@ -1458,7 +1607,10 @@ static int ram_save_multifd_page(QEMUFile *file, RAMBlock *block,
     if (multifd_queue_page(file, block, offset) < 0) {
         return -1;
     }
-    stat64_add(&ram_atomic_counters.normal, 1);
+    /* Otherwise counted by the channel, once it knows if the page is zero */
+    if (!migrate_multifd_zero_page()) {
+        stat64_add(&ram_atomic_counters.normal, 1);
+    }
 
     return 1;
 }
@@ -2075,6 +2227,36 @@ void ram_write_tracking_stop(void)
 }
 #endif /* defined(__linux__) */
 
+/*
+ * With postcopy-multifd, a page requested after it was sent may still be
+ * in the multifd packet being filled up, and the destination would wait
+ * for that to be sent.  The packet belongs to the migration thread, which
+ * is the only one to call this.
+ */
+static void ram_multifd_flush(QEMUFile *f)
+{
+    if (multifd_flush_pages(f) < 0) {
+        error_report("%s: multifd_flush_pages fail", __func__);
+    }
+}
+
+/* Requests served by the return path thread ask for the flush here */
+static void ram_multifd_flush_request(RAMState *rs)
+{
+    if (migrate_postcopy_multifd() &&
+        !qatomic_xchg(&rs->multifd_flush_requested, true)) {
+        migration_make_urgent_request();
+    }
+}
+
+static void ram_multifd_flush_pending(RAMState *rs, QEMUFile *f)
+{
+    if (qatomic_xchg(&rs->multifd_flush_requested, false)) {
+        migration_consume_urgent_request();
+        ram_multifd_flush(f);
+    }
+}
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -2089,6 +2271,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 {
     RAMBlock  *block;
     ram_addr_t offset;
+    bool flush = false;
     bool dirty;
 
     do {
@@ -2107,6 +2290,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
             if (!dirty) {
                 trace_get_queued_page_not_dirty(block->idstr, (uint64_t)offset,
                                                 page);
+                flush = true;
             } else {
                 trace_get_queued_page(block->idstr, (uint64_t)offset, page);
             }
@@ -2114,6 +2298,11 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     } while (block && !dirty);
 
+    if (flush && migrate_postcopy_multifd() && migration_in_postcopy()) {
+        ram_multifd_flush(pss->pss_channel);
+    }
+    ram_multifd_flush_pending(rs, pss->pss_channel);
+
     if (!block) {
         /*
          * Poll write faults too if background snapshot is enabled; that's
@@ -2226,6 +2415,7 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         qemu_mutex_lock(&rs->bitmap_mutex);
 
         pss_init(pss, ramblock, page_start);
+        pss->postcopy_requested = true;
         /*
          * Always use the preempt channel, and make sure it's there.  It's
          * safe to access without lock, because when rp-thread is running
@@ -2331,6 +2521,32 @@ static bool save_compress_page(RAMState *rs, PageSearchStatus *pss,
     return false;
 }
 
+/*
+ * Whether to send the page through multifd
+ *
+ * By default, do not use multifd in postcopy as one whole host page should
+ * be placed.  Meanwhile postcopy requires atomic update of pages, so even
+ * if host page size == guest page size the dest guest during run may still
+ * see partially copied pages which is data corruption.
+ *
+ * With postcopy-multifd, the destination places the pages it gets from
+ * multifd during postcopy atomically, one at a time, so pages pushed in
+ * the background can go through multifd as long as each is a whole host
+ * page.  Requested pages keep their channel, which is not held up by the
+ * background push.
+ */
+static bool ram_save_use_multifd(PageSearchStatus *pss)
+{
+    if (!migrate_use_multifd()) {
+        return false;
+    }
+    if (!migration_in_postcopy()) {
+        return true;
+    }
+    return migrate_postcopy_multifd() && !pss->postcopy_requested &&
+           qemu_ram_pagesize(pss->block) == TARGET_PAGE_SIZE;
+}
+
 /**
  * ram_save_target_page_legacy: save one target page
  *
@@ -2353,6 +2569,15 @@ static int ram_save_target_page_legacy(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /*
+     * Multifd channels may check for zero pages themselves, which spreads
+     * that work over them.  Pages sent through multifd are not kept in
+     * the XBZRLE cache, so it need not know about them.
+     */
+    if (ram_save_use_multifd(pss) && migrate_multifd_zero_page()) {
+        return ram_save_multifd_page(pss->pss_channel, block, offset);
+    }
+
     res = save_zero_page(pss, pss->pss_channel, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2366,13 +2591,7 @@ static int ram_save_target_page_legacy(RAMState *rs, PageSearchStatus *pss)
         return res;
     }
 
-    /*
-     * Do not use multifd in postcopy as one whole host page should be
-     * placed.  Meanwhile postcopy requires atomic update of pages, so even
-     * if host page size == guest page size the dest guest during run may
-     * still see partially copied pages which is data corruption.
-     */
-    if (migrate_use_multifd() && !migration_in_postcopy()) {
+    if (ram_save_use_multifd(pss)) {
         return ram_save_multifd_page(pss->pss_channel, block, offset);
     }
 
@@ -2457,6 +2676,7 @@ static int ram_save_host_page_urgent(PageSearchStatus *pss)
     if (pss_overlap(pss, &ram_state->pss[RAM_CHANNEL_PRECOPY])) {
         trace_postcopy_preempt_hit(pss->block->idstr,
                                    pss->page << TARGET_PAGE_BITS);
+        ram_multifd_flush_request(rs);
         return 0;
     }
 
@@ -2479,6 +2699,9 @@ out:
     /* For urgent requests, flush immediately if sent */
     if (sent) {
         qemu_fflush(pss->pss_channel);
+    } else {
+        /* It may wait in a multifd packet, have that sent */
+        ram_multifd_flush_request(rs);
     }
     return ret;
 }
@@ -2604,7 +2827,8 @@ static int ram_find_and_save_block(RAMState *rs)
     pss_init(pss, rs->last_seen_block, rs->last_page);
 
     while (true){
-        if (!get_queued_page(rs, pss)) {
+        pss->postcopy_requested = get_queued_page(rs, pss);
+        if (!pss->postcopy_requested) {
             /* priority queue empty, so just search for something dirty */
             int res = find_dirty_block(rs, pss);
             if (res != PAGE_DIRTY_FOUND) {
@@ -3345,6 +3569,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         smp_rmb();
 
         ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+        ram_multifd_flush_pending(rs, f);
 
         t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         i = 0;
@@ -40,6 +40,7 @@
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/clone-visitor.h"
@@ -2017,6 +2018,8 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
             postcopy_ram_incoming_cleanup(mis);
             return -1;
         }
+        /* Pages pushed through multifd during postcopy can be placed now */
+        multifd_recv_postcopy_listen();
     }
 
     trace_loadvm_postcopy_handle_listen("after uffd");
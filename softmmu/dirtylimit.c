@@ -72,6 +72,15 @@ static QemuMutex dirtylimit_mutex;
 /* dirtylimit thread quit if dirtylimit_quit is true */
 static bool dirtylimit_quit;
 
+/* limits are set by migration, with the dirty-limit capability */
+static bool dirtylimit_migration;
+
+/*
+ * Limits the user had set when migration took over, per vcpu and 0 for
+ * none.  Migration keeps vcpus within them and restores them once done.
+ */
+static uint64_t *dirtylimit_user_quota;
+
 static void vcpu_dirty_rate_stat_collect(void)
 {
     VcpuStat stat;
@@ -425,6 +434,119 @@ static void dirtylimit_cleanup(void)
     dirtylimit_state_finalize();
 }
 
+void dirtylimit_migration_start(void)
+{
+    int i;
+
+    dirtylimit_state_lock();
+
+    if (dirtylimit_migration) {
+        dirtylimit_state_unlock();
+        return;
+    }
+
+    if (!dirtylimit_in_service()) {
+        dirtylimit_init();
+    } else {
+        dirtylimit_user_quota = g_new0(uint64_t, dirtylimit_state->max_cpus);
+        for (i = 0; i < dirtylimit_state->max_cpus; i++) {
+            if (dirtylimit_vcpu_get_state(i)->enabled) {
+                dirtylimit_user_quota[i] = dirtylimit_vcpu_get_state(i)->quota;
+            }
+        }
+    }
+    dirtylimit_migration = true;
+
+    dirtylimit_state_unlock();
+}
+
+void dirtylimit_migration_stop(void)
+{
+    int i;
+
+    dirtylimit_state_lock();
+
+    if (dirtylimit_migration && dirtylimit_user_quota) {
+        for (i = 0; i < dirtylimit_state->max_cpus; i++) {
+            dirtylimit_set_vcpu(i, dirtylimit_user_quota[i],
+                                dirtylimit_user_quota[i] != 0);
+        }
+        g_free(dirtylimit_user_quota);
+        dirtylimit_user_quota = NULL;
+    } else if (dirtylimit_migration && dirtylimit_in_service()) {
+        dirtylimit_set_all(0, false);
+        dirtylimit_cleanup();
+    }
+    dirtylimit_migration = false;
+
+    dirtylimit_state_unlock();
+}
+
+static int dirtylimit_rate_cmp(const void *a, const void *b)
+{
+    uint64_t rate_a = *(const uint64_t *)a;
+    uint64_t rate_b = *(const uint64_t *)b;
+
+    return rate_a < rate_b ? -1 : rate_a > rate_b;
+}
+
+void dirtylimit_migration_throttle(uint64_t quota, uint64_t min_quota)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int max_cpus = ms->smp.max_cpus;
+    g_autofree uint64_t *rates = g_new(uint64_t, max_cpus);
+    g_autofree uint64_t *sorted = g_new(uint64_t, max_cpus);
+    uint64_t left = quota, share, limit;
+    int i, nr_sorted = 0, nr_left = 0;
+
+    dirtylimit_state_lock();
+
+    if (!dirtylimit_migration || !dirtylimit_in_service()) {
+        dirtylimit_state_unlock();
+        return;
+    }
+
+    /* vCPUs that are limited already count as the fastest ones */
+    for (i = 0; i < max_cpus; i++) {
+        rates[i] = vcpu_dirty_rate_get(i);
+        if (dirtylimit_vcpu_get_state(i)->enabled) {
+            nr_left++;
+        } else {
+            sorted[nr_sorted++] = rates[i];
+        }
+    }
+    qsort(sorted, nr_sorted, sizeof(*sorted), dirtylimit_rate_cmp);
+
+    /*
+     * Hand out the quota from the slowest vCPU up, each taking no more
+     * than an even share of what is left.  The first vCPU that dirties
+     * faster than that share, and all the faster ones, get the share.
+     */
+    nr_left += nr_sorted;
+    for (i = 0; i < nr_sorted && sorted[i] <= left / nr_left; i++) {
+        left -= sorted[i];
+        nr_left--;
+    }
+    if (!nr_left) {
+        /* Together, all the vCPUs already dirty less than the quota */
+        dirtylimit_state_unlock();
+        return;
+    }
+    share = left / nr_left;
+    limit = MAX(share, min_quota);
+    trace_dirtylimit_migration_throttle(quota, limit, nr_left);
+
+    for (i = 0; i < max_cpus; i++) {
+        if (dirtylimit_user_quota && dirtylimit_user_quota[i]) {
+            dirtylimit_set_vcpu(i, MIN(limit, dirtylimit_user_quota[i]), true);
+        } else if (dirtylimit_vcpu_get_state(i)->enabled || rates[i] > share) {
+            dirtylimit_set_vcpu(i, limit, true);
+        }
+    }
+
+    dirtylimit_state_unlock();
+}
+
 void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index,
                                  int64_t cpu_index,
                                  Error **errp)
@@ -444,6 +566,13 @@ void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index,
 
     dirtylimit_state_lock();
 
+    if (dirtylimit_migration) {
+        dirtylimit_state_unlock();
+        error_setg(errp, "dirty page limits are set by the migration in "
+                   "progress");
+        return;
+    }
+
     if (has_cpu_index) {
         dirtylimit_set_vcpu(cpu_index, 0, false);
     } else {
@@ -495,6 +624,13 @@ void qmp_set_vcpu_dirty_limit(bool has_cpu_index,
 
     dirtylimit_state_lock();
 
+    if (dirtylimit_migration) {
+        dirtylimit_state_unlock();
+        error_setg(errp, "dirty page limits are set by the migration in "
+                   "progress");
+        return;
+    }
+
     if (!dirtylimit_in_service()) {
         dirtylimit_init();
     }
@@ -92,6 +92,11 @@ static void print_stats_results(Monitor *mon, StatsTarget target,
                        StatsProvider_str(result->provider));
     }
 
+    /* There can be many CXL devices */
+    if (target == STATS_TARGET_CXL && result->qom_path) {
+        monitor_printf(mon, "%s:\n", result->qom_path);
+    }
+
     for (stats_list = result->stats; stats_list;
              stats_list = stats_list->next,
              schema_value_list = schema_value_list->next) {
@@ -157,6 +162,8 @@ static StatsFilter *stats_filter(StatsTarget target, const char *names,
     }
     case STATS_TARGET_CRYPTODEV:
         break;
+    case STATS_TARGET_CXL:
+        break;
     default:
         break;
     }
@@ -229,6 +236,7 @@ void hmp_info_stats(Monitor *mon, const QDict *qdict)
         filter = stats_filter(target, names, cpu_index, provider);
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_CXL:
         filter = stats_filter(target, names, -1, provider);
         break;
     default:
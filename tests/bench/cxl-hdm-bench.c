@@ -0,0 +1,100 @@
+/*
+ * CXL HDM decoder lookup benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Times HPA to DPA translation through the decoder table of a Type 3 device
+ * with 1, 4 and 8 committed decoders, which should cost about the same.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "hw/cxl/cxl_component.h"
+
+#define CXL_HDM_BENCH_LOOKUPS (32 * 1024 * 1024)
+#define CXL_HDM_BENCH_ADDRS 4096
+
+static void cxl_hdm_bench_commit(uint32_t *cache_mem, int which,
+                                 uint64_t base, uint64_t size, uint64_t skip)
+{
+    uint32_t *regs = cache_mem + which * CXL_HDM_DECODER_STRIDE;
+    uint32_t ctrl = 0;
+
+    regs[R_CXL_HDM_DECODER0_BASE_LO] = base;
+    regs[R_CXL_HDM_DECODER0_BASE_HI] = base >> 32;
+    regs[R_CXL_HDM_DECODER0_SIZE_LO] = size;
+    regs[R_CXL_HDM_DECODER0_SIZE_HI] = size >> 32;
+    regs[R_CXL_HDM_DECODER0_DPA_SKIP_LO] = skip;
+    regs[R_CXL_HDM_DECODER0_DPA_SKIP_HI] = skip >> 32;
+    ctrl = FIELD_DP32(ctrl, CXL_HDM_DECODER0_CTRL, COMMITTED, 1);
+    regs[R_CXL_HDM_DECODER0_CTRL] = ctrl;
+}
+
+static void test_hdm_lookup_speed(const void *opaque)
+{
+    int decoders = GPOINTER_TO_INT(opaque);
+    uint32_t *cache_mem = g_new0(uint32_t, CXL2_COMPONENT_CM_REGION_SIZE >> 2);
+    CXLHDMDecoderTable *table = g_new0(CXLHDMDecoderTable, 1);
+    uint64_t *addrs = g_new(uint64_t, CXL_HDM_BENCH_ADDRS);
+    const CXLHDMDecoder *decoder;
+    uint64_t sum = 0;
+    int i;
+
+    ARRAY_FIELD_DP32(cache_mem, CXL_HDM_DECODER_CAPABILITY, DECODER_COUNT,
+                     cxl_decoder_count_enc(CXL_HDM_DECODER_COUNT));
+
+    /* 256MiB regions with a 256MiB hole and 256MiB of DPA skip between */
+    for (i = 0; i < decoders; i++) {
+        cxl_hdm_bench_commit(cache_mem, i, 4 * GiB + i * 512 * MiB, 256 * MiB,
+                             i ? 256 * MiB : 0);
+    }
+    cxl_hdm_table_build(table, cache_mem);
+    g_assert_cmpint(table->count, ==, decoders);
+
+    for (i = 0; i < CXL_HDM_BENCH_ADDRS; i++) {
+        addrs[i] = 4 * GiB + g_test_rand_int_range(0, decoders) * 512 * MiB +
+                   g_test_rand_int_range(0, 256 * MiB);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < CXL_HDM_BENCH_LOOKUPS; i++) {
+        uint64_t hpa = addrs[i % CXL_HDM_BENCH_ADDRS];
+
+        decoder = cxl_hdm_table_find(table, hpa, NULL);
+        sum += cxl_hdm_decoder_dpa(decoder, hpa);
+    }
+    g_test_timer_elapsed();
+
+    g_test_message("%d decoders: %.2f ns/lookup (%" PRIx64 ")", decoders,
+                   g_test_timer_last() * 1e9 / CXL_HDM_BENCH_LOOKUPS, sum);
+
+    /* Last decoder is preceded by all the others and their skips */
+    decoder = cxl_hdm_table_find(table, 4 * GiB + (decoders - 1) * 512 * MiB,
+                                 NULL);
+    g_assert(decoder);
+    g_assert_cmpuint(decoder->dpa_base, ==, (decoders - 1) * 512 * MiB);
+    g_assert_null(cxl_hdm_table_find(table, 4 * GiB + 256 * MiB, NULL));
+
+    g_free(addrs);
+    g_free(table);
+    g_free(cache_mem);
+}
+
+int main(int argc, char **argv)
+{
+    static const int decoders[] = { 1, 4, 8 };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(decoders); i++) {
+        g_autofree char *name =
+            g_strdup_printf("/cxl/benchmark/hdm/lookup/decoders-%d",
+                            decoders[i]);
+
+        g_test_add_data_func(name, GINT_TO_POINTER(decoders[i]),
+                             test_hdm_lookup_speed);
+    }
+
+    return g_test_run();
+}
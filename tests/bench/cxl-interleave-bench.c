@@ -0,0 +1,269 @@
+/*
+ * CXL fixed memory window interleave benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Starts a q35 machine with a fixed memory window interleaved across 1 up
+ * to 16 host bridges, at granularities of 256B up to 16KiB, each host
+ * bridge with a single root port and Type 3 device, and commits the HDM
+ * decoders of the devices as firmware would.  Then it times:
+ *
+ * - single accesses at random addresses of the window, less the same
+ *   accesses to guest RAM, so roughly the decode cost of cfmws_ops when
+ *   the interleave is finer than a page and the window cannot be mapped
+ *   directly
+ * - sequential and random bandwidth through the window
+ * - committing and uncommitting a decoder, which rebuilds the window
+ *   decode and its direct mappings
+ *
+ * Everything goes through the qtest protocol, whose overhead is part of
+ * the results, so they are only comparable between runs on the same host.
+ *
+ * Needs QTEST_QEMU_BINARY to point at a qemu-system-x86_64 built with CXL.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/host-utils.h"
+#include "libqtest.h"
+#include "hw/pci/pci_regs.h"
+#include "libqos/pci-pc.h"
+
+#define CXL_BENCH_T3D_SIZE (256 * MiB)
+#define CXL_BENCH_HB_BUS(hb) (16 + (hb) * 4)
+#define CXL_BENCH_ACCESSES 4096
+#define CXL_BENCH_SEQ_SIZE (16 * MiB)
+#define CXL_BENCH_SEQ_CHUNK (1 * MiB)
+#define CXL_BENCH_RAND_CHUNK (4 * KiB)
+#define CXL_BENCH_RECOMMITS 256
+/* Guest RAM to compare single accesses with */
+#define CXL_BENCH_RAM_BASE (16 * MiB)
+
+/* HDM decoder 0 of a Type 3 device, in its component registers in BAR 0 */
+#define CXL_BENCH_HDM_DECODER0_BASE_LO (0x1000 + 0x120)
+#define CXL_BENCH_HDM_DECODER0_BASE_HI (0x1000 + 0x124)
+#define CXL_BENCH_HDM_DECODER0_SIZE_LO (0x1000 + 0x128)
+#define CXL_BENCH_HDM_DECODER0_SIZE_HI (0x1000 + 0x12c)
+#define CXL_BENCH_HDM_DECODER0_CTRL (0x1000 + 0x130)
+#define CXL_BENCH_HDM_DECODER_CTRL_IW_SHIFT 4
+#define CXL_BENCH_HDM_DECODER_CTRL_COMMIT (1 << 9)
+
+typedef struct CXLInterleaveBench {
+    int ways;
+    int gran;
+} CXLInterleaveBench;
+
+typedef struct CXLInterleaveMachine {
+    QTestState *qts;
+    QPCIBus *pcibus;
+    QPCIDevice *t3d[16];
+    QPCIBar bar[16];
+    uint64_t base;
+    uint64_t size;
+    uint32_t ctrl;
+} CXLInterleaveMachine;
+
+static char *cxl_bench_args(const CXLInterleaveBench *b)
+{
+    GString *args = g_string_new("-machine q35,cxl=on ");
+    int hb;
+
+    for (hb = 0; hb < b->ways; hb++) {
+        g_string_append_printf(args,
+                               "-device pxb-cxl,id=cxl.%d,bus=pcie.0,bus_nr=%d "
+                               "-device cxl-rp,id=rp%d,bus=cxl.%d,chassis=%d,"
+                               "slot=0 "
+                               "-object memory-backend-ram,id=vmem%d,size=%"
+                               PRIu64 " "
+                               "-device cxl-type3,bus=rp%d,volatile-memdev="
+                               "vmem%d,id=cxl-vmem%d ",
+                               hb, CXL_BENCH_HB_BUS(hb), hb, hb, hb, hb,
+                               CXL_BENCH_T3D_SIZE, hb, hb, hb);
+    }
+
+    g_string_append_printf(args, "-M cxl-fmw.0.size=%" PRIu64 ","
+                           "cxl-fmw.0.interleave-granularity=%d",
+                           b->ways * CXL_BENCH_T3D_SIZE, b->gran);
+    for (hb = 0; hb < b->ways; hb++) {
+        g_string_append_printf(args, ",cxl-fmw.0.targets.%d=cxl.%d", hb, hb);
+    }
+
+    return g_string_free(args, false);
+}
+
+static uint64_t cxl_bench_fmw_base(QTestState *qts)
+{
+    g_autofree char *mtree = qtest_hmp(qts, "info mtree");
+    char *line = strstr(mtree, ": cxl-fixed-memory-region");
+
+    g_assert(line);
+    while (line > mtree && line[-1] != '\n') {
+        line--;
+    }
+    return g_ascii_strtoull(line, NULL, 16);
+}
+
+static void cxl_bench_commit(CXLInterleaveMachine *m, int hb, bool commit)
+{
+    qpci_io_writel(m->t3d[hb], m->bar[hb], CXL_BENCH_HDM_DECODER0_CTRL,
+                   m->ctrl | (commit ? CXL_BENCH_HDM_DECODER_CTRL_COMMIT : 0));
+}
+
+/*
+ * Do what firmware would: give each root port a bus and a 1MiB memory
+ * window for the registers of its device, and commit the first HDM decoder
+ * of each device to take its share of the whole fixed memory window.  Host
+ * bridges with a single root port need no decoders.
+ */
+static void cxl_bench_start(CXLInterleaveMachine *m,
+                            const CXLInterleaveBench *b)
+{
+    g_autofree char *args = cxl_bench_args(b);
+    int hb;
+
+    m->qts = qtest_init(args);
+    m->pcibus = qpci_new_pc(m->qts, NULL);
+    m->base = cxl_bench_fmw_base(m->qts);
+    m->size = b->ways * CXL_BENCH_T3D_SIZE;
+    m->ctrl = (ctz32(b->gran) - 8) |
+              ctz32(b->ways) << CXL_BENCH_HDM_DECODER_CTRL_IW_SHIFT;
+
+    for (hb = 0; hb < b->ways; hb++) {
+        int bus = CXL_BENCH_HB_BUS(hb);
+        uint16_t window = 0xe000 + hb * 0x10;
+        QPCIDevice *rp;
+
+        rp = qpci_device_find(m->pcibus, bus << 8);
+        g_assert(rp);
+        qpci_config_writeb(rp, PCI_SECONDARY_BUS, bus + 1);
+        qpci_config_writeb(rp, PCI_SUBORDINATE_BUS, bus + 1);
+        qpci_config_writew(rp, PCI_MEMORY_BASE, window);
+        qpci_config_writew(rp, PCI_MEMORY_LIMIT, window);
+        qpci_config_writew(rp, PCI_COMMAND, PCI_COMMAND_MEMORY);
+        g_free(rp);
+
+        m->t3d[hb] = qpci_device_find(m->pcibus, (bus + 1) << 8);
+        g_assert(m->t3d[hb]);
+        qpci_device_enable(m->t3d[hb]);
+        m->pcibus->mmio_alloc_ptr = (uint64_t)window << 16;
+        m->bar[hb] = qpci_iomap(m->t3d[hb], 0, NULL);
+
+        qpci_io_writel(m->t3d[hb], m->bar[hb], CXL_BENCH_HDM_DECODER0_BASE_LO,
+                       (uint32_t)m->base);
+        qpci_io_writel(m->t3d[hb], m->bar[hb], CXL_BENCH_HDM_DECODER0_BASE_HI,
+                       m->base >> 32);
+        qpci_io_writel(m->t3d[hb], m->bar[hb], CXL_BENCH_HDM_DECODER0_SIZE_LO,
+                       (uint32_t)m->size);
+        qpci_io_writel(m->t3d[hb], m->bar[hb], CXL_BENCH_HDM_DECODER0_SIZE_HI,
+                       m->size >> 32);
+        cxl_bench_commit(m, hb, true);
+    }
+}
+
+static void cxl_bench_stop(CXLInterleaveMachine *m, int ways)
+{
+    int hb;
+
+    for (hb = 0; hb < ways; hb++) {
+        g_free(m->t3d[hb]);
+    }
+    qpci_free_pc(m->pcibus);
+    qtest_quit(m->qts);
+}
+
+static double cxl_bench_time_accesses(QTestState *qts, uint64_t base,
+                                      uint64_t size)
+{
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < CXL_BENCH_ACCESSES; i++) {
+        uint64_t offset = g_test_rand_int_range(0, size / 8) * 8;
+
+        qtest_readq(qts, base + offset);
+    }
+    return g_test_timer_elapsed();
+}
+
+static void test_cxl_interleave_speed(const void *opaque)
+{
+    const CXLInterleaveBench *b = opaque;
+    CXLInterleaveMachine m = {};
+    g_autofree uint8_t *buf = g_malloc(CXL_BENCH_SEQ_CHUNK);
+    double window_time, ram_time, seq_time, rand_time, commit_time;
+    uint64_t offset;
+    int i;
+
+    cxl_bench_start(&m, b);
+
+    /* Each granule goes to the next device, and must come back from it */
+    for (i = 0; i < b->ways; i++) {
+        qtest_writeq(m.qts, m.base + i * b->gran, 0x0123456789abcdefULL + i);
+    }
+    for (i = 0; i < b->ways; i++) {
+        g_assert_cmphex(qtest_readq(m.qts, m.base + i * b->gran), ==,
+                        0x0123456789abcdefULL + i);
+        qtest_writeq(m.qts, m.base + i * b->gran, 0);
+    }
+
+    window_time = cxl_bench_time_accesses(m.qts, m.base, m.size);
+    ram_time = cxl_bench_time_accesses(m.qts, CXL_BENCH_RAM_BASE,
+                                       CXL_BENCH_T3D_SIZE / 4);
+
+    g_test_timer_start();
+    for (offset = 0; offset < CXL_BENCH_SEQ_SIZE;
+         offset += CXL_BENCH_SEQ_CHUNK) {
+        qtest_bufread(m.qts, m.base + offset, buf, CXL_BENCH_SEQ_CHUNK);
+    }
+    seq_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < CXL_BENCH_SEQ_SIZE / CXL_BENCH_RAND_CHUNK; i++) {
+        offset = g_test_rand_int_range(0, m.size / CXL_BENCH_RAND_CHUNK) *
+                 CXL_BENCH_RAND_CHUNK;
+        qtest_bufread(m.qts, m.base + offset, buf, CXL_BENCH_RAND_CHUNK);
+    }
+    rand_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < CXL_BENCH_RECOMMITS; i++) {
+        cxl_bench_commit(&m, 0, false);
+        cxl_bench_commit(&m, 0, true);
+    }
+    commit_time = g_test_timer_elapsed();
+
+    g_test_message("%d ways, %d byte granularity: %.0f ns/access over RAM, "
+                   "%.1f MiB/s sequential, %.1f MiB/s random, "
+                   "%.1f us/decoder commit", b->ways, b->gran,
+                   (window_time - ram_time) * 1e9 / CXL_BENCH_ACCESSES,
+                   CXL_BENCH_SEQ_SIZE / seq_time / MiB,
+                   CXL_BENCH_SEQ_SIZE / rand_time / MiB,
+                   commit_time * 1e6 / (2 * CXL_BENCH_RECOMMITS));
+
+    cxl_bench_stop(&m, b->ways);
+}
+
+int main(int argc, char **argv)
+{
+    static const int ways[] = { 1, 2, 4, 8, 16 };
+    static const int grans[] = { 256, 1024, 4096, 16384 };
+    static CXLInterleaveBench benches[ARRAY_SIZE(ways) * ARRAY_SIZE(grans)];
+    int i, j;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(ways); i++) {
+        for (j = 0; j < ARRAY_SIZE(grans); j++) {
+            CXLInterleaveBench *b = &benches[i * ARRAY_SIZE(grans) + j];
+            g_autofree char *name = NULL;
+
+            b->ways = ways[i];
+            b->gran = grans[j];
+            name = g_strdup_printf("/cxl/benchmark/interleave/ways-%d/gran-%d",
+                                   b->ways, b->gran);
+            g_test_add_data_func(name, b, test_cxl_interleave_speed);
+        }
+    }
+
+    return g_test_run();
+}
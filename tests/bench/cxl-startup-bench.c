@@ -0,0 +1,93 @@
+/*
+ * CXL topology startup benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * Times the start of a q35 machine with 1 up to 16 CXL host bridges, the
+ * most the host bridge register space has room for, each with root ports
+ * and Type 3 devices below them, a fixed memory window per host bridge and
+ * one interleaved across all of them.  Time per host bridge should stay
+ * about the same as the topology grows.
+ *
+ * Needs QTEST_QEMU_BINARY to point at a qemu-system-x86_64 built with CXL.
+ */
+#include "qemu/osdep.h"
+#include "libqtest.h"
+
+#define CXL_STARTUP_BENCH_PORTS 4
+#define CXL_STARTUP_BENCH_RUNS 3
+
+static char *cxl_startup_bench_args(int hbs)
+{
+    GString *args = g_string_new("-machine q35,cxl=on ");
+    int hb, port;
+
+    for (hb = 0; hb < hbs; hb++) {
+        g_string_append_printf(args, "-device pxb-cxl,id=cxl.%d,bus=pcie.0,"
+                               "bus_nr=%d ", hb, 16 + hb * 12);
+        for (port = 0; port < CXL_STARTUP_BENCH_PORTS; port++) {
+            int dev = hb * CXL_STARTUP_BENCH_PORTS + port;
+
+            g_string_append_printf(args, "-device cxl-rp,id=rp%d,bus=cxl.%d,"
+                                   "chassis=%d,slot=%d ", dev, hb, hb, port);
+            g_string_append_printf(args, "-object memory-backend-ram,"
+                                   "id=vmem%d,size=256M ", dev);
+            g_string_append_printf(args, "-device cxl-type3,bus=rp%d,"
+                                   "volatile-memdev=vmem%d,id=cxl-vmem%d ",
+                                   dev, dev, dev);
+        }
+        g_string_append_printf(args, "-M cxl-fmw.%d.targets.0=cxl.%d,"
+                               "cxl-fmw.%d.size=4G ", hb, hb, hb);
+    }
+
+    g_string_append_printf(args, "-M cxl-fmw.%d.size=%dG", hbs, 4 * hbs);
+    for (hb = 0; hb < hbs; hb++) {
+        g_string_append_printf(args, ",cxl-fmw.%d.targets.%d=cxl.%d",
+                               hbs, hb, hb);
+    }
+
+    return g_string_free(args, false);
+}
+
+static void test_cxl_startup_speed(const void *opaque)
+{
+    int hbs = GPOINTER_TO_INT(opaque);
+    g_autofree char *args = cxl_startup_bench_args(hbs);
+    double total = 0;
+    int i;
+
+    for (i = 0; i < CXL_STARTUP_BENCH_RUNS; i++) {
+        QTestState *qts;
+
+        g_test_timer_start();
+        qts = qtest_init(args);
+        /* Machine init, CXL linking included, is done once QMP is up */
+        g_test_timer_elapsed();
+        total += g_test_timer_last();
+        qtest_quit(qts);
+    }
+
+    g_test_message("%d host bridges, %d Type 3 devices: %.2f ms to start, "
+                   "%.2f ms/host bridge", hbs, hbs * CXL_STARTUP_BENCH_PORTS,
+                   total * 1e3 / CXL_STARTUP_BENCH_RUNS,
+                   total * 1e3 / CXL_STARTUP_BENCH_RUNS / hbs);
+}
+
+int main(int argc, char **argv)
+{
+    static const int hbs[] = { 1, 4, 16 };
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(hbs); i++) {
+        g_autofree char *name =
+            g_strdup_printf("/cxl/benchmark/startup/host-bridges-%d", hbs[i]);
+
+        g_test_add_data_func(name, GINT_TO_POINTER(hbs[i]),
+                             test_cxl_startup_speed);
+    }
+
+    return g_test_run();
+}
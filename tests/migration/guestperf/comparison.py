@@ -135,4 +135,22 @@ def __init__(self, name, scenarios):
         Scenario("compr-multifd-channels-64",
                  multifd=True, multifd_channels=64),
     ]),
+
+
+    # Looking at effect of multifd compression methods
+    # with a fixed number of channels
+    Comparison("compr-multifd-method", scenarios = [
+        Scenario("compr-multifd-method-none",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="none"),
+        Scenario("compr-multifd-method-zlib",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zlib"),
+        Scenario("compr-multifd-method-zstd",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="zstd"),
+        Scenario("compr-multifd-method-lz4",
+                 multifd=True, multifd_channels=8,
+                 multifd_compression="lz4"),
+    ]),
 ]
@@ -195,6 +195,8 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                ])
             resp = src.command("migrate-set-parameters",
                                multifd_channels=scenario._multifd_channels)
+            resp = src.command("migrate-set-parameters",
+                               multifd_compression=scenario._multifd_compression)
             resp = dst.command("migrate-set-capabilities",
                                capabilities = [
                                    { "capability": "multifd",
@@ -202,6 +204,8 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                                ])
             resp = dst.command("migrate-set-parameters",
                                multifd_channels=scenario._multifd_channels)
+            resp = dst.command("migrate-set-parameters",
+                               multifd_compression=scenario._multifd_compression)
 
         resp = src.command("migrate", uri=connect_uri)
 
@@ -126,6 +126,8 @@ def __init__(self):
                             action="store_true")
         parser.add_argument("--multifd-channels", dest="multifd_channels",
                             default=2, type=int)
+        parser.add_argument("--multifd-compression", dest="multifd_compression",
+                            default="none")
 
     def get_scenario(self, args):
         return Scenario(name="perfreport",
@@ -150,7 +152,8 @@ def get_scenario(self, args):
                         compression_xbzrle_cache=args.compression_xbzrle_cache,
 
                         multifd=args.multifd,
-                        multifd_channels=args.multifd_channels)
+                        multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -6,7 +6,17 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
 #include "libqtest-single.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+#include "hw/pci/pci_regs.h"
+#include "hw/pci-host/q35.h"
+#include "libqos/pci-pc.h"
+#include "migration-helpers.h"
 
 #define QEMU_PXB_CMD "-machine q35,cxl=on " \
                      "-device pxb-cxl,id=cxl.0,bus=pcie.0,bus_nr=52 "  \
@@ -29,29 +39,89 @@
                  "-device cxl-rp,id=rp2,bus=cxl.1,chassis=0,slot=2 " \
                  "-device cxl-rp,id=rp3,bus=cxl.1,chassis=0,slot=3 "
 
-#define QEMU_T3D "-object memory-backend-file,id=cxl-mem0,mem-path=%s,size=256M " \
-                 "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "    \
-                 "-device cxl-type3,bus=rp0,memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 "
+#define QEMU_T3D_DEPRECATED \
+    "-object memory-backend-file,id=cxl-mem0,mem-path=%s,size=256M " \
+    "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "    \
+    "-device cxl-type3,bus=rp0,memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 "
+
+#define QEMU_T3D_PMEM \
+    "-object memory-backend-file,id=m0,mem-path=%s,size=256M "    \
+    "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "  \
+    "-device cxl-type3,bus=rp0,persistent-memdev=m0,lsa=lsa0,id=cxl-pmem0 "
+
+#define QEMU_T3D_VMEM \
+    "-object memory-backend-ram,id=vmem0,size=256M " \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,id=cxl-vmem0 "
+
+#define QEMU_T3D_DCD \
+    "-object memory-backend-ram,id=dc0,size=512M " \
+    "-device cxl-type3,bus=rp0,volatile-dc-memdev=dc0,num-dc-regions=2," \
+    "id=cxl-dcd0 "
+
+/* Volatile memory shared with other QEMU instances */
+#define QEMU_T3D_VMEM_SHARED \
+    "-object memory-backend-file,id=vmem0,mem-path=%s,size=256M,share=on " \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,shared=on,id=cxl-vmem0 "
+
+#define QEMU_T2D \
+    "-object memory-backend-ram,id=hdm0,size=256M " \
+    "-object iothread,id=io0 " \
+    "-device cxl-type2,bus=rp0,volatile-memdev=hdm0,iothread=io0,id=cxl-t2d0 "
+
+#define QEMU_T3D_VMEM_TIMING \
+    "-object memory-backend-ram,id=vmem0,size=256M " \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,id=cxl-vmem0,"  \
+    "timing-model=on,read-latency=300,write-latency=600,"           \
+    "read-bandwidth=1,write-bandwidth=1 "
+
+#define QEMU_T3D_VMEM_COUNTED \
+    "-object memory-backend-ram,id=vmem0,size=256M " \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,id=cxl-vmem0,"  \
+    "timing-model=on "
+
+#define QEMU_T3D_VMEM_PMEM \
+    "-object memory-backend-ram,id=vmem0,size=256M " \
+    "-object memory-backend-file,id=m0,mem-path=%s,size=256M "    \
+    "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "  \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,"             \
+    "persistent-memdev=m0,lsa=lsa0,id=cxl-mem0 "
 
 #define QEMU_2T3D "-object memory-backend-file,id=cxl-mem0,mem-path=%s,size=256M "    \
                   "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp0,memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 " \
+                  "-device cxl-type3,bus=rp0,persistent-memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 " \
                   "-object memory-backend-file,id=cxl-mem1,mem-path=%s,size=256M "    \
                   "-object memory-backend-file,id=lsa1,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp1,memdev=cxl-mem1,lsa=lsa1,id=cxl-pmem1 "
+                  "-device cxl-type3,bus=rp1,persistent-memdev=cxl-mem1,lsa=lsa1,id=cxl-pmem1 "
 
 #define QEMU_4T3D "-object memory-backend-file,id=cxl-mem0,mem-path=%s,size=256M " \
                   "-object memory-backend-file,id=lsa0,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp0,memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 " \
+                  "-device cxl-type3,bus=rp0,persistent-memdev=cxl-mem0,lsa=lsa0,id=cxl-pmem0 " \
                   "-object memory-backend-file,id=cxl-mem1,mem-path=%s,size=256M "    \
                   "-object memory-backend-file,id=lsa1,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp1,memdev=cxl-mem1,lsa=lsa1,id=cxl-pmem1 " \
+                  "-device cxl-type3,bus=rp1,persistent-memdev=cxl-mem1,lsa=lsa1,id=cxl-pmem1 " \
                   "-object memory-backend-file,id=cxl-mem2,mem-path=%s,size=256M "    \
                   "-object memory-backend-file,id=lsa2,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp2,memdev=cxl-mem2,lsa=lsa2,id=cxl-pmem2 " \
+                  "-device cxl-type3,bus=rp2,persistent-memdev=cxl-mem2,lsa=lsa2,id=cxl-pmem2 " \
                   "-object memory-backend-file,id=cxl-mem3,mem-path=%s,size=256M "    \
                   "-object memory-backend-file,id=lsa3,mem-path=%s,size=256M "    \
-                  "-device cxl-type3,bus=rp3,memdev=cxl-mem3,lsa=lsa3,id=cxl-pmem3 "
+                  "-device cxl-type3,bus=rp3,persistent-memdev=cxl-mem3,lsa=lsa3,id=cxl-pmem3 "
+
+/*
+ * A Type 3 device behind each of two host bridges with a single root port,
+ * so that a region of the window interleaves across them with no host
+ * bridge decoders.
+ */
+#define QEMU_2PXB_2T3D "-machine q35,cxl=on "                            \
+    "-device pxb-cxl,id=cxl.0,bus=pcie.0,bus_nr=52 "                    \
+    "-device pxb-cxl,id=cxl.1,bus=pcie.0,bus_nr=60 "                    \
+    "-M cxl-fmw.0.targets.0=cxl.0,cxl-fmw.0.targets.1=cxl.1,"            \
+    "cxl-fmw.0.size=4G "                                                \
+    "-device cxl-rp,id=rp0,bus=cxl.0,chassis=0,slot=0 "                 \
+    "-device cxl-rp,id=rp1,bus=cxl.1,chassis=0,slot=1 "                 \
+    "-object memory-backend-ram,id=vmem0,size=256M "                    \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,id=cxl-vmem0 "     \
+    "-object memory-backend-ram,id=vmem1,size=256M "                    \
+    "-device cxl-type3,bus=rp1,volatile-memdev=vmem1,id=cxl-vmem1 "
 
 static void cxl_basic_hb(void)
 {
@@ -71,6 +141,36 @@ static void cxl_pxb_with_window(void)
     qtest_end();
 }
 
+static void cxl_hot_pages(void)
+{
+    QDict *response;
+
+    qtest_start(QEMU_PXB_CMD);
+
+    response = qmp("{ 'execute': 'query-cxl-hot-pages' }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-set-hot-page-tracking', "
+                   "'arguments': { 'enable': true } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    /* Nothing has accessed the window yet */
+    response = qmp("{ 'execute': 'query-cxl-hot-pages', "
+                   "'arguments': { 'count': 8, 'reset': true } }");
+    g_assert(qdict_haskey(response, "return"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(response, "return")), ==, 0);
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-set-hot-page-tracking', "
+                   "'arguments': { 'enable': false } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    qtest_end();
+}
+
 static void cxl_2pxb_with_window(void)
 {
     qtest_start(QEMU_2PXB_CMD);
@@ -89,15 +189,1274 @@ static void cxl_2root_port(void)
     qtest_end();
 }
 
+/* Switch without downstream ports below rp0 */
+#define QEMU_USP "-device cxl-upstream,bus=rp0,id=us0 "
+
+#define CXL_ECAM_BASE MCH_HOST_BRIDGE_PCIEXBAR_DEFAULT
+#define CXL_ECAM(bus, off) (CXL_ECAM_BASE + ((bus) << 20) + (off))
+
+/* DOE registers, from the DOE extended capability */
+#define CXL_DOE_CDAT_HEADER 0x00021e98 /* CXL vendor, Table Access */
+#define CXL_DOE_CTRL 0x08
+#define CXL_DOE_CTRL_GO (1u << 31)
+#define CXL_DOE_STATUS 0x0c
+#define CXL_DOE_STATUS_ERROR (1 << 2)
+#define CXL_DOE_STATUS_READY (1u << 31)
+#define CXL_DOE_WR_MBOX 0x10
+
+/*
+ * The CDAT of a switch is built once it has downstream ports.  Reading it
+ * before must not bring QEMU down, there is just no response.
+ */
+static void cxl_usp_cdat_no_dsp(void)
+{
+    QTestState *qts = qtest_init(QEMU_PXB_CMD QEMU_RP QEMU_USP);
+    QPCIBus *pcibus = qpci_new_pc(qts, NULL);
+    QPCIDevice *dev;
+    uint32_t cap, off = PCI_CFG_SPACE_SIZE;
+
+    /* Enable ECAM, for the extended capabilities */
+    dev = qpci_device_find(pcibus, 0);
+    qpci_config_writel(dev, MCH_HOST_BRIDGE_PCIEXBAR + 4, 0);
+    qpci_config_writel(dev, MCH_HOST_BRIDGE_PCIEXBAR,
+                       CXL_ECAM_BASE | MCH_HOST_BRIDGE_PCIEXBAREN);
+    g_free(dev);
+
+    dev = qpci_device_find(pcibus, 52 << 8);
+    g_assert(dev);
+    qpci_config_writeb(dev, PCI_SECONDARY_BUS, 53);
+    qpci_config_writeb(dev, PCI_SUBORDINATE_BUS, 54);
+    g_free(dev);
+
+    do {
+        cap = qtest_readl(qts, CXL_ECAM(53, off));
+        g_assert(cap);
+        if (PCI_EXT_CAP_ID(cap) == PCI_EXT_CAP_ID_DOE) {
+            break;
+        }
+        off = PCI_EXT_CAP_NEXT(cap);
+    } while (off);
+    g_assert(off);
+
+    /* Read Entry 0 */
+    qtest_writel(qts, CXL_ECAM(53, off + CXL_DOE_WR_MBOX),
+                 CXL_DOE_CDAT_HEADER);
+    qtest_writel(qts, CXL_ECAM(53, off + CXL_DOE_WR_MBOX), 3);
+    qtest_writel(qts, CXL_ECAM(53, off + CXL_DOE_WR_MBOX), 0);
+    qtest_writel(qts, CXL_ECAM(53, off + CXL_DOE_CTRL), CXL_DOE_CTRL_GO);
+
+    g_assert_false(qtest_readl(qts, CXL_ECAM(53, off + CXL_DOE_STATUS)) &
+                   (CXL_DOE_STATUS_READY | CXL_DOE_STATUS_ERROR));
+
+    qpci_free_pc(pcibus);
+    qtest_quit(qts);
+}
+
 #ifdef CONFIG_POSIX
-static void cxl_t3d(void)
+/*
+ * HDM decoder 0 of a Type 3 device, in the CXL.cache/mem registers that
+ * follow the CXL.io registers in the component register BAR.
+ */
+#define CXL_T3D_HDM_DECODER0_BASE_LO (0x1000 + 0x120)
+#define CXL_T3D_HDM_DECODER0_BASE_HI (0x1000 + 0x124)
+#define CXL_T3D_HDM_DECODER0_SIZE_LO (0x1000 + 0x128)
+#define CXL_T3D_HDM_DECODER0_SIZE_HI (0x1000 + 0x12c)
+#define CXL_T3D_HDM_DECODER0_CTRL (0x1000 + 0x130)
+#define CXL_HDM_DECODER_CTRL_IW_SHIFT 4
+#define CXL_HDM_DECODER_CTRL_COMMIT (1 << 9)
+#define CXL_HDM_DECODER_CTRL_COMMITTED (1 << 10)
+
+#define CXL_HDM_DECODER0_TARGET_LIST_LO (0x1000 + 0x134)
+
+/* Address of the first memory region called @name in the system memory */
+static uint64_t cxl_mtree_base(QTestState *qts, const char *name)
+{
+    g_autofree char *mtree = qtest_hmp(qts, "info mtree");
+    g_autofree char *needle = g_strdup_printf(": %s\n", name);
+    char *line = strstr(mtree, needle);
+
+    g_assert(line);
+    while (line > mtree && line[-1] != '\n') {
+        line--;
+    }
+    return g_ascii_strtoull(line, NULL, 16);
+}
+
+/* Base of the first fixed memory window */
+static uint64_t cxl_fmw_base(QTestState *qts)
+{
+    return cxl_mtree_base(qts, "cxl-fixed-memory-region");
+}
+
+/*
+ * Do what firmware would for the first root port of the host bridge on
+ * @bus, and enable the device behind it.
+ */
+static QPCIDevice *cxl_rp_device(QPCIBus *pcibus, int bus)
+{
+    QPCIDevice *rp, *dev;
+
+    rp = qpci_device_find(pcibus, bus << 8);
+    g_assert(rp);
+    qpci_config_writeb(rp, PCI_SECONDARY_BUS, bus + 1);
+    qpci_config_writeb(rp, PCI_SUBORDINATE_BUS, bus + 1);
+    qpci_config_writew(rp, PCI_MEMORY_BASE, 0xe000);
+    qpci_config_writew(rp, PCI_MEMORY_LIMIT, 0xe0f0);
+    qpci_config_writew(rp, PCI_COMMAND, PCI_COMMAND_MEMORY);
+    g_free(rp);
+
+    dev = qpci_device_find(pcibus, (bus + 1) << 8);
+    g_assert(dev);
+    qpci_device_enable(dev);
+    return dev;
+}
+
+/*
+ * Commit the first HDM decoder of the device behind the first root port of
+ * the host bridge on @bus to map @size at @hpa, interleaved 2^@iw ways at
+ * the 256 byte granularity the windows default to.  Host bridges with a
+ * single root port need no decoders.
+ */
+static void cxl_t3d_commit(QTestState *qts, int bus, uint64_t hpa,
+                           uint64_t size, unsigned iw)
+{
+    QPCIBus *pcibus = qpci_new_pc(qts, NULL);
+    QPCIDevice *t3d = cxl_rp_device(pcibus, bus);
+    QPCIBar bar = qpci_iomap(t3d, 0, NULL);
+
+    qpci_io_writel(t3d, bar, CXL_T3D_HDM_DECODER0_BASE_LO, (uint32_t)hpa);
+    qpci_io_writel(t3d, bar, CXL_T3D_HDM_DECODER0_BASE_HI, hpa >> 32);
+    qpci_io_writel(t3d, bar, CXL_T3D_HDM_DECODER0_SIZE_LO, (uint32_t)size);
+    qpci_io_writel(t3d, bar, CXL_T3D_HDM_DECODER0_SIZE_HI, size >> 32);
+    qpci_io_writel(t3d, bar, CXL_T3D_HDM_DECODER0_CTRL,
+                   iw << CXL_HDM_DECODER_CTRL_IW_SHIFT |
+                   CXL_HDM_DECODER_CTRL_COMMIT);
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+}
+
+/*
+ * Commit HDM decoder 0 of the component registers at @regs, in the system
+ * memory, to map @size at @hpa interleaved 2^@iw ways across the ports
+ * numbered in the bytes of @targets.
+ */
+static void cxl_hdm_commit(QTestState *qts, uint64_t regs, uint64_t hpa,
+                           uint64_t size, unsigned iw, uint32_t targets)
+{
+    qtest_writel(qts, regs + CXL_HDM_DECODER0_TARGET_LIST_LO, targets);
+    qtest_writel(qts, regs + CXL_T3D_HDM_DECODER0_BASE_LO, (uint32_t)hpa);
+    qtest_writel(qts, regs + CXL_T3D_HDM_DECODER0_BASE_HI, hpa >> 32);
+    qtest_writel(qts, regs + CXL_T3D_HDM_DECODER0_SIZE_LO, (uint32_t)size);
+    qtest_writel(qts, regs + CXL_T3D_HDM_DECODER0_SIZE_HI, size >> 32);
+    qtest_writel(qts, regs + CXL_T3D_HDM_DECODER0_CTRL,
+                 iw << CXL_HDM_DECODER_CTRL_IW_SHIFT |
+                 CXL_HDM_DECODER_CTRL_COMMIT);
+    g_assert(qtest_readl(qts, regs + CXL_T3D_HDM_DECODER0_CTRL) &
+             CXL_HDM_DECODER_CTRL_COMMITTED);
+}
+
+/*
+ * Give the bridge at @devfn on @bus the bus numbers @sec to @sub, and a
+ * memory window for the BARs mapped below it from now on.  If @bar is given
+ * map BAR 0 of the bridge first, so that it stays outside of the window.
+ */
+static QPCIDevice *cxl_bridge_open(QPCIBus *pcibus, int bus, int devfn,
+                                   int sec, int sub, QPCIBar *bar)
+{
+    QPCIDevice *dev = qpci_device_find(pcibus, bus << 8 | devfn);
+
+    g_assert(dev);
+    if (bar) {
+        *bar = qpci_iomap(dev, 0, NULL);
+    }
+    pcibus->mmio_alloc_ptr = QEMU_ALIGN_UP(pcibus->mmio_alloc_ptr, MiB);
+
+    qpci_config_writeb(dev, PCI_SECONDARY_BUS, sec);
+    qpci_config_writeb(dev, PCI_SUBORDINATE_BUS, sub);
+    qpci_config_writew(dev, PCI_MEMORY_BASE, pcibus->mmio_alloc_ptr >> 16);
+    qpci_config_writew(dev, PCI_MEMORY_LIMIT, 0xe0f0);
+    qpci_config_writew(dev, PCI_COMMAND, PCI_COMMAND_MEMORY);
+    return dev;
+}
+
+/* Map all 256M of the device behind rp0 at @hpa */
+static void cxl_t3d_map(QTestState *qts, uint64_t hpa)
+{
+    cxl_t3d_commit(qts, 52, hpa, 256 * MiB, 0);
+}
+
+/*
+ * Mailbox of a Type 3 device, in the device register BAR.  Commands run
+ * synchronously, the doorbell is clear once the doorbell write returns.
+ */
+#define CXL_T3D_MBOX (0x80 + 0x8)
+#define CXL_T3D_MBOX_CTRL (CXL_T3D_MBOX + 0x4)
+#define CXL_T3D_MBOX_CMD (CXL_T3D_MBOX + 0x8)
+#define CXL_T3D_MBOX_STS (CXL_T3D_MBOX + 0x10)
+#define CXL_T3D_MBOX_BG_CMD_STS (CXL_T3D_MBOX + 0x18)
+#define CXL_T3D_MBOX_PAYLOAD (CXL_T3D_MBOX + 0x20)
+#define CXL_T3D_MBOX_PAYLOAD_SIZE 2048
+#define CXL_MBOX_DOORBELL 0x1
+#define CXL_MBOX_BG_INT_EN 0x4
+#define CXL_MBOX_STS_BG_OP 0x1
+#define CXL_T3D_MBOX_VECTOR 0
+
+#define CXL_MBOX_GET_EVENT_RECORDS 0x0100
+#define CXL_MBOX_CLEAR_EVENT_RECORDS 0x0101
+#define CXL_MBOX_GET_EVENT_INT_POLICY 0x0102
+#define CXL_MBOX_SET_EVENT_INT_POLICY 0x0103
+#define CXL_MBOX_GET_LSA 0x4102
+#define CXL_MBOX_SET_LSA 0x4103
+#define CXL_MBOX_GET_POISON_LIST 0x4300
+#define CXL_MBOX_INJECT_POISON 0x4301
+#define CXL_MBOX_CLEAR_POISON 0x4302
+#define CXL_MBOX_SCAN_MEDIA 0x4304
+#define CXL_MBOX_GET_SCAN_MEDIA_RESULTS 0x4305
+#define CXL_MBOX_GET_DC_EXTENT_LIST 0x4801
+#define CXL_MBOX_ADD_DC_RESPONSE 0x4802
+#define CXL_MBOX_RELEASE_DC 0x4803
+#define CXL_MBOX_SANITIZE 0x4400
+#define CXL_MBOX_SECURE_ERASE 0x4401
+
+#define CXL_MBOX_BG_STARTED 0x1
+#define CXL_MBOX_INVALID_INPUT 0x2
+#define CXL_MBOX_BUSY 0x6
+
+#define CXL_EVENT_LOG_FAILURE 2
+#define CXL_EVENT_INT_MODE_MSI 0x1
+#define CXL_T3D_EVENT_VECTOR 1
+#define CXL_T3D_EVENT_LOG_SIZE 256
+
+/*
+ * The device behind rp0 with its device registers mapped, and its component
+ * registers mapped first so they stay where cxl_t3d_map() put them.
+ */
+static QPCIDevice *cxl_t3d_mbox_open(QPCIBus *pcibus, QPCIBar *bar)
+{
+    QPCIDevice *t3d = cxl_rp_device(pcibus, 52);
+
+    qpci_iomap(t3d, 0, NULL);
+    *bar = qpci_iomap(t3d, 2, NULL);
+    return t3d;
+}
+
+/*
+ * Run mailbox command @opcode with the @len bytes of @payload as input,
+ * keeping the interrupt enables.  Return its return code, with its output
+ * in @payload, which must have room for a full payload, and the output
+ * length in *@out_len if given.
+ */
+static uint16_t cxl_t3d_mbox(QPCIDevice *t3d, QPCIBar bar, uint16_t opcode,
+                             void *payload, size_t len, size_t *out_len)
+{
+    size_t out;
+
+    qpci_memwrite(t3d, bar, CXL_T3D_MBOX_PAYLOAD, payload, len);
+    qpci_io_writeq(t3d, bar, CXL_T3D_MBOX_CMD, opcode | (uint64_t)len << 16);
+    qpci_io_writel(t3d, bar, CXL_T3D_MBOX_CTRL,
+                   qpci_io_readl(t3d, bar, CXL_T3D_MBOX_CTRL) |
+                   CXL_MBOX_DOORBELL);
+    g_assert_false(qpci_io_readl(t3d, bar, CXL_T3D_MBOX_CTRL) &
+                   CXL_MBOX_DOORBELL);
+
+    out = extract64(qpci_io_readq(t3d, bar, CXL_T3D_MBOX_CMD), 16, 20);
+    g_assert_cmpint(out, <=, CXL_T3D_MBOX_PAYLOAD_SIZE);
+    qpci_memread(t3d, bar, CXL_T3D_MBOX_PAYLOAD, payload, out);
+    if (out_len) {
+        *out_len = out;
+    }
+    return extract64(qpci_io_readq(t3d, bar, CXL_T3D_MBOX_STS), 32, 16);
+}
+
+/*
+ * Run background command @opcode with the @len bytes of @payload as input
+ * and wait for it to complete.  Return the return code it completed with.
+ */
+static uint16_t cxl_t3d_mbox_bg(QPCIDevice *t3d, QPCIBar bar, uint16_t opcode,
+                                void *payload, size_t len)
+{
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, opcode, payload, len, NULL), ==,
+                    CXL_MBOX_BG_STARTED);
+    while (qpci_io_readq(t3d, bar, CXL_T3D_MBOX_STS) & CXL_MBOX_STS_BG_OP) {
+        g_usleep(1000);
+    }
+    return extract64(qpci_io_readq(t3d, bar, CXL_T3D_MBOX_BG_CMD_STS), 32, 16);
+}
+
+static void cxl_t3d_deprecated(void)
 {
     g_autoptr(GString) cmdline = g_string_new(NULL);
     g_autofree const char *tmpfs = NULL;
 
     tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
 
-    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D, tmpfs, tmpfs);
+    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D_DEPRECATED,
+                    tmpfs, tmpfs);
+
+    qtest_start(cmdline->str);
+    qtest_end();
+    rmdir(tmpfs);
+}
+
+static void cxl_t3d_persistent(void)
+{
+    g_autoptr(GString) cmdline = g_string_new(NULL);
+    g_autofree const char *tmpfs = NULL;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+
+    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D_PMEM,
+                    tmpfs, tmpfs);
+
+    qtest_start(cmdline->str);
+    qtest_end();
+    rmdir(tmpfs);
+}
+
+/* Labels in a file of their own, shared so that label writes reach it */
+#define QEMU_T3D_PMEM_LSA_FILE \
+    "-object memory-backend-file,id=m0,mem-path=%s,size=256M "          \
+    "-object memory-backend-file,id=lsa0,mem-path=%s/lsa0,size=1M,"     \
+    "share=on "                                                         \
+    "-device cxl-type3,bus=rp0,persistent-memdev=m0,lsa=lsa0,id=cxl-pmem0 "
+
+/* Longer than the delay before labels are written back */
+#define CXL_T3D_LSA_FLUSH_WAIT_US (300 * 1000)
+
+static uint16_t cxl_t3d_set_lsa(QPCIDevice *t3d, QPCIBar bar,
+                                uint32_t offset, uint8_t c, size_t len)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+
+    stl_le_p(payload, offset);
+    memset(payload + 8, c, len);
+    return cxl_t3d_mbox(t3d, bar, CXL_MBOX_SET_LSA, payload, 8 + len, NULL);
+}
+
+static uint16_t cxl_t3d_get_lsa(QPCIDevice *t3d, QPCIBar bar,
+                                uint32_t offset, uint32_t len, uint8_t *buf)
+{
+    stl_le_p(buf, offset);
+    stl_le_p(buf + 4, len);
+    return cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_LSA, buf, 8, NULL);
+}
+
+/*
+ * Labels set at two places far apart are written back to the file, and
+ * accesses that do not fit in the LSA or the payload are refused.
+ */
+static void cxl_t3d_lsa(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE];
+    uint8_t expected[64];
+    g_autoptr(GString) cmdline = g_string_new(NULL);
+    g_autofree const char *tmpfs = NULL;
+    g_autofree char *path = NULL;
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    QPCIBar bar;
+    int fd;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+    path = g_strdup_printf("%s/lsa0", tmpfs);
+
+    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D_PMEM_LSA_FILE,
+                    tmpfs, tmpfs);
+    qtest_start(cmdline->str);
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+
+    g_assert_cmpint(cxl_t3d_set_lsa(t3d, bar, 0x100, 0xa5, 64), ==, 0);
+    g_assert_cmpint(cxl_t3d_set_lsa(t3d, bar, 0x80000, 0x5a, 32), ==, 0);
+
+    g_assert_cmpint(cxl_t3d_get_lsa(t3d, bar, 0x100, 64, payload), ==, 0);
+    memset(expected, 0xa5, 64);
+    g_assert_cmpmem(payload, 64, expected, 64);
+
+    /* Both ranges are in the file once the write back has had time to run */
+    g_usleep(CXL_T3D_LSA_FLUSH_WAIT_US);
+    fd = open(path, O_RDONLY);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(pread(fd, payload, 64, 0x100), ==, 64);
+    g_assert_cmpmem(payload, 64, expected, 64);
+    memset(expected, 0x5a, 32);
+    g_assert_cmpint(pread(fd, payload, 32, 0x80000), ==, 32);
+    g_assert_cmpmem(payload, 32, expected, 32);
+    close(fd);
+
+    /* Up to the very end of the LSA, but not past it */
+    g_assert_cmpint(cxl_t3d_get_lsa(t3d, bar, MiB - 16, 16, payload), ==, 0);
+    g_assert_cmpint(cxl_t3d_get_lsa(t3d, bar, MiB - 8, 16, payload), ==,
+                    CXL_MBOX_INVALID_INPUT);
+    g_assert_cmpint(cxl_t3d_get_lsa(t3d, bar, UINT32_MAX - 7, 16, payload),
+                    ==, CXL_MBOX_INVALID_INPUT);
+    g_assert_cmpint(cxl_t3d_set_lsa(t3d, bar, MiB - 16, 0x11, 16), ==, 0);
+    g_assert_cmpint(cxl_t3d_set_lsa(t3d, bar, MiB - 8, 0x11, 16), ==,
+                    CXL_MBOX_INVALID_INPUT);
+    g_assert_cmpint(cxl_t3d_set_lsa(t3d, bar, UINT32_MAX - 7, 0x11, 16), ==,
+                    CXL_MBOX_INVALID_INPUT);
+
+    /* More than the output payload holds */
+    g_assert_cmpint(cxl_t3d_get_lsa(t3d, bar, 0,
+                                    CXL_T3D_MBOX_PAYLOAD_SIZE + 1, payload),
+                    ==, CXL_MBOX_INVALID_INPUT);
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+    qtest_end();
+    unlink(path);
+    rmdir(tmpfs);
+}
+
+static void cxl_t3d_volatile(void)
+{
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM);
+    qtest_end();
+}
+
+/* Statistic @name of the only Type 3 device */
+static int64_t cxl_t3d_stat(QTestState *qts, const char *name)
+{
+    QDict *response, *result, *stat;
+    QList *results, *stats;
+    int64_t value;
+
+    response = qtest_qmp(qts, "{ 'execute': 'query-stats', "
+                         "'arguments': { 'target': 'cxl', 'providers': [ "
+                         "{ 'provider': 'cxl', 'names': [ %s ] } ] } }",
+                         name);
+    results = qdict_get_qlist(response, "return");
+    g_assert(results);
+    g_assert_cmpint(qlist_size(results), ==, 1);
+    result = qobject_to(QDict, qlist_peek(results));
+    stats = qdict_get_qlist(result, "stats");
+    g_assert_cmpint(qlist_size(stats), ==, 1);
+    stat = qobject_to(QDict, qlist_peek(stats));
+    value = qdict_get_int(stat, "value");
+
+    qobject_unref(response);
+    return value;
+}
+
+static void cxl_t3d_stats(void)
+{
+    QDict *response, *result, *stat;
+    QList *results, *stats;
+    QListEntry *entry;
+    int found = 0;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM);
+
+    response = qmp("{ 'execute': 'query-stats', "
+                   "'arguments': { 'target': 'cxl', 'providers': [ "
+                   "{ 'provider': 'cxl', 'names': [ 'reads', 'errors' ] } "
+                   "] } }");
+    g_assert(qdict_haskey(response, "return"));
+    results = qdict_get_qlist(response, "return");
+    g_assert_cmpint(qlist_size(results), ==, 1);
+
+    result = qobject_to(QDict, qlist_peek(results));
+    g_assert_cmpstr(qdict_get_str(result, "provider"), ==, "cxl");
+    g_assert(g_str_has_suffix(qdict_get_str(result, "qom-path"),
+                              "cxl-vmem0"));
+
+    /* Nothing has accessed the device yet */
+    stats = qdict_get_qlist(result, "stats");
+    QLIST_FOREACH_ENTRY(stats, entry) {
+        stat = qobject_to(QDict, qlist_entry_obj(entry));
+        g_assert_cmpint(qdict_get_int(stat, "value"), ==, 0);
+        found++;
+    }
+    g_assert_cmpint(found, ==, 2);
+
+    qobject_unref(response);
+    qtest_end();
+}
+
+/*
+ * Accesses through the window are counted for the device, and for the
+ * decoder that maps them.  The timing model keeps the memory from being
+ * mapped straight into the guest, where accesses would not be seen.
+ */
+static void cxl_t3d_stats_counted(void)
+{
+    uint64_t base;
+    int i;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_COUNTED);
+    base = cxl_fmw_base(global_qtest);
+
+    /* Nothing maps the window yet */
+    readq(base);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "errors"), ==, 1);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-errors"), ==, 0);
+
+    /* Twice the capacity, the upper half of which is beyond the device */
+    cxl_t3d_commit(global_qtest, 52, base, 512 * MiB, 0);
+
+    for (i = 0; i < 4; i++) {
+        writeq(base + i * 8, i);
+    }
+    for (i = 0; i < 3; i++) {
+        g_assert_cmpint(readq(base + i * 8), ==, i);
+    }
+    writel(base + 64, 0);
+    readq(base + 256 * MiB);
+    writeq(base + 256 * MiB, 0);
+
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "reads"), ==, 3);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "read-bytes"), ==, 24);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "writes"), ==, 5);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "write-bytes"), ==, 36);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "errors"), ==, 3);
+
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-reads"), ==, 3);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-read-bytes"), ==,
+                    24);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-writes"), ==, 5);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-write-bytes"), ==,
+                    36);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder0-errors"), ==, 2);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "decoder1-reads"), ==, 0);
+
+    qtest_end();
+}
+
+/* Accesses through the window are counted for the page they hit */
+static void cxl_t3d_hot_pages(void)
+{
+    QDict *response, *page;
+    QList *pages;
+    uint64_t base;
+    int i;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_COUNTED);
+    base = cxl_fmw_base(global_qtest);
+    cxl_t3d_map(global_qtest, base);
+
+    response = qmp("{ 'execute': 'cxl-set-hot-page-tracking', "
+                   "'arguments': { 'enable': true } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    for (i = 0; i < 3; i++) {
+        writeq(base + 2 * 4096 + i * 8, i);
+    }
+    readq(base + 2 * 4096);
+    /* Far into the window, so the counts of other pages are allocated */
+    for (i = 0; i < 2; i++) {
+        readq(base + 200 * MiB + i * 8);
+    }
+
+    response = qmp("{ 'execute': 'query-cxl-hot-pages', "
+                   "'arguments': { 'count': 8, 'reset': true } }");
+    pages = qdict_get_qlist(response, "return");
+    g_assert(pages);
+    g_assert_cmpint(qlist_size(pages), ==, 2);
+
+    page = qobject_to(QDict, qlist_pop(pages));
+    g_assert_cmphex(qdict_get_int(page, "address"), ==, base + 2 * 4096);
+    g_assert_cmpint(qdict_get_int(page, "reads"), ==, 1);
+    g_assert_cmpint(qdict_get_int(page, "writes"), ==, 3);
+    g_assert_cmpint(qdict_get_int(page, "dirty-samples"), ==, 0);
+    qobject_unref(page);
+
+    page = qobject_to(QDict, qlist_pop(pages));
+    g_assert_cmphex(qdict_get_int(page, "address"), ==, base + 200 * MiB);
+    g_assert_cmpint(qdict_get_int(page, "reads"), ==, 2);
+    g_assert_cmpint(qdict_get_int(page, "writes"), ==, 0);
+    qobject_unref(page);
+    qobject_unref(response);
+
+    /* The counts were reset */
+    response = qmp("{ 'execute': 'query-cxl-hot-pages' }");
+    g_assert_cmpint(qlist_size(qdict_get_qlist(response, "return")), ==, 0);
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-set-hot-page-tracking', "
+                   "'arguments': { 'enable': false } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    qtest_end();
+}
+
+static void cxl_t3d_poison(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    QDict *response;
+    QPCIBar bar;
+    uint64_t base;
+    size_t len;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM);
+
+    response = qmp("{ 'execute': 'cxl-inject-poison', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem0', "
+                   "'start': 4096, 'length': 128 } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    /* Overlaps and merges with the previous range */
+    response = qmp("{ 'execute': 'cxl-inject-poison', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem0', "
+                   "'start': 4160, 'length': 4096 } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-inject-poison', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem0', "
+                   "'start': 4100, 'length': 64 } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-inject-poison', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem0', "
+                   "'start': 268435392, 'length': 128 } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+
+    stq_le_p(payload, 16384);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_INJECT_POISON, payload,
+                                 8, NULL), ==, 0);
+
+    /* Splits the range injected from QMP, [4096, 8256) */
+    stq_le_p(payload, 4160);
+    memset(payload + 8, 0x5a, 64);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_CLEAR_POISON, payload,
+                                 8 + 64, NULL), ==, 0);
+
+    stq_le_p(payload, 0);
+    stq_le_p(payload + 8, 256 * MiB / 64);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_POISON_LIST, payload,
+                                 16, &len), ==, 0);
+    g_assert_cmpint(len, ==, 0x20 + 3 * 16);
+    g_assert_cmpint(lduw_le_p(payload + 10), ==, 3);
+    /* Address and type, length in units of 64 bytes */
+    g_assert_cmphex(ldq_le_p(payload + 0x20), ==, 4096 | 0x2);
+    g_assert_cmpint(ldl_le_p(payload + 0x28), ==, 1);
+    g_assert_cmphex(ldq_le_p(payload + 0x30), ==, 4224 | 0x2);
+    g_assert_cmpint(ldl_le_p(payload + 0x38), ==, (8256 - 4224) / 64);
+    g_assert_cmphex(ldq_le_p(payload + 0x40), ==, 16384 | 0x3);
+    g_assert_cmpint(ldl_le_p(payload + 0x48), ==, 1);
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+
+    /* What Clear Poison wrote reads back through the window */
+    base = cxl_fmw_base(global_qtest);
+    cxl_t3d_map(global_qtest, base);
+    g_assert_cmphex(readq(base + 4160), ==, 0x5a5a5a5a5a5a5a5aULL);
+
+    qtest_end();
+}
+
+/* Updated Extent List payload of a single extent, of 32 bytes */
+static void cxl_dc_extent_list(uint8_t *payload, uint64_t dpa, uint64_t len)
+{
+    memset(payload, 0, 32);
+    stl_le_p(payload, 1);
+    stq_le_p(payload + 8, dpa);
+    stq_le_p(payload + 16, len);
+}
+
+static void cxl_t3d_dcd(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    QDict *response;
+    int64_t errors;
+    QPCIBar bar;
+    uint64_t base;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_DCD);
+
+    response = qmp("{ 'execute': 'cxl-add-dynamic-capacity', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 1, "
+                   "'extents': [ { 'offset': 0, 'len': 2097152 }, "
+                   "{ 'offset': 8388608, 'len': 4194304 } ] } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+
+    /* Already offered */
+    response = qmp("{ 'execute': 'cxl-add-dynamic-capacity', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 1, "
+                   "'extents': [ { 'offset': 10485760, 'len': 2097152 } ] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    /* Not a multiple of the block size */
+    response = qmp("{ 'execute': 'cxl-add-dynamic-capacity', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 0, "
+                   "'extents': [ { 'offset': 4096, 'len': 2097152 } ] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-add-dynamic-capacity', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 2, "
+                   "'extents': [ { 'offset': 0, 'len': 2097152 } ] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    /* The host has not accepted it */
+    response = qmp("{ 'execute': 'cxl-release-dynamic-capacity', "
+                   "'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 1, "
+                   "'extents': [ { 'offset': 0, 'len': 2097152 } ] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+
+    /* Accept the first extent offered, the rest of the offer lapses */
+    cxl_dc_extent_list(payload, 256 * MiB, 2 * MiB);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_ADD_DC_RESPONSE, payload,
+                                 32, NULL), ==, 0);
+    cxl_dc_extent_list(payload, 264 * MiB, 4 * MiB);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_ADD_DC_RESPONSE, payload,
+                                 32, NULL), !=, 0);
+
+    stl_le_p(payload, 8);
+    stl_le_p(payload + 4, 0);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_DC_EXTENT_LIST,
+                                 payload, 8, NULL), ==, 0);
+    g_assert_cmpint(ldl_le_p(payload), ==, 1);
+    g_assert_cmphex(ldq_le_p(payload + 16), ==, 256 * MiB);
+    g_assert_cmphex(ldq_le_p(payload + 24), ==, 2 * MiB);
+
+    /* Both regions, region 1 at DPA 256M */
+    base = cxl_fmw_base(global_qtest);
+    cxl_t3d_commit(global_qtest, 52, base, 512 * MiB, 0);
+
+    writeq(base + 256 * MiB, 0x0123456789abcdefULL);
+    g_assert_cmphex(readq(base + 256 * MiB), ==, 0x0123456789abcdefULL);
+
+    /* Capacity the host has not accepted fails */
+    errors = cxl_t3d_stat(global_qtest, "errors");
+    readq(base + 264 * MiB);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "errors"), ==, errors + 1);
+
+    cxl_dc_extent_list(payload, 256 * MiB, 2 * MiB);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_RELEASE_DC, payload,
+                                 32, NULL), ==, 0);
+    readq(base + 256 * MiB);
+    g_assert_cmpint(cxl_t3d_stat(global_qtest, "errors"), ==, errors + 2);
+
+    /* The memory was given back, so it comes back zeroed */
+    response = qmp("{ 'execute': 'cxl-add-dynamic-capacity', 'arguments': { "
+                   "'path': '/machine/peripheral/cxl-dcd0', 'region-id': 1, "
+                   "'extents': [ { 'offset': 0, 'len': 2097152 } ] } }");
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+    cxl_dc_extent_list(payload, 256 * MiB, 2 * MiB);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_ADD_DC_RESPONSE, payload,
+                                 32, NULL), ==, 0);
+    g_assert_cmphex(readq(base + 256 * MiB), ==, 0);
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+    qtest_end();
+}
+
+/* Add General Media records for DPAs @first * 64 on to the failure log */
+static void cxl_t3d_inject_events(int first, int n)
+{
+    QDict *args = qdict_new();
+    QList *records = qlist_new();
+    QDict *response;
+    int i;
+
+    for (i = first; i < first + n; i++) {
+        QDict *rec = qdict_new();
+
+        qdict_put_int(rec, "dpa", i * 64);
+        qdict_put_int(rec, "descriptor", 1);
+        qdict_put_int(rec, "type", 0);
+        qdict_put_int(rec, "transaction-type", 1);
+        qlist_append(records, rec);
+    }
+    qdict_put_str(args, "path", "/machine/peripheral/cxl-vmem0");
+    qdict_put_str(args, "log", "failure");
+    qdict_put(args, "records", records);
+
+    response = qmp("{ 'execute': 'cxl-inject-general-media-events', "
+                   "'arguments': %p }", args);
+    g_assert(qdict_haskey(response, "return"));
+    qobject_unref(response);
+}
+
+/*
+ * Whether the interrupt on MSI-X @vector was raised since the last call.  It
+ * is left pending as the vector is masked, and unmasking the vector delivers
+ * it, which clears the pending bit.
+ */
+static bool cxl_t3d_irq(QPCIDevice *t3d, uint16_t vector)
+{
+    uint64_t ctrl = t3d->msix_table_off + vector * PCI_MSIX_ENTRY_SIZE +
+                    PCI_MSIX_ENTRY_VECTOR_CTRL;
+    bool pending = qpci_msix_pending(t3d, vector);
+
+    qpci_io_writel(t3d, t3d->msix_table_bar, ctrl, 0);
+    qpci_io_writel(t3d, t3d->msix_table_bar, ctrl,
+                   PCI_MSIX_ENTRY_CTRL_MASKBIT);
+    return pending;
+}
+
+static void cxl_t3d_events(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    QDict *response;
+    QPCIBar bar;
+    size_t len;
+    int i;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM);
+
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+    qpci_msix_enable(t3d);
+
+    /* MSI interrupts for the failure log, reported with their vector */
+    memset(payload, 0, 4);
+    payload[CXL_EVENT_LOG_FAILURE] = CXL_EVENT_INT_MODE_MSI;
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_SET_EVENT_INT_POLICY,
+                                 payload, 4, NULL), ==, 0);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_EVENT_INT_POLICY,
+                                 payload, 0, &len), ==, 0);
+    g_assert_cmpint(len, ==, 5);
+    g_assert_cmphex(payload[CXL_EVENT_LOG_FAILURE], ==,
+                    CXL_EVENT_INT_MODE_MSI | CXL_T3D_EVENT_VECTOR << 4);
+    g_assert_cmphex(payload[0], ==, 0);
+
+    /* A batch raises a single interrupt, on the event vector */
+    g_assert_false(cxl_t3d_irq(t3d, CXL_T3D_EVENT_VECTOR));
+    cxl_t3d_inject_events(0, 2);
+    g_assert_false(qpci_msix_pending(t3d, 0));
+    g_assert_true(cxl_t3d_irq(t3d, CXL_T3D_EVENT_VECTOR));
+
+    /* Adding to a log the host has not emptied yet raises none */
+    cxl_t3d_inject_events(2, CXL_T3D_EVENT_LOG_SIZE + 8);
+    g_assert_false(cxl_t3d_irq(t3d, CXL_T3D_EVENT_VECTOR));
+
+    /* The oldest records first, with the ones that did not fit counted */
+    payload[0] = CXL_EVENT_LOG_FAILURE;
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_EVENT_RECORDS,
+                                 payload, 1, &len), ==, 0);
+    g_assert_cmpint(len, ==, 0x20 + 15 * 0x80);
+    g_assert_cmphex(payload[0], ==, 0x3);
+    g_assert_cmpint(lduw_le_p(payload + 2), ==, 10);
+    g_assert_cmpint(lduw_le_p(payload + 0x12), ==, 15);
+    for (i = 0; i < 15; i++) {
+        uint8_t *rec = payload + 0x20 + i * 0x80;
+
+        g_assert_cmpint(rec[0x10], ==, 0x80);
+        g_assert_cmpint(lduw_le_p(rec + 0x14), ==, i + 1);
+        g_assert_cmphex(ldq_le_p(rec + 0x30), ==, i * 64);
+    }
+
+    /* Clearing anything but the oldest records fails and clears nothing */
+    memset(payload, 0, 6);
+    payload[0] = CXL_EVENT_LOG_FAILURE;
+    payload[2] = 2;
+    stw_le_p(payload + 6, 2);
+    stw_le_p(payload + 8, 3);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_CLEAR_EVENT_RECORDS,
+                                 payload, 10, NULL), !=, 0);
+
+    stw_le_p(payload + 6, 1);
+    stw_le_p(payload + 8, 2);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_CLEAR_EVENT_RECORDS,
+                                 payload, 10, NULL), ==, 0);
+
+    payload[0] = CXL_EVENT_LOG_FAILURE;
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_EVENT_RECORDS,
+                                 payload, 1, NULL), ==, 0);
+    g_assert_cmpint(lduw_le_p(payload + 0x20 + 0x14), ==, 3);
+    g_assert_cmphex(ldq_le_p(payload + 0x20 + 0x30), ==, 2 * 64);
+    g_assert_cmpint(lduw_le_p(payload + 2), ==, 10);
+
+    /* Emptying the log drops the overflow and rearms the interrupt */
+    memset(payload, 0, 6);
+    payload[0] = CXL_EVENT_LOG_FAILURE;
+    payload[1] = 0x1;
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_CLEAR_EVENT_RECORDS,
+                                 payload, 6, NULL), ==, 0);
+    payload[0] = CXL_EVENT_LOG_FAILURE;
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_EVENT_RECORDS,
+                                 payload, 1, &len), ==, 0);
+    g_assert_cmpint(len, ==, 0x20);
+    g_assert_cmphex(payload[0], ==, 0);
+    g_assert_cmpint(lduw_le_p(payload + 2), ==, 0);
+
+    cxl_t3d_inject_events(0, 1);
+    g_assert_true(cxl_t3d_irq(t3d, CXL_T3D_EVENT_VECTOR));
+
+    qpci_msix_disable(t3d);
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+
+    response = qmp("{ 'execute': 'cxl-inject-general-media-events', "
+                   "'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem0', "
+                   "'log': 'dynamic-capacity', 'records': [ "
+                   "{ 'dpa': 4096, 'descriptor': 1, 'type': 0, "
+                   "'transaction-type': 1 } ] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qmp("{ 'execute': 'cxl-inject-general-media-events', "
+                   "'arguments': { "
+                   "'path': '/machine/peripheral/cxl-vmem1', "
+                   "'log': 'warning', 'records': [] } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    qtest_end();
+}
+
+/* Large enough for Sanitize to still be running when the next command is */
+#define QEMU_T3D_VMEM_2G \
+    "-object memory-backend-ram,id=vmem0,size=2G " \
+    "-device cxl-type3,bus=rp0,volatile-memdev=vmem0,id=cxl-vmem0 "
+
+/*
+ * Sanitize runs in the background: the mailbox reports that until it is
+ * done, with the progress in the Background Command Status register, and
+ * turns away other background commands.  Completion is signalled with an
+ * interrupt if enabled.
+ */
+static void cxl_t3d_background(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+    unsigned pct, last_pct = 0;
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    uint64_t sts;
+    QPCIBar bar;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_2G);
+
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+    qpci_msix_enable(t3d);
+    qpci_io_writel(t3d, bar, CXL_T3D_MBOX_CTRL, CXL_MBOX_BG_INT_EN);
+
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_SANITIZE,
+                                 payload, 0, NULL), ==, CXL_MBOX_BG_STARTED);
+    g_assert_true(qpci_io_readq(t3d, bar, CXL_T3D_MBOX_STS) &
+                  CXL_MBOX_STS_BG_OP);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_SANITIZE,
+                                 payload, 0, NULL), ==, CXL_MBOX_BUSY);
+
+    do {
+        sts = qpci_io_readq(t3d, bar, CXL_T3D_MBOX_BG_CMD_STS);
+        g_assert_cmphex(extract64(sts, 0, 16), ==, CXL_MBOX_SANITIZE);
+        pct = extract64(sts, 16, 7);
+        g_assert_cmpint(pct, >=, last_pct);
+        g_assert_cmpint(pct, <=, 100);
+        last_pct = pct;
+    } while (qpci_io_readq(t3d, bar, CXL_T3D_MBOX_STS) & CXL_MBOX_STS_BG_OP);
+
+    sts = qpci_io_readq(t3d, bar, CXL_T3D_MBOX_BG_CMD_STS);
+    g_assert_cmpint(extract64(sts, 16, 7), ==, 100);
+    g_assert_cmpint(extract64(sts, 32, 16), ==, 0);
+    g_assert_true(cxl_t3d_irq(t3d, CXL_T3D_MBOX_VECTOR));
+
+    /* Only background commands are turned away, and only while one runs */
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_SANITIZE,
+                                 payload, 0, NULL), ==, CXL_MBOX_BG_STARTED);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_EVENT_INT_POLICY,
+                                 payload, 0, NULL), ==, 0);
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+    qtest_end();
+}
+
+/* Offsets dirtied in the first and a later chunk, and at the very end */
+static const uint64_t cxl_t3d_dirty[] = { 0, 100 * MiB, 256 * MiB - 4 * KiB };
+
+static void cxl_t3d_dirty_all(uint64_t base)
+{
+    uint8_t buf[4 * KiB];
+    int i;
+
+    memset(buf, 0x5a, sizeof(buf));
+    for (i = 0; i < ARRAY_SIZE(cxl_t3d_dirty); i++) {
+        memwrite(base + cxl_t3d_dirty[i], buf, sizeof(buf));
+    }
+}
+
+static void cxl_t3d_assert_zero(uint64_t base)
+{
+    uint8_t buf[4 * KiB];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cxl_t3d_dirty); i++) {
+        memread(base + cxl_t3d_dirty[i], buf, sizeof(buf));
+        g_assert_true(buffer_is_zero(buf, sizeof(buf)));
+    }
+}
+
+/* Number of records in the poison list of the whole device */
+static int cxl_t3d_poison_count(QPCIDevice *t3d, QPCIBar bar)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+
+    stq_le_p(payload, 0);
+    stq_le_p(payload + 8, 256 * MiB / 64);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_POISON_LIST, payload,
+                                 16, NULL), ==, 0);
+    return lduw_le_p(payload + 10);
+}
+
+/*
+ * Secure Erase and Sanitize zero what was written through the window, and
+ * only Sanitize clears poison.  Scan Media finds more errors than the
+ * results payload holds, so they take several Get Scan Media Results.
+ */
+static void cxl_t3d_sanitize(void)
+{
+    uint8_t payload[CXL_T3D_MBOX_PAYLOAD_SIZE] = { 0 };
+    int max = (CXL_T3D_MBOX_PAYLOAD_SIZE - 0x20) / 16;
+    QPCIBus *pcibus;
+    QPCIDevice *t3d;
+    QPCIBar bar;
+    uint64_t base;
+    int i;
+
+    qtest_start(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM);
+
+    base = cxl_fmw_base(global_qtest);
+    cxl_t3d_map(global_qtest, base);
+    pcibus = qpci_new_pc(global_qtest, NULL);
+    t3d = cxl_t3d_mbox_open(pcibus, &bar);
+
+    cxl_t3d_dirty_all(base);
+    stq_le_p(payload, 8 * KiB);
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_INJECT_POISON, payload,
+                                 8, NULL), ==, 0);
+    g_assert_cmpint(cxl_t3d_mbox_bg(t3d, bar, CXL_MBOX_SECURE_ERASE,
+                                    payload, 0), ==, 0);
+    cxl_t3d_assert_zero(base);
+    g_assert_cmpint(cxl_t3d_poison_count(t3d, bar), ==, 1);
+
+    cxl_t3d_dirty_all(base);
+    g_assert_cmpint(cxl_t3d_mbox_bg(t3d, bar, CXL_MBOX_SANITIZE,
+                                    payload, 0), ==, 0);
+    cxl_t3d_assert_zero(base);
+    g_assert_cmpint(cxl_t3d_poison_count(t3d, bar), ==, 0);
+
+    /* Separate errors, a few more than fit in one results payload */
+    for (i = 0; i < max + 4; i++) {
+        stq_le_p(payload, i * 128);
+        g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_INJECT_POISON,
+                                     payload, 8, NULL), ==, 0);
+    }
+
+    stq_le_p(payload, 0);
+    stq_le_p(payload + 8, 256 * MiB / 64);
+    payload[16] = 0;
+    g_assert_cmpint(cxl_t3d_mbox_bg(t3d, bar, CXL_MBOX_SCAN_MEDIA,
+                                    payload, 17), ==, 0);
+
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_SCAN_MEDIA_RESULTS,
+                                 payload, 0, NULL), ==, 0);
+    g_assert_cmpint(lduw_le_p(payload + 0x12), ==, max);
+    g_assert_cmphex(payload[0x10] & 0x1, ==, 0x1);
+    for (i = 0; i < max; i++) {
+        g_assert_cmphex(ldq_le_p(payload + 0x20 + i * 16), ==,
+                        i * 128 | 0x3);
+        g_assert_cmpint(ldl_le_p(payload + 0x28 + i * 16), ==, 1);
+    }
+
+    /* The rest, with no more to come */
+    g_assert_cmpint(cxl_t3d_mbox(t3d, bar, CXL_MBOX_GET_SCAN_MEDIA_RESULTS,
+                                 payload, 0, NULL), ==, 0);
+    g_assert_cmpint(lduw_le_p(payload + 0x12), ==, 4);
+    g_assert_cmphex(payload[0x10] & 0x1, ==, 0);
+    for (i = 0; i < 4; i++) {
+        g_assert_cmphex(ldq_le_p(payload + 0x20 + i * 16), ==,
+                        (max + i) * 128 | 0x3);
+    }
+
+    g_free(t3d);
+    qpci_free_pc(pcibus);
+    qtest_end();
+}
+
+/*
+ * Two instances share the memory of their devices, and map it at different
+ * addresses of their windows to check each is routed by its own decoders.
+ */
+static void cxl_t3d_shared(void)
+{
+    g_autoptr(GString) cmdline = g_string_new(NULL);
+    g_autofree const char *tmpfs = NULL;
+    g_autofree char *path = NULL;
+    QTestState *a, *b;
+    uint64_t base_a, base_b;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+    path = g_strdup_printf("%s/shared", tmpfs);
+
+    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_SHARED, path);
+    a = qtest_init(cmdline->str);
+    b = qtest_init(cmdline->str);
+
+    base_a = cxl_fmw_base(a);
+    base_b = cxl_fmw_base(b) + 256 * MiB;
+    cxl_t3d_map(a, base_a);
+    cxl_t3d_map(b, base_b);
+
+    qtest_writeq(a, base_a + 0x1000, 0x0123456789abcdefULL);
+    g_assert_cmphex(qtest_readq(b, base_b + 0x1000), ==,
+                    0x0123456789abcdefULL);
+
+    qtest_writeq(b, base_b + 0x2000, 0xfedcba9876543210ULL);
+    g_assert_cmphex(qtest_readq(a, base_a + 0x2000), ==,
+                    0xfedcba9876543210ULL);
+
+    qtest_quit(b);
+    qtest_quit(a);
+    unlink(path);
+    rmdir(tmpfs);
+}
+
+/* Compute engine registers of a Type 2 device, in BAR 5 */
+#define CXL_T2D_ENGINE_SRC 0x08
+#define CXL_T2D_ENGINE_DST 0x10
+#define CXL_T2D_ENGINE_LEN 0x18
+#define CXL_T2D_ENGINE_PATTERN 0x20
+#define CXL_T2D_ENGINE_CMD 0x28
+#define CXL_T2D_ENGINE_DOORBELL 0x30
+#define CXL_T2D_ENGINE_STS 0x38
+#define CXL_T2D_ENGINE_RESULT 0x40
+#define CXL_T2D_ENGINE_COMPLETED 0x48
+#define CXL_T2D_ENGINE_STS_BUSY 0x1
+#define CXL_T2D_ENGINE_STS_DONE 0x2
+#define CXL_T2D_ENGINE_STS_ERR 0x4
+#define CXL_T2D_ENGINE_OP_COPY 1
+#define CXL_T2D_ENGINE_OP_FILL 2
+#define CXL_T2D_ENGINE_OP_CRC 3
+
+/* Run an engine operation to completion, and return its status */
+static uint64_t cxl_t2d_engine_run(QPCIDevice *dev, QPCIBar bar, uint64_t op,
+                                   uint64_t src, uint64_t dst, uint64_t len)
+{
+    uint64_t sts;
+
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_SRC, src);
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_DST, dst);
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_LEN, len);
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_CMD, op);
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_DOORBELL, 1);
+    do {
+        sts = qpci_io_readq(dev, bar, CXL_T2D_ENGINE_STS);
+    } while (sts & CXL_T2D_ENGINE_STS_BUSY);
+    qpci_io_writeq(dev, bar, CXL_T2D_ENGINE_STS, sts);
+
+    return sts;
+}
+
+static void cxl_t2d_engine(void)
+{
+    QTestState *qts = qtest_init(QEMU_PXB_CMD QEMU_RP QEMU_T2D);
+    QPCIBus *pcibus = qpci_new_pc(qts, NULL);
+    QPCIDevice *t2d = cxl_rp_device(pcibus, 52);
+    QPCIBar bar = qpci_iomap(t2d, 5, NULL);
+    g_autofree uint64_t *buf = g_new(uint64_t, 64 * KiB / sizeof(uint64_t));
+    uint32_t crc;
+    int i;
+
+    for (i = 0; i < 64 * KiB / sizeof(uint64_t); i++) {
+        buf[i] = cpu_to_le64(0x0123456789abcdefULL);
+    }
+    crc = crc32c(0xffffffff, (uint8_t *)buf, 64 * KiB) ^ 0xffffffff;
+
+    qpci_io_writeq(t2d, bar, CXL_T2D_ENGINE_PATTERN, 0x0123456789abcdefULL);
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_FILL,
+                                       0, 0, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE);
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_CRC,
+                                       0, 0, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE);
+    g_assert_cmphex(qpci_io_readq(t2d, bar, CXL_T2D_ENGINE_RESULT), ==, crc);
+
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_COPY,
+                                       0, 1 * MiB, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE);
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_CRC,
+                                       1 * MiB, 0, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE);
+    g_assert_cmphex(qpci_io_readq(t2d, bar, CXL_T2D_ENGINE_RESULT), ==, crc);
+
+    /* Overlapping copies and ranges beyond the HDM are refused */
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_COPY,
+                                       0, 4 * KiB, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE | CXL_T2D_ENGINE_STS_ERR);
+    g_assert_cmphex(cxl_t2d_engine_run(t2d, bar, CXL_T2D_ENGINE_OP_FILL,
+                                       0, 256 * MiB - 4 * KiB, 64 * KiB), ==,
+                    CXL_T2D_ENGINE_STS_DONE | CXL_T2D_ENGINE_STS_ERR);
+    g_assert_cmpuint(qpci_io_readq(t2d, bar, CXL_T2D_ENGINE_COMPLETED), ==, 4);
+
+    g_free(t2d);
+    qpci_free_pc(pcibus);
+    qtest_quit(qts);
+}
+
+/*
+ * The device moves 1 MB/s, i.e. a byte per us, each way, so accesses to
+ * 16K take at least 16ms however they are split.
+ */
+static void cxl_t3d_volatile_timing(void)
+{
+    g_autofree uint8_t *buf = g_malloc0(16 * KiB);
+    QTestState *qts;
+    uint64_t base;
+    QDict *resp;
+
+    qts = qtest_init(QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_TIMING);
+
+    resp = qtest_qmp(qts, "{ 'execute': 'qom-get', 'arguments': "
+                     "{ 'path': '/machine/peripheral/cxl-vmem0', "
+                     "'property': 'write-latency' } }");
+    g_assert_cmpint(qdict_get_int(resp, "return"), ==, 600);
+    qobject_unref(resp);
+
+    base = cxl_fmw_base(qts);
+    cxl_t3d_map(qts, base);
+
+    g_test_timer_start();
+    qtest_memwrite(qts, base, buf, 16 * KiB);
+    g_assert_cmpfloat(g_test_timer_elapsed(), >=, 0.016);
+
+    g_test_timer_start();
+    qtest_memread(qts, base, buf, 16 * KiB);
+    g_assert_cmpfloat(g_test_timer_elapsed(), >=, 0.016);
+
+    qtest_quit(qts);
+}
+
+static void cxl_t3d_volatile_persistent(void)
+{
+    g_autoptr(GString) cmdline = g_string_new(NULL);
+    g_autofree const char *tmpfs = NULL;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+
+    g_string_printf(cmdline, QEMU_PXB_CMD QEMU_RP QEMU_T3D_VMEM_PMEM,
+                    tmpfs, tmpfs);
 
     qtest_start(cmdline->str);
     qtest_end();
@@ -134,6 +1493,253 @@ static void cxl_2pxb_4rp_4t3d(void)
     qtest_end();
     rmdir(tmpfs);
 }
+
+/* Interleaved across both host bridges by the window */
+static void cxl_2pxb_4rp_4t3d_migrate(void)
+{
+    g_autoptr(GString) cmdline = g_string_new(NULL);
+    g_autofree const char *tmpfs = NULL;
+    g_autofree char *sock = NULL;
+    g_autofree char *uri = NULL;
+    QTestState *from, *to;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+    sock = g_strdup_printf("%s/migsocket", tmpfs);
+    uri = g_strdup_printf("unix:%s", sock);
+
+    g_string_printf(cmdline, QEMU_2PXB_CMD QEMU_4RP QEMU_4T3D,
+                    tmpfs, tmpfs, tmpfs, tmpfs, tmpfs, tmpfs,
+                    tmpfs, tmpfs);
+    from = qtest_init(cmdline->str);
+
+    g_string_append_printf(cmdline, "-incoming %s ", uri);
+    to = qtest_init(cmdline->str);
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+    wait_for_migration_complete(to);
+
+    qtest_quit(to);
+    qtest_quit(from);
+    unlink(sock);
+    rmdir(tmpfs);
+}
+
+/*
+ * Interleave a region two ways across the host bridges and check that the
+ * decoders and the contents of the region make it to the destination.
+ */
+static void cxl_2pxb_2t3d_interleaved_migrate(void)
+{
+    g_autofree uint8_t *pattern = g_malloc(64 * KiB);
+    g_autofree uint8_t *buf = g_malloc0(64 * KiB);
+    g_autofree const char *tmpfs = NULL;
+    g_autofree char *sock = NULL;
+    g_autofree char *uri = NULL;
+    QTestState *from, *to;
+    QPCIBus *pcibus;
+    QPCIDevice *dev;
+    QPCIBar bar;
+    uint64_t base;
+    int i;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+    sock = g_strdup_printf("%s/migsocket", tmpfs);
+    uri = g_strdup_printf("unix:%s", sock);
+
+    /* Different in each 256 byte granule */
+    for (i = 0; i < 64 * KiB; i++) {
+        pattern[i] = i + i / 256;
+    }
+
+    from = qtest_init(QEMU_2PXB_2T3D);
+    base = cxl_fmw_base(from);
+    cxl_t3d_commit(from, 52, base, 512 * MiB, 1);
+
+    /* Close the memory window of rp0, rp1 is given the same */
+    pcibus = qpci_new_pc(from, NULL);
+    dev = qpci_device_find(pcibus, 52 << 8);
+    qpci_config_writew(dev, PCI_COMMAND, 0);
+    g_free(dev);
+    qpci_free_pc(pcibus);
+
+    cxl_t3d_commit(from, 60, base, 512 * MiB, 1);
+    qtest_memwrite(from, base, pattern, 64 * KiB);
+
+    to = qtest_initf(QEMU_2PXB_2T3D "-incoming %s", uri);
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+    wait_for_migration_complete(to);
+
+    /* The device behind rp1 is still reachable as set up on the source */
+    pcibus = qpci_new_pc(to, NULL);
+    dev = qpci_device_find(pcibus, 61 << 8);
+    g_assert(dev);
+    bar = qpci_iomap(dev, 0, NULL);
+    g_assert(qpci_io_readl(dev, bar, CXL_T3D_HDM_DECODER0_CTRL) &
+             CXL_HDM_DECODER_CTRL_COMMITTED);
+    g_free(dev);
+    qpci_free_pc(pcibus);
+
+    qtest_memread(to, base, buf, 64 * KiB);
+    g_assert_cmpmem(buf, 64 * KiB, pattern, 64 * KiB);
+
+    qtest_quit(to);
+    qtest_quit(from);
+    unlink(sock);
+    rmdir(tmpfs);
+}
+/*
+ * Two switches cascaded below rp0, the second with a Type 3 device on each
+ * of its two downstream ports.  The host bridge also has rp1, so that it
+ * decodes rather than passing through to rp0.
+ */
+#define QEMU_CASCADED_SWITCHES QEMU_PXB_CMD                             \
+    "-device cxl-rp,id=rp0,bus=cxl.0,chassis=0,slot=0,port=0 "          \
+    "-device cxl-rp,id=rp1,bus=cxl.0,chassis=0,slot=1,port=1 "          \
+    "-device cxl-upstream,bus=rp0,id=us0 "                              \
+    "-device cxl-downstream,bus=us0,id=ds0,chassis=1,slot=0,port=0 "    \
+    "-device cxl-upstream,bus=ds0,id=us1 "                              \
+    "-device cxl-downstream,bus=us1,id=ds1,chassis=1,slot=1,port=0,"    \
+    "addr=0.0 "                                                         \
+    "-device cxl-downstream,bus=us1,id=ds2,chassis=1,slot=2,port=1,"    \
+    "addr=1.0 "                                                         \
+    "-object memory-backend-file,id=vmem0,mem-path=%s/vmem0,size=256M," \
+    "share=on "                                                         \
+    "-device cxl-type3,bus=ds1,volatile-memdev=vmem0,id=cxl-vmem0 "     \
+    "-object memory-backend-file,id=vmem1,mem-path=%s/vmem1,size=256M," \
+    "share=on "                                                         \
+    "-device cxl-type3,bus=ds2,volatile-memdev=vmem1,id=cxl-vmem1 "
+
+/*
+ * Commit decoder 0 of the Type 3 device behind the downstream port at
+ * @devfn on bus 56, with that port the only one forwarding memory.
+ */
+static void cxl_cascaded_t3d_commit(QTestState *qts, QPCIBus *pcibus,
+                                    int devfn, uint64_t hpa)
+{
+    int bus = devfn ? 58 : 57;
+    QPCIDevice *ds = cxl_bridge_open(pcibus, 56, devfn, bus, bus, NULL);
+    QPCIDevice *t3d = qpci_device_find(pcibus, bus << 8);
+
+    g_assert(t3d);
+    qpci_device_enable(t3d);
+    cxl_hdm_commit(qts, qpci_iomap(t3d, 0, NULL).addr, hpa, 512 * MiB, 1, 0);
+    qpci_config_writew(ds, PCI_COMMAND, 0);
+    g_free(t3d);
+    g_free(ds);
+}
+
+/* The @len bytes at @dpa of the memory of the device backed by @path */
+static void cxl_cascaded_read_dpa(const char *path, uint64_t dpa,
+                                  uint8_t *buf, size_t len)
+{
+    int fd = open(path, O_RDONLY);
+
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(pread(fd, buf, len, dpa), ==, len);
+    close(fd);
+}
+
+/*
+ * Route a region through the host bridge, both switches and a two way
+ * interleave at the second switch, and check that each 256 byte granule
+ * written through the window lands at the right place in the memory of the
+ * right device.  Then hot unplug one of the devices, which must leave the
+ * other one reachable and the granules of the one that is gone undecoded.
+ */
+static void cxl_cascaded_switches(void)
+{
+    g_autofree uint8_t *pattern = g_malloc(4 * KiB);
+    g_autofree uint8_t *buf = g_malloc0(4 * KiB);
+    g_autofree const char *tmpfs = NULL;
+    g_autofree char *path0 = NULL;
+    g_autofree char *path1 = NULL;
+    QPCIDevice *rp, *us0, *ds0, *us1, *ds2;
+    QTestState *qts;
+    QPCIBus *pcibus;
+    QPCIBar bar;
+    uint64_t base;
+    uint16_t sltctl;
+    uint8_t exp;
+    int i;
+
+    tmpfs = g_dir_make_tmp("cxl-test-XXXXXX", NULL);
+    path0 = g_strdup_printf("%s/vmem0", tmpfs);
+    path1 = g_strdup_printf("%s/vmem1", tmpfs);
+
+    /* Different in each 256 byte granule */
+    for (i = 0; i < 4 * KiB; i++) {
+        pattern[i] = i + i / 256;
+    }
+
+    qts = qtest_initf(QEMU_CASCADED_SWITCHES, tmpfs, tmpfs);
+    base = cxl_fmw_base(qts);
+    pcibus = qpci_new_pc(qts, NULL);
+
+    /* Host bridge to rp0 */
+    cxl_hdm_commit(qts, cxl_mtree_base(qts, "cxl_host_reg"), base,
+                   512 * MiB, 0, 0);
+
+    /* us0 to ds0 */
+    rp = cxl_bridge_open(pcibus, 52, 0, 53, 58, NULL);
+    us0 = cxl_bridge_open(pcibus, 53, 0, 54, 58, &bar);
+    cxl_hdm_commit(qts, bar.addr, base, 512 * MiB, 0, 0);
+
+    /* us1 interleaving across ds1 and ds2, port 0 and 1 */
+    ds0 = cxl_bridge_open(pcibus, 54, 0, 55, 58, NULL);
+    us1 = cxl_bridge_open(pcibus, 55, 0, 56, 58, &bar);
+    cxl_hdm_commit(qts, bar.addr, base, 512 * MiB, 1, 0x0100);
+
+    cxl_cascaded_t3d_commit(qts, pcibus, QPCI_DEVFN(0, 0), base);
+    cxl_cascaded_t3d_commit(qts, pcibus, QPCI_DEVFN(1, 0), base);
+
+    qtest_memwrite(qts, base, pattern, 4 * KiB);
+    qtest_memread(qts, base, buf, 4 * KiB);
+    g_assert_cmpmem(buf, 4 * KiB, pattern, 4 * KiB);
+
+    /* Even granules to the device on port 0, odd ones to that on port 1 */
+    for (i = 0; i < 16; i++) {
+        cxl_cascaded_read_dpa(i % 2 ? path1 : path0, i / 2 * 256, buf, 256);
+        g_assert_cmpmem(buf, 256, pattern + i * 256, 256);
+    }
+
+    /* Unplug the device behind ds2 the way a guest would, by powering off */
+    ds2 = qpci_device_find(pcibus, 56 << 8 | QPCI_DEVFN(1, 0));
+    g_assert(ds2);
+    exp = qpci_find_capability(ds2, PCI_CAP_ID_EXP, 0);
+    g_assert(exp);
+    qtest_qmp_device_del_send(qts, "cxl-vmem1");
+    sltctl = qpci_config_readw(ds2, exp + PCI_EXP_SLTCTL);
+    sltctl &= ~PCI_EXP_SLTCTL_PIC;
+    qpci_config_writew(ds2, exp + PCI_EXP_SLTCTL,
+                       sltctl | PCI_EXP_SLTCTL_PWR_IND_OFF |
+                       PCI_EXP_SLTCTL_PCC);
+    qtest_qmp_eventwait(qts, "DEVICE_DELETED");
+
+    memset(pattern, 0xa5, 4 * KiB);
+    qtest_memwrite(qts, base, pattern, 4 * KiB);
+    qtest_memread(qts, base, buf, 4 * KiB);
+    for (i = 0; i < 16; i++) {
+        if (i % 2) {
+            g_assert_true(buffer_is_zero(buf + i * 256, 256));
+        } else {
+            g_assert_cmpmem(buf + i * 256, 256, pattern + i * 256, 256);
+        }
+    }
+
+    g_free(ds2);
+    g_free(us1);
+    g_free(ds0);
+    g_free(us0);
+    g_free(rp);
+    qpci_free_pc(pcibus);
+    qtest_quit(qts);
+    unlink(path0);
+    unlink(path1);
+    rmdir(tmpfs);
+}
 #endif /* CONFIG_POSIX */
 
 int main(int argc, char **argv)
@@ -144,12 +1750,37 @@ int main(int argc, char **argv)
     qtest_add_func("/pci/cxl/basic_pxb", cxl_basic_pxb);
     qtest_add_func("/pci/cxl/pxb_with_window", cxl_pxb_with_window);
     qtest_add_func("/pci/cxl/pxb_x2_with_window", cxl_2pxb_with_window);
+    qtest_add_func("/pci/cxl/hot_pages", cxl_hot_pages);
     qtest_add_func("/pci/cxl/rp", cxl_root_port);
     qtest_add_func("/pci/cxl/rp_x2", cxl_2root_port);
+    qtest_add_func("/pci/cxl/usp_cdat_no_dsp", cxl_usp_cdat_no_dsp);
 #ifdef CONFIG_POSIX
-    qtest_add_func("/pci/cxl/type3_device", cxl_t3d);
+    qtest_add_func("/pci/cxl/type3_device", cxl_t3d_deprecated);
+    qtest_add_func("/pci/cxl/type3_device_pmem", cxl_t3d_persistent);
+    qtest_add_func("/pci/cxl/type3_device_lsa", cxl_t3d_lsa);
+    qtest_add_func("/pci/cxl/type3_device_vmem", cxl_t3d_volatile);
+    qtest_add_func("/pci/cxl/type3_device_stats", cxl_t3d_stats);
+    qtest_add_func("/pci/cxl/type3_device_stats/counted",
+                   cxl_t3d_stats_counted);
+    qtest_add_func("/pci/cxl/type3_device_hot_pages", cxl_t3d_hot_pages);
+    qtest_add_func("/pci/cxl/type3_device_poison", cxl_t3d_poison);
+    qtest_add_func("/pci/cxl/type3_device_dcd", cxl_t3d_dcd);
+    qtest_add_func("/pci/cxl/type3_device_events", cxl_t3d_events);
+    qtest_add_func("/pci/cxl/type3_device_background", cxl_t3d_background);
+    qtest_add_func("/pci/cxl/type3_device_sanitize", cxl_t3d_sanitize);
+    qtest_add_func("/pci/cxl/type3_device_shared", cxl_t3d_shared);
+    qtest_add_func("/pci/cxl/type2_device_engine", cxl_t2d_engine);
+    qtest_add_func("/pci/cxl/type3_device_vmem_timing",
+                   cxl_t3d_volatile_timing);
+    qtest_add_func("/pci/cxl/type3_device_vmem_pmem",
+                   cxl_t3d_volatile_persistent);
     qtest_add_func("/pci/cxl/rp_x2_type3_x2", cxl_1pxb_2rp_2t3d);
     qtest_add_func("/pci/cxl/pxb_x2_root_port_x4_type3_x4", cxl_2pxb_4rp_4t3d);
+    qtest_add_func("/pci/cxl/pxb_x2_root_port_x4_type3_x4/migrate",
+                   cxl_2pxb_4rp_4t3d_migrate);
+    qtest_add_func("/pci/cxl/pxb_x2_type3_x2_interleaved/migrate",
+                   cxl_2pxb_2t3d_interleaved_migrate);
+    qtest_add_func("/pci/cxl/cascaded_switches", cxl_cascaded_switches);
 #endif
     return g_test_run();
 }
@@ -577,6 +577,7 @@ typedef struct {
     /* Postcopy specific fields */
     void *postcopy_data;
     bool postcopy_preempt;
+    bool postcopy_multifd;
 } MigrateCommon;
 
 static int test_migrate_start(QTestState **from, QTestState **to,
@@ -1116,6 +1117,12 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
         migrate_set_capability(to, "postcopy-preempt", true);
     }
 
+    if (args->postcopy_multifd) {
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+        migrate_set_capability(from, "postcopy-multifd", true);
+    }
+
     migrate_ensure_non_converge(from);
 
     /* Wait for the first serial output from the source */
@@ -1178,6 +1185,53 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void test_postcopy_multifd(void)
+{
+    MigrateCommon args = {
+        .postcopy_multifd = true,
+    };
+
+    test_postcopy_common(&args);
+}
+
+static void test_postcopy_preempt_multifd(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .postcopy_multifd = true,
+    };
+
+    test_postcopy_common(&args);
+}
+
+/*
+ * The pages the destination faults on are often queued already for the
+ * background push through multifd, so the packet they are in must be sent
+ * on request rather than once full.  With the background push throttled,
+ * the destination guest only gets through its memory if that happens.
+ */
+static void test_postcopy_preempt_multifd_throttled(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .postcopy_multifd = true,
+    };
+    QTestState *from, *to;
+
+    if (migrate_postcopy_prepare(&from, &to, &args)) {
+        return;
+    }
+    migrate_set_parameter_int(from, "max-postcopy-bandwidth", 1000 * 1000);
+    migrate_postcopy_start(from, to);
+
+    /* A full pass over guest memory at the throttled rate takes minutes */
+    wait_for_serial("dest_serial");
+
+    migrate_set_parameter_int(from, "max-postcopy-bandwidth",
+                              1 * 1000 * 1000 * 1000);
+    migrate_postcopy_complete(from, to, &args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -1898,6 +1952,14 @@ test_migrate_precopy_tcp_multifd_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_zero_page_start(QTestState *from,
+                                                 QTestState *to)
+{
+    migrate_set_capability(from, "multifd-zero-page", true);
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -1914,6 +1976,15 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZ4
+static void *
+test_migrate_precopy_tcp_multifd_lz4_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lz4");
+}
+#endif /* CONFIG_LZ4 */
+
 static void test_multifd_tcp_none(void)
 {
     MigrateCommon args = {
@@ -1923,6 +1994,15 @@ static void test_multifd_tcp_none(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_zero_page(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zero_page_start,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zlib(void)
 {
     MigrateCommon args = {
@@ -1943,6 +2023,17 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lz4_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_GNUTLS
 static void *
 test_migrate_multifd_tcp_tls_psk_start_match(QTestState *from,
@@ -2437,6 +2528,116 @@ static void test_vcpu_dirty_limit(void)
     dirtylimit_stop_vm(vm);
 }
 
+static bool vcpu_dirty_limited(QTestState *who)
+{
+    QDict *rsp = query_vcpu_dirty_limit(who);
+    QList *rates = qdict_get_qlist(rsp, "return");
+    bool limited = rates && !qlist_empty(rates);
+
+    qobject_unref(rsp);
+    return limited;
+}
+
+static void test_migrate_dirty_limit(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {
+        .use_dirty_ring = true,
+    };
+    QTestState *from, *to;
+    QDict *rsp;
+    const int64_t min_rate = 1;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "vcpu-dirty-limit", min_rate);
+
+    /*
+     * Set the initial parameters so that the migration could not converge
+     * without throttling.
+     */
+    migrate_ensure_non_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Wait for the only vCPU, which dirties memory, to be limited */
+    while (!vcpu_dirty_limited(from)) {
+        usleep(20);
+        g_assert_false(got_stop);
+    }
+    g_assert_cmpint(get_limit_rate(from), >=, min_rate);
+
+    /* The limits belong to migration while it runs */
+    rsp = qtest_qmp(from, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+    g_assert_true(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    /* Now, when we tested that throttling works, let it converge */
+    migrate_ensure_converge(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* And are lifted once it is done */
+    while (vcpu_dirty_limited(from)) {
+        usleep(20);
+    }
+
+    test_migrate_end(from, to, true);
+}
+
+/* Limits the user set are kept during migration and restored after it */
+static void test_migrate_dirty_limit_user(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {
+        .use_dirty_ring = true,
+    };
+    QTestState *from, *to;
+    const int64_t min_rate = 1, user_rate = 1000;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "vcpu-dirty-limit", min_rate);
+    migrate_ensure_non_converge(from);
+
+    wait_for_serial("src_serial");
+    dirtylimit_set_all(from, user_rate);
+
+    migrate_qmp(from, uri, "{}");
+
+    /* Migration may only lower the limit of the vCPU */
+    while (get_limit_rate(from) == user_rate) {
+        usleep(20);
+        g_assert_false(got_stop);
+    }
+    g_assert_cmpint(get_limit_rate(from), <, user_rate);
+
+    migrate_ensure_converge(from);
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    while (get_limit_rate(from) != user_rate) {
+        usleep(20);
+    }
+
+    test_migrate_end(from, to, true);
+}
+
 static bool kvm_dirty_ring_supported(void)
 {
 #if defined(__linux__) && defined(HOST_X86_64)
@@ -2508,6 +2709,12 @@ int main(int argc, char **argv)
         qtest_add_func("/migration/postcopy/recovery/plain",
                        test_postcopy_recovery);
         qtest_add_func("/migration/postcopy/preempt/plain", test_postcopy_preempt);
+        qtest_add_func("/migration/postcopy/multifd/plain",
+                       test_postcopy_multifd);
+        qtest_add_func("/migration/postcopy/preempt/multifd/plain",
+                       test_postcopy_preempt_multifd);
+        qtest_add_func("/migration/postcopy/preempt/multifd/throttled",
+                       test_postcopy_preempt_multifd_throttled);
         qtest_add_func("/migration/postcopy/preempt/recovery/plain",
                        test_postcopy_preempt_recovery);
     }
@@ -2587,12 +2794,18 @@ int main(int argc, char **argv)
         qtest_add_func("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     }
+    qtest_add_func("/migration/multifd/tcp/plain/zero-page",
+                   test_multifd_tcp_zero_page);
     qtest_add_func("/migration/multifd/tcp/plain/zlib",
                    test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/plain/zstd",
                    test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/plain/lz4",
+                   test_multifd_tcp_lz4);
+#endif
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/multifd/tcp/tls/psk/match",
                    test_multifd_tcp_tls_psk_match);
@@ -2617,6 +2830,10 @@ int main(int argc, char **argv)
                        test_precopy_unix_dirty_ring);
         qtest_add_func("/migration/vcpu_dirty_limit",
                        test_vcpu_dirty_limit);
+        qtest_add_func("/migration/dirty_limit",
+                       test_migrate_dirty_limit);
+        qtest_add_func("/migration/dirty_limit/user",
+                       test_migrate_dirty_limit_user);
     }
 
     ret = g_test_run();